@@ -16,6 +16,13 @@
 
 #include "BranchListFile.h"
 
+#include <fcntl.h>
+#include <string.h>
+
+#include <queue>
+
+#include <android-base/file.h>
+
 #include "ETMDecoder.h"
 #include "system/extras/simpleperf/branch_list.pb.h"
 
@@ -44,6 +51,155 @@ std::vector<bool> ProtoStringToETMBranch(const std::string& s, size_t bit_size)
   return branch;
 }
 
+std::vector<bool> UnorderedETMBranchMap::Branch::ToVector() const {
+  std::vector<bool> branch(bit_size);
+  for (size_t i = 0; i < bit_size; i++) {
+    branch[i] = (words[i >> 6] >> (i & 63)) & 1;
+  }
+  return branch;
+}
+
+std::string UnorderedETMBranchMap::Branch::ToProtoString() const {
+  size_t bytes = (bit_size + 7) / 8;
+  std::string res(bytes, '\0');
+  for (size_t i = 0; i < bytes; i++) {
+    res[i] = static_cast<char>(words[i >> 3] >> ((i & 7) * 8));
+  }
+  return res;
+}
+
+static uint32_t HashETMBranch(uint64_t addr, const uint64_t* words, uint32_t bit_size) {
+  uint64_t h = addr ^ (static_cast<uint64_t>(bit_size) << 48);
+  for (size_t i = 0; i < (bit_size + 63) / 64; i++) {
+    h = (h ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 32;
+  return static_cast<uint32_t>(h);
+}
+
+void UnorderedETMBranchMap::clear() {
+  entries_.clear();
+  words_.clear();
+  slots_.clear();
+}
+
+void UnorderedETMBranchMap::Add(uint64_t addr, const std::vector<bool>& branch, uint64_t count) {
+  pack_buffer_.assign((branch.size() + 63) / 64, 0);
+  for (size_t i = 0; i < branch.size(); i++) {
+    if (branch[i]) {
+      pack_buffer_[i >> 6] |= 1ULL << (i & 63);
+    }
+  }
+  AddWords(addr, pack_buffer_.data(), branch.size(), count);
+}
+
+void UnorderedETMBranchMap::AddProtoString(uint64_t addr, const std::string& s, size_t bit_size,
+                                           uint64_t count) {
+  pack_buffer_.assign((bit_size + 63) / 64, 0);
+  size_t bytes = std::min(s.size(), (bit_size + 7) / 8);
+  for (size_t i = 0; i < bytes; i++) {
+    pack_buffer_[i >> 3] |= static_cast<uint64_t>(static_cast<uint8_t>(s[i])) << ((i & 7) * 8);
+  }
+  if (bit_size % 64 != 0) {
+    // Clear bits not belonging to the branch list, so equal branch lists have equal words.
+    pack_buffer_.back() &= (1ULL << (bit_size % 64)) - 1;
+  }
+  AddWords(addr, pack_buffer_.data(), bit_size, count);
+}
+
+void UnorderedETMBranchMap::Merge(const UnorderedETMBranchMap& other) {
+  if (&other == this) {
+    return;
+  }
+  for (const Entry& entry : other.entries_) {
+    AddWords(entry.addr, other.GetWords(entry), entry.bit_size, entry.count);
+  }
+}
+
+void UnorderedETMBranchMap::ConvertAddrs(const std::function<uint64_t(uint64_t)>& convert_addr_fn) {
+  std::vector<Entry> old_entries = std::move(entries_);
+  std::vector<uint64_t> old_words = std::move(words_);
+  clear();
+  for (const Entry& entry : old_entries) {
+    const uint64_t* words = entry.bit_size <= 64 ? &entry.bits : &old_words[entry.bits];
+    AddWords(convert_addr_fn(entry.addr), words, entry.bit_size, entry.count);
+  }
+}
+
+std::vector<UnorderedETMBranchMap::Branch> UnorderedETMBranchMap::GetBranchesSortedByAddr() const {
+  std::vector<Branch> branches;
+  branches.reserve(entries_.size());
+  for (const Entry& entry : entries_) {
+    branches.emplace_back(GetBranch(entry));
+  }
+  std::stable_sort(branches.begin(), branches.end(),
+                   [](const Branch& b1, const Branch& b2) { return b1.addr < b2.addr; });
+  return branches;
+}
+
+ETMBranchMap UnorderedETMBranchMap::GetOrderedBranchMap() const {
+  ETMBranchMap result;
+  for (const Entry& entry : entries_) {
+    result[entry.addr][GetBranch(entry).ToVector()] = entry.count;
+  }
+  return result;
+}
+
+size_t UnorderedETMBranchMap::MemoryUsage() const {
+  return entries_.capacity() * sizeof(Entry) + words_.capacity() * sizeof(uint64_t) +
+         slots_.capacity() * sizeof(uint32_t) + pack_buffer_.capacity() * sizeof(uint64_t);
+}
+
+void UnorderedETMBranchMap::AddWords(uint64_t addr, const uint64_t* words, uint32_t bit_size,
+                                     uint64_t count) {
+  // Keep the load factor <= 0.75.
+  if ((entries_.size() + 1) * 4 > slots_.size() * 3) {
+    Rehash(std::max<size_t>(16, slots_.size() * 2));
+  }
+  uint32_t hash = HashETMBranch(addr, words, bit_size);
+  size_t word_count = (bit_size + 63) / 64;
+  size_t mask = slots_.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    uint32_t slot = slots_[i];
+    if (slot == 0) {
+      Entry entry;
+      entry.addr = addr;
+      entry.count = count;
+      entry.bit_size = bit_size;
+      entry.hash = hash;
+      if (bit_size <= 64) {
+        entry.bits = word_count == 0 ? 0 : words[0];
+      } else {
+        entry.bits = words_.size();
+        words_.insert(words_.end(), words, words + word_count);
+      }
+      entries_.emplace_back(entry);
+      slots_[i] = entries_.size();
+      return;
+    }
+    Entry& entry = entries_[slot - 1];
+    if (entry.hash == hash && entry.addr == addr && entry.bit_size == bit_size &&
+        std::equal(words, words + word_count, GetWords(entry))) {
+      OverflowSafeAdd(entry.count, count);
+      return;
+    }
+  }
+}
+
+void UnorderedETMBranchMap::Rehash(size_t slot_count) {
+  slots_.assign(slot_count, 0);
+  size_t mask = slot_count - 1;
+  for (size_t i = 0; i < entries_.size(); i++) {
+    size_t pos = entries_[i].hash & mask;
+    while (slots_[pos] != 0) {
+      pos = (pos + 1) & mask;
+    }
+    slots_[pos] = i + 1;
+  }
+}
+
 static std::optional<proto::ETMBinary::BinaryType> ToProtoBinaryType(DsoType dso_type) {
   switch (dso_type) {
     case DSO_ELF_FILE:
@@ -58,42 +214,43 @@ static std::optional<proto::ETMBinary::BinaryType> ToProtoBinaryType(DsoType dso
   }
 }
 
+static bool ETMBinaryToProto(const BinaryKey& key, const ETMBinary& binary,
+                             proto::ETMBinary& binary_proto) {
+  binary_proto.set_path(key.path);
+  if (!key.build_id.IsEmpty()) {
+    binary_proto.set_build_id(key.build_id.ToString().substr(2));
+  }
+  auto opt_binary_type = ToProtoBinaryType(binary.dso_type);
+  if (!opt_binary_type.has_value()) {
+    return false;
+  }
+  binary_proto.set_type(opt_binary_type.value());
+
+  proto::ETMBinary::Address* addr_proto = nullptr;
+  for (const auto& branch : binary.branch_map.GetBranchesSortedByAddr()) {
+    if (addr_proto == nullptr || addr_proto->addr() != branch.addr) {
+      addr_proto = binary_proto.add_addrs();
+      addr_proto->set_addr(branch.addr);
+    }
+    auto branch_proto = addr_proto->add_branches();
+    branch_proto->set_branch(branch.ToProtoString());
+    branch_proto->set_branch_size(branch.bit_size);
+    branch_proto->set_count(branch.count);
+  }
+
+  if (binary.dso_type == DSO_KERNEL) {
+    binary_proto.mutable_kernel_info()->set_kernel_start_addr(key.kernel_start_addr);
+  }
+  return true;
+}
+
 bool ETMBinaryMapToString(const ETMBinaryMap& binary_map, std::string& s) {
   proto::BranchList branch_list_proto;
   branch_list_proto.set_magic(ETM_BRANCH_LIST_PROTO_MAGIC);
-  std::vector<char> branch_buf;
   for (const auto& p : binary_map) {
-    const BinaryKey& key = p.first;
-    const ETMBinary& binary = p.second;
-    auto binary_proto = branch_list_proto.add_etm_data();
-
-    binary_proto->set_path(key.path);
-    if (!key.build_id.IsEmpty()) {
-      binary_proto->set_build_id(key.build_id.ToString().substr(2));
-    }
-    auto opt_binary_type = ToProtoBinaryType(binary.dso_type);
-    if (!opt_binary_type.has_value()) {
+    if (!ETMBinaryToProto(p.first, p.second, *branch_list_proto.add_etm_data())) {
       return false;
     }
-    binary_proto->set_type(opt_binary_type.value());
-
-    for (const auto& addr_p : binary.branch_map) {
-      auto addr_proto = binary_proto->add_addrs();
-      addr_proto->set_addr(addr_p.first);
-
-      for (const auto& branch_p : addr_p.second) {
-        const std::vector<bool>& branch = branch_p.first;
-        auto branch_proto = addr_proto->add_branches();
-
-        branch_proto->set_branch(ETMBranchToProtoString(branch));
-        branch_proto->set_branch_size(branch.size());
-        branch_proto->set_count(branch_p.second);
-      }
-    }
-
-    if (binary.dso_type == DSO_KERNEL) {
-      binary_proto->mutable_kernel_info()->set_kernel_start_addr(key.kernel_start_addr);
-    }
   }
   if (!branch_list_proto.SerializeToString(&s)) {
     LOG(ERROR) << "failed to serialize branch list binary map";
@@ -120,17 +277,31 @@ static UnorderedETMBranchMap BuildUnorderedETMBranchMap(const proto::ETMBinary&
   UnorderedETMBranchMap branch_map;
   for (size_t i = 0; i < binary_proto.addrs_size(); i++) {
     const auto& addr_proto = binary_proto.addrs(i);
-    auto& b_map = branch_map[addr_proto.addr()];
     for (size_t j = 0; j < addr_proto.branches_size(); j++) {
       const auto& branch_proto = addr_proto.branches(j);
-      std::vector<bool> branch =
-          ProtoStringToETMBranch(branch_proto.branch(), branch_proto.branch_size());
-      b_map[branch] = branch_proto.count();
+      branch_map.AddProtoString(addr_proto.addr(), branch_proto.branch(),
+                                branch_proto.branch_size(), branch_proto.count());
     }
   }
   return branch_map;
 }
 
+static bool ProtoToETMBinary(const proto::ETMBinary& binary_proto, BinaryKey& key,
+                             ETMBinary& binary) {
+  key = BinaryKey(binary_proto.path(), BuildId(binary_proto.build_id()));
+  if (binary_proto.has_kernel_info()) {
+    key.kernel_start_addr = binary_proto.kernel_info().kernel_start_addr();
+  }
+  auto dso_type = ToDsoType(binary_proto.type());
+  if (!dso_type) {
+    LOG(ERROR) << "invalid binary type " << binary_proto.type();
+    return false;
+  }
+  binary.dso_type = dso_type.value();
+  binary.branch_map = BuildUnorderedETMBranchMap(binary_proto);
+  return true;
+}
+
 bool StringToETMBinaryMap(const std::string& s, ETMBinaryMap& binary_map) {
   LBRData lbr_data;
   return ParseBranchListData(s, binary_map, lbr_data);
@@ -326,7 +497,7 @@ void ETMBranchListGeneratorImpl::ProcessBranchList(const ETMBranchList& branch_l
     return;
   }
   auto& branch_map = branch_list_binary_map_[branch_list.dso].branch_map;
-  ++branch_map[branch_list.addr][branch_list.branch];
+  branch_map.Add(branch_list.addr, branch_list.branch);
 }
 
 ETMBinaryMap ETMBranchListGeneratorImpl::GetETMBinaryMap() {
@@ -397,19 +568,12 @@ bool ParseBranchListData(const std::string& s, ETMBinaryMap& etm_data, LBRData&
     return false;
   }
   for (size_t i = 0; i < branch_list_proto.etm_data_size(); i++) {
-    const auto& binary_proto = branch_list_proto.etm_data(i);
-    BinaryKey key(binary_proto.path(), BuildId(binary_proto.build_id()));
-    if (binary_proto.has_kernel_info()) {
-      key.kernel_start_addr = binary_proto.kernel_info().kernel_start_addr();
-    }
-    ETMBinary& binary = etm_data[key];
-    auto dso_type = ToDsoType(binary_proto.type());
-    if (!dso_type) {
-      LOG(ERROR) << "invalid binary type " << binary_proto.type();
+    BinaryKey key;
+    ETMBinary binary;
+    if (!ProtoToETMBinary(branch_list_proto.etm_data(i), key, binary)) {
       return false;
     }
-    binary.dso_type = dso_type.value();
-    binary.branch_map = BuildUnorderedETMBranchMap(binary_proto);
+    etm_data[key] = std::move(binary);
   }
   if (branch_list_proto.has_lbr_data()) {
     const auto& lbr_data_proto = branch_list_proto.lbr_data();
@@ -437,4 +601,214 @@ bool ParseBranchListData(const std::string& s, ETMBinaryMap& etm_data, LBRData&
   return true;
 }
 
+bool BinaryKey::operator<(const BinaryKey& other) const {
+  if (path != other.path) {
+    return path < other.path;
+  }
+  if (int result = memcmp(build_id.Data(), other.build_id.Data(), BuildId::Size()); result != 0) {
+    return result < 0;
+  }
+  return kernel_start_addr < other.kernel_start_addr;
+}
+
+BranchListFileWriter::~BranchListFileWriter() {
+  if (fd_.ok()) {
+    Close();
+  }
+}
+
+bool BranchListFileWriter::Open(const std::string& filename) {
+  filename_ = filename;
+  fd_.reset(TEMP_FAILURE_RETRY(
+      open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644)));
+  if (!fd_.ok()) {
+    PLOG(ERROR) << "failed to open " << filename;
+    return false;
+  }
+  // Serialized BranchList messages can be concatenated. Fields of the concatenated message are
+  // merged, so repeated etm_data fields are appended.
+  proto::BranchList branch_list_proto;
+  branch_list_proto.set_magic(ETM_BRANCH_LIST_PROTO_MAGIC);
+  return Write(branch_list_proto);
+}
+
+bool BranchListFileWriter::WriteETMBinary(const BinaryKey& key, const ETMBinary& binary) {
+  proto::BranchList branch_list_proto;
+  if (!ETMBinaryToProto(key, binary, *branch_list_proto.add_etm_data())) {
+    return false;
+  }
+  empty_ = false;
+  return Write(branch_list_proto);
+}
+
+bool BranchListFileWriter::Close() {
+  fd_.reset();
+  if (empty_) {
+    // Don't produce empty output file.
+    LOG(INFO) << "Skip empty output file.";
+    unlink(filename_.c_str());
+  }
+  return true;
+}
+
+bool BranchListFileWriter::Write(const proto::BranchList& branch_list_proto) {
+  std::string s;
+  if (!branch_list_proto.SerializeToString(&s)) {
+    LOG(ERROR) << "failed to serialize branch list";
+    return false;
+  }
+  if (!android::base::WriteFully(fd_, s.data(), s.size())) {
+    PLOG(ERROR) << "failed to write to " << filename_;
+    return false;
+  }
+  return true;
+}
+
+// A run file contains binaries sorted by BinaryKey. Each binary is stored as a uint32_t size
+// followed by a serialized proto::ETMBinary message.
+bool ETMBinaryRunMerger::WriteRun(ETMBinaryMap& binary_map) {
+  std::vector<const BinaryKey*> keys;
+  for (const auto& p : binary_map) {
+    keys.emplace_back(&p.first);
+  }
+  std::sort(keys.begin(), keys.end(),
+            [](const BinaryKey* key1, const BinaryKey* key2) { return *key1 < *key2; });
+
+  auto tmpfile = std::make_unique<TemporaryFile>(tmp_dir_);
+  if (tmpfile->fd == -1) {
+    PLOG(ERROR) << "failed to create tmpfile under " << tmp_dir_;
+    return false;
+  }
+  std::string s;
+  for (const BinaryKey* key : keys) {
+    proto::ETMBinary binary_proto;
+    if (!ETMBinaryToProto(*key, binary_map[*key], binary_proto)) {
+      return false;
+    }
+    if (!binary_proto.SerializeToString(&s)) {
+      LOG(ERROR) << "failed to serialize branch list";
+      return false;
+    }
+    uint32_t size = static_cast<uint32_t>(s.size());
+    if (size != s.size() || !android::base::WriteFully(tmpfile->fd, &size, sizeof(size)) ||
+        !android::base::WriteFully(tmpfile->fd, s.data(), s.size())) {
+      PLOG(ERROR) << "failed to write to " << tmpfile->path;
+      return false;
+    }
+  }
+  close(tmpfile->release());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const BinaryKey* key : keys) {
+    keys_.emplace(*key);
+  }
+  runs_.emplace_back(std::move(tmpfile));
+  binary_map.clear();
+  return true;
+}
+
+std::vector<BinaryKey> ETMBinaryRunMerger::GetKeys() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::vector<BinaryKey>(keys_.begin(), keys_.end());
+}
+
+namespace {
+
+// Read binaries in a run file one by one.
+class ETMBinaryRunReader {
+ public:
+  ETMBinaryRunReader(const std::string& path) : path_(path) {}
+
+  bool Open() {
+    fp_.reset(fopen(path_.c_str(), "rb"));
+    if (!fp_) {
+      PLOG(ERROR) << "failed to open " << path_;
+      return false;
+    }
+    return true;
+  }
+
+  // Read the next binary. Return false on error. At the end of the run, set has_binary to false.
+  bool ReadNext() {
+    uint32_t size;
+    if (fread(&size, sizeof(size), 1, fp_.get()) != 1) {
+      if (ferror(fp_.get())) {
+        PLOG(ERROR) << "failed to read " << path_;
+        return false;
+      }
+      has_binary = false;
+      return true;
+    }
+    buf_.resize(size);
+    if (fread(buf_.data(), size, 1, fp_.get()) != 1) {
+      PLOG(ERROR) << "failed to read " << path_;
+      return false;
+    }
+    proto::ETMBinary binary_proto;
+    if (!binary_proto.ParseFromString(buf_)) {
+      LOG(ERROR) << "invalid branch list data in " << path_;
+      return false;
+    }
+    binary = ETMBinary();
+    has_binary = true;
+    return ProtoToETMBinary(binary_proto, key, binary);
+  }
+
+  bool has_binary = false;
+  BinaryKey key;
+  ETMBinary binary;
+
+ private:
+  const std::string path_;
+  std::unique_ptr<FILE, decltype(&fclose)> fp_{nullptr, fclose};
+  std::string buf_;
+};
+
+}  // namespace
+
+bool ETMBinaryRunMerger::Merge(
+    const std::function<bool(const BinaryKey&, ETMBinary&)>& callback) {
+  std::vector<std::unique_ptr<ETMBinaryRunReader>> readers;
+  auto greater = [](const ETMBinaryRunReader* r1, const ETMBinaryRunReader* r2) {
+    return r2->key < r1->key;
+  };
+  // A min heap of readers ordered by the key of their current binary.
+  std::priority_queue<ETMBinaryRunReader*, std::vector<ETMBinaryRunReader*>, decltype(greater)>
+      heap(greater);
+  for (const auto& run : runs_) {
+    auto reader = std::make_unique<ETMBinaryRunReader>(run->path);
+    if (!reader->Open() || !reader->ReadNext()) {
+      return false;
+    }
+    if (reader->has_binary) {
+      heap.push(reader.get());
+    }
+    readers.emplace_back(std::move(reader));
+  }
+  while (!heap.empty()) {
+    ETMBinaryRunReader* reader = heap.top();
+    heap.pop();
+    BinaryKey key = reader->key;
+    ETMBinary binary = std::move(reader->binary);
+    while (true) {
+      if (!reader->ReadNext()) {
+        return false;
+      }
+      if (reader->has_binary) {
+        heap.push(reader);
+      }
+      if (heap.empty() || !(heap.top()->key == key)) {
+        break;
+      }
+      reader = heap.top();
+      heap.pop();
+      binary.Merge(reader->binary);
+    }
+    if (!callback(key, binary)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 }  // namespace simpleperf
@@ -16,6 +16,14 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+
 #include "ETMDecoder.h"
 #include "RegEx.h"
 #include "thread_tree.h"
@@ -49,6 +57,9 @@ struct BinaryKey {
     return path == other.path && build_id == other.build_id &&
            kernel_start_addr == other.kernel_start_addr;
   }
+
+  // Order by path, build_id, then kernel_start_addr.
+  bool operator<(const BinaryKey& other) const;
 };
 
 struct BinaryKeyHash {
@@ -91,47 +102,142 @@ class BinaryFilter {
   std::unordered_map<const Dso*, bool> dso_filter_cache_;
 };
 
-using UnorderedETMBranchMap =
-    std::unordered_map<uint64_t, std::unordered_map<std::vector<bool>, uint64_t>>;
+// UnorderedETMBranchMap counts (addr, branch list) pairs in a compact open addressing hash table.
+// Instead of storing each branch list in a std::vector<bool> in a nested node-based map, bits of
+// branch lists are packed into uint64_t words. Branch lists of no more than 64 branches (the most
+// common case) are stored inline in entries, longer ones are stored in a shared word array.
+// Entries are stored in insertion order in a vector, and the hash table only keeps their indexes.
+class UnorderedETMBranchMap {
+ public:
+  // A view of a branch list stored in the map. It becomes invalid when the map is modified.
+  struct Branch {
+    uint64_t addr;
+    // bit i is in bit (i % 64) of words[i / 64]. 1 for branch taken, 0 for not taken.
+    const uint64_t* words;
+    uint32_t bit_size;
+    uint64_t count;
 
-struct ETMBinary {
-  DsoType dso_type;
-  UnorderedETMBranchMap branch_map;
+    std::vector<bool> ToVector() const;
+    // Return the branch list in the format used in branch_list.proto.
+    std::string ToProtoString() const;
+  };
+
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+  void clear();
+
+  // Add count to the branch list starting at addr.
+  void Add(uint64_t addr, const std::vector<bool>& branch, uint64_t count = 1);
+  // Add a branch list in the format used in branch_list.proto.
+  void AddProtoString(uint64_t addr, const std::string& s, size_t bit_size, uint64_t count);
+  void Merge(const UnorderedETMBranchMap& other);
+  // Replace each addr with convert_addr_fn(addr). Counts of branch lists mapped to the same addr
+  // are added.
+  void ConvertAddrs(const std::function<uint64_t(uint64_t)>& convert_addr_fn);
 
-  void Merge(const ETMBinary& other) {
-    for (auto& other_p : other.branch_map) {
-      auto it = branch_map.find(other_p.first);
-      if (it == branch_map.end()) {
-        branch_map[other_p.first] = std::move(other_p.second);
-      } else {
-        auto& map2 = it->second;
-        for (auto& other_p2 : other_p.second) {
-          auto it2 = map2.find(other_p2.first);
-          if (it2 == map2.end()) {
-            map2[other_p2.first] = other_p2.second;
-          } else {
-            OverflowSafeAdd(it2->second, other_p2.second);
-          }
-        }
-      }
+  // Call fn(const Branch&) for each branch list, in insertion order.
+  template <typename Fn>
+  void ForEach(Fn fn) const {
+    for (const Entry& entry : entries_) {
+      fn(GetBranch(entry));
     }
   }
 
-  ETMBranchMap GetOrderedBranchMap() const {
-    ETMBranchMap result;
-    for (const auto& p : branch_map) {
-      uint64_t addr = p.first;
-      const auto& b_map = p.second;
-      result[addr] = std::map<std::vector<bool>, uint64_t>(b_map.begin(), b_map.end());
-    }
-    return result;
+  // Return branch lists sorted by addr. Branch lists of the same addr are in insertion order.
+  std::vector<Branch> GetBranchesSortedByAddr() const;
+  ETMBranchMap GetOrderedBranchMap() const;
+  // Return the size of memory allocated by the map.
+  size_t MemoryUsage() const;
+
+ private:
+  struct Entry {
+    uint64_t addr;
+    uint64_t count;
+    // If bit_size <= 64, bits of the branch list. Otherwise, the index of its first word in
+    // words_.
+    uint64_t bits;
+    uint32_t bit_size;
+    uint32_t hash;
+  };
+
+  const uint64_t* GetWords(const Entry& entry) const {
+    return entry.bit_size <= 64 ? &entry.bits : &words_[entry.bits];
+  }
+  Branch GetBranch(const Entry& entry) const {
+    return Branch{entry.addr, GetWords(entry), entry.bit_size, entry.count};
   }
+  void AddWords(uint64_t addr, const uint64_t* words, uint32_t bit_size, uint64_t count);
+  void Rehash(size_t slot_count);
+
+  std::vector<Entry> entries_;
+  // Words of branch lists longer than 64 branches.
+  std::vector<uint64_t> words_;
+  // Open addressing hash table with linear probing. Each slot stores an index in entries_ plus 1,
+  // or 0 for an empty slot. Its size is a power of 2.
+  std::vector<uint32_t> slots_;
+  // Used to pack branch lists before adding them.
+  std::vector<uint64_t> pack_buffer_;
+};
+
+struct ETMBinary {
+  DsoType dso_type;
+  UnorderedETMBranchMap branch_map;
+
+  void Merge(const ETMBinary& other) { branch_map.Merge(other.branch_map); }
+
+  ETMBranchMap GetOrderedBranchMap() const { return branch_map.GetOrderedBranchMap(); }
 };
 
 using ETMBinaryMap = std::unordered_map<BinaryKey, ETMBinary, BinaryKeyHash>;
 bool ETMBinaryMapToString(const ETMBinaryMap& binary_map, std::string& s);
 bool StringToETMBinaryMap(const std::string& s, ETMBinaryMap& binary_map);
 
+namespace proto {
+class BranchList;
+}  // namespace proto
+
+// Write a branch list file binary by binary, so the whole branch list doesn't need to be in
+// memory.
+class BranchListFileWriter {
+ public:
+  ~BranchListFileWriter();
+  bool Open(const std::string& filename);
+  bool WriteETMBinary(const BinaryKey& key, const ETMBinary& binary);
+  // If no binary is written, the file is removed.
+  bool Close();
+
+ private:
+  bool Write(const proto::BranchList& branch_list_proto);
+
+  std::string filename_;
+  android::base::unique_fd fd_;
+  bool empty_ = true;
+};
+
+// Merge ETMBinaryMaps not fitting in memory with an external merge.
+// Each ETMBinaryMap is written to a temporary file as a run sorted by BinaryKey. Then Merge() reads
+// all runs at the same time, and merges binaries with the same key. It only keeps the current
+// binary of each run in memory.
+class ETMBinaryRunMerger {
+ public:
+  ETMBinaryRunMerger(const std::string& tmp_dir) : tmp_dir_(tmp_dir) {}
+
+  // Write binary_map to a new run, and clear it. It can be called in multiple threads.
+  bool WriteRun(ETMBinaryMap& binary_map);
+  size_t RunCount() const { return runs_.size(); }
+  // Return keys of binaries in all runs, in order.
+  std::vector<BinaryKey> GetKeys();
+  // Call callback for each merged binary, in the order of BinaryKey.
+  bool Merge(const std::function<bool(const BinaryKey&, ETMBinary&)>& callback);
+
+ private:
+  const std::string tmp_dir_;
+  std::mutex mutex_;
+  // Below fields are protected by mutex_.
+  std::vector<std::unique_ptr<TemporaryFile>> runs_;
+  std::set<BinaryKey> keys_;
+};
+
 // Convert ETM data into branch lists while recording.
 class ETMBranchListGenerator {
  public:
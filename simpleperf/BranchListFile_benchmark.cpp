@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+#include "BranchListFile.h"
+
+using namespace simpleperf;
+
+namespace {
+
+struct TestBranch {
+  uint64_t addr;
+  std::vector<bool> branch;
+};
+
+// Generate branch lists similar to those decoded from etm data: most are short, and many are
+// repeated.
+std::vector<TestBranch> GenerateBranches(size_t count, size_t addr_count) {
+  std::mt19937_64 rng(0);
+  std::vector<TestBranch> branches(count);
+  for (auto& b : branches) {
+    b.addr = 0x10000 + (rng() % addr_count) * 4;
+    size_t size = (rng() % 8 == 0) ? rng() % 256 : rng() % 32;
+    b.branch.resize(size);
+    uint64_t bits = rng() & rng();
+    for (size_t i = 0; i < size; i++) {
+      b.branch[i] = (bits >> (i % 64)) & 1;
+    }
+  }
+  return branches;
+}
+
+const std::vector<TestBranch>& GetBranches() {
+  static std::vector<TestBranch> branches = GenerateBranches(1000000, 50000);
+  return branches;
+}
+
+// The representation used before UnorderedETMBranchMap, kept for comparison.
+using NestedBranchMap =
+    std::unordered_map<uint64_t, std::unordered_map<std::vector<bool>, uint64_t>>;
+
+void BM_NestedBranchMapAdd(benchmark::State& state) {
+  const auto& branches = GetBranches();
+  for (auto _ : state) {
+    NestedBranchMap map;
+    for (const auto& b : branches) {
+      ++map[b.addr][b.branch];
+    }
+    benchmark::DoNotOptimize(map);
+  }
+  state.SetItemsProcessed(state.iterations() * branches.size());
+}
+BENCHMARK(BM_NestedBranchMapAdd);
+
+void BM_UnorderedETMBranchMapAdd(benchmark::State& state) {
+  const auto& branches = GetBranches();
+  size_t memory = 0;
+  for (auto _ : state) {
+    UnorderedETMBranchMap map;
+    for (const auto& b : branches) {
+      map.Add(b.addr, b.branch);
+    }
+    memory = map.MemoryUsage();
+    benchmark::DoNotOptimize(map);
+  }
+  state.SetItemsProcessed(state.iterations() * branches.size());
+  state.counters["memory_bytes"] = memory;
+}
+BENCHMARK(BM_UnorderedETMBranchMapAdd);
+
+void BM_NestedBranchMapMerge(benchmark::State& state) {
+  const auto& branches = GetBranches();
+  std::vector<NestedBranchMap> maps(8);
+  for (size_t i = 0; i < branches.size(); i++) {
+    ++maps[i % maps.size()][branches[i].addr][branches[i].branch];
+  }
+  for (auto _ : state) {
+    NestedBranchMap result;
+    for (const auto& map : maps) {
+      for (const auto& [addr, b_map] : map) {
+        auto& result_b_map = result[addr];
+        for (const auto& [branch, count] : b_map) {
+          result_b_map[branch] += count;
+        }
+      }
+    }
+    benchmark::DoNotOptimize(result);
+  }
+  state.SetItemsProcessed(state.iterations() * branches.size());
+}
+BENCHMARK(BM_NestedBranchMapMerge);
+
+void BM_UnorderedETMBranchMapMerge(benchmark::State& state) {
+  const auto& branches = GetBranches();
+  std::vector<UnorderedETMBranchMap> maps(8);
+  for (size_t i = 0; i < branches.size(); i++) {
+    maps[i % maps.size()].Add(branches[i].addr, branches[i].branch);
+  }
+  for (auto _ : state) {
+    UnorderedETMBranchMap result;
+    for (const auto& map : maps) {
+      result.Merge(map);
+    }
+    benchmark::DoNotOptimize(result);
+  }
+  state.SetItemsProcessed(state.iterations() * branches.size());
+}
+BENCHMARK(BM_UnorderedETMBranchMapMerge);
+
+void BM_ETMBinaryMapToString(benchmark::State& state) {
+  const auto& branches = GetBranches();
+  ETMBinaryMap binary_map;
+  ETMBinary& binary = binary_map[BinaryKey("/bin/test", BuildId())];
+  binary.dso_type = DSO_ELF_FILE;
+  for (const auto& b : branches) {
+    binary.branch_map.Add(b.addr, b.branch);
+  }
+  for (auto _ : state) {
+    std::string s;
+    ETMBinaryMapToString(binary_map, s);
+    benchmark::DoNotOptimize(s);
+  }
+}
+BENCHMARK(BM_ETMBinaryMapToString);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <android-base/file.h>
 #include <gtest/gtest.h>
 
 #include "BranchListFile.h"
@@ -33,3 +34,127 @@ TEST(BranchListFile, etm_branch_to_proto_string) {
     ASSERT_EQ(branch, branch2);
   }
 }
+
+TEST(BranchListFile, unordered_etm_branch_map) {
+  std::vector<bool> short_branch = {true, false, true};
+  std::vector<bool> long_branch(100, false);
+  long_branch[0] = long_branch[64] = long_branch[99] = true;
+
+  UnorderedETMBranchMap map;
+  map.Add(0x200, short_branch);
+  map.Add(0x100, long_branch, 2);
+  map.Add(0x200, short_branch);
+  map.Add(0x200, {});
+  ASSERT_EQ(map.size(), 3);
+
+  UnorderedETMBranchMap map2;
+  map2.AddProtoString(0x100, ETMBranchToProtoString(long_branch), long_branch.size(), 3);
+  map2.AddProtoString(0x100, ETMBranchToProtoString(short_branch), short_branch.size(), 1);
+  map.Merge(map2);
+  ASSERT_EQ(map.size(), 4);
+
+  ETMBranchMap expected;
+  expected[0x100][long_branch] = 5;
+  expected[0x100][short_branch] = 1;
+  expected[0x200][short_branch] = 2;
+  expected[0x200][{}] = 1;
+  ASSERT_EQ(map.GetOrderedBranchMap(), expected);
+
+  std::vector<UnorderedETMBranchMap::Branch> branches = map.GetBranchesSortedByAddr();
+  ASSERT_EQ(branches.size(), 4);
+  ASSERT_EQ(branches[0].addr, 0x100);
+  ASSERT_EQ(branches[0].ToVector(), long_branch);
+  ASSERT_EQ(branches[0].ToProtoString(), ETMBranchToProtoString(long_branch));
+  ASSERT_EQ(branches[3].addr, 0x200);
+
+  map.ConvertAddrs([](uint64_t addr) { return addr == 0x200 ? 0x100 : addr; });
+  expected.clear();
+  expected[0x100][long_branch] = 5;
+  expected[0x100][short_branch] = 3;
+  expected[0x100][{}] = 1;
+  ASSERT_EQ(map.GetOrderedBranchMap(), expected);
+}
+
+TEST(BranchListFile, etm_binary_map_to_string) {
+  std::vector<bool> branch1 = {true, true, false};
+  std::vector<bool> branch2(70, true);
+  ETMBinaryMap binary_map;
+  ETMBinary& binary = binary_map[BinaryKey("/bin/test", BuildId())];
+  binary.dso_type = DSO_ELF_FILE;
+  binary.branch_map.Add(0x300, branch1, 4);
+  binary.branch_map.Add(0x100, branch2, 1);
+  binary.branch_map.Add(0x300, branch2, 2);
+
+  std::string s;
+  ASSERT_TRUE(ETMBinaryMapToString(binary_map, s));
+  ETMBinaryMap binary_map2;
+  ASSERT_TRUE(StringToETMBinaryMap(s, binary_map2));
+  ASSERT_EQ(binary_map2.size(), 1);
+  const ETMBinary& binary2 = binary_map2.begin()->second;
+  ASSERT_EQ(binary2.dso_type, DSO_ELF_FILE);
+  ASSERT_EQ(binary2.GetOrderedBranchMap(), binary.GetOrderedBranchMap());
+}
+
+TEST(BranchListFile, etm_binary_run_merger) {
+  TemporaryDir tmpdir;
+  ETMBinaryRunMerger run_merger(tmpdir.path);
+  std::vector<bool> branch = {true, false};
+  BinaryKey key1("/bin/a", BuildId());
+  BinaryKey key2("/bin/b", BuildId());
+  for (size_t i = 0; i < 3; i++) {
+    ETMBinaryMap binary_map;
+    binary_map[key2].dso_type = DSO_ELF_FILE;
+    binary_map[key2].branch_map.Add(0x100, branch);
+    if (i != 1) {
+      binary_map[key1].dso_type = DSO_ELF_FILE;
+      binary_map[key1].branch_map.Add(0x200 + i, branch);
+    }
+    ASSERT_TRUE(run_merger.WriteRun(binary_map));
+    ASSERT_TRUE(binary_map.empty());
+  }
+  ASSERT_EQ(run_merger.RunCount(), 3);
+  std::vector<BinaryKey> expected_keys = {key1, key2};
+  ASSERT_EQ(run_merger.GetKeys(), expected_keys);
+
+  std::vector<std::pair<BinaryKey, ETMBranchMap>> merged;
+  ASSERT_TRUE(run_merger.Merge([&](const BinaryKey& key, ETMBinary& binary) {
+    merged.emplace_back(key, binary.GetOrderedBranchMap());
+    return true;
+  }));
+  ASSERT_EQ(merged.size(), 2);
+  ASSERT_EQ(merged[0].first, key1);
+  ETMBranchMap expected;
+  expected[0x200][branch] = 1;
+  expected[0x202][branch] = 1;
+  ASSERT_EQ(merged[0].second, expected);
+  ASSERT_EQ(merged[1].first, key2);
+  expected.clear();
+  expected[0x100][branch] = 3;
+  ASSERT_EQ(merged[1].second, expected);
+}
+
+TEST(BranchListFile, branch_list_file_writer) {
+  ETMBinaryMap binary_map;
+  for (const char* path : {"/bin/a", "/bin/b"}) {
+    ETMBinary& binary = binary_map[BinaryKey(path, BuildId())];
+    binary.dso_type = DSO_ELF_FILE;
+    binary.branch_map.Add(0x100, {true, false, true});
+  }
+  TemporaryFile tmpfile;
+  close(tmpfile.release());
+  BranchListFileWriter writer;
+  ASSERT_TRUE(writer.Open(tmpfile.path));
+  for (const auto& [key, binary] : binary_map) {
+    ASSERT_TRUE(writer.WriteETMBinary(key, binary));
+  }
+  ASSERT_TRUE(writer.Close());
+
+  std::string s;
+  ASSERT_TRUE(android::base::ReadFileToString(tmpfile.path, &s));
+  ETMBinaryMap binary_map2;
+  ASSERT_TRUE(StringToETMBinaryMap(s, binary_map2));
+  ASSERT_EQ(binary_map2.size(), 2);
+  for (const auto& [key, binary] : binary_map) {
+    ASSERT_EQ(binary_map2[key].GetOrderedBranchMap(), binary.GetOrderedBranchMap());
+  }
+}
@@ -16,7 +16,11 @@
 
 #include "ETMDecoder.h"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 #include <android-base/expected.h>
 #include <android-base/logging.h>
@@ -235,6 +239,14 @@ class MapLocator : public PacketCallback {
 
   void SetUseVmid(uint8_t trace_id, bool value) { trace_data_[trace_id].use_vmid = value; }
 
+  // Dso functions lazily compute and cache values. When dsos are shared by decoders running in
+  // different threads, they should be called with the dso lock held.
+  void SetDsoMutex(std::mutex* dso_mutex) { dso_mutex_ = dso_mutex; }
+  std::unique_lock<std::mutex> LockDso() {
+    return dso_mutex_ != nullptr ? std::unique_lock<std::mutex>(*dso_mutex_)
+                                 : std::unique_lock<std::mutex>();
+  }
+
  private:
   struct TraceData {
     int32_t tid = -1;  // thread id, -1 if invalid
@@ -245,6 +257,7 @@ class MapLocator : public PacketCallback {
 
   ETMThreadTree& thread_tree_;
   TraceData trace_data_[256];
+  std::mutex* dso_mutex_ = nullptr;
 };
 
 // Map (trace_id, ip address) to (binary_path, binary_offset), and read binary files.
@@ -270,6 +283,7 @@ class MemAccess : public ITargetMemAccess {
     // slow path
     size_t copy_size = 0;
     if (map != nullptr) {
+      auto dso_lock = map_locator_.LockDso();
       llvm::MemoryBuffer* memory = GetMemoryBuffer(map->dso);
       if (memory != nullptr) {
         if (auto opt_offset = map->dso->IpToFileOffset(address, map->start_addr, map->pgoff);
@@ -458,6 +472,7 @@ class InstrRangeParser : public ElementCallback {
         FlushData(data);
         return OCSD_RESP_CONT;
       }
+      auto dso_lock = map_locator_.LockDso();
       uint64_t start_addr = map->GetVaddrInFile(elem.st_addr);
       auto& instr_range = data.instr_range;
 
@@ -613,7 +628,10 @@ class BranchListParser : public PacketCallback {
         return;
       }
       data.branch.dso = map->dso;
-      data.branch.addr = map->GetVaddrInFile(data.addr);
+      {
+        auto dso_lock = map_locator_.LockDso();
+        data.branch.addr = map->GetVaddrInFile(data.addr);
+      }
       if (data.isa == 1) {  // thumb instruction, mark it in bit 0.
         data.branch.addr |= 1;
       }
@@ -779,10 +797,14 @@ class ETMDecoderImpl : public ETMDecoder {
     return true;
   }
 
+  // Used when multiple decoders share dsos. Should be called before registering callbacks.
+  void SetDsoMutex(std::mutex* dso_mutex) { dso_mutex_ = dso_mutex; }
+
  private:
   void InstallMapLocator() {
     if (!map_locator_) {
       map_locator_.reset(new MapLocator(thread_tree_));
+      map_locator_->SetDsoMutex(dso_mutex_);
       for (auto& cfg : configs_) {
         int64_t configr = (*(const ocsd_etmv4_cfg*)*cfg.second).reg_configr;
         map_locator_->SetUseVmid(cfg.first,
@@ -826,6 +848,218 @@ class ETMDecoderImpl : public ETMDecoder {
   std::unique_ptr<InstrRangeParser> instr_range_parser_;
   std::unique_ptr<MapLocator> map_locator_;
   std::unique_ptr<BranchListParser> branch_list_parser_;
+  std::mutex* dso_mutex_ = nullptr;
+};
+
+// ParallelETMDecoder decodes etm data of different cpus in different threads.
+// Each decoding thread has its own ETMDecoderImpl, which contains a complete decode tree and
+// parsers. Data blocks of a cpu are always sent to the same thread, so the decoding states of a
+// trace id are kept in one decoder, like in ETMDecoderImpl. Results are collected from decoding
+// threads, and passed to callbacks in the thread calling ProcessData(), WaitForPendingData() and
+// FinishData(). So the order of results may differ from ETMDecoderImpl, but not the results.
+// Decoding threads read the thread tree and dsos. The thread tree is only read, so it shouldn't be
+// modified while data is being decoded (see WaitForPendingData()). Dsos lazily cache values, so
+// accessing them is protected by dso_mutex_.
+class ParallelETMDecoder : public ETMDecoder {
+ public:
+  ParallelETMDecoder(ETMThreadTree& thread_tree, size_t thread_count, size_t max_pending_bytes)
+      : max_pending_bytes_(max_pending_bytes) {
+    CHECK_GT(thread_count, 0u);
+    for (size_t i = 0; i < thread_count; i++) {
+      auto worker = std::make_unique<Worker>();
+      worker->decoder.reset(new ETMDecoderImpl(thread_tree));
+      worker->decoder->SetDsoMutex(&dso_mutex_);
+      workers_.emplace_back(std::move(worker));
+    }
+  }
+
+  ~ParallelETMDecoder() override { StopWorkers(); }
+
+  void CreateDecodeTree(const AuxTraceInfoRecord& auxtrace_info) {
+    for (auto& worker : workers_) {
+      worker->decoder->CreateDecodeTree(auxtrace_info);
+    }
+  }
+
+  // Dumped data of different threads may interleave.
+  void EnableDump(const ETMDumpOption& option) override {
+    for (auto& worker : workers_) {
+      worker->decoder->EnableDump(option);
+    }
+  }
+
+  void RegisterCallback(const InstrRangeCallbackFn& callback) override {
+    instr_range_callback_ = callback;
+    for (auto& worker : workers_) {
+      Worker* p = worker.get();
+      p->decoder->RegisterCallback(
+          [p](const ETMInstrRange& range) { p->results.instr_ranges.emplace_back(range); });
+    }
+  }
+
+  void RegisterCallback(const BranchListCallbackFn& callback) override {
+    branch_list_callback_ = callback;
+    for (auto& worker : workers_) {
+      Worker* p = worker.get();
+      p->decoder->RegisterCallback(
+          [p](const ETMBranchList& branch) { p->results.branch_lists.emplace_back(branch); });
+    }
+  }
+
+  bool ProcessData(const uint8_t* data, size_t size, bool formatted, uint32_t cpu) override {
+    StartWorkers();
+    // Data is copied, because the caller may reuse the buffer.
+    DataBlock block;
+    block.data.assign(data, data + size);
+    block.formatted = formatted;
+    block.cpu = cpu;
+    Worker& worker = *workers_[cpu % workers_.size()];
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      finish_cond_.wait(lock, [&]() { return pending_bytes_ <= max_pending_bytes_; });
+      pending_bytes_ += size;
+      worker.queue.emplace_back(std::move(block));
+    }
+    worker.cond.notify_one();
+    return DeliverResults();
+  }
+
+  bool WaitForPendingData() override {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      finish_cond_.wait(lock, [&]() { return pending_bytes_ == 0; });
+    }
+    return DeliverResults();
+  }
+
+  bool FinishData() override {
+    if (!WaitForPendingData()) {
+      return false;
+    }
+    StopWorkers();
+    // Decoding threads are stopped, so no lock is needed.
+    for (auto& worker : workers_) {
+      worker->decoder->FinishData();
+      ready_results_.emplace_back(std::move(worker->results));
+      worker->results = Results();
+    }
+    return DeliverResults();
+  }
+
+ private:
+  struct DataBlock {
+    std::vector<uint8_t> data;
+    bool formatted = false;
+    uint32_t cpu = 0;
+  };
+
+  struct Results {
+    std::vector<ETMInstrRange> instr_ranges;
+    std::vector<ETMBranchList> branch_lists;
+  };
+
+  struct Worker {
+    std::unique_ptr<ETMDecoderImpl> decoder;
+    // Results generated by the decoder, only accessed in the decoding thread.
+    Results results;
+    std::deque<DataBlock> queue;
+    std::condition_variable cond;
+    std::thread thread;
+  };
+
+  void StartWorkers() {
+    if (!started_) {
+      started_ = true;
+      for (auto& worker : workers_) {
+        Worker* p = worker.get();
+        p->thread = std::thread([this, p]() { RunWorker(p); });
+      }
+    }
+  }
+
+  void StopWorkers() {
+    if (!started_) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    for (auto& worker : workers_) {
+      worker->cond.notify_one();
+    }
+    for (auto& worker : workers_) {
+      worker->thread.join();
+    }
+    started_ = false;
+    stop_ = false;
+  }
+
+  void RunWorker(Worker* worker) {
+    while (true) {
+      DataBlock block;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        worker->cond.wait(lock, [&]() { return stop_ || !worker->queue.empty(); });
+        if (worker->queue.empty()) {
+          return;
+        }
+        block = std::move(worker->queue.front());
+        worker->queue.pop_front();
+      }
+      bool result = worker->decoder->ProcessData(block.data.data(), block.data.size(),
+                                                 block.formatted, block.cpu);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!result) {
+          failed_ = true;
+        }
+        ready_results_.emplace_back(std::move(worker->results));
+        pending_bytes_ -= block.data.size();
+      }
+      worker->results = Results();
+      finish_cond_.notify_one();
+    }
+  }
+
+  // Pass results collected from decoding threads to callbacks.
+  bool DeliverResults() {
+    std::vector<Results> results;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      results.swap(ready_results_);
+      if (failed_) {
+        return false;
+      }
+    }
+    // Callbacks may access dsos.
+    std::lock_guard<std::mutex> dso_lock(dso_mutex_);
+    for (const Results& r : results) {
+      for (const ETMInstrRange& range : r.instr_ranges) {
+        instr_range_callback_(range);
+      }
+      for (const ETMBranchList& branch : r.branch_lists) {
+        branch_list_callback_(branch);
+      }
+    }
+    return true;
+  }
+
+  const size_t max_pending_bytes_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  InstrRangeCallbackFn instr_range_callback_;
+  BranchListCallbackFn branch_list_callback_;
+  bool started_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable finish_cond_;
+  // Below fields are protected by mutex_.
+  size_t pending_bytes_ = 0;
+  std::vector<Results> ready_results_;
+  bool failed_ = false;
+  bool stop_ = false;
+
+  std::mutex dso_mutex_;
 };
 
 }  // namespace
@@ -847,7 +1081,15 @@ bool ParseEtmDumpOption(const std::string& s, ETMDumpOption* option) {
 }
 
 std::unique_ptr<ETMDecoder> ETMDecoder::Create(const AuxTraceInfoRecord& auxtrace_info,
-                                               ETMThreadTree& thread_tree) {
+                                               ETMThreadTree& thread_tree, size_t thread_count) {
+  if (thread_count > 1) {
+    // Limit memory used by data blocks waiting to be decoded.
+    const size_t max_pending_bytes = 64 * 1024 * 1024;
+    auto decoder =
+        std::make_unique<ParallelETMDecoder>(thread_tree, thread_count, max_pending_bytes);
+    decoder->CreateDecodeTree(auxtrace_info);
+    return std::unique_ptr<ETMDecoder>(decoder.release());
+  }
   auto decoder = std::make_unique<ETMDecoderImpl>(thread_tree);
   decoder->CreateDecodeTree(auxtrace_info);
   return std::unique_ptr<ETMDecoder>(decoder.release());
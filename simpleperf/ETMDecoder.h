@@ -72,8 +72,10 @@ class ETMThreadTree {
 
 class ETMDecoder {
  public:
+  // If thread_count > 1, data of different cpus is decoded in parallel in thread_count threads.
+  // Callbacks are still called in the thread calling the decoder's functions.
   static std::unique_ptr<ETMDecoder> Create(const AuxTraceInfoRecord& auxtrace_info,
-                                            ETMThreadTree& thread_tree);
+                                            ETMThreadTree& thread_tree, size_t thread_count = 1);
   virtual ~ETMDecoder() {}
   virtual void EnableDump(const ETMDumpOption& option) = 0;
 
@@ -84,6 +86,9 @@ class ETMDecoder {
   virtual void RegisterCallback(const BranchListCallbackFn& callback) = 0;
 
   virtual bool ProcessData(const uint8_t* data, size_t size, bool formatted, uint32_t cpu) = 0;
+  // Wait until all data passed to ProcessData() is decoded. When decoding in parallel, the thread
+  // tree is read in decoding threads. So this should be called before modifying the thread tree.
+  virtual bool WaitForPendingData() { return true; }
   virtual bool FinishData() = 0;
 };
 
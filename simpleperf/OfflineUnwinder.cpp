@@ -220,8 +220,9 @@ void UnwindMaps::UpdateMaps(const MapSet& map_set) {
   size_t i = 0;
   size_t old_size = entries_.size();
   bool has_removed_entry = false;
-  for (auto it = map_set.maps.begin(); it != map_set.maps.end();) {
-    const MapEntry* entry = it->second;
+  const std::vector<const MapEntry*>& map_entries = map_set.GetMaps();
+  for (auto it = map_entries.begin(); it != map_entries.end();) {
+    const MapEntry* entry = *it;
     if (i < old_size && entry == entries_[i]) {
       i++;
       ++it;
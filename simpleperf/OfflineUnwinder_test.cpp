@@ -17,6 +17,8 @@
 #include "OfflineUnwinder.h"
 #include "OfflineUnwinder_impl.h"
 
+#include <algorithm>
+
 #include <android-base/parseint.h>
 #include <unwindstack/RegsArm64.h>
 
@@ -25,12 +27,16 @@
 using namespace simpleperf;
 
 bool CheckUnwindMaps(UnwindMaps& maps, const MapSet& map_set) {
-  if (maps.Total() != map_set.maps.size()) {
+  if (maps.Total() != map_set.GetMaps().size()) {
     return false;
   }
   std::shared_ptr<unwindstack::MapInfo> prev_real_map;
   for (auto& info : maps) {
-    if (info == nullptr || map_set.maps.find(info->start()) == map_set.maps.end()) {
+    if (info == nullptr) {
+      return false;
+    }
+    const MapEntry* map = map_set.FindMapByAddr(info->start());
+    if (map == nullptr || map->start_addr != info->start()) {
       return false;
     }
     if (prev_real_map != nullptr && prev_real_map->name() == info->name() &&
@@ -61,7 +67,7 @@ TEST(OfflineUnwinder, UnwindMaps) {
   // 3. Add maps starting from even addr.
   map_set.version = 1;
   for (size_t i = 0; i < map_entries.size(); i += 2) {
-    map_set.maps.insert(std::make_pair(map_entries[i].start_addr, &map_entries[i]));
+    map_set.MutableMaps().push_back(&map_entries[i]);
   }
 
   maps.UpdateMaps(map_set);
@@ -70,7 +76,8 @@ TEST(OfflineUnwinder, UnwindMaps) {
   // 4. Add maps starting from odd addr.
   map_set.version = 2;
   for (size_t i = 1; i < 10; i += 2) {
-    map_set.maps.insert(std::make_pair(map_entries[i].start_addr, &map_entries[i]));
+    std::vector<const MapEntry*>& entries = map_set.MutableMaps();
+    entries.insert(entries.begin() + i, &map_entries[i]);
   }
   maps.UpdateMaps(map_set);
   ASSERT_TRUE(CheckUnwindMaps(maps, map_set));
@@ -78,14 +85,15 @@ TEST(OfflineUnwinder, UnwindMaps) {
   // 5. Remove maps starting from even addr.
   map_set.version = 3;
   for (size_t i = 0; i < 10; i += 2) {
-    map_set.maps.erase(map_entries[i].start_addr);
+    std::vector<const MapEntry*>& entries = map_set.MutableMaps();
+    entries.erase(std::find(entries.begin(), entries.end(), &map_entries[i]));
   }
   maps.UpdateMaps(map_set);
   ASSERT_TRUE(CheckUnwindMaps(maps, map_set));
 
   // 6. Remove all maps.
   map_set.version = 4;
-  map_set.maps.clear();
+  map_set.Clear();
   maps.UpdateMaps(map_set);
   ASSERT_TRUE(CheckUnwindMaps(maps, map_set));
 }
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ParallelUnwinder.h"
+
+#include <android-base/logging.h>
+
+#include "perf_regs.h"
+
+namespace simpleperf {
+
+ParallelUnwinder::ParallelUnwinder(size_t thread_count, size_t max_pending_bytes,
+                                   UnwinderCreator unwinder_creator)
+    : max_pending_bytes_(max_pending_bytes) {
+  CHECK_GT(thread_count, 0u);
+  for (size_t i = 0; i < thread_count; i++) {
+    auto worker = std::make_unique<Worker>();
+    worker->unwinder = unwinder_creator();
+    workers_.emplace_back(std::move(worker));
+  }
+  for (auto& worker : workers_) {
+    Worker* p = worker.get();
+    p->thread = std::thread([this, p]() { RunWorker(p); });
+  }
+}
+
+ParallelUnwinder::~ParallelUnwinder() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  for (auto& worker : workers_) {
+    worker->cond.notify_one();
+  }
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+void ParallelUnwinder::AddRecord(std::unique_ptr<Record> record, bool need_unwinding) {
+  auto task = std::make_unique<UnwindingTask>();
+  pending_bytes_ += record->size();
+  task->record.reset(record.release());
+  task->need_unwinding = need_unwinding;
+  if (need_unwinding) {
+    CHECK_EQ(task->record->type(), PERF_RECORD_SAMPLE);
+    size_t index;
+    if (samples_per_chunk_ != 0) {
+      index = (dispatched_samples_++ / samples_per_chunk_) % workers_.size();
+    } else {
+      auto& r = *static_cast<SampleRecord*>(task->record.get());
+      index = static_cast<uint32_t>(r.tid_data.pid) % workers_.size();
+    }
+    PushWorkItem(*workers_[index], WorkItem{nullptr, task.get()});
+  } else {
+    // No need to lock, because the task isn't visible to unwinding threads.
+    task->finished = true;
+    BroadcastRecord(task->record);
+  }
+  tasks_.emplace_back(std::move(task));
+}
+
+void ParallelUnwinder::UpdateThreadTrees(std::unique_ptr<Record> record) {
+  BroadcastRecord(std::shared_ptr<Record>(record.release()));
+}
+
+void ParallelUnwinder::BroadcastRecord(std::shared_ptr<Record> record) {
+  switch (record->type()) {
+    case PERF_RECORD_MMAP:
+    case PERF_RECORD_MMAP2:
+    case PERF_RECORD_COMM:
+    case PERF_RECORD_FORK:
+    case PERF_RECORD_EXIT:
+      break;
+    default:
+      // Other records don't affect unwinding. Kernel symbols are global, and are updated by the
+      // main thread.
+      return;
+  }
+  for (auto& worker : workers_) {
+    PushWorkItem(*worker, WorkItem{record, nullptr});
+  }
+}
+
+void ParallelUnwinder::PushWorkItem(Worker& worker, WorkItem&& item) {
+  bool notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    notify = worker.queue.empty();
+    worker.queue.emplace_back(std::move(item));
+  }
+  if (notify) {
+    worker.cond.notify_one();
+  }
+}
+
+std::unique_ptr<UnwindingTask> ParallelUnwinder::GetNextTask(bool wait) {
+  if (tasks_.empty()) {
+    return nullptr;
+  }
+  UnwindingTask* task = tasks_.front().get();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!task->finished) {
+      if (!wait) {
+        return nullptr;
+      }
+      finish_cond_.wait(lock, [&]() { return task->finished; });
+    }
+  }
+  std::unique_ptr<UnwindingTask> result = std::move(tasks_.front());
+  tasks_.pop_front();
+  pending_bytes_ -= result->record->size();
+  return result;
+}
+
+void ParallelUnwinder::RunWorker(Worker* worker) {
+  while (true) {
+    WorkItem item;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      worker->cond.wait(lock, [&]() { return stop_ || !worker->queue.empty(); });
+      if (stop_) {
+        return;
+      }
+      item = std::move(worker->queue.front());
+      worker->queue.pop_front();
+    }
+    if (item.task == nullptr) {
+      worker->thread_tree.Update(*item.record);
+      continue;
+    }
+    UnwindingTask* task = item.task;
+    auto& r = *static_cast<SampleRecord*>(task->record.get());
+    ThreadEntry* thread = worker->thread_tree.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+    RegSet regs(r.regs_user_data.abi, r.regs_user_data.reg_mask, r.regs_user_data.regs);
+    task->unwinding_success =
+        worker->unwinder->UnwindCallChain(*thread, regs, r.stack_user_data.data,
+                                          r.GetValidStackSize(), &task->ips, &task->sps);
+    task->callchain_broken_for_incomplete_jit_debug_info =
+        worker->unwinder->IsCallChainBrokenForIncompleteJITDebugInfo();
+    task->unwinding_result = worker->unwinder->GetUnwindingResult();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task->finished = true;
+    }
+    finish_cond_.notify_one();
+  }
+}
+
+}  // namespace simpleperf
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "OfflineUnwinder.h"
+#include "record.h"
+#include "thread_tree.h"
+
+namespace simpleperf {
+
+// An UnwindingTask holds a record passed to ParallelUnwinder, and the unwinding result if the
+// record is a sample needing unwinding.
+struct UnwindingTask {
+  std::shared_ptr<Record> record;
+  bool need_unwinding = false;
+
+  // Below fields are set by unwinding threads.
+  bool unwinding_success = false;
+  bool callchain_broken_for_incomplete_jit_debug_info = false;
+  std::vector<uint64_t> ips;
+  std::vector<uint64_t> sps;
+  UnwindingResult unwinding_result = {};
+
+  // Protected by ParallelUnwinder::mutex_.
+  bool finished = false;
+};
+
+// ParallelUnwinder unwinds samples in multiple unwinding threads, and returns results in the order
+// records are added.
+// Each unwinding thread has its own ThreadTree and OfflineUnwinder. Map, comm, fork and exit
+// records are sent to all unwinding threads to update their thread trees. By default, samples are
+// dispatched by pid, so samples of a process always go to the same thread and reuse its cached
+// maps.
+// All public functions should be called in the same thread.
+class ParallelUnwinder {
+ public:
+  using UnwinderCreator = std::function<std::unique_ptr<OfflineUnwinder>()>;
+
+  // max_pending_bytes limits the total size of records added but not returned by GetNextTask().
+  ParallelUnwinder(size_t thread_count, size_t max_pending_bytes, UnwinderCreator unwinder_creator);
+  ~ParallelUnwinder();
+
+  size_t ThreadCount() const { return workers_.size(); }
+
+  // Dispatch every samples_per_chunk consecutive samples to the same thread, and dispatch chunks
+  // to threads in turn. It balances the work when most samples come from a few processes.
+  void DispatchSamplesByChunk(size_t samples_per_chunk) { samples_per_chunk_ = samples_per_chunk; }
+
+  // Add a record. If need_unwinding is true, the record should be a SampleRecord with regs and
+  // stack data.
+  void AddRecord(std::unique_ptr<Record> record, bool need_unwinding);
+  // Update thread trees in unwinding threads, without generating a task.
+  void UpdateThreadTrees(std::unique_ptr<Record> record);
+  // Return the earliest added task if it is finished. If wait is true, wait until it is finished.
+  // Return nullptr if there is no task to return.
+  std::unique_ptr<UnwindingTask> GetNextTask(bool wait);
+  bool HasPendingTasks() const { return !tasks_.empty(); }
+  bool IsFull() const { return pending_bytes_ >= max_pending_bytes_; }
+
+ private:
+  struct WorkItem {
+    // For updating thread trees.
+    std::shared_ptr<Record> record;
+    // For unwinding samples.
+    UnwindingTask* task = nullptr;
+  };
+
+  struct Worker {
+    ThreadTree thread_tree;
+    std::unique_ptr<OfflineUnwinder> unwinder;
+    std::deque<WorkItem> queue;
+    std::condition_variable cond;
+    std::thread thread;
+  };
+
+  void BroadcastRecord(std::shared_ptr<Record> record);
+  void PushWorkItem(Worker& worker, WorkItem&& item);
+  void RunWorker(Worker* worker);
+
+  const size_t max_pending_bytes_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // Only accessed in the main thread.
+  std::deque<std::unique_ptr<UnwindingTask>> tasks_;
+  size_t pending_bytes_ = 0;
+  size_t samples_per_chunk_ = 0;
+  uint64_t dispatched_samples_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable finish_cond_;
+  bool stop_ = false;
+};
+
+}  // namespace simpleperf
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ParallelUnwinder.h"
+
+#include <gtest/gtest.h>
+
+#include "event_attr.h"
+#include "event_type.h"
+
+using namespace simpleperf;
+
+namespace {
+
+// Instead of unwinding, report the pid and the count of maps seen in the thread tree.
+class FakeUnwinder : public OfflineUnwinder {
+ public:
+  bool UnwindCallChain(const ThreadEntry& thread, const RegSet&, const char*, size_t,
+                       std::vector<uint64_t>* ips, std::vector<uint64_t>* sps) override {
+    *ips = {static_cast<uint64_t>(thread.pid), thread.maps->GetMaps().size()};
+    *sps = {0, 0};
+    unwinding_result_.error_code = thread.pid;
+    return true;
+  }
+};
+
+}  // namespace
+
+class ParallelUnwinderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const EventType* type = FindEventTypeByName("cpu-clock");
+    ASSERT_TRUE(type != nullptr);
+    attr = CreateDefaultPerfEventAttr(*type);
+    attr.sample_id_all = 1;
+    attr.sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+  }
+
+  std::unique_ptr<ParallelUnwinder> CreateUnwinder(size_t thread_count) {
+    return std::make_unique<ParallelUnwinder>(thread_count, 1024 * 1024,
+                                              []() { return std::make_unique<FakeUnwinder>(); });
+  }
+
+  std::unique_ptr<Record> CreateMap(uint32_t pid, uint64_t addr, uint64_t time) {
+    return std::make_unique<MmapRecord>(attr, false, pid, pid, addr, 0x1000, 0, "fake_lib", 0,
+                                        time);
+  }
+
+  std::unique_ptr<Record> CreateSample(uint32_t pid, uint64_t time) {
+    return std::make_unique<SampleRecord>(attr, 0, 0x1000, pid, pid, time, 0, 1,
+                                          PerfSampleReadType(), std::vector<uint64_t>(),
+                                          std::vector<char>(64), 64);
+  }
+
+  perf_event_attr attr;
+};
+
+TEST_F(ParallelUnwinderTest, keep_record_order) {
+  for (size_t thread_count : {1, 2, 4}) {
+    auto unwinder = CreateUnwinder(thread_count);
+    ASSERT_EQ(unwinder->ThreadCount(), thread_count);
+    uint64_t time = 0;
+    for (uint32_t pid = 1; pid <= 8; pid++) {
+      unwinder->AddRecord(CreateMap(pid, 0x1000, time++), false);
+      unwinder->AddRecord(CreateSample(pid, time++), true);
+      unwinder->AddRecord(CreateMap(pid, 0x2000, time++), false);
+      unwinder->AddRecord(CreateSample(pid, time++), true);
+    }
+    for (uint64_t i = 0; i < time; i++) {
+      std::unique_ptr<UnwindingTask> task = unwinder->GetNextTask(true);
+      ASSERT_TRUE(task);
+      ASSERT_EQ(task->record->Timestamp(), i);
+      if (task->record->type() == PERF_RECORD_SAMPLE) {
+        ASSERT_TRUE(task->need_unwinding);
+        ASSERT_TRUE(task->unwinding_success);
+        auto& r = *static_cast<SampleRecord*>(task->record.get());
+        // Samples should be unwound with maps added before them.
+        std::vector<uint64_t> expected_ips = {r.tid_data.pid, i % 4 == 1 ? 1u : 2u};
+        ASSERT_EQ(task->ips, expected_ips);
+        ASSERT_EQ(task->unwinding_result.error_code, r.tid_data.pid);
+      } else {
+        ASSERT_FALSE(task->need_unwinding);
+      }
+    }
+    ASSERT_FALSE(unwinder->HasPendingTasks());
+    ASSERT_TRUE(unwinder->GetNextTask(true) == nullptr);
+  }
+}
+
+TEST_F(ParallelUnwinderTest, dispatch_samples_by_chunk) {
+  auto unwinder = CreateUnwinder(4);
+  unwinder->DispatchSamplesByChunk(2);
+  uint64_t time = 0;
+  unwinder->AddRecord(CreateMap(1, 0x1000, time++), false);
+  for (size_t i = 0; i < 16; i++) {
+    unwinder->AddRecord(CreateSample(1, time++), true);
+    if (i == 8) {
+      unwinder->AddRecord(CreateMap(1, 0x2000, time++), false);
+    }
+  }
+  for (uint64_t i = 0; i < time; i++) {
+    std::unique_ptr<UnwindingTask> task = unwinder->GetNextTask(true);
+    ASSERT_TRUE(task);
+    ASSERT_EQ(task->record->Timestamp(), i);
+    if (task->need_unwinding) {
+      // All threads should see maps added before the sample.
+      std::vector<uint64_t> expected_ips = {1, i < 11 ? 1u : 2u};
+      ASSERT_EQ(task->ips, expected_ips);
+    }
+  }
+}
+
+TEST_F(ParallelUnwinderTest, update_thread_trees) {
+  auto unwinder = CreateUnwinder(2);
+  unwinder->UpdateThreadTrees(CreateMap(1, 0x1000, 0));
+  unwinder->AddRecord(CreateSample(1, 1), true);
+  std::unique_ptr<UnwindingTask> task = unwinder->GetNextTask(true);
+  ASSERT_TRUE(task);
+  std::vector<uint64_t> expected_ips = {1, 1};
+  ASSERT_EQ(task->ips, expected_ips);
+  ASSERT_TRUE(unwinder->GetNextTask(true) == nullptr);
+}
+
+TEST_F(ParallelUnwinderTest, limit_pending_bytes) {
+  auto unwinder = std::make_unique<ParallelUnwinder>(
+      1, 1, []() { return std::make_unique<FakeUnwinder>(); });
+  ASSERT_FALSE(unwinder->IsFull());
+  unwinder->AddRecord(CreateSample(1, 0), true);
+  ASSERT_TRUE(unwinder->IsFull());
+  ASSERT_TRUE(unwinder->GetNextTask(true));
+  ASSERT_FALSE(unwinder->IsFull());
+}
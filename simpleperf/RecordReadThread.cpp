@@ -31,6 +31,10 @@ namespace simpleperf {
 
 static constexpr size_t kDefaultLowBufferLevel = 10 * kMegabyte;
 static constexpr size_t kDefaultCriticalBufferLevel = 5 * kMegabyte;
+// Stack data kept in sample records when the free size in record buffer reaches critical level.
+static constexpr size_t kMinTruncatedStackSize = 1024;
+// Number of threads whose recent stack usage is tracked. It is a power of two.
+static constexpr size_t kStackUsageTableSize = 4096;
 
 RecordBuffer::RecordBuffer(size_t buffer_size)
     : read_head_(0), write_head_(0), buffer_size_(buffer_size), buffer_(new char[buffer_size]) {}
@@ -74,11 +78,13 @@ void RecordBuffer::FinishWrite() {
   size_t write_head = write_head_.load(std::memory_order_relaxed);
   write_head = (write_head + cur_write_record_size_) % buffer_size_;
   write_head_.store(write_head, std::memory_order_release);
+  total_write_size_ += cur_write_record_size_;
 }
 
 char* RecordBuffer::GetCurrentRecord() {
   size_t write_head = write_head_.load(std::memory_order_acquire);
-  size_t read_head = read_head_.load(std::memory_order_relaxed);
+  size_t read_head =
+      (read_head_.load(std::memory_order_relaxed) + cur_read_record_size_) % buffer_size_;
   if (read_head == write_head) {
     return nullptr;
   }
@@ -180,10 +186,15 @@ size_t RecordParser::GetStackSizePos(
   return (sample_type_ & PERF_SAMPLE_STACK_USER) ? pos : 0;
 }
 
-KernelRecordReader::KernelRecordReader(EventFd* event_fd) : event_fd_(event_fd) {
+KernelRecordReader::KernelRecordReader(EventFd* event_fd, KernelBufferStat* stat,
+                                       bool discard_early)
+    : event_fd_(event_fd), stat_(stat), discard_early_(discard_early) {
   size_t buffer_size;
   buffer_ = event_fd_->GetMappedBuffer(buffer_size);
   buffer_mask_ = buffer_size - 1;
+  if (stat_ != nullptr) {
+    stat_->buffer_size = buffer_size;
+  }
 }
 
 bool KernelRecordReader::GetDataFromKernelBuffer() {
@@ -193,6 +204,11 @@ bool KernelRecordReader::GetDataFromKernelBuffer() {
   }
   init_data_size_ = data_size_;
   record_header_.size = 0;
+  if (stat_ != nullptr) {
+    stat_->data_size += data_size_;
+    uint32_t fill_percent = static_cast<uint32_t>(data_size_ * 100 / (buffer_mask_ + 1));
+    stat_->max_fill_percent = std::max(stat_->max_fill_percent, fill_percent);
+  }
   return true;
 }
 
@@ -213,6 +229,14 @@ bool KernelRecordReader::MoveToNextRecord(const RecordParser& parser) {
     init_data_size_ = 0;
     return false;
   }
+  if (discard_early_) {
+    size_t read_size = init_data_size_ - data_size_;
+    if (read_size >= (buffer_mask_ + 1) / 2) {
+      // Let the kernel reuse the space without waiting for the rest of the data to be read.
+      event_fd_->DiscardMmapData(read_size);
+      init_data_size_ = data_size_;
+    }
+  }
   ReadRecord(0, sizeof(record_header_), &record_header_);
   size_t time_pos = parser.GetTimePos(record_header_);
   if (time_pos != 0) {
@@ -228,6 +252,7 @@ RecordReadThread::RecordReadThread(size_t record_buffer_size, const perf_event_a
     : record_buffer_(record_buffer_size),
       record_parser_(attr),
       attr_(attr),
+      stack_usage_table_(kStackUsageTableSize),
       min_mmap_pages_(min_mmap_pages),
       max_mmap_pages_(max_mmap_pages),
       aux_buffer_size_(aux_buffer_size) {
@@ -315,6 +340,18 @@ bool RecordReadThread::SendCmdToReadThread(Cmd cmd, void* cmd_arg) {
   return cmd_result_;
 }
 
+void RecordReadThread::UpdateStackUsage(pid_t tid, uint32_t used_stack_size) {
+  std::atomic_uint64_t& entry = stack_usage_table_[tid & (kStackUsageTableSize - 1)];
+  uint64_t old_value = entry.load(std::memory_order_relaxed);
+  if (static_cast<pid_t>(old_value >> 32) == tid) {
+    // Let the old usage decay slowly, so a few shallow samples don't hide deep ones.
+    uint32_t old_size = static_cast<uint32_t>(old_value);
+    used_stack_size = std::max(used_stack_size, old_size - old_size / 4);
+  }
+  uint64_t new_value = (static_cast<uint64_t>(static_cast<uint32_t>(tid)) << 32) | used_stack_size;
+  entry.store(new_value, std::memory_order_relaxed);
+}
+
 std::unique_ptr<Record> RecordReadThread::GetRecord() {
   record_buffer_.MoveToNextRecord();
   char* p = record_buffer_.GetCurrentRecord();
@@ -328,18 +365,52 @@ std::unique_ptr<Record> RecordReadThread::GetRecord() {
     }
     return r;
   }
+  ClearDataNotification();
+  return nullptr;
+}
+
+void RecordReadThread::GetRecords(RecordArena& arena, size_t max_records,
+                                  std::vector<Record*>& records) {
+  records.clear();
+  arena.Reset();
+  record_buffer_.MoveToNextRecord();
+  while (records.size() < max_records) {
+    char* p = record_buffer_.GetCurrentRecord();
+    if (p == nullptr) {
+      break;
+    }
+    perf_event_header header;
+    memcpy(&header, p, sizeof(header));
+    Record* r = ReadRecordFromBuffer(attr_, header.type, p, record_buffer_.BufferEnd(), arena);
+    CHECK(r != nullptr);
+    if (r->type() == PERF_RECORD_AUXTRACE) {
+      auto auxtrace = static_cast<AuxTraceRecord*>(r);
+      record_buffer_.AddCurrentRecordSize(auxtrace->data->aux_size);
+      auxtrace->location.addr = r->Binary() + r->size();
+    }
+    records.push_back(r);
+  }
+  if (records.empty()) {
+    ClearDataNotification();
+  }
+}
+
+void RecordReadThread::ClearDataNotification() {
   if (has_data_notification_) {
     char unused;
     TEMP_FAILURE_RETRY(read(read_data_fd_, &unused, 1));
     has_data_notification_ = false;
   }
-  return nullptr;
 }
 
 void RecordReadThread::RunReadThread() {
   IncreaseThreadPriority();
   IOEventLoop loop;
   CHECK(loop.AddReadEvent(read_cmd_fd_, [&]() { return HandleCmd(loop); }));
+  if (notification_max_latency_in_ms_ != 0) {
+    timeval period = SecondToTimeval(notification_max_latency_in_ms_ / 1000.0);
+    CHECK(loop.AddPeriodicEvent(period, [&]() { return FlushDataNotification(); }));
+  }
   loop.RunLoop();
 }
 
@@ -372,7 +443,7 @@ bool RecordReadThread::HandleCmd(IOEventLoop& loop) {
       result = HandleRemoveEventFds(*static_cast<std::vector<EventFd*>*>(cmd_arg_));
       break;
     case CMD_SYNC_KERNEL_BUFFER:
-      result = ReadRecordsFromKernelBuffer();
+      result = ReadRecordsFromKernelBuffer(true);
       break;
     case CMD_STOP_THREAD:
       result = loop.ExitLoop();
@@ -431,10 +502,11 @@ bool RecordReadThread::HandleAddEventFds(IOEventLoop& loop,
     return false;
   }
   for (auto& pair : cpu_map) {
-    if (!pair.second->StartPolling(loop, [this]() { return ReadRecordsFromKernelBuffer(); })) {
+    if (!pair.second->StartPolling(loop, [this]() { return ReadRecordsFromKernelBuffer(false); })) {
       return false;
     }
-    kernel_record_readers_.emplace_back(pair.second);
+    kernel_record_readers_.emplace_back(pair.second, &stat_.kernel_buffer_stats[pair.first],
+                                        discard_kernel_data_early_);
   }
   return true;
 }
@@ -463,7 +535,8 @@ static bool CompareRecordTime(KernelRecordReader* r1, KernelRecordReader* r2) {
 // When reading from mmap buffers, we prefer reading from all buffers at once rather than reading
 // one buffer at a time. Because by reading all buffers at once, we can merge records from
 // different buffers easily in memory. Otherwise, we have to sort records with greater effort.
-bool RecordReadThread::ReadRecordsFromKernelBuffer() {
+// When sync is true, the main thread is notified of all records in the RecordBuffer.
+bool RecordReadThread::ReadRecordsFromKernelBuffer(bool sync) {
   do {
     std::vector<KernelRecordReader*> readers;
     for (auto& reader : kernel_record_readers_) {
@@ -511,12 +584,12 @@ bool RecordReadThread::ReadRecordsFromKernelBuffer() {
       event_fd->SetEnableEvent(true);
     }
     event_fds_disabled_by_kernel_.clear();
-    if (!SendDataNotificationToMainThread()) {
+    if (!MaybeSendDataNotification()) {
       return false;
     }
     // If there are no commands, we can loop until there is no more data from the kernel.
   } while (GetCmd() == NO_CMD);
-  return true;
+  return sync ? FlushDataNotification() : true;
 }
 
 void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_record_reader) {
@@ -539,9 +612,9 @@ void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_recor
     size_t stack_size_limit = stack_size_in_sample_record_;
     if (free_size < record_buffer_low_level_) {
       // When the free size in record buffer is below low level, truncate the stack data in sample
-      // records to 1K. This makes the unwinder unwind only part of the callchains, but hopefully
+      // records. This makes the unwinder unwind only part of the callchains, but hopefully
       // the call chain joiner can complete the callchains.
-      stack_size_limit = 1024;
+      stack_size_limit = GetStackSizeLimit(kernel_record_reader, free_size);
     }
     size_t stack_size_pos =
         record_parser_.GetStackSizePos([&](size_t pos, size_t size, void* dest) {
@@ -581,6 +654,7 @@ void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_recor
           record_buffer_.FinishWrite();
           if (new_stack_size < dyn_stack_size) {
             stat_.userspace_truncated_stack_samples++;
+            stat_.userspace_truncated_stack_size += dyn_stack_size - new_stack_size;
           }
         } else {
           stat_.userspace_lost_samples++;
@@ -607,6 +681,9 @@ void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_recor
       LostRecord r;
       if (r.Parse(attr_, p, p + header.size)) {
         stat_.kernelspace_lost_records += static_cast<size_t>(r.lost);
+        if (KernelBufferStat* stat = kernel_record_reader->GetStat(); stat != nullptr) {
+          stat->lost_records += static_cast<size_t>(r.lost);
+        }
       }
     }
     record_buffer_.FinishWrite();
@@ -619,6 +696,33 @@ void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_recor
   }
 }
 
+size_t RecordReadThread::GetStackSizeLimit(KernelRecordReader* kernel_record_reader,
+                                           size_t free_size) {
+  // Scale the limit by buffer pressure: from the full stack size at low level down to 1K at
+  // critical level.
+  uint64_t limit = kMinTruncatedStackSize;
+  if (free_size > record_buffer_critical_level_ &&
+      stack_size_in_sample_record_ > kMinTruncatedStackSize) {
+    limit += static_cast<uint64_t>(stack_size_in_sample_record_ - kMinTruncatedStackSize) *
+             (free_size - record_buffer_critical_level_) /
+             (record_buffer_low_level_ - record_buffer_critical_level_);
+  }
+  // Let threads whose recent unwinding used more stack keep up to twice the limit. Shallow
+  // unwinding never lowers the limit, since the next sample of the thread may be deeper.
+  if (size_t pid_pos = record_parser_.GetPidPosInSampleRecord(); pid_pos != 0) {
+    uint32_t tid;
+    kernel_record_reader->ReadRecord(pid_pos + sizeof(uint32_t), sizeof(tid), &tid);
+    uint64_t value =
+        stack_usage_table_[tid & (kStackUsageTableSize - 1)].load(std::memory_order_relaxed);
+    if (static_cast<uint32_t>(value >> 32) == tid) {
+      uint64_t usage = static_cast<uint32_t>(value);
+      limit = std::max(limit, std::min(usage, limit * 2));
+    }
+  }
+  limit = std::max<uint64_t>(limit, kMinTruncatedStackSize);
+  return static_cast<size_t>(std::min<uint64_t>(limit, stack_size_in_sample_record_));
+}
+
 void RecordReadThread::ReadAuxDataFromKernelBuffer(bool* has_data) {
   for (auto& reader : kernel_record_readers_) {
     EventFd* event_fd = reader.GetEventFd();
@@ -658,6 +762,31 @@ void RecordReadThread::ReadAuxDataFromKernelBuffer(bool* has_data) {
   }
 }
 
+bool RecordReadThread::MaybeSendDataNotification() {
+  uint64_t unnotified_size = record_buffer_.GetTotalWriteSize() - notified_write_size_;
+  if (unnotified_size == 0) {
+    return true;
+  }
+  if (notification_max_latency_in_ms_ != 0 && unnotified_size < notification_size_watermark_ &&
+      record_buffer_.GetFreeSize() > record_buffer_.size() / 2) {
+    // Wait for more records, to let the main thread handle them in larger batches. The periodic
+    // event in the read thread calls FlushDataNotification() to bound the latency.
+    return true;
+  }
+  return FlushDataNotification();
+}
+
+bool RecordReadThread::FlushDataNotification() {
+  notified_write_size_ = record_buffer_.GetTotalWriteSize();
+  // Also notify when records written before are left in the buffer. It happens when the main
+  // thread clears the notification after finding the buffer empty, but before seeing records
+  // written just after that.
+  if (record_buffer_.GetFreeSize() + 1 < record_buffer_.size()) {
+    return SendDataNotificationToMainThread();
+  }
+  return true;
+}
+
 bool RecordReadThread::SendDataNotificationToMainThread() {
   if (!has_data_notification_.load(std::memory_order_relaxed)) {
     has_data_notification_ = true;
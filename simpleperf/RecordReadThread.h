@@ -21,10 +21,12 @@
 #include <atomic>
 #include <condition_variable>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <unordered_set>
+#include <vector>
 
 #include <android-base/macros.h>
 #include <android-base/unique_fd.h>
@@ -49,11 +51,16 @@ class RecordBuffer {
   char* AllocWriteSpace(size_t record_size);
   // Called after writing a record, let the read thread see the record.
   void FinishWrite();
+  // Return the total size of records written to the buffer.
+  uint64_t GetTotalWriteSize() const { return total_write_size_; }
 
-  // Get data of the current record. Return nullptr if there is no records in the buffer.
+  // Get data of the next unread record. Return nullptr if there is no more records in the buffer.
+  // Records returned stay valid until MoveToNextRecord() is called, so the main thread can
+  // look at a batch of records in place.
   char* GetCurrentRecord();
   void AddCurrentRecordSize(size_t size) { cur_read_record_size_ += size; }
-  // Called after reading a record, the space of the record will be writable.
+  // Called after reading records, the space of all records returned by GetCurrentRecord() will
+  // be writable.
   void MoveToNextRecord();
 
  private:
@@ -61,6 +68,7 @@ class RecordBuffer {
   std::atomic_size_t write_head_;
   size_t cur_write_record_size_ = 0;
   size_t cur_read_record_size_ = 0;
+  uint64_t total_write_size_ = 0;
   const size_t buffer_size_;
   std::unique_ptr<char> buffer_;
 
@@ -89,21 +97,38 @@ class RecordParser {
   size_t read_pos_in_sample_records_ = 0;
 };
 
+// Statistics of the kernel buffer of a cpu.
+struct KernelBufferStat {
+  size_t buffer_size = 0;
+  size_t lost_records = 0;
+  uint64_t data_size = 0;
+  // The max percent of the buffer filled with data when reading the buffer.
+  uint32_t max_fill_percent = 0;
+};
+
 struct RecordStat {
   size_t kernelspace_lost_records = 0;
   size_t userspace_lost_samples = 0;
   size_t userspace_lost_non_samples = 0;
   size_t userspace_truncated_stack_samples = 0;
+  // Total size of valid stack data removed from truncated samples.
+  uint64_t userspace_truncated_stack_size = 0;
   uint64_t aux_data_size = 0;
   uint64_t lost_aux_data_size = 0;
+  // Map from cpu to the stat of its kernel buffer.
+  std::map<int, KernelBufferStat> kernel_buffer_stats;
 };
 
 // Read records from the kernel buffer belong to an event_fd.
 class KernelRecordReader {
  public:
-  KernelRecordReader(EventFd* event_fd);
+  // If discard_early is true, space of read records is given back to the kernel once half of
+  // the buffer is read, instead of after reading all available data.
+  KernelRecordReader(EventFd* event_fd, KernelBufferStat* stat = nullptr,
+                     bool discard_early = false);
 
   EventFd* GetEventFd() const { return event_fd_; }
+  KernelBufferStat* GetStat() const { return stat_; }
   // Get available data in the kernel buffer. Return true if there is some data.
   bool GetDataFromKernelBuffer();
   // Get header of the current record.
@@ -117,6 +142,8 @@ class KernelRecordReader {
 
  private:
   EventFd* event_fd_;
+  KernelBufferStat* stat_;
+  bool discard_early_;
   char* buffer_;
   size_t buffer_mask_;
   size_t data_pos_ = 0;
@@ -138,6 +165,19 @@ class RecordReadThread {
     record_buffer_low_level_ = record_buffer_low_level;
     record_buffer_critical_level_ = record_buffer_critical_level;
   }
+  // By default, the main thread is notified each time records are moved to the RecordBuffer.
+  // To reduce wakeups, notifications can be coalesced: the main thread is notified when records
+  // of at least size_watermark bytes are waiting or the RecordBuffer is half full, and records
+  // wait at most max_latency_in_ms otherwise. It should be called before RegisterDataCallback().
+  void SetDataNotificationLimits(size_t size_watermark, uint32_t max_latency_in_ms) {
+    notification_size_watermark_ = size_watermark;
+    notification_max_latency_in_ms_ = max_latency_in_ms;
+  }
+  // If enabled, when more than half of a kernel buffer is read in one pass, the space of read
+  // records is given back to the kernel before reading the rest of the buffer. It lets busy cpus
+  // keep writing while their buffers are merged with others. It should be called before
+  // AddEventFds().
+  void SetDiscardKernelDataEarly(bool enable) { discard_kernel_data_early_ = enable; }
 
   // Below functions are called in the main thread:
 
@@ -152,8 +192,17 @@ class RecordReadThread {
   // Stop the read thread, no more records will be put into the RecordBuffer.
   bool StopReadThread();
 
+  // Report how much user stack unwinding a sample of thread tid used. used_stack_size is
+  // UINT32_MAX if unwinding may need more stack than the sample has. When the RecordBuffer is
+  // low, threads using much stack keep more stack data in later samples.
+  void UpdateStackUsage(pid_t tid, uint32_t used_stack_size);
+
   // If available, return the next record in the RecordBuffer, otherwise return nullptr.
   std::unique_ptr<Record> GetRecord();
+  // Read at most max_records records from the RecordBuffer. The records are allocated in arena
+  // and refer to data in the RecordBuffer, so they are valid until the next call of GetRecords()
+  // or GetRecord(). When the RecordBuffer is empty, records is empty.
+  void GetRecords(RecordArena& arena, size_t max_records, std::vector<Record*>& records);
 
   const RecordStat& GetStat() const { return stat_; }
 
@@ -176,13 +225,18 @@ class RecordReadThread {
   bool HandleCmd(IOEventLoop& loop);
   bool HandleAddEventFds(IOEventLoop& loop, const std::vector<EventFd*>& event_fds);
   bool HandleRemoveEventFds(const std::vector<EventFd*>& event_fds);
-  bool ReadRecordsFromKernelBuffer();
+  bool ReadRecordsFromKernelBuffer(bool sync);
   void PushRecordToRecordBuffer(KernelRecordReader* kernel_record_reader);
+  size_t GetStackSizeLimit(KernelRecordReader* kernel_record_reader, size_t free_size);
   void ReadAuxDataFromKernelBuffer(bool* has_data);
+  bool MaybeSendDataNotification();
+  bool FlushDataNotification();
   bool SendDataNotificationToMainThread();
+  void ClearDataNotification();
 
   RecordBuffer record_buffer_;
-  // When free size in record buffer is below low level, we cut stack data of sample records to 1K.
+  // When free size in record buffer is below low level, we cut stack data of sample records. The
+  // less free size, the more is cut, down to 1K at critical level.
   size_t record_buffer_low_level_;
   // When free size in record buffer is below critical level, we drop sample records to avoid
   // losing more important records (like mmap or fork records).
@@ -190,9 +244,14 @@ class RecordReadThread {
   RecordParser record_parser_;
   perf_event_attr attr_;
   size_t stack_size_in_sample_record_ = 0;
+  // Recent stack usage of threads, indexed by tid. Each entry stores tid in the high 32 bits and
+  // used stack size in the low 32 bits. It is written by the main thread and read by the read
+  // thread.
+  std::vector<std::atomic_uint64_t> stack_usage_table_;
   size_t min_mmap_pages_;
   size_t max_mmap_pages_;
   size_t aux_buffer_size_;
+  bool discard_kernel_data_early_ = false;
 
   // Used to pass command notification from the main thread to the read thread.
   android::base::unique_fd write_cmd_fd_;
@@ -207,6 +266,10 @@ class RecordReadThread {
   android::base::unique_fd write_data_fd_;
   android::base::unique_fd read_data_fd_;
   std::atomic_bool has_data_notification_;
+  size_t notification_size_watermark_ = 0;
+  uint32_t notification_max_latency_in_ms_ = 0;
+  // Total size of records written to the RecordBuffer when last notifying the main thread.
+  uint64_t notified_write_size_ = 0;
 
   std::unique_ptr<std::thread> read_thread_;
   std::vector<KernelRecordReader> kernel_record_readers_;
@@ -27,6 +27,7 @@
 
 using ::testing::_;
 using ::testing::Eq;
+using ::testing::Invoke;
 using ::testing::Return;
 using ::testing::Truly;
 
@@ -229,6 +230,45 @@ TEST(KernelRecordReader, smoke) {
   ASSERT_FALSE(reader.MoveToNextRecord(parser));
 }
 
+TEST(KernelRecordReader, discard_early) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  // Fill 3/4 of the buffer with records.
+  std::vector<char> buffer(4096);
+  size_t record_size = CreateFakeRecords(attr, 1, 0, 0)[0]->size();
+  std::vector<std::unique_ptr<Record>> records =
+      CreateFakeRecords(attr, buffer.size() * 3 / 4 / record_size, 0, 0);
+  size_t data_size = records.size() * record_size;
+  size_t pos = 0;
+  for (auto& r : records) {
+    memcpy(&buffer[pos], r->Binary(), r->size());
+    pos += r->size();
+  }
+  MockEventFd event_fd(attr, 0, buffer.data(), buffer.size(), false);
+  EXPECT_CALL(event_fd, GetAvailableMmapDataSize(Truly(SetArg(0))))
+      .Times(1)
+      .WillOnce(Return(data_size));
+  std::vector<size_t> discard_sizes;
+  EXPECT_CALL(event_fd, DiscardMmapData(_))
+      .Times(2)
+      .WillRepeatedly(Invoke([&](size_t size) { discard_sizes.push_back(size); }));
+  KernelBufferStat stat;
+  KernelRecordReader reader(&event_fd, &stat, true);
+  RecordParser parser(attr);
+  ASSERT_TRUE(reader.GetDataFromKernelBuffer());
+  for (size_t i = 0; i < records.size(); ++i) {
+    ASSERT_TRUE(reader.MoveToNextRecord(parser));
+    ASSERT_EQ(reader.RecordTime(), records[i]->Timestamp());
+  }
+  ASSERT_FALSE(reader.MoveToNextRecord(parser));
+  // Space of records read is given back once half of the buffer is read.
+  ASSERT_EQ(discard_sizes.size(), 2u);
+  ASSERT_GE(discard_sizes[0], buffer.size() / 2);
+  ASSERT_EQ(discard_sizes[0] + discard_sizes[1], data_size);
+  ASSERT_EQ(stat.buffer_size, buffer.size());
+  ASSERT_EQ(stat.data_size, data_size);
+  ASSERT_EQ(stat.max_fill_percent, data_size * 100 / buffer.size());
+}
+
 class RecordReadThreadTest : public ::testing::Test {
  protected:
   std::vector<EventFd*> CreateFakeEventFds(const perf_event_attr& attr, size_t event_fd_count) {
@@ -323,6 +363,128 @@ TEST_F(RecordReadThreadTest, read_records) {
   }
 }
 
+TEST_F(RecordReadThreadTest, read_records_in_batches) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  RecordReadThread thread(128 * 1024, attr, 1, 1, 0);
+  // Coalesced notifications are still sent when syncing kernel buffers.
+  thread.SetDataNotificationLimits(64 * 1024, 1000);
+  IOEventLoop loop;
+  RecordArena arena;
+  std::vector<Record*> batch;
+  size_t record_index = 0;
+  auto callback = [&]() {
+    while (true) {
+      thread.GetRecords(arena, 7, batch);
+      if (batch.empty()) {
+        break;
+      }
+      if (batch.size() > 7u) {
+        return false;
+      }
+      for (Record* r : batch) {
+        std::unique_ptr<Record>& expected = records_[record_index++];
+        if (r->size() != expected->size() ||
+            memcmp(r->Binary(), expected->Binary(), r->size()) != 0) {
+          return false;
+        }
+      }
+    }
+    return loop.ExitLoop();
+  };
+  ASSERT_TRUE(thread.RegisterDataCallback(loop, callback));
+  records_ = CreateFakeRecords(attr, 30, 0, 0);
+  std::vector<EventFd*> event_fds = CreateFakeEventFds(attr, 3);
+  ASSERT_TRUE(thread.AddEventFds(event_fds));
+  ASSERT_TRUE(thread.SyncKernelBuffer());
+  ASSERT_TRUE(loop.RunLoop());
+  ASSERT_EQ(record_index, records_.size());
+  ASSERT_TRUE(thread.RemoveEventFds(event_fds));
+}
+
+TEST_F(RecordReadThreadTest, read_records_left_after_stopping_with_notification_limits) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  RecordReadThread thread(128 * 1024, attr, 1, 1, 0);
+  // Records are far below the size watermark, and the latency bound doesn't expire.
+  thread.SetDataNotificationLimits(64 * 1024, 1000);
+  IOEventLoop loop;
+  ASSERT_TRUE(thread.RegisterDataCallback(loop, []() { return true; }));
+  records_ = CreateFakeRecords(attr, 10, 0, 0);
+  std::vector<EventFd*> event_fds = CreateFakeEventFds(attr, 1);
+  ASSERT_TRUE(thread.AddEventFds(event_fds));
+  // Like what record does when recording stops: sync kernel buffers, stop the read thread and
+  // read all records left in the record buffer.
+  ASSERT_TRUE(thread.SyncKernelBuffer());
+  ASSERT_TRUE(thread.RemoveEventFds(event_fds));
+  ASSERT_TRUE(thread.StopReadThread());
+  RecordArena arena;
+  std::vector<Record*> batch;
+  size_t record_index = 0;
+  while (true) {
+    thread.GetRecords(arena, 4, batch);
+    if (batch.empty()) {
+      break;
+    }
+    for (Record* r : batch) {
+      ASSERT_LT(record_index, records_.size());
+      std::unique_ptr<Record>& expected = records_[record_index++];
+      ASSERT_EQ(r->size(), expected->size());
+      ASSERT_EQ(memcmp(r->Binary(), expected->Binary(), r->size()), 0);
+    }
+  }
+  ASSERT_EQ(record_index, records_.size());
+}
+
+TEST_F(RecordReadThreadTest, kernel_buffer_stats_and_discard_early) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  RecordReadThread thread(128 * 1024, attr, 1, 1, 0);
+  thread.SetDiscardKernelDataEarly(true);
+  IOEventLoop loop;
+  ASSERT_TRUE(thread.RegisterDataCallback(loop, []() { return true; }));
+  // Fill 3/4 of the buffer with records.
+  std::vector<char> buffer(4096);
+  size_t record_size = CreateFakeRecords(attr, 1, 0, 0)[0]->size();
+  records_ = CreateFakeRecords(attr, buffer.size() * 3 / 4 / record_size, 0, 0);
+  size_t data_size = records_.size() * record_size;
+  size_t pos = 0;
+  for (auto& r : records_) {
+    memcpy(&buffer[pos], r->Binary(), r->size());
+    pos += r->size();
+  }
+
+  // Cpu 0 is busy, cpu 1 is idle.
+  std::vector<std::unique_ptr<MockEventFd>> event_fds;
+  for (int cpu = 0; cpu < 2; cpu++) {
+    auto fd = std::make_unique<MockEventFd>(attr, cpu, buffer.data(), buffer.size(), false);
+    EXPECT_CALL(*fd, CreateMappedBuffer(_, _)).Times(1).WillOnce(Return(true));
+    EXPECT_CALL(*fd, StartPolling(_, _)).Times(1).WillOnce(Return(true));
+    if (cpu == 0) {
+      EXPECT_CALL(*fd, GetAvailableMmapDataSize(Truly(SetArg(0))))
+          .Times(1)
+          .WillOnce(Return(data_size));
+      // Space is given back once half of the buffer is read, and after reading the rest.
+      EXPECT_CALL(*fd, DiscardMmapData(_)).Times(2);
+    } else {
+      EXPECT_CALL(*fd, GetAvailableMmapDataSize(_)).Times(1).WillOnce(Return(0));
+    }
+    EXPECT_CALL(*fd, StopPolling()).Times(1).WillOnce(Return(true));
+    EXPECT_CALL(*fd, DestroyMappedBuffer()).Times(1);
+    EXPECT_CALL(*fd, DestroyAuxBuffer()).Times(1);
+    event_fds.emplace_back(std::move(fd));
+  }
+  std::vector<EventFd*> fds = {event_fds[0].get(), event_fds[1].get()};
+  ASSERT_TRUE(thread.AddEventFds(fds));
+  ASSERT_TRUE(thread.SyncKernelBuffer());
+  ASSERT_TRUE(thread.RemoveEventFds(fds));
+
+  const auto& stats = thread.GetStat().kernel_buffer_stats;
+  ASSERT_EQ(stats.size(), 2u);
+  ASSERT_EQ(stats.at(0).buffer_size, buffer.size());
+  ASSERT_EQ(stats.at(0).data_size, data_size);
+  ASSERT_EQ(stats.at(0).max_fill_percent, data_size * 100 / buffer.size());
+  ASSERT_EQ(stats.at(1).data_size, 0u);
+  ASSERT_EQ(stats.at(1).max_fill_percent, 0u);
+}
+
 TEST_F(RecordReadThreadTest, process_sample_record) {
   perf_event_attr attr = CreateFakeEventAttr();
   attr.sample_type |= PERF_SAMPLE_STACK_USER;
@@ -333,6 +495,8 @@ TEST_F(RecordReadThreadTest, process_sample_record) {
   ASSERT_TRUE(thread.RegisterDataCallback(loop, []() { return true; }));
 
   auto read_record = [&](std::unique_ptr<Record>& r) {
+    // Release the previous record, so the record buffer is empty.
+    ASSERT_FALSE(thread.GetRecord());
     std::vector<EventFd*> event_fds = CreateFakeEventFds(attr, 1);
     ASSERT_TRUE(thread.AddEventFds(event_fds));
     ASSERT_TRUE(thread.SyncKernelBuffer());
@@ -357,22 +521,56 @@ TEST_F(RecordReadThreadTest, process_sample_record) {
   ASSERT_EQ(sr->stack_user_data.size, 4096u);
   ASSERT_EQ(sr->stack_user_data.dyn_size, 4096u);
 
-  // When the free space in record buffer is below low level but above critical level, only
-  // 1K stack data in sample records is left.
-  thread.SetBufferLevels(record_buffer_size, 0);
+  // When the free space in record buffer is below low level, stack data in sample records is
+  // truncated. The closer the free space is to critical level, the less stack data is left.
+  size_t free_size = record_buffer_size - 1;
+  thread.SetBufferLevels(free_size * 63, 0);
+  read_record(r);
+  ASSERT_TRUE(r);
+  sr = static_cast<SampleRecord*>(r.get());
+  ASSERT_EQ(sr->stack_user_data.size, 2048u);
+  ASSERT_EQ(sr->stack_user_data.dyn_size, 2048u);
+
+  // Shallow unwinding of recent samples doesn't lower the limit.
+  thread.UpdateStackUsage(sr->tid_data.tid, 600);
+  read_record(r);
+  ASSERT_TRUE(r);
+  sr = static_cast<SampleRecord*>(r.get());
+  ASSERT_EQ(sr->stack_user_data.size, 2048u);
+  ASSERT_EQ(sr->stack_user_data.dyn_size, 2048u);
+
+  // At critical level, only 1K stack data in sample records is left.
+  thread.SetBufferLevels(record_buffer_size, free_size);
   read_record(r);
   ASSERT_TRUE(r);
   sr = static_cast<SampleRecord*>(r.get());
   ASSERT_EQ(sr->stack_user_data.size, 1024u);
   ASSERT_EQ(sr->stack_user_data.dyn_size, 1024u);
 
+  // If unwinding recent samples of the thread used more stack, keep what unwinding used, up to
+  // twice the limit.
+  thread.UpdateStackUsage(sr->tid_data.tid, 1500);
+  read_record(r);
+  ASSERT_TRUE(r);
+  sr = static_cast<SampleRecord*>(r.get());
+  ASSERT_EQ(sr->stack_user_data.size, 1504u);
+  ASSERT_EQ(sr->stack_user_data.dyn_size, 1504u);
+  thread.UpdateStackUsage(sr->tid_data.tid, UINT32_MAX);
+  read_record(r);
+  ASSERT_TRUE(r);
+  sr = static_cast<SampleRecord*>(r.get());
+  ASSERT_EQ(sr->stack_user_data.size, 2048u);
+  ASSERT_EQ(sr->stack_user_data.dyn_size, 2048u);
+
   // When the free space in record buffer is below critical level, sample records are dropped.
   thread.SetBufferLevels(record_buffer_size, record_buffer_size);
   read_record(r);
   ASSERT_FALSE(r);
   ASSERT_EQ(thread.GetStat().userspace_lost_samples, 1u);
   ASSERT_EQ(thread.GetStat().userspace_lost_non_samples, 0u);
-  ASSERT_EQ(thread.GetStat().userspace_truncated_stack_samples, 1u);
+  ASSERT_EQ(thread.GetStat().userspace_truncated_stack_samples, 5u);
+  ASSERT_EQ(thread.GetStat().userspace_truncated_stack_size,
+            2048u + 2048u + 3072u + 2592u + 2048u);
 }
 
 // Test that the data notification exists until the RecordBuffer is empty. So we can read all
@@ -48,18 +48,28 @@ struct CallChainRoot {
 
   CallChainRoot() : duplicated(false), children_period(0) {}
 
+  using IsSameSampleFn = std::function<bool(const EntryT*, const EntryT*)>;
+
   void AddCallChain(const std::vector<EntryT*>& callchain, uint64_t period,
-                    std::function<bool(const EntryT*, const EntryT*)> is_same_sample) {
+                    const IsSameSampleFn& is_same_sample) {
+    AddCallChain(callchain.data(), callchain.size(), period, is_same_sample);
+  }
+
+  // Add a callchain stored in an array, which can be part of a longer callchain.
+  void AddCallChain(EntryT* const* callchain, size_t size, uint64_t period,
+                    const IsSameSampleFn& is_same_sample) {
     children_period += period;
     NodeT* p = FindMatchingNode(children, callchain[0], is_same_sample);
     if (p == nullptr) {
-      std::unique_ptr<NodeT> new_node = AllocateNode(callchain, 0, period, 0);
+      std::unique_ptr<NodeT> new_node = AllocateNode(callchain, size, period, 0);
       children.push_back(std::move(new_node));
       return;
     }
     size_t callchain_pos = 0;
     while (true) {
-      size_t match_length = GetMatchingLengthInNode(p, callchain, callchain_pos, is_same_sample);
+      size_t match_length =
+          GetMatchingLengthInNode(p, callchain + callchain_pos, size - callchain_pos,
+                                  is_same_sample);
       CHECK_GT(match_length, 0u);
       callchain_pos += match_length;
       bool find_child = true;
@@ -67,7 +77,7 @@ struct CallChainRoot {
         SplitNode(p, match_length);
         find_child = false;  // No need to find matching node in p->children.
       }
-      if (callchain_pos == callchain.size()) {
+      if (callchain_pos == size) {
         p->period += period;
         return;
       }
@@ -79,12 +89,32 @@ struct CallChainRoot {
           continue;
         }
       }
-      std::unique_ptr<NodeT> new_node = AllocateNode(callchain, callchain_pos, period, 0);
+      std::unique_ptr<NodeT> new_node =
+          AllocateNode(callchain + callchain_pos, size - callchain_pos, period, 0);
       p->children.push_back(std::move(new_node));
       break;
     }
   }
 
+  // Add all callchains in another callchain tree. It is used to merge sample trees built in
+  // different threads.
+  void MergeCallChain(const CallChainRoot& other, const IsSameSampleFn& is_same_sample) {
+    std::vector<EntryT*> callchain;
+    std::function<void(const NodeT*)> add_node = [&](const NodeT* node) {
+      callchain.insert(callchain.end(), node->chain.begin(), node->chain.end());
+      if (node->period != 0 || node->children.empty()) {
+        AddCallChain(callchain, node->period, is_same_sample);
+      }
+      for (auto& child : node->children) {
+        add_node(child.get());
+      }
+      callchain.resize(callchain.size() - node->chain.size());
+    };
+    for (auto& child : other.children) {
+      add_node(child.get());
+    }
+  }
+
   void SortByPeriod() {
     std::queue<std::vector<std::unique_ptr<NodeT>>*> queue;
     queue.push(&children);
@@ -102,7 +132,13 @@ struct CallChainRoot {
 
  private:
   NodeT* FindMatchingNode(const std::vector<std::unique_ptr<NodeT>>& nodes, const EntryT* sample,
-                          std::function<bool(const EntryT*, const EntryT*)> is_same_sample) {
+                          const IsSameSampleFn& is_same_sample) {
+    // Most samples in callchains are shared in a sample tree, so compare pointers first.
+    for (auto& node : nodes) {
+      if (node->chain.front() == sample) {
+        return node.get();
+      }
+    }
     for (auto& node : nodes) {
       if (is_same_sample(node->chain.front(), sample)) {
         return node.get();
@@ -111,20 +147,20 @@ struct CallChainRoot {
     return nullptr;
   }
 
-  size_t GetMatchingLengthInNode(NodeT* node, const std::vector<EntryT*>& chain, size_t chain_start,
-                                 std::function<bool(const EntryT*, const EntryT*)> is_same_sample) {
-    size_t i, j;
-    for (i = 0, j = chain_start; i < node->chain.size() && j < chain.size(); ++i, ++j) {
-      if (!is_same_sample(node->chain[i], chain[j])) {
-        break;
-      }
+  size_t GetMatchingLengthInNode(NodeT* node, EntryT* const* chain, size_t size,
+                                 const IsSameSampleFn& is_same_sample) {
+    size_t limit = std::min(node->chain.size(), size);
+    size_t i = 0;
+    while (i < limit && (node->chain[i] == chain[i] || is_same_sample(node->chain[i], chain[i]))) {
+      ++i;
     }
     return i;
   }
 
   void SplitNode(NodeT* parent, size_t parent_length) {
     std::unique_ptr<NodeT> child =
-        AllocateNode(parent->chain, parent_length, parent->period, parent->children_period);
+        AllocateNode(parent->chain.data() + parent_length, parent->chain.size() - parent_length,
+                     parent->period, parent->children_period);
     child->children = std::move(parent->children);
     parent->period = 0;
     parent->children_period = child->period + child->children_period;
@@ -133,12 +169,10 @@ struct CallChainRoot {
     parent->children.push_back(std::move(child));
   }
 
-  std::unique_ptr<NodeT> AllocateNode(const std::vector<EntryT*>& chain, size_t chain_start,
-                                      uint64_t period, uint64_t children_period) {
+  std::unique_ptr<NodeT> AllocateNode(EntryT* const* chain, size_t size, uint64_t period,
+                                      uint64_t children_period) {
     std::unique_ptr<NodeT> node(new NodeT);
-    for (size_t i = chain_start; i < chain.size(); ++i) {
-      node->chain.push_back(chain[i]);
-    }
+    node->chain.assign(chain, chain + size);
     node->period = period;
     node->children_period = children_period;
     return node;
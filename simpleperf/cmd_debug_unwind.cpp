@@ -407,8 +407,7 @@ class TestFileGenerator : public RecordFileProcessor {
       const perf_event_attr& attr = attrs[0].attr;
       uint64_t event_id = attrs[0].ids[0];
 
-      for (const auto& p : thread->maps->maps) {
-        const MapEntry* map = p.second;
+      for (const MapEntry* map : thread->maps->GetMaps()) {
         Mmap2Record map_record(attr, false, r.tid_data.pid, r.tid_data.tid, map->start_addr,
                                map->len, map->pgoff, map->flags, map->dso->Path(), event_id,
                                r.Timestamp());
@@ -593,6 +593,25 @@ bool DumpRecordCommand::DumpFeatureSection() {
           }
         }
       }
+    } else if (feature == FEAT_RECORD_INDEX) {
+      PrintIndented(1, "record_index:\n");
+      if (auto opt_index = record_file_reader_->ReadRecordIndexFeature(); opt_index) {
+        for (const RecordIndexChunk& chunk : opt_index.value()) {
+          PrintIndented(2, "chunk: offset %" PRIu64 ", size %" PRIu64 "\n", chunk.offset,
+                        chunk.size);
+          PrintIndented(3, "sample_count: %" PRIu64 "\n", chunk.sample_count);
+          if (chunk.sample_count != 0) {
+            PrintIndented(3, "sample_time: %" PRIu64 " - %" PRIu64 "\n", chunk.min_sample_time,
+                          chunk.max_sample_time);
+            std::vector<std::string> pids;
+            for (uint32_t pid : chunk.pids) {
+              pids.emplace_back(std::to_string(pid));
+            }
+            PrintIndented(3, "pids: %s\n", android::base::Join(pids, ",").c_str());
+          }
+          PrintIndented(3, "has_non_sample_records: %d\n", chunk.has_non_sample_records);
+        }
+      }
     }
   }
   return true;
@@ -18,9 +18,12 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <optional>
 #include <string>
+#include <thread>
 
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
@@ -169,8 +172,20 @@ class PerfDataReader {
     if (!reader_->LoadBuildIdAndFileFeatures(thread_tree_)) {
       return false;
     }
-    if (!reader_->ReadDataSection([this](auto r) { return ProcessRecord(*r); })) {
-      return false;
+    RecordArena arena;
+    std::vector<Record*> records;
+    while (true) {
+      if (!reader_->ReadRecordBatch(arena, RecordFileReader::kRecordBatchSize, records)) {
+        return false;
+      }
+      if (records.empty()) {
+        break;
+      }
+      for (Record* r : records) {
+        if (!ProcessRecord(*r)) {
+          return false;
+        }
+      }
     }
     return PostProcess();
   }
@@ -228,9 +243,11 @@ class ETMThreadTreeWithFilter : public ETMThreadTree {
 class ETMPerfDataReader : public PerfDataReader {
  public:
   ETMPerfDataReader(std::unique_ptr<RecordFileReader> reader, bool exclude_perf,
-                    const RegEx* binary_name_regex, ETMDumpOption etm_dump_option)
+                    const RegEx* binary_name_regex, ETMDumpOption etm_dump_option,
+                    size_t decode_threads)
       : PerfDataReader(std::move(reader), exclude_perf, binary_name_regex),
         etm_dump_option_(etm_dump_option),
+        decode_threads_(decode_threads),
         etm_thread_tree_(thread_tree_, exclude_pid_) {}
 
   bool Read() override {
@@ -242,9 +259,13 @@ class ETMPerfDataReader : public PerfDataReader {
 
  private:
   bool ProcessRecord(Record& r) override {
+    if (etm_decoder_ && UpdatesThreadTree(r) && !etm_decoder_->WaitForPendingData()) {
+      return false;
+    }
     thread_tree_.Update(r);
     if (r.type() == PERF_RECORD_AUXTRACE_INFO) {
-      etm_decoder_ = ETMDecoder::Create(static_cast<AuxTraceInfoRecord&>(r), etm_thread_tree_);
+      etm_decoder_ = ETMDecoder::Create(static_cast<AuxTraceInfoRecord&>(r), etm_thread_tree_,
+                                        decode_threads_);
       if (!etm_decoder_) {
         return false;
       }
@@ -265,16 +286,16 @@ class ETMPerfDataReader : public PerfDataReader {
       size_t aux_size = aux.data->aux_size;
       if (aux_size > 0) {
         bool error = false;
-        if (!reader_->ReadAuxData(aux.Cpu(), aux.data->aux_offset, aux_size, aux_data_buffer_,
-                                  error)) {
+        const uint8_t* aux_data =
+            reader_->GetAuxData(aux.Cpu(), aux.data->aux_offset, aux_size, aux_data_buffer_, error);
+        if (aux_data == nullptr) {
           return !error;
         }
         if (!etm_decoder_) {
           LOG(ERROR) << "ETMDecoder isn't created";
           return false;
         }
-        return etm_decoder_->ProcessData(aux_data_buffer_.data(), aux_size, !aux.Unformatted(),
-                                         aux.Cpu());
+        return etm_decoder_->ProcessData(aux_data, aux_size, !aux.Unformatted(), aux.Cpu());
       }
     } else if (r.type() == PERF_RECORD_MMAP && r.InKernel()) {
       auto& mmap_r = static_cast<MmapRecord&>(r);
@@ -285,6 +306,21 @@ class ETMPerfDataReader : public PerfDataReader {
     return true;
   }
 
+  // Etm data may be decoded in other threads, which read the thread tree.
+  static bool UpdatesThreadTree(const Record& r) {
+    switch (r.type()) {
+      case PERF_RECORD_MMAP:
+      case PERF_RECORD_MMAP2:
+      case PERF_RECORD_COMM:
+      case PERF_RECORD_FORK:
+      case PERF_RECORD_EXIT:
+      case SIMPLE_PERF_RECORD_KERNEL_SYMBOL:
+        return true;
+      default:
+        return false;
+    }
+  }
+
   bool PostProcess() override {
     if (etm_decoder_ && !etm_decoder_->FinishData()) {
       return false;
@@ -337,7 +373,7 @@ class ETMPerfDataReader : public PerfDataReader {
     }
 
     auto& branch_map = etm_binary_map_[branch_list.dso].branch_map;
-    ++branch_map[branch_list.addr][branch_list.branch];
+    branch_map.Add(branch_list.addr, branch_list.branch);
   }
 
   void ProcessETMBinary() {
@@ -363,6 +399,7 @@ class ETMPerfDataReader : public PerfDataReader {
   }
 
   ETMDumpOption etm_dump_option_;
+  size_t decode_threads_;
   ETMThreadTreeWithFilter etm_thread_tree_;
   std::vector<uint8_t> aux_data_buffer_;
   std::unique_ptr<ETMDecoder> etm_decoder_;
@@ -638,12 +675,9 @@ class ETMBranchListToAutoFDOConverter {
       return;
     }
     // Addresses are still kernel ip addrs in memory. Need to convert them to vaddrs in vmlinux.
-    UnorderedETMBranchMap new_branch_map;
-    for (auto& p : binary.branch_map) {
-      uint64_t vaddr_in_file = dso->IpToVaddrInFile(p.first, kernel_start_addr, 0);
-      new_branch_map[vaddr_in_file] = std::move(p.second);
-    }
-    binary.branch_map = std::move(new_branch_map);
+    binary.branch_map.ConvertAddrs([&](uint64_t addr) {
+      return dso->IpToVaddrInFile(addr, kernel_start_addr, 0);
+    });
   }
 };
 
@@ -659,6 +693,13 @@ class AutoFDOWriter {
     }
   }
 
+  void Merge(AutoFDOWriter& other) {
+    for (auto& [key, binary] : other.binary_map_) {
+      AddAutoFDOBinary(key, binary);
+    }
+    other.binary_map_.clear();
+  }
+
   bool Write(const std::string& output_filename) {
     std::unique_ptr<FILE, decltype(&fclose)> output_fp(fopen(output_filename.c_str(), "w"), fclose);
     if (!output_fp) {
@@ -675,61 +716,69 @@ class AutoFDOWriter {
     }
     std::sort(keys.begin(), keys.end(),
               [](const BinaryKey& key1, const BinaryKey& key2) { return key1.path < key2.path; });
-    if (keys.size() > 1) {
-      fprintf(output_fp.get(),
+    WriteHeader(output_fp.get(), keys.size());
+    for (const auto& key : keys) {
+      WriteBinary(output_fp.get(), key, binary_map_[key]);
+    }
+    return true;
+  }
+
+  // Below functions are used to write binaries one by one, in the order of paths.
+  static void WriteHeader(FILE* output_fp, size_t binary_count) {
+    if (binary_count > 1) {
+      fprintf(output_fp,
               "// Please split this file. AutoFDO only accepts profile for one binary.\n");
     }
-    for (const auto& key : keys) {
-      const AutoFDOBinaryInfo& binary = binary_map_[key];
-      // AutoFDO text format needs file_offsets instead of virtual addrs in a binary. And it uses
-      // below formula: vaddr = file_offset + GetFirstLoadSegmentVaddr().
-      uint64_t first_load_segment_addr = binary.first_load_segment_addr;
-
-      auto to_offset = [&](uint64_t vaddr) -> uint64_t {
-        if (vaddr == 0) {
-          return 0;
-        }
-        CHECK_GE(vaddr, first_load_segment_addr);
-        return vaddr - first_load_segment_addr;
-      };
+  }
 
-      // Write range_count_map.
-      std::map<AddrPair, uint64_t> range_count_map(binary.range_count_map.begin(),
-                                                   binary.range_count_map.end());
-      fprintf(output_fp.get(), "%zu\n", range_count_map.size());
-      for (const auto& pair2 : range_count_map) {
-        const AddrPair& addr_range = pair2.first;
-        uint64_t count = pair2.second;
+  static void WriteBinary(FILE* output_fp, const BinaryKey& key, const AutoFDOBinaryInfo& binary) {
+    // AutoFDO text format needs file_offsets instead of virtual addrs in a binary. And it uses
+    // below formula: vaddr = file_offset + GetFirstLoadSegmentVaddr().
+    uint64_t first_load_segment_addr = binary.first_load_segment_addr;
 
-        fprintf(output_fp.get(), "%" PRIx64 "-%" PRIx64 ":%" PRIu64 "\n",
-                to_offset(addr_range.first), to_offset(addr_range.second), count);
+    auto to_offset = [&](uint64_t vaddr) -> uint64_t {
+      if (vaddr == 0) {
+        return 0;
       }
+      CHECK_GE(vaddr, first_load_segment_addr);
+      return vaddr - first_load_segment_addr;
+    };
 
-      // Write addr_count_map.
-      std::map<uint64_t, uint64_t> address_count_map(binary.address_count_map.begin(),
-                                                     binary.address_count_map.end());
-      fprintf(output_fp.get(), "%zu\n", address_count_map.size());
-      for (const auto& [addr, count] : address_count_map) {
-        fprintf(output_fp.get(), "%" PRIx64 ":%" PRIu64 "\n", to_offset(addr), count);
-      }
+    // Write range_count_map.
+    std::map<AddrPair, uint64_t> range_count_map(binary.range_count_map.begin(),
+                                                 binary.range_count_map.end());
+    fprintf(output_fp, "%zu\n", range_count_map.size());
+    for (const auto& pair2 : range_count_map) {
+      const AddrPair& addr_range = pair2.first;
+      uint64_t count = pair2.second;
 
-      // Write branch_count_map.
-      std::map<AddrPair, uint64_t> branch_count_map(binary.branch_count_map.begin(),
-                                                    binary.branch_count_map.end());
-      fprintf(output_fp.get(), "%zu\n", branch_count_map.size());
-      for (const auto& pair2 : branch_count_map) {
-        const AddrPair& branch = pair2.first;
-        uint64_t count = pair2.second;
+      fprintf(output_fp, "%" PRIx64 "-%" PRIx64 ":%" PRIu64 "\n", to_offset(addr_range.first),
+              to_offset(addr_range.second), count);
+    }
 
-        fprintf(output_fp.get(), "%" PRIx64 "->%" PRIx64 ":%" PRIu64 "\n", to_offset(branch.first),
-                to_offset(branch.second), count);
-      }
+    // Write addr_count_map.
+    std::map<uint64_t, uint64_t> address_count_map(binary.address_count_map.begin(),
+                                                   binary.address_count_map.end());
+    fprintf(output_fp, "%zu\n", address_count_map.size());
+    for (const auto& [addr, count] : address_count_map) {
+      fprintf(output_fp, "%" PRIx64 ":%" PRIu64 "\n", to_offset(addr), count);
+    }
 
-      // Write the binary path in comment.
-      fprintf(output_fp.get(), "// build_id: %s\n", key.build_id.ToString().c_str());
-      fprintf(output_fp.get(), "// %s\n\n", key.path.c_str());
+    // Write branch_count_map.
+    std::map<AddrPair, uint64_t> branch_count_map(binary.branch_count_map.begin(),
+                                                  binary.branch_count_map.end());
+    fprintf(output_fp, "%zu\n", branch_count_map.size());
+    for (const auto& pair2 : branch_count_map) {
+      const AddrPair& branch = pair2.first;
+      uint64_t count = pair2.second;
+
+      fprintf(output_fp, "%" PRIx64 "->%" PRIx64 ":%" PRIu64 "\n", to_offset(branch.first),
+              to_offset(branch.second), count);
     }
-    return true;
+
+    // Write the binary path in comment.
+    fprintf(output_fp, "// build_id: %s\n", key.build_id.ToString().c_str());
+    fprintf(output_fp, "// %s\n\n", key.path.c_str());
   }
 
  private:
@@ -778,8 +827,29 @@ struct BranchListMerger {
     }
   }
 
+  void Merge(BranchListMerger& other) {
+    for (auto& [key, binary] : other.etm_data_) {
+      AddETMBinary(key, binary);
+    }
+    other.etm_data_.clear();
+    if (!other.lbr_data_.samples.empty()) {
+      AddLBRData(other.lbr_data_);
+    }
+    other.lbr_data_ = LBRData();
+    other.lbr_binary_id_map_.clear();
+  }
+
   ETMBinaryMap& GetETMData() { return etm_data_; }
 
+  // Return the approximate size of memory used by etm data.
+  size_t ETMDataMemoryUsage() const {
+    size_t size = 0;
+    for (const auto& [key, binary] : etm_data_) {
+      size += sizeof(key) + key.path.size() + sizeof(binary) + binary.branch_map.MemoryUsage();
+    }
+    return size;
+  }
+
   LBRData& GetLBRData() { return lbr_data_; }
 
  private:
@@ -788,6 +858,20 @@ struct BranchListMerger {
   std::unordered_map<BinaryKey, uint32_t, BinaryKeyHash> lbr_binary_id_map_;
 };
 
+// Merge results[1..] into results[0]. In each round, pairs of results are merged in parallel.
+template <typename T>
+static void MergeInTree(std::vector<T>& results) {
+  for (size_t step = 1; step < results.size(); step *= 2) {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i + step < results.size(); i += 2 * step) {
+      threads.emplace_back([&results, i, step]() { results[i].Merge(results[i + step]); });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+}
+
 // Write branch lists to a protobuf file specified by branch_list.proto.
 static bool WriteBranchListFile(const std::string& output_filename, const ETMBinaryMap& etm_data,
                                 const LBRData& lbr_data) {
@@ -832,7 +916,15 @@ class InjectCommand : public Command {
 "                             Default is autofdo.\n"
 "--dump-etm type1,type2,...   Dump etm data. A type is one of raw, packet and element.\n"
 "--exclude-perf               Exclude trace data for the recording process.\n"
+"--merge-memory-limit SIZE[K|M|G]\n"
+"                             When merging branch list files, use about SIZE bytes of memory to\n"
+"                             keep merged etm data. Data exceeding the limit is written to\n"
+"                             temporary files in the output file's directory, and merged at the\n"
+"                             end.\n"
 "--symdir <dir>               Look for binaries in a directory recursively.\n"
+"-j <jobs>                    Use jobs threads to read input files in parallel. Default is 1.\n"
+"                             When reading one file, use jobs threads to decode etm data of\n"
+"                             different cpus in parallel.\n"
 "\n"
 "Examples:\n"
 "1. Generate autofdo text output.\n"
@@ -875,6 +967,8 @@ class InjectCommand : public Command {
         {"--dump-etm", {OptionValueType::STRING, OptionType::SINGLE}},
         {"--exclude-perf", {OptionValueType::NONE, OptionType::SINGLE}},
         {"-i", {OptionValueType::STRING, OptionType::MULTIPLE}},
+        {"-j", {OptionValueType::UINT, OptionType::SINGLE}},
+        {"--merge-memory-limit", {OptionValueType::UINT, OptionType::SINGLE}},
         {"-o", {OptionValueType::STRING, OptionType::SINGLE}},
         {"--output", {OptionValueType::STRING, OptionType::SINGLE}},
         {"--symdir", {OptionValueType::STRING, OptionType::MULTIPLE}},
@@ -913,6 +1007,12 @@ class InjectCommand : public Command {
     if (input_filenames_.empty()) {
       input_filenames_.emplace_back("perf.data");
     }
+    if (!options.PullUintValue("-j", &jobs_, 1)) {
+      return false;
+    }
+    if (!options.PullUintValue("--merge-memory-limit", &merge_memory_limit_, 1)) {
+      return false;
+    }
     options.PullStringValue("-o", &output_filename_);
     if (auto value = options.PullValue("--output"); value) {
       const std::string& output = *value->str_value;
@@ -949,87 +1049,206 @@ class InjectCommand : public Command {
     return true;
   }
 
-  bool ReadPerfDataFiles(const std::function<void(PerfDataReader&)> reader_callback) {
+  size_t ReaderThreadCount() const {
+    return std::max<size_t>(1, std::min<size_t>(jobs_, input_filenames_.size()));
+  }
+
+  // Etm data is decoded in parallel only when files are read in one thread. Because decoding
+  // threads can't see build ids used by reading threads. Dumping data also needs one thread to
+  // keep the output in order.
+  size_t DecodeThreadCount() const {
+    const ETMDumpOption& dump = etm_dump_option_;
+    if (ReaderThreadCount() > 1 || dump.dump_raw_data || dump.dump_packets || dump.dump_elements) {
+      return 1;
+    }
+    return std::max<size_t>(1, jobs_);
+  }
+
+  // Call read_file(filename, thread_index) for each input file, in ReaderThreadCount() threads.
+  bool ReadInputFiles(const std::function<bool(const std::string&, size_t)>& read_file) {
+    size_t thread_count = ReaderThreadCount();
+    std::atomic<size_t> next_file_index = 0;
+    std::atomic<bool> failed = false;
+    auto thread_func = [&](size_t thread_index) {
+      while (!failed) {
+        size_t i = next_file_index++;
+        if (i >= input_filenames_.size()) {
+          break;
+        }
+        if (!read_file(input_filenames_[i], thread_index)) {
+          failed = true;
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++) {
+      threads.emplace_back(thread_func, i);
+    }
+    thread_func(0);
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    return !failed;
+  }
+
+  // Read perf.data files. reader_callback is called with the index of the thread reading the
+  // file, to add callbacks collecting results for that thread.
+  bool ReadPerfDataFiles(const std::function<void(PerfDataReader&, size_t)>& reader_callback) {
     if (input_filenames_.empty()) {
       return true;
     }
+    std::unique_ptr<RecordFileReader> first_reader =
+        RecordFileReader::CreateInstance(input_filenames_[0]);
+    if (!first_reader) {
+      return false;
+    }
+    const std::string expected_data_type = PerfDataReader::GetDataType(*first_reader);
+
+    bool use_threads = ReaderThreadCount() > 1;
+    if (!use_threads) {
+      first_reader.reset();
+    }
+    // When reading in threads, the arch and event types set by first_reader are used for all
+    // files. Readers created in threads don't change them, because they are process wide.
+    std::unique_ptr<Dso> placeholder_dso;
+    if (use_threads) {
+      // Global Dso states are cleaned when Dso count is decreased to zero. Prevent it from
+      // happening while files are read in parallel.
+      placeholder_dso = Dso::CreateDso(DSO_UNKNOWN_FILE, "unknown");
+    }
+
+    auto read_file = [&](const std::string& filename, size_t thread_index) {
+      // Files may have different build ids for the same path.
+      Dso::UseThreadLocalBuildIds(use_threads);
+      bool result =
+          ReadPerfDataFile(filename, expected_data_type, !use_threads,
+                           [&](PerfDataReader& r) { reader_callback(r, thread_index); });
+      Dso::UseThreadLocalBuildIds(false);
+      return result;
+    };
+    return ReadInputFiles(read_file);
+  }
+
+  bool ReadPerfDataFile(const std::string& filename, const std::string& expected_data_type,
+                        bool use_recording_environment,
+                        const std::function<void(PerfDataReader&)>& reader_callback) {
+    std::unique_ptr<RecordFileReader> file_reader =
+        RecordFileReader::CreateInstance(filename, use_recording_environment);
+    if (!file_reader) {
+      return false;
+    }
+    // Avoid copying records and aux data. If it fails, records are read from the file.
+    file_reader->MmapDataSection();
+    std::string data_type = PerfDataReader::GetDataType(*file_reader);
+    if (expected_data_type != data_type) {
+      LOG(ERROR) << "files have different data type: " << input_filenames_[0] << ", " << filename;
+      return false;
+    }
+    std::unique_ptr<PerfDataReader> reader;
+    if (data_type == "etm") {
+      reader.reset(new ETMPerfDataReader(std::move(file_reader), exclude_perf_,
+                                         binary_name_regex_.get(), etm_dump_option_,
+                                         DecodeThreadCount()));
+    } else if (data_type == "lbr") {
+      reader.reset(
+          new LBRPerfDataReader(std::move(file_reader), exclude_perf_, binary_name_regex_.get()));
+    } else {
+      LOG(ERROR) << "unsupported data type " << data_type << " in " << filename;
+      return false;
+    }
+    reader_callback(*reader);
+    return reader->Read();
+  }
 
-    std::string expected_data_type;
-    for (const auto& filename : input_filenames_) {
-      std::unique_ptr<RecordFileReader> file_reader = RecordFileReader::CreateInstance(filename);
-      if (!file_reader) {
+  // Read branch list files, and merge them into mergers[0].
+  // With --merge-memory-limit, when the etm data merged in a thread exceeds its share of the
+  // limit, it's written to a run in run_merger. If any run is written, all etm data is moved to
+  // runs, and should be merged by run_merger.
+  bool ReadBranchListFiles(std::vector<BranchListMerger>& mergers,
+                           ETMBinaryRunMerger& run_merger) {
+    mergers.resize(ReaderThreadCount());
+    const size_t thread_memory_limit = merge_memory_limit_ / mergers.size();
+    std::atomic<bool> has_lbr_data = false;
+    auto read_file = [&](const std::string& filename, size_t thread_index) {
+      BranchListMerger& merger = mergers[thread_index];
+      BranchListReader reader(filename, binary_name_regex_.get());
+      reader.AddCallback([&](const BinaryKey& key, ETMBinary& binary) {
+        merger.AddETMBinary(key, binary);
+      });
+      reader.AddCallback([&](LBRData& lbr_data) {
+        has_lbr_data = true;
+        merger.AddLBRData(lbr_data);
+      });
+      if (!reader.Read()) {
         return false;
       }
-      std::string data_type = PerfDataReader::GetDataType(*file_reader);
-      if (expected_data_type.empty()) {
-        expected_data_type = data_type;
-      } else if (expected_data_type != data_type) {
-        LOG(ERROR) << "files have different data type: " << input_filenames_[0] << ", " << filename;
-        return false;
+      if (thread_memory_limit != 0 && merger.ETMDataMemoryUsage() > thread_memory_limit) {
+        return run_merger.WriteRun(merger.GetETMData());
       }
-      std::unique_ptr<PerfDataReader> reader;
-      if (data_type == "etm") {
-        reader.reset(new ETMPerfDataReader(std::move(file_reader), exclude_perf_,
-                                           binary_name_regex_.get(), etm_dump_option_));
-      } else if (data_type == "lbr") {
-        reader.reset(
-            new LBRPerfDataReader(std::move(file_reader), exclude_perf_, binary_name_regex_.get()));
-      } else {
-        LOG(ERROR) << "unsupported data type " << data_type << " in " << filename;
+      return true;
+    };
+    if (!ReadInputFiles(read_file)) {
+      return false;
+    }
+    if (run_merger.RunCount() > 0) {
+      if (has_lbr_data) {
+        LOG(ERROR) << "--merge-memory-limit doesn't support lbr data";
         return false;
       }
-      reader_callback(*reader);
-      if (!reader->Read()) {
-        return false;
+      for (auto& merger : mergers) {
+        if (!merger.GetETMData().empty() && !run_merger.WriteRun(merger.GetETMData())) {
+          return false;
+        }
       }
+      return true;
     }
+    MergeInTree(mergers);
     return true;
   }
 
   bool ConvertPerfDataToAutoFDO() {
-    AutoFDOWriter autofdo_writer;
-    auto afdo_callback = [&](const BinaryKey& key, AutoFDOBinaryInfo& binary) {
-      autofdo_writer.AddAutoFDOBinary(key, binary);
+    std::vector<AutoFDOWriter> writers(ReaderThreadCount());
+    auto reader_callback = [&](PerfDataReader& reader, size_t thread_index) {
+      AutoFDOWriter& writer = writers[thread_index];
+      reader.AddCallback([&writer](const BinaryKey& key, AutoFDOBinaryInfo& binary) {
+        writer.AddAutoFDOBinary(key, binary);
+      });
     };
-    auto reader_callback = [&](PerfDataReader& reader) { reader.AddCallback(afdo_callback); };
     if (!ReadPerfDataFiles(reader_callback)) {
       return false;
     }
-    return autofdo_writer.Write(output_filename_);
+    MergeInTree(writers);
+    return writers[0].Write(output_filename_);
   }
 
   bool ConvertPerfDataToBranchList() {
-    BranchListMerger merger;
-    auto etm_callback = [&](const BinaryKey& key, ETMBinary& binary) {
-      merger.AddETMBinary(key, binary);
-    };
-    auto lbr_callback = [&](LBRData& lbr_data) { merger.AddLBRData(lbr_data); };
-
-    auto reader_callback = [&](PerfDataReader& reader) {
-      reader.AddCallback(etm_callback);
-      reader.AddCallback(lbr_callback);
+    std::vector<BranchListMerger> mergers(ReaderThreadCount());
+    auto reader_callback = [&](PerfDataReader& reader, size_t thread_index) {
+      BranchListMerger& merger = mergers[thread_index];
+      reader.AddCallback([&merger](const BinaryKey& key, ETMBinary& binary) {
+        merger.AddETMBinary(key, binary);
+      });
+      reader.AddCallback([&merger](LBRData& lbr_data) { merger.AddLBRData(lbr_data); });
     };
     if (!ReadPerfDataFiles(reader_callback)) {
       return false;
     }
-    return WriteBranchListFile(output_filename_, merger.GetETMData(), merger.GetLBRData());
+    MergeInTree(mergers);
+    return WriteBranchListFile(output_filename_, mergers[0].GetETMData(),
+                               mergers[0].GetLBRData());
   }
 
   bool ConvertBranchListToAutoFDO() {
     // Step1 : Merge branch lists from all input files.
-    BranchListMerger merger;
-    auto etm_callback = [&](const BinaryKey& key, ETMBinary& binary) {
-      merger.AddETMBinary(key, binary);
-    };
-    auto lbr_callback = [&](LBRData& lbr_data) { merger.AddLBRData(lbr_data); };
-    for (const auto& input_filename : input_filenames_) {
-      BranchListReader reader(input_filename, binary_name_regex_.get());
-      reader.AddCallback(etm_callback);
-      reader.AddCallback(lbr_callback);
-      if (!reader.Read()) {
-        return false;
-      }
+    std::vector<BranchListMerger> mergers;
+    ETMBinaryRunMerger run_merger(GetTmpDir());
+    if (!ReadBranchListFiles(mergers, run_merger)) {
+      return false;
+    }
+    if (run_merger.RunCount() > 0) {
+      return ConvertRunsToAutoFDO(run_merger);
     }
+    BranchListMerger& merger = mergers[0];
 
     // Step2: Convert ETMBinary and LBRData to AutoFDOBinaryInfo.
     AutoFDOWriter autofdo_writer;
@@ -1061,26 +1280,82 @@ class InjectCommand : public Command {
 
   bool ConvertBranchListToBranchList() {
     // Step1 : Merge branch lists from all input files.
-    BranchListMerger merger;
-    auto etm_callback = [&](const BinaryKey& key, ETMBinary& binary) {
-      merger.AddETMBinary(key, binary);
-    };
-    auto lbr_callback = [&](LBRData& lbr_data) { merger.AddLBRData(lbr_data); };
-    for (const auto& input_filename : input_filenames_) {
-      BranchListReader reader(input_filename, binary_name_regex_.get());
-      reader.AddCallback(etm_callback);
-      reader.AddCallback(lbr_callback);
-      if (!reader.Read()) {
+    std::vector<BranchListMerger> mergers;
+    ETMBinaryRunMerger run_merger(GetTmpDir());
+    if (!ReadBranchListFiles(mergers, run_merger)) {
+      return false;
+    }
+    if (run_merger.RunCount() > 0) {
+      BranchListFileWriter writer;
+      if (!writer.Open(output_filename_)) {
         return false;
       }
+      auto write_binary = [&](const BinaryKey& key, ETMBinary& binary) {
+        return writer.WriteETMBinary(key, binary);
+      };
+      return run_merger.Merge(write_binary) && writer.Close();
     }
     // Step2: Write ETMBinary.
-    return WriteBranchListFile(output_filename_, merger.GetETMData(), merger.GetLBRData());
+    return WriteBranchListFile(output_filename_, mergers[0].GetETMData(),
+                               mergers[0].GetLBRData());
+  }
+
+  // Temporary files for --merge-memory-limit are created in the directory of the output file.
+  std::string GetTmpDir() const {
+    std::string dir = android::base::Dirname(output_filename_);
+    return dir.empty() ? "." : dir;
+  }
+
+  // Merge runs and write each binary to the output file after converting it. Binaries with the
+  // same path and build id are adjacent in runs, and are combined before writing.
+  bool ConvertRunsToAutoFDO(ETMBinaryRunMerger& run_merger) {
+    std::unique_ptr<FILE, decltype(&fclose)> output_fp(fopen(output_filename_.c_str(), "w"),
+                                                       fclose);
+    if (!output_fp) {
+      PLOG(ERROR) << "failed to write to " << output_filename_;
+      return false;
+    }
+    // kernel_start_addr is ignored in AutoFDO output.
+    std::set<BinaryKey> binaries;
+    for (const BinaryKey& key : run_merger.GetKeys()) {
+      binaries.emplace(key.path, key.build_id);
+    }
+    AutoFDOWriter::WriteHeader(output_fp.get(), binaries.size());
+
+    ETMBranchListToAutoFDOConverter converter;
+    std::optional<BinaryKey> pending_key;
+    AutoFDOBinaryInfo pending_binary;
+    auto convert_binary = [&](const BinaryKey& key, ETMBinary& binary) {
+      std::unique_ptr<AutoFDOBinaryInfo> autofdo_binary = converter.Convert(key, binary);
+      if (!autofdo_binary) {
+        return true;
+      }
+      BinaryKey new_key(key.path, key.build_id);
+      if (pending_key && *pending_key == new_key) {
+        pending_binary.Merge(*autofdo_binary);
+        return true;
+      }
+      if (pending_key) {
+        AutoFDOWriter::WriteBinary(output_fp.get(), *pending_key, pending_binary);
+      }
+      pending_key = new_key;
+      pending_binary = std::move(*autofdo_binary);
+      return true;
+    };
+    if (!run_merger.Merge(convert_binary)) {
+      return false;
+    }
+    if (pending_key) {
+      AutoFDOWriter::WriteBinary(output_fp.get(), *pending_key, pending_binary);
+    }
+    return true;
   }
 
   std::unique_ptr<RegEx> binary_name_regex_;
   bool exclude_perf_ = false;
   std::vector<std::string> input_filenames_;
+  size_t jobs_ = 1;
+  uint64_t merge_memory_limit_ = 0;
   std::string output_filename_ = "perf_inject.data";
   OutputFormat output_format_ = OutputFormat::AutoFDO;
   ETMDumpOption etm_dump_option_;
@@ -19,7 +19,9 @@
 #include <gtest/gtest.h>
 
 #include "command.h"
+#include "event_type.h"
 #include "get_test_data.h"
+#include "perf_regs.h"
 #include "test_util.h"
 #include "utils.h"
 
@@ -165,6 +167,92 @@ TEST(cmd_inject, multiple_input_files) {
   ASSERT_NE(data.find("106c->1074:200"), std::string::npos);
 }
 
+TEST(cmd_inject, j_option) {
+  std::string perf_data = GetTestData(PERF_DATA_ETM_TEST_LOOP);
+  std::string perf_with_unformatted_trace =
+      GetTestData(std::string("etm") + OS_PATH_SEPARATOR + "perf_with_unformatted_trace.data");
+  std::string input_files = perf_with_unformatted_trace + "," + perf_data + "," + perf_data;
+  std::string expected_data;
+  ASSERT_TRUE(RunInjectCmd({"-i", input_files}, &expected_data));
+  for (const char* jobs : {"2", "3", "8"}) {
+    // Read perf.data files in parallel.
+    std::string data;
+    ASSERT_TRUE(RunInjectCmd({"-i", input_files, "-j", jobs}, &data));
+    ASSERT_EQ(data, expected_data);
+
+    // Read branch list files in parallel.
+    TemporaryFile branch_list_file;
+    close(branch_list_file.release());
+    ASSERT_TRUE(RunInjectCmd(
+        {"-i", input_files, "-j", jobs, "--output", "branch-list", "-o", branch_list_file.path}));
+    std::string branch_list_files =
+        std::string(branch_list_file.path) + "," + branch_list_file.path;
+    std::string branch_list_data;
+    ASSERT_TRUE(RunInjectCmd({"-i", branch_list_files, "-j", jobs}, &branch_list_data));
+    ASSERT_NE(branch_list_data.find("106c->1074:"), std::string::npos);
+  }
+  ASSERT_FALSE(RunInjectCmd({"-j", "0"}));
+}
+
+TEST(cmd_inject, j_option_with_event_type_info) {
+  // All these files carry event_type_info in meta info. Reading them in parallel shouldn't
+  // race on the process wide arch and event types, and shouldn't leave them changed.
+  std::string perf_data = GetTestData(PERF_DATA_ETM_TEST_LOOP);
+  std::string input_files = perf_data;
+  for (size_t i = 0; i < 7; i++) {
+    input_files += "," + perf_data;
+  }
+  ArchType arch = ScopedCurrentArch::GetCurrentArch();
+  std::string expected_data;
+  ASSERT_TRUE(RunInjectCmd({"-i", input_files}, &expected_data));
+  for (const char* jobs : {"2", "4", "8"}) {
+    std::string data;
+    ASSERT_TRUE(RunInjectCmd({"-i", input_files, "-j", jobs}, &data));
+    ASSERT_EQ(data, expected_data);
+    ASSERT_EQ(ScopedCurrentArch::GetCurrentArch(), arch);
+    ASSERT_EQ(EventTypeManager::Instance().GetScopedFinder(), nullptr);
+  }
+
+  std::string lbr_data = GetTestData("lbr/perf_lbr.data");
+  input_files = lbr_data + "," + lbr_data + "," + lbr_data + "," + lbr_data;
+  ASSERT_TRUE(RunInjectCmd({"-i", input_files}, &expected_data));
+  std::string data;
+  ASSERT_TRUE(RunInjectCmd({"-i", input_files, "-j", "4"}, &data));
+  ASSERT_EQ(data, expected_data);
+  ASSERT_EQ(ScopedCurrentArch::GetCurrentArch(), arch);
+  ASSERT_EQ(EventTypeManager::Instance().GetScopedFinder(), nullptr);
+}
+
+TEST(cmd_inject, decode_etm_data_in_parallel) {
+  std::string perf_data = GetTestData(PERF_DATA_ETM_TEST_LOOP);
+  std::string perf_with_unformatted_trace =
+      GetTestData(std::string("etm") + OS_PATH_SEPARATOR + "perf_with_unformatted_trace.data");
+  for (const std::string& input_file : {perf_data, perf_with_unformatted_trace}) {
+    std::string expected_data;
+    ASSERT_TRUE(RunInjectCmd({"-i", input_file}, &expected_data));
+    TemporaryFile expected_branch_list;
+    close(expected_branch_list.release());
+    ASSERT_TRUE(RunInjectCmd(
+        {"-i", input_file, "--output", "branch-list", "-o", expected_branch_list.path}));
+    std::string expected_branch_list_data;
+    ASSERT_TRUE(RunInjectCmd({"-i", expected_branch_list.path}, &expected_branch_list_data));
+
+    for (const char* jobs : {"2", "4"}) {
+      std::string data;
+      ASSERT_TRUE(RunInjectCmd({"-i", input_file, "-j", jobs}, &data));
+      ASSERT_EQ(data, expected_data);
+
+      TemporaryFile branch_list;
+      close(branch_list.release());
+      ASSERT_TRUE(RunInjectCmd(
+          {"-i", input_file, "-j", jobs, "--output", "branch-list", "-o", branch_list.path}));
+      std::string branch_list_data;
+      ASSERT_TRUE(RunInjectCmd({"-i", branch_list.path}, &branch_list_data));
+      ASSERT_EQ(branch_list_data, expected_branch_list_data);
+    }
+  }
+}
+
 TEST(cmd_inject, merge_branch_list_files) {
   TemporaryFile tmpfile;
   close(tmpfile.release());
@@ -178,6 +266,37 @@ TEST(cmd_inject, merge_branch_list_files) {
   ASSERT_NE(autofdo_data.find("106c->1074:200"), std::string::npos);
 }
 
+TEST(cmd_inject, merge_memory_limit_option) {
+  std::string perf_with_unformatted_trace =
+      GetTestData(std::string("etm") + OS_PATH_SEPARATOR + "perf_with_unformatted_trace.data");
+  TemporaryFile branch_list_file1;
+  close(branch_list_file1.release());
+  ASSERT_TRUE(RunInjectCmd({"--output", "branch-list", "-o", branch_list_file1.path}));
+  TemporaryFile branch_list_file2;
+  close(branch_list_file2.release());
+  ASSERT_TRUE(RunInjectCmd({"-i", perf_with_unformatted_trace, "--output", "branch-list", "-o",
+                            branch_list_file2.path}));
+  std::string input_files = std::string(branch_list_file1.path) + "," + branch_list_file2.path +
+                            "," + branch_list_file1.path;
+
+  std::string expected_data;
+  ASSERT_TRUE(RunInjectCmd({"-i", input_files}, &expected_data));
+  for (const char* jobs : {"1", "2"}) {
+    // Use a small limit to merge branch lists through temporary files.
+    std::string data;
+    ASSERT_TRUE(
+        RunInjectCmd({"-i", input_files, "-j", jobs, "--merge-memory-limit", "1K"}, &data));
+    ASSERT_EQ(data, expected_data);
+
+    TemporaryFile branch_list_file;
+    close(branch_list_file.release());
+    ASSERT_TRUE(RunInjectCmd({"-i", input_files, "-j", jobs, "--merge-memory-limit", "1K",
+                              "--output", "branch-list", "-o", branch_list_file.path}));
+    ASSERT_TRUE(RunInjectCmd({"-i", branch_list_file.path}, &data));
+    ASSERT_EQ(data, expected_data);
+  }
+}
+
 TEST(cmd_inject, report_warning_when_overflow) {
   CapturedStderr capture;
   std::vector<std::unique_ptr<TemporaryFile>> branch_list_files;
@@ -233,6 +233,13 @@ class SlabSampleTreeBuilder : public SampleTreeBuilder<SlabSample, SlabAccumulat
     sample1->sample_count += sample2->sample_count;
   }
 
+  void MergeCallChain(SlabSample* sample1, SlabSample* sample2) override {
+    sample1->callchain.MergeCallChain(sample2->callchain,
+                                      [this](const SlabSample* s1, const SlabSample* s2) {
+                                        return sample_comparator_.IsSameSample(s1, s2);
+                                      });
+  }
+
  private:
   ThreadTree* thread_tree_;
   uint64_t total_requested_bytes_;
@@ -277,6 +277,11 @@ class MergeCommand : public Command {
   bool MergeAttrSection() { return writer_->WriteAttrSection(readers_[0]->AttrSection()); }
 
   bool MergeDataSection() {
+    // Offsets in the record index of input files don't apply to the merged file. So build a new
+    // index while writing records.
+    if (readers_[0]->HasFeature(PerfFileFormat::FEAT_RECORD_INDEX)) {
+      writer_->IndexRecordsWhileWriting();
+    }
     for (size_t i = 0; i < readers_.size(); i++) {
       if (i != 0) {
         if (!WriteGapInDataSection(i - 1, i)) {
@@ -340,6 +345,10 @@ class MergeCommand : public Command {
         WriteBuildIdFeature();
       } else if (feature == PerfFileFormat::FEAT_FILE || feature == PerfFileFormat::FEAT_FILE2) {
         WriteFileFeature();
+      } else if (feature == PerfFileFormat::FEAT_RECORD_INDEX) {
+        if (!writer_->WriteRecordIndexFeature()) {
+          return false;
+        }
       } else {
         LOG(WARNING) << "Drop feature " << feature << ", which isn't supported in the merge cmd.";
       }
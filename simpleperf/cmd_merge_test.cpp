@@ -19,6 +19,7 @@
 #include <optional>
 
 #include <android-base/file.h>
+#include <android-base/test_utils.h>
 
 #include "command.h"
 #include "get_test_data.h"
@@ -63,6 +64,59 @@ TEST(merge_cmd, input_output_options) {
   ASSERT_TRUE(MergeCmd()->Run({"-i", input_file, "-i", input_file, "-o", tmpfile.path}));
 }
 
+// Copy a recording file, adding a record index feature.
+static bool AddRecordIndex(const std::string& input_file, const std::string& output_file) {
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(input_file);
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(output_file);
+  if (!reader || !writer || !writer->WriteAttrSection(reader->AttrSection())) {
+    return false;
+  }
+  writer->IndexRecordsWhileWriting();
+  if (!reader->ReadDataSection(
+          [&](std::unique_ptr<Record> r) { return writer->WriteRecord(*r); })) {
+    return false;
+  }
+  const auto& features = reader->FeatureSectionDescriptors();
+  if (!writer->BeginWriteFeatures(features.size() + 1)) {
+    return false;
+  }
+  for (const auto& [feature, _] : features) {
+    std::vector<char> data;
+    if (!reader->ReadFeatureSection(feature, &data) ||
+        !writer->WriteFeature(feature, data.data(), data.size())) {
+      return false;
+    }
+  }
+  return writer->WriteRecordIndexFeature() && writer->EndWriteFeatures() && writer->Close();
+}
+
+TEST(merge_cmd, merge_files_with_record_index) {
+  TemporaryFile input_file1;
+  TemporaryFile input_file2;
+  ASSERT_TRUE(AddRecordIndex(GetTestData("perf_merge1.data"), input_file1.path));
+  ASSERT_TRUE(AddRecordIndex(GetTestData("perf_merge2.data"), input_file2.path));
+  TemporaryFile tmpfile;
+  close(tmpfile.release());
+  CapturedStderr capture;
+  ASSERT_TRUE(MergeCmd()->Run(
+      {"-i", std::string(input_file1.path) + "," + input_file2.path, "-o", tmpfile.path}));
+  capture.Stop();
+  ASSERT_EQ(capture.str().find("Drop feature"), std::string::npos);
+
+  // The record index is rebuilt for the merged file.
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader);
+  std::optional<RecordIndexFeature> index = reader->ReadRecordIndexFeature();
+  ASSERT_TRUE(index.has_value());
+  uint64_t index_sample_count = 0;
+  for (const RecordIndexChunk& chunk : index.value()) {
+    ASSERT_LE(chunk.offset + chunk.size, reader->FileHeader().data.size);
+    index_sample_count += chunk.sample_count;
+  }
+  ASSERT_EQ(index_sample_count, 58u);
+  ASSERT_NE(GetReport(tmpfile.path).find("Samples: 58"), std::string::npos);
+}
+
 TEST(merge_cmd, merge_two_files) {
   std::string input_file1 = GetTestData("perf_merge1.data");
   std::string input_file2 = GetTestData("perf_merge2.data");
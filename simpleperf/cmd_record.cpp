@@ -17,6 +17,7 @@
 #include <inttypes.h>
 #include <libgen.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/utsname.h>
@@ -54,6 +55,7 @@
 #include "JITDebugReader.h"
 #include "MapRecordReader.h"
 #include "OfflineUnwinder.h"
+#include "ParallelUnwinder.h"
 #include "ProbeEvents.h"
 #include "RecordFilter.h"
 #include "cmd_record_impl.h"
@@ -110,6 +112,22 @@ static constexpr size_t DEFAULT_CALL_CHAIN_JOINER_CACHE_SIZE = 8 * kMegabyte;
 
 static constexpr size_t kDefaultAuxBufferSize = 4 * kMegabyte;
 
+// With --user-buffer-latency, records in the userspace buffer are handed to the main thread in
+// batches of at least this size, or after waiting for the latency.
+static constexpr size_t kUserBufferNotificationWatermark = 256 * kKilobyte;
+
+// Stack bytes above the sp of the last unwound frame that unwinding may read, like the saved
+// frame pointer and return address.
+static constexpr uint64_t kStackUsageSlackSize = 512;
+
+// Max size of records waiting in ParallelUnwinder.
+static constexpr size_t kParallelUnwindingBufferSize = 64 * kMegabyte;
+// When post unwinding, consecutive samples are unwound in chunks by different threads.
+static constexpr size_t kPostUnwindingSamplesPerChunk = 64;
+
+// The zstd level used by -z. Level 3 is fast enough to keep up with recording.
+static constexpr int kDefaultCompressionLevel = 3;
+
 // On Pixel 3, it takes about 1ms to enable ETM, and 16-40ms to disable ETM and copy 4M ETM data.
 // So make default period to 100ms.
 static constexpr double kDefaultEtmDataFlushPeriodInSec = 0.1;
@@ -119,7 +137,37 @@ struct TimeStat {
   uint64_t start_recording_time = 0;
   uint64_t stop_recording_time = 0;
   uint64_t finish_recording_time = 0;
+  uint64_t read_left_records_time = 0;
+  uint64_t process_records_time = 0;
   uint64_t post_process_time = 0;
+  // Breakdown of time spent in processing records.
+  size_t rewrite_passes = 0;
+  uint64_t merge_map_records_duration = 0;
+  uint64_t join_callchains_duration = 0;
+  uint64_t collect_hit_files_duration = 0;
+  // Time spent in collecting hit files before recording stops. It isn't part of post processing.
+  uint64_t collect_hit_files_while_recording_duration = 0;
+};
+
+// An address hit by samples, whose symbol is looked up after collecting hit files.
+struct HitAddr {
+  const MapEntry* map;
+  uint64_t ip;
+  bool in_failed_unwinding_sample;
+};
+
+struct HitAddrKeyHash {
+  size_t operator()(const std::pair<const MapEntry*, uint64_t>& key) const {
+    return std::hash<const MapEntry*>()(key.first) ^ (key.second * 0x9E3779B97F4A7C15ULL);
+  }
+};
+
+// Steps run on records when rewriting the recording file in post processing.
+struct RecordRewriteSteps {
+  bool merge_map_records = false;
+  bool unwind = false;
+  bool join_callchains = false;
+  bool collect_hit_files = false;
 };
 
 std::optional<size_t> GetDefaultRecordBufferSize(bool system_wide_recording) {
@@ -238,8 +286,16 @@ class RecordCommand : public Command {
 "-m mmap_pages   Set pages used in the kernel to cache sample data for each cpu.\n"
 "                It should be a power of 2. If not set, the max possible value <= 1024\n"
 "                will be used.\n"
+"--discard-kernel-data-early  When more than half of a kernel buffer is read in one pass,\n"
+"                             give the space of read records back to the kernel before reading\n"
+"                             the rest. It reduces records lost in the kernel on busy cpus.\n"
+"                             Per-cpu kernel buffer stats are stored in meta info with or\n"
+"                             without this option.\n"
 "--user-buffer-size <buffer_size> Set buffer size in userspace to cache sample data.\n"
 "                                 By default, it is %s.\n"
+"--user-buffer-latency <ms>  Let records wait in the userspace buffer for at most <ms> before\n"
+"                            being processed, so they are processed in larger batches with fewer\n"
+"                            wakeups. By default, records are processed as soon as possible.\n"
 "--no-inherit  Don't record created child threads/processes.\n"
 "--cpu-percent <percent>  Set the max percent of cpu time used for recording.\n"
 "                         percent is in range [1-100], default is 25.\n"
@@ -256,6 +312,11 @@ class RecordCommand : public Command {
 "--no-unwind   If `--call-graph dwarf` option is used, then the user's stack\n"
 "              will be unwound by default. Use this option to disable the\n"
 "              unwinding of the user's stack.\n"
+"--unwind-threads <count>  If `--call-graph dwarf` option is used, set the number of threads\n"
+"                          used to unwind samples. When unwinding while recording, samples\n"
+"                          of the same process are unwound in the same thread, and default\n"
+"                          is 1, which unwinds samples in the main thread. When post\n"
+"                          unwinding, default is the number of online cpus.\n"
 "--no-callchain-joiner  If `--call-graph dwarf` option is used, then by default\n"
 "                       callchain joiner is used to break the 64k stack limit\n"
 "                       and build more complete call graphs. However, the built\n"
@@ -265,9 +326,11 @@ class RecordCommand : public Command {
 "               callchains. The count should be >= 1. By default it is 1.\n"
 "--no-cut-samples   Simpleperf uses a record buffer to cache records received from the kernel.\n"
 "                   When the available space in the buffer reaches low level, the stack data in\n"
-"                   samples is truncated to 1KB. When the available space reaches critical level,\n"
-"                   it drops all samples. This option makes simpleperf not truncate stack data\n"
-"                   when the available space reaches low level.\n"
+"                   samples is truncated, down to 1KB as the space gets close to critical level.\n"
+"                   Stack data a thread's recent samples needed for unwinding is kept if\n"
+"                   possible. When the available space reaches critical level, it drops all\n"
+"                   samples. This option makes simpleperf not truncate stack data when the\n"
+"                   available space reaches low level.\n"
 "--keep-failed-unwinding-result        Keep reasons for failed unwinding cases\n"
 "--keep-failed-unwinding-debug-info    Keep debug info for failed unwinding cases\n"
 "\n"
@@ -284,6 +347,8 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_RECORDING
 "-o record_file_name    Set record file name, default is perf.data.\n"
 "--size-limit SIZE[K|M|G]      Stop recording after SIZE bytes of records.\n"
 "                              Default is unlimited.\n"
+"-z             Compress records in perf.data with zstd, in a background thread. It makes\n"
+"               perf.data several times smaller. But the file can't be read by linux perf.\n"
 "--symfs <dir>    Look for files with symbols relative to this directory.\n"
 "                 This option is used to provide files with symbol table and\n"
 "                 debug information, which are used for unwinding and dumping symbols.\n"
@@ -387,6 +452,7 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_RECORDING
   bool DumpKernelSymbol();
   bool DumpTracingData();
   bool DumpMaps();
+  bool NeedMapRecordThread();
   bool DumpAuxTraceInfo();
 
   // recording functions
@@ -400,20 +466,36 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_RECORDING
   bool ProcessControlCmd(IOEventLoop* loop);
   void UpdateRecord(Record* record);
   bool UnwindRecord(SampleRecord& r);
-  bool KeepFailedUnwindingResult(const SampleRecord& r, const std::vector<uint64_t>& ips,
+  bool UnwindCallChain(const SampleRecord& r, std::vector<uint64_t>* ips,
+                       std::vector<uint64_t>* sps);
+  bool SaveUnwindingResult(SampleRecord& r, const UnwindingResult& result,
+                           const std::vector<uint64_t>& ips, const std::vector<uint64_t>& sps);
+  bool KeepFailedUnwindingResult(const SampleRecord& r, const UnwindingResult& result,
+                                 const std::vector<uint64_t>& ips,
                                  const std::vector<uint64_t>& sps);
+  void CreateParallelUnwinder(size_t thread_count);
+  bool AddRecordToParallelUnwinder(std::unique_ptr<Record> record);
+  bool SaveUnwindingTasks(bool wait_all);
+  bool SaveUnwindingTask(UnwindingTask& task);
+  bool SaveUnwoundSample(SampleRecord& r);
 
   // post recording functions
   std::unique_ptr<RecordFileReader> MoveRecordFile(const std::string& old_filename);
-  bool MergeMapRecords();
-  bool PostUnwindRecords();
-  bool JoinCallChains();
+  bool PostProcessRecords();
+  bool RewriteRecordFile(const RecordRewriteSteps& steps);
+  bool JoinCallChain(SampleRecord& r);
+  bool WriteRecord(const Record& record);
+  bool CollectHitFilesInDataSection();
+  void StartCollectingHitFiles(bool update_thread_tree, bool while_recording);
+  void CollectHitFiles(const Record& record);
+  bool HitProcessHasSymbolMapFile();
+  void FinishCollectingHitFiles();
   bool DumpAdditionalFeatures(const std::vector<std::string>& args);
   bool DumpBuildIdFeature();
   bool DumpFileFeature();
   bool DumpMetaInfoFeature(bool kernel_symbols_available);
   bool DumpDebugUnwindFeature(const std::unordered_set<Dso*>& dso_set);
-  void CollectHitFileInfo(const SampleRecord& r, std::unordered_set<Dso*>* dso_set);
+  void CollectHitFileInfo(const SampleRecord& r, bool in_failed_unwinding_sample);
   bool DumpETMBranchListFeature();
 
   bool system_wide_collection_;
@@ -426,6 +508,13 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_RECORDING
   bool keep_failed_unwinding_result_ = false;
   bool keep_failed_unwinding_debug_info_ = false;
   std::unique_ptr<OfflineUnwinder> offline_unwinder_;
+  // 0 means using the default thread count.
+  size_t unwind_thread_count_ = 0;
+  std::unique_ptr<ParallelUnwinder> parallel_unwinder_;
+  // The attr used to parse records passed to parallel_unwinder_.
+  perf_event_attr unwinding_attr_;
+  // Set when retrying unwinding for incomplete JIT debug info in the main thread.
+  bool in_jit_unwinding_retry_ = false;
   bool child_inherit_;
   uint64_t delay_in_ms_ = 0;
   double duration_in_sec_;
@@ -436,6 +525,8 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_RECORDING
 
   std::pair<size_t, size_t> mmap_page_range_;
   std::optional<size_t> user_buffer_size_;
+  // Zero means records are processed as soon as they are read from kernel buffers.
+  uint32_t user_buffer_latency_in_ms_ = 0;
   size_t aux_buffer_size_ = kDefaultAuxBufferSize;
 
   ThreadTree thread_tree_;
@@ -453,6 +544,7 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_RECORDING
   bool trace_offcpu_;
   bool exclude_kernel_callchain_;
   uint64_t size_limit_in_bytes_ = 0;
+  int compression_level_ = 0;
   uint64_t max_sample_freq_ = DEFAULT_SAMPLE_FREQ_FOR_NONTRACEPOINT_EVENT;
   size_t cpu_time_max_percent_ = 25;
 
@@ -461,10 +553,26 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_RECORDING
   size_t callchain_joiner_min_matching_nodes_;
   std::unique_ptr<CallChainJoiner> callchain_joiner_;
   bool allow_truncating_samples_ = true;
+  bool discard_kernel_data_early_ = false;
 
   std::unique_ptr<JITDebugReader> jit_debug_reader_;
   uint64_t last_record_timestamp_;  // used to insert Mmap2Records for JIT debug info
   TimeStat time_stat_;
+
+  // Used to collect hit files from records written while recording, or in the last post
+  // processing pass.
+  bool collect_hit_files_ = false;
+  bool collect_hit_files_while_recording_ = false;
+  // False if the thread tree is already updated by unwinding when records are written.
+  bool update_thread_tree_for_hit_files_ = false;
+  bool kernel_symbols_available_ = false;
+  std::unordered_set<int> hit_pids_;
+  std::unordered_set<Dso*> debug_unwinding_files_;
+  bool failed_unwinding_sample_ = false;
+  // Hit addresses whose symbols need dump ids, in the order they are hit.
+  std::vector<HitAddr> hit_addrs_;
+  std::unordered_map<std::pair<const MapEntry*, uint64_t>, size_t, HitAddrKeyHash>
+      hit_addr_index_;
   EventAttrWithId dumping_attr_id_;
   // In system wide recording, record if we have dumped map info for a process.
   std::unordered_set<pid_t> dumped_processes_;
@@ -604,6 +712,9 @@ bool RecordCommand::PrepareRecording(Workload* workload) {
   if (unwind_dwarf_callchain_) {
     bool collect_stat = keep_failed_unwinding_result_;
     offline_unwinder_ = OfflineUnwinder::Create(collect_stat);
+    if (!post_unwind_ && unwind_thread_count_ > 1) {
+      CreateParallelUnwinder(unwind_thread_count_);
+    }
   }
   if (unwind_dwarf_callchain_ && allow_callchain_joiner_) {
     callchain_joiner_.reset(new CallChainJoiner(DEFAULT_CALL_CHAIN_JOINER_CACHE_SIZE,
@@ -670,6 +781,12 @@ bool RecordCommand::PrepareRecording(Workload* workload) {
                                            allow_truncating_samples_, exclude_perf_)) {
     return false;
   }
+  if (user_buffer_latency_in_ms_ != 0) {
+    event_selection_set_.SetRecordNotificationLimits(
+        std::min(record_buffer_size / 16, kUserBufferNotificationWatermark),
+        user_buffer_latency_in_ms_);
+  }
+  event_selection_set_.SetDiscardKernelDataEarly(discard_kernel_data_early_);
   auto callback = std::bind(&RecordCommand::ProcessRecord, this, std::placeholders::_1);
   if (!event_selection_set_.PrepareToReadMmapEventData(callback)) {
     return false;
@@ -841,27 +958,25 @@ bool RecordCommand::PostProcessRecording(const std::vector<std::string>& args) {
   if (!event_selection_set_.FinishReadMmapEventData()) {
     return false;
   }
-
-  // 2. Merge map records dumped while recording by map record thread.
-  if (map_record_thread_) {
-    if (!map_record_thread_->Join() || !MergeMapRecords()) {
+  if (parallel_unwinder_) {
+    if (!SaveUnwindingTasks(true)) {
       return false;
     }
+    parallel_unwinder_.reset();
   }
+  time_stat_.read_left_records_time = GetSystemClock();
 
-  // 3. Post unwind dwarf callchain.
-  if (unwind_dwarf_callchain_ && post_unwind_) {
-    if (!PostUnwindRecords()) {
-      return false;
-    }
+  // 2. Merge map records dumped while recording by map record thread, post unwind dwarf
+  // callchains, optionally join callchains, and collect hit files.
+  if (map_record_thread_ && !map_record_thread_->Join()) {
+    return false;
   }
-
-  // 4. Optionally join Callchains.
-  if (callchain_joiner_) {
-    JoinCallChains();
+  if (!PostProcessRecords()) {
+    return false;
   }
+  time_stat_.process_records_time = GetSystemClock();
 
-  // 5. Dump additional features, and close record file.
+  // 3. Dump additional features, and close record file.
   if (!DumpAdditionalFeatures(args)) {
     return false;
   }
@@ -873,7 +988,7 @@ bool RecordCommand::PostProcessRecording(const std::vector<std::string>& args) {
   }
   time_stat_.post_process_time = GetSystemClock();
 
-  // 6. Show brief record result.
+  // 4. Show brief record result.
   auto record_stat = event_selection_set_.GetRecordStat();
   if (event_selection_set_.HasAuxTrace()) {
     LOG(INFO) << "Aux data traced: " << ReadableCount(record_stat.aux_data_size);
@@ -892,7 +1007,10 @@ bool RecordCommand::PostProcessRecording(const std::vector<std::string>& args) {
     os << "Samples recorded: " << ReadableCount(sample_record_count_);
     if (record_stat.userspace_truncated_stack_samples > 0) {
       os << " (" << ReadableCount(record_stat.userspace_truncated_stack_samples)
-         << " with truncated stacks)";
+         << " with truncated stacks, "
+         << record_stat.userspace_truncated_stack_size /
+                record_stat.userspace_truncated_stack_samples
+         << " bytes removed per stack on average)";
     }
     os << ". Samples lost: " << ReadableCount(lost_samples);
     if (lost_samples != 0) {
@@ -908,7 +1026,15 @@ bool RecordCommand::PostProcessRecording(const std::vector<std::string>& args) {
                << ", userspace_lost_non_samples="
                << ReadableCount(record_stat.userspace_lost_non_samples)
                << ", userspace_truncated_stack_samples="
-               << ReadableCount(record_stat.userspace_truncated_stack_samples);
+               << ReadableCount(record_stat.userspace_truncated_stack_samples)
+               << ", userspace_truncated_stack_size="
+               << ReadableCount(record_stat.userspace_truncated_stack_size);
+    for (const auto& [cpu, stat] : record_stat.kernel_buffer_stats) {
+      if (stat.lost_records != 0) {
+        LOG(DEBUG) << "Kernel buffer of cpu " << cpu << " lost " << ReadableCount(stat.lost_records)
+                   << " records, max fill percent " << stat.max_fill_percent << "%";
+      }
+    }
 
     if (sample_record_count_ + record_stat.kernelspace_lost_records != 0) {
       double kernelspace_lost_percent =
@@ -948,10 +1074,21 @@ bool RecordCommand::PostProcessRecording(const std::vector<std::string>& args) {
              << (time_stat_.start_recording_time - time_stat_.prepare_recording_time) / 1e9
              << " s, recording time "
              << (time_stat_.stop_recording_time - time_stat_.start_recording_time) / 1e9
-             << " s, stop recording time "
+             << " s (collect hit files "
+             << time_stat_.collect_hit_files_while_recording_duration / 1e9
+             << " s), stop recording time "
              << (time_stat_.finish_recording_time - time_stat_.stop_recording_time) / 1e9
              << " s, post process time "
              << (time_stat_.post_process_time - time_stat_.finish_recording_time) / 1e9 << " s.";
+  LOG(DEBUG) << "Post process time: read left records "
+             << (time_stat_.read_left_records_time - time_stat_.finish_recording_time) / 1e9
+             << " s, process records "
+             << (time_stat_.process_records_time - time_stat_.read_left_records_time) / 1e9
+             << " s (" << time_stat_.rewrite_passes << " rewrite passes, merge map records "
+             << time_stat_.merge_map_records_duration / 1e9 << " s, join callchains "
+             << time_stat_.join_callchains_duration / 1e9 << " s, collect hit files "
+             << time_stat_.collect_hit_files_duration / 1e9 << " s), dump features "
+             << (time_stat_.post_process_time - time_stat_.process_records_time) / 1e9 << " s.";
   return true;
 }
 
@@ -1114,6 +1251,7 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
 
   allow_callchain_joiner_ = !options.PullBoolValue("--no-callchain-joiner");
   allow_truncating_samples_ = !options.PullBoolValue("--no-cut-samples");
+  discard_kernel_data_early_ = options.PullBoolValue("--discard-kernel-data-early");
   can_dump_kernel_symbols_ = !options.PullBoolValue("--no-dump-kernel-symbols");
   dump_symbols_ = !options.PullBoolValue("--no-dump-symbols");
   if (auto value = options.PullValue("--no-inherit"); value) {
@@ -1124,6 +1262,9 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
     child_inherit_ = false;
   }
   unwind_dwarf_callchain_ = !options.PullBoolValue("--no-unwind");
+  if (!options.PullUintValue("--unwind-threads", &unwind_thread_count_, 1)) {
+    return false;
+  }
 
   if (auto value = options.PullValue("-o"); value) {
     record_filename_ = *value->str_value;
@@ -1160,10 +1301,16 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
     }
     user_buffer_size_ = static_cast<size_t>(v);
   }
+  if (!options.PullUintValue("--user-buffer-latency", &user_buffer_latency_in_ms_, 0, 1000)) {
+    return false;
+  }
 
   if (!options.PullUintValue("--size-limit", &size_limit_in_bytes_, 1)) {
     return false;
   }
+  if (options.PullBoolValue("-z")) {
+    compression_level_ = kDefaultCompressionLevel;
+  }
 
   if (auto value = options.PullValue("--start_profiling_fd"); value) {
     start_profiling_fd_.reset(static_cast<int>(value->uint_value));
@@ -1417,6 +1564,8 @@ bool RecordCommand::SetEventSelectionFlags() {
 
 bool RecordCommand::CreateAndInitRecordFile() {
   EventAttrIds attrs = event_selection_set_.GetEventAttrWithId();
+  CHECK(!attrs.empty());
+  unwinding_attr_ = attrs[0].attr;
   bool remove_regs_and_stacks = unwind_dwarf_callchain_ && !post_unwind_;
   if (remove_regs_and_stacks) {
     for (auto& attr : attrs) {
@@ -1435,6 +1584,14 @@ bool RecordCommand::CreateAndInitRecordFile() {
                              event_selection_set_.RecordNotExecutableMaps());
   map_record_reader_->SetCallback([this](Record* r) { return ProcessRecord(r); });
 
+  // If the recording file isn't rewritten in post processing, collect hit files while recording.
+  // Then the data section doesn't need to be read again after recording. Map records dumped in
+  // the map record thread are merged into the recording file in post processing.
+  if (!(unwind_dwarf_callchain_ && post_unwind_) && !callchain_joiner_ &&
+      !NeedMapRecordThread()) {
+    record_file_writer_->IndexRecordsWhileWriting();
+    StartCollectingHitFiles(!unwind_dwarf_callchain_, true);
+  }
   return DumpKernelSymbol() && DumpTracingData() && DumpMaps() && DumpAuxTraceInfo();
 }
 
@@ -1442,6 +1599,9 @@ std::unique_ptr<RecordFileWriter> RecordCommand::CreateRecordFile(const std::str
                                                                   const EventAttrIds& attrs) {
   std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(filename);
   if (writer != nullptr && writer->WriteAttrSection(attrs)) {
+    if (compression_level_ != 0) {
+      writer->EnableCompression(compression_level_);
+    }
     return writer;
   }
   return nullptr;
@@ -1481,6 +1641,11 @@ bool RecordCommand::DumpTracingData() {
   return true;
 }
 
+bool RecordCommand::NeedMapRecordThread() {
+  return system_wide_collection_ && event_selection_set_.HasAuxTrace() &&
+         !etm_branch_list_generator_;
+}
+
 bool RecordCommand::DumpMaps() {
   if (system_wide_collection_) {
     // For system wide recording:
@@ -1490,7 +1655,7 @@ bool RecordCommand::DumpMaps() {
     //   If aux tracing without decoding etm data, we don't know which maps will be needed, so dump
     //   all process maps. To reduce pre recording time, we dump process maps in map record thread
     //   while recording.
-    if (event_selection_set_.HasAuxTrace() && !etm_branch_list_generator_) {
+    if (NeedMapRecordThread()) {
       map_record_thread_.emplace(*map_record_reader_);
       return true;
     }
@@ -1620,7 +1785,33 @@ bool RecordCommand::SaveRecordForPostUnwinding(Record* record) {
   return true;
 }
 
+static bool ShouldSkipUnwinding(const SampleRecord& r) {
+  return !(r.sample_type & PERF_SAMPLE_CALLCHAIN) && (r.sample_type & PERF_SAMPLE_REGS_USER) &&
+         (r.regs_user_data.reg_mask != 0) && (r.sample_type & PERF_SAMPLE_STACK_USER);
+}
+
+// Copy a record to a buffer owned by the new record.
+static std::unique_ptr<Record> CopyRecord(const perf_event_attr& attr, const Record& record) {
+  char* p = new char[record.size()];
+  memcpy(p, record.Binary(), record.size());
+  std::unique_ptr<Record> r = ReadRecordFromBuffer(attr, record.type(), p, p + record.size());
+  if (!r) {
+    delete[] p;
+    return nullptr;
+  }
+  r->OwnBinary();
+  return r;
+}
+
 bool RecordCommand::SaveRecordAfterUnwinding(Record* record) {
+  if (parallel_unwinder_ && !in_jit_unwinding_retry_) {
+    // The record may refer to the record buffer, which is reused after this function returns.
+    std::unique_ptr<Record> copy = CopyRecord(unwinding_attr_, *record);
+    if (!copy) {
+      return false;
+    }
+    return AddRecordToParallelUnwinder(std::move(copy));
+  }
   if (record->type() == PERF_RECORD_SAMPLE) {
     auto& r = *static_cast<SampleRecord*>(record);
     // AdjustCallChainGeneratedByKernel() should go before UnwindRecord(). Because we don't want
@@ -1629,17 +1820,104 @@ bool RecordCommand::SaveRecordAfterUnwinding(Record* record) {
     if (!UnwindRecord(r)) {
       return false;
     }
-    // ExcludeKernelCallChain() should go after UnwindRecord() to notice the generated user call
-    // chain.
-    if (r.InKernel() && exclude_kernel_callchain_ && !r.ExcludeKernelCallChain()) {
-      // If current record contains no user callchain, skip it.
+    return SaveUnwoundSample(r);
+  }
+  thread_tree_.Update(*record);
+  if (in_jit_unwinding_retry_) {
+    // JIT maps generated while retrying unwinding are also needed by unwinding threads.
+    std::unique_ptr<Record> copy = CopyRecord(unwinding_attr_, *record);
+    if (!copy) {
+      return false;
+    }
+    parallel_unwinder_->UpdateThreadTrees(std::move(copy));
+  }
+  return WriteRecord(*record);
+}
+
+bool RecordCommand::SaveUnwoundSample(SampleRecord& r) {
+  // ExcludeKernelCallChain() should go after UnwindRecord() to notice the generated user call
+  // chain.
+  if (r.InKernel() && exclude_kernel_callchain_ && !r.ExcludeKernelCallChain()) {
+    // If current record contains no user callchain, skip it.
+    return true;
+  }
+  sample_record_count_++;
+  return WriteRecord(r);
+}
+
+void RecordCommand::CreateParallelUnwinder(size_t thread_count) {
+  bool collect_stat = keep_failed_unwinding_result_;
+  parallel_unwinder_.reset(
+      new ParallelUnwinder(thread_count, kParallelUnwindingBufferSize,
+                           [collect_stat]() { return OfflineUnwinder::Create(collect_stat); }));
+}
+
+// The record should own its binary, because it is saved after unwinding.
+bool RecordCommand::AddRecordToParallelUnwinder(std::unique_ptr<Record> record) {
+  if (record->type() == PERF_RECORD_AUXTRACE) {
+    // Aux data isn't copied with the record. So save the record after all previous records.
+    if (!SaveUnwindingTasks(true)) {
+      return false;
+    }
+    return WriteRecord(*record);
+  }
+  bool need_unwinding = false;
+  if (record->type() == PERF_RECORD_SAMPLE) {
+    auto& r = *static_cast<SampleRecord*>(record.get());
+    r.AdjustCallChainGeneratedByKernel();
+    need_unwinding = !ShouldSkipUnwinding(r) && r.GetValidStackSize() > 0;
+  }
+  parallel_unwinder_->AddRecord(std::move(record), need_unwinding);
+  return SaveUnwindingTasks(false);
+}
+
+// Save records finished by parallel_unwinder_, in the order they are added. Wait for unfinished
+// records if wait_all is true or too many records are pending.
+bool RecordCommand::SaveUnwindingTasks(bool wait_all) {
+  while (true) {
+    bool wait = wait_all || parallel_unwinder_->IsFull();
+    std::unique_ptr<UnwindingTask> task = parallel_unwinder_->GetNextTask(wait);
+    if (!task) {
       return true;
     }
-    sample_record_count_++;
-  } else {
+    if (!SaveUnwindingTask(*task)) {
+      return false;
+    }
+  }
+}
+
+bool RecordCommand::SaveUnwindingTask(UnwindingTask& task) {
+  Record* record = task.record.get();
+  if (record->type() != PERF_RECORD_SAMPLE) {
     thread_tree_.Update(*record);
+    return WriteRecord(*record);
   }
-  return record_file_writer_->WriteRecord(*record);
+  auto& r = *static_cast<SampleRecord*>(record);
+  if (task.need_unwinding) {
+    if (!task.unwinding_success) {
+      return false;
+    }
+    if (jit_debug_reader_ && !post_unwind_ && task.callchain_broken_for_incomplete_jit_debug_info) {
+      // Reading JIT debug info generates records, which are saved directly. So retry unwinding
+      // in the main thread.
+      in_jit_unwinding_retry_ = true;
+      jit_debug_reader_->ReadProcess(r.tid_data.pid);
+      bool result = jit_debug_reader_->FlushDebugInfo(r.Timestamp()) &&
+                    UnwindCallChain(r, &task.ips, &task.sps);
+      in_jit_unwinding_retry_ = false;
+      if (!result) {
+        return false;
+      }
+      task.unwinding_result = offline_unwinder_->GetUnwindingResult();
+    }
+    if (!SaveUnwindingResult(r, task.unwinding_result, task.ips, task.sps)) {
+      return false;
+    }
+  } else if (!ShouldSkipUnwinding(r)) {
+    // For kernel samples, we still need to remove user stack and register fields.
+    r.ReplaceRegAndStackWithCallChain({});
+  }
+  return SaveUnwoundSample(r);
 }
 
 bool RecordCommand::SaveRecordWithoutUnwinding(Record* record) {
@@ -1654,7 +1932,7 @@ bool RecordCommand::SaveRecordWithoutUnwinding(Record* record) {
     }
     sample_record_count_++;
   }
-  return record_file_writer_->WriteRecord(*record);
+  return WriteRecord(*record);
 }
 
 bool RecordCommand::ProcessJITDebugInfo(std::vector<JITDebugInfo> debug_info,
@@ -1786,17 +2064,13 @@ void RecordCommand::UpdateRecord(Record* record) {
 }
 
 bool RecordCommand::UnwindRecord(SampleRecord& r) {
-  if (!(r.sample_type & PERF_SAMPLE_CALLCHAIN) && (r.sample_type & PERF_SAMPLE_REGS_USER) &&
-      (r.regs_user_data.reg_mask != 0) && (r.sample_type & PERF_SAMPLE_STACK_USER)) {
+  if (ShouldSkipUnwinding(r)) {
     return true;
   }
   if (r.GetValidStackSize() > 0) {
-    ThreadEntry* thread = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
-    RegSet regs(r.regs_user_data.abi, r.regs_user_data.reg_mask, r.regs_user_data.regs);
     std::vector<uint64_t> ips;
     std::vector<uint64_t> sps;
-    if (!offline_unwinder_->UnwindCallChain(*thread, regs, r.stack_user_data.data,
-                                            r.GetValidStackSize(), &ips, &sps)) {
+    if (!UnwindCallChain(r, &ips, &sps)) {
       return false;
     }
     // The unwinding may fail if JIT debug info isn't the latest. In this case, read JIT debug info
@@ -1805,38 +2079,56 @@ bool RecordCommand::UnwindRecord(SampleRecord& r) {
         offline_unwinder_->IsCallChainBrokenForIncompleteJITDebugInfo()) {
       jit_debug_reader_->ReadProcess(r.tid_data.pid);
       jit_debug_reader_->FlushDebugInfo(r.Timestamp());
-      if (!offline_unwinder_->UnwindCallChain(*thread, regs, r.stack_user_data.data,
-                                              r.GetValidStackSize(), &ips, &sps)) {
+      if (!UnwindCallChain(r, &ips, &sps)) {
         return false;
       }
     }
-    if (keep_failed_unwinding_result_ && !KeepFailedUnwindingResult(r, ips, sps)) {
-      return false;
-    }
-    r.ReplaceRegAndStackWithCallChain(ips);
-    if (callchain_joiner_ &&
-        !callchain_joiner_->AddCallChain(r.tid_data.pid, r.tid_data.tid,
-                                         CallChainJoiner::ORIGINAL_OFFLINE, ips, sps)) {
-      return false;
-    }
-  } else {
-    // For kernel samples, we still need to remove user stack and register fields.
-    r.ReplaceRegAndStackWithCallChain({});
+    return SaveUnwindingResult(r, offline_unwinder_->GetUnwindingResult(), ips, sps);
+  }
+  // For kernel samples, we still need to remove user stack and register fields.
+  r.ReplaceRegAndStackWithCallChain({});
+  return true;
+}
+
+bool RecordCommand::UnwindCallChain(const SampleRecord& r, std::vector<uint64_t>* ips,
+                                    std::vector<uint64_t>* sps) {
+  ThreadEntry* thread = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+  RegSet regs(r.regs_user_data.abi, r.regs_user_data.reg_mask, r.regs_user_data.regs);
+  return offline_unwinder_->UnwindCallChain(*thread, regs, r.stack_user_data.data,
+                                            r.GetValidStackSize(), ips, sps);
+}
+
+bool RecordCommand::SaveUnwindingResult(SampleRecord& r, const UnwindingResult& result,
+                                        const std::vector<uint64_t>& ips,
+                                        const std::vector<uint64_t>& sps) {
+  if (keep_failed_unwinding_result_ && !KeepFailedUnwindingResult(r, result, ips, sps)) {
+    return false;
+  }
+  // Tell the record read thread how much stack unwinding used, so it keeps enough stack data in
+  // later samples of the thread when the record buffer is low.
+  if (size_t stack_size = r.GetValidStackSize(); stack_size > 0 && !sps.empty()) {
+    uint64_t used_size = sps.back() - sps.front() + kStackUsageSlackSize;
+    event_selection_set_.UpdateStackUsage(
+        r.tid_data.tid, used_size < stack_size ? static_cast<uint32_t>(used_size) : UINT32_MAX);
+  }
+  r.ReplaceRegAndStackWithCallChain(ips);
+  if (callchain_joiner_ &&
+      !callchain_joiner_->AddCallChain(r.tid_data.pid, r.tid_data.tid,
+                                       CallChainJoiner::ORIGINAL_OFFLINE, ips, sps)) {
+    return false;
   }
   return true;
 }
 
-bool RecordCommand::KeepFailedUnwindingResult(const SampleRecord& r,
+bool RecordCommand::KeepFailedUnwindingResult(const SampleRecord& r, const UnwindingResult& result,
                                               const std::vector<uint64_t>& ips,
                                               const std::vector<uint64_t>& sps) {
-  auto& result = offline_unwinder_->GetUnwindingResult();
   if (result.error_code != unwindstack::ERROR_NONE) {
     if (keep_failed_unwinding_debug_info_) {
-      return record_file_writer_->WriteRecord(UnwindingResultRecord(
-          r.time_data.time, result, r.regs_user_data, r.stack_user_data, ips, sps));
+      return WriteRecord(UnwindingResultRecord(r.time_data.time, result, r.regs_user_data,
+                                               r.stack_user_data, ips, sps));
     }
-    return record_file_writer_->WriteRecord(
-        UnwindingResultRecord(r.time_data.time, result, {}, {}, {}, {}));
+    return WriteRecord(UnwindingResultRecord(r.time_data.time, result, {}, {}, {}, {}));
   }
   return true;
 }
@@ -1871,159 +2163,261 @@ std::unique_ptr<RecordFileReader> RecordCommand::MoveRecordFile(const std::strin
   return reader;
 }
 
-bool RecordCommand::MergeMapRecords() {
-  // 1. Move records from record_filename_ to a temporary file.
-  auto tmp_file = ScopedTempFiles::CreateTempFile();
-  auto reader = MoveRecordFile(tmp_file->path);
-  if (!reader) {
-    return false;
-  }
-
-  // 2. Copy map records from map record thread.
-  auto callback = [this](Record* r) {
-    UpdateRecord(r);
-    if (ShouldOmitRecord(r)) {
+// Records are processed in a streaming pass, which reads the old recording file and writes the
+// new one. Hit files are collected from records written in the last pass, so the data section
+// doesn't need to be read again.
+bool RecordCommand::PostProcessRecords() {
+  RecordRewriteSteps steps;
+  steps.merge_map_records = map_record_thread_.has_value();
+  steps.unwind = unwind_dwarf_callchain_ && post_unwind_;
+  // Callchains can only be joined after all of them are unwound. So when post unwinding, they
+  // are joined in a second pass.
+  bool join_in_second_pass = callchain_joiner_ && steps.unwind;
+  steps.join_callchains = callchain_joiner_ && !steps.unwind;
+  if (!steps.merge_map_records && !steps.unwind && !steps.join_callchains) {
+    if (collect_hit_files_while_recording_ && !HitProcessHasSymbolMapFile()) {
+      collect_hit_files_ = false;
+      FinishCollectingHitFiles();
       return true;
     }
-    return record_file_writer_->WriteRecord(*r);
-  };
-  if (!map_record_thread_->ReadMapRecords(callback)) {
+    return CollectHitFilesInDataSection();
+  }
+  collect_hit_files_ = false;
+  steps.collect_hit_files = !join_in_second_pass;
+  if (!RewriteRecordFile(steps)) {
     return false;
   }
-
-  // 3. Copy data section from the old recording file.
-  std::vector<char> buf(64 * 1024);
-  uint64_t offset = reader->FileHeader().data.offset;
-  uint64_t left_size = reader->FileHeader().data.size;
-  while (left_size > 0) {
-    size_t nread = std::min<size_t>(left_size, buf.size());
-    if (!reader->ReadAtOffset(offset, buf.data(), nread) ||
-        !record_file_writer_->WriteData(buf.data(), nread)) {
-      return false;
-    }
-    offset += nread;
-    left_size -= nread;
+  if (join_in_second_pass) {
+    steps = RecordRewriteSteps();
+    steps.join_callchains = true;
+    steps.collect_hit_files = true;
+    return RewriteRecordFile(steps);
   }
   return true;
 }
 
-bool RecordCommand::PostUnwindRecords() {
+bool RecordCommand::RewriteRecordFile(const RecordRewriteSteps& steps) {
+  time_stat_.rewrite_passes++;
+  bool join_callchains = false;
+  if (steps.join_callchains) {
+    uint64_t start_time = GetSystemClock();
+    // Failing to join callchains isn't fatal. Then samples are kept unchanged.
+    join_callchains = callchain_joiner_->JoinCallChains();
+    time_stat_.join_callchains_duration += GetSystemClock() - start_time;
+  }
+
+  // 1. Move records from record_filename_ to a temporary file.
   auto tmp_file = ScopedTempFiles::CreateTempFile();
   auto reader = MoveRecordFile(tmp_file->path);
   if (!reader) {
     return false;
   }
-  // Write new event attrs without regs and stacks fields.
-  EventAttrIds attrs = reader->AttrSection();
-  for (auto& attr : attrs) {
-    ReplaceRegAndStackWithCallChain(attr.attr);
+  if (steps.unwind) {
+    // Write new event attrs without regs and stacks fields.
+    EventAttrIds attrs = reader->AttrSection();
+    for (auto& attr : attrs) {
+      ReplaceRegAndStackWithCallChain(attr.attr);
+    }
+    if (!record_file_writer_->WriteAttrSection(attrs)) {
+      return false;
+    }
+    sample_record_count_ = 0;
+    size_t thread_count = unwind_thread_count_;
+    if (thread_count == 0) {
+      thread_count = std::max<size_t>(GetOnlineCpus().size(), 1);
+    }
+    if (thread_count > 1) {
+      // Records in the recording file are ordered by time. Split samples into chunks and unwind
+      // them in all threads, while each thread sees all map records.
+      CreateParallelUnwinder(thread_count);
+      parallel_unwinder_->DispatchSamplesByChunk(kPostUnwindingSamplesPerChunk);
+    }
   }
-  if (!record_file_writer_->WriteAttrSection(attrs)) {
-    return false;
+  if (steps.collect_hit_files) {
+    record_file_writer_->IndexRecordsWhileWriting();
+    // Unwinding updates the thread tree before writing records.
+    StartCollectingHitFiles(!steps.unwind, false);
   }
 
-  sample_record_count_ = 0;
-  auto callback = [this](std::unique_ptr<Record> record) {
-    return SaveRecordAfterUnwinding(record.get());
+  // 2. Write map records from map record thread, which go before records in the old file.
+  if (steps.merge_map_records) {
+    uint64_t start_time = GetSystemClock();
+    auto callback = [&](Record* r) {
+      UpdateRecord(r);
+      if (ShouldOmitRecord(r)) {
+        return true;
+      }
+      return steps.unwind ? SaveRecordAfterUnwinding(r) : WriteRecord(*r);
+    };
+    if (!map_record_thread_->ReadMapRecords(callback)) {
+      return false;
+    }
+    time_stat_.merge_map_records_duration += GetSystemClock() - start_time;
+  }
+
+  // 3. Read records from the old file, and write them after unwinding or joining callchains.
+  auto callback = [&](std::unique_ptr<Record> r) {
+    if (steps.unwind) {
+      if (parallel_unwinder_) {
+        return AddRecordToParallelUnwinder(std::move(r));
+      }
+      return SaveRecordAfterUnwinding(r.get());
+    }
+    if (join_callchains && r->type() == PERF_RECORD_SAMPLE &&
+        !JoinCallChain(*static_cast<SampleRecord*>(r.get()))) {
+      return false;
+    }
+    return WriteRecord(*r);
   };
-  return reader->ReadDataSection(callback);
+  if (!reader->ReadDataSection(callback)) {
+    return false;
+  }
+  if (parallel_unwinder_) {
+    if (!SaveUnwindingTasks(true)) {
+      return false;
+    }
+    parallel_unwinder_.reset();
+  }
+  if (steps.collect_hit_files) {
+    collect_hit_files_ = false;
+    FinishCollectingHitFiles();
+  }
+  return true;
 }
 
-bool RecordCommand::JoinCallChains() {
-  // 1. Prepare joined callchains.
-  if (!callchain_joiner_->JoinCallChains()) {
-    return false;
+bool RecordCommand::JoinCallChain(SampleRecord& r) {
+  if (!r.HasUserCallChain()) {
+    return true;
   }
-  // 2. Move records from record_filename_ to a temporary file.
-  auto tmp_file = ScopedTempFiles::CreateTempFile();
-  auto reader = MoveRecordFile(tmp_file->path);
-  if (!reader) {
+  pid_t pid;
+  pid_t tid;
+  CallChainJoiner::ChainType type;
+  std::vector<uint64_t> ips;
+  std::vector<uint64_t> sps;
+  if (!callchain_joiner_->GetNextCallChain(pid, tid, type, ips, sps)) {
     return false;
   }
+  CHECK_EQ(type, CallChainJoiner::JOINED_OFFLINE);
+  CHECK_EQ(pid, static_cast<pid_t>(r.tid_data.pid));
+  CHECK_EQ(tid, static_cast<pid_t>(r.tid_data.tid));
+  r.UpdateUserCallChain(ips);
+  return true;
+}
 
-  // 3. Read records from the temporary file, and write record with joined call chains back
-  // to record_filename_.
-  auto record_callback = [&](std::unique_ptr<Record> r) {
-    if (r->type() != PERF_RECORD_SAMPLE) {
-      return record_file_writer_->WriteRecord(*r);
-    }
-    SampleRecord& sr = *static_cast<SampleRecord*>(r.get());
-    if (!sr.HasUserCallChain()) {
-      return record_file_writer_->WriteRecord(sr);
-    }
-    pid_t pid;
-    pid_t tid;
-    CallChainJoiner::ChainType type;
-    std::vector<uint64_t> ips;
-    std::vector<uint64_t> sps;
-    if (!callchain_joiner_->GetNextCallChain(pid, tid, type, ips, sps)) {
-      return false;
-    }
-    CHECK_EQ(type, CallChainJoiner::JOINED_OFFLINE);
-    CHECK_EQ(pid, static_cast<pid_t>(sr.tid_data.pid));
-    CHECK_EQ(tid, static_cast<pid_t>(sr.tid_data.tid));
-    sr.UpdateUserCallChain(ips);
-    return record_file_writer_->WriteRecord(sr);
-  };
-  return reader->ReadDataSection(record_callback);
+bool RecordCommand::WriteRecord(const Record& record) {
+  if (collect_hit_files_) {
+    CollectHitFiles(record);
+  }
+  return record_file_writer_->WriteRecord(record);
 }
 
-static void LoadSymbolMapFile(int pid, const std::string& package, ThreadTree* thread_tree) {
+static std::string GetSymbolMapFile(int pid, const std::string& package) {
   // On Linux, symbol map files usually go to /tmp/perf-<pid>.map
   // On Android, there is no directory where any process can create files.
   // For now, use /data/local/tmp/perf-<pid>.map, which works for standalone programs,
   // and /data/data/<package>/perf-<pid>.map, which works for apps.
-  auto path = package.empty()
-                  ? android::base::StringPrintf("/data/local/tmp/perf-%d.map", pid)
-                  : android::base::StringPrintf("/data/data/%s/perf-%d.map", package.c_str(), pid);
+  return package.empty()
+             ? android::base::StringPrintf("/data/local/tmp/perf-%d.map", pid)
+             : android::base::StringPrintf("/data/data/%s/perf-%d.map", package.c_str(), pid);
+}
 
-  auto symbols = ReadSymbolMapFromFile(path);
+static void LoadSymbolMapFile(int pid, const std::string& package, ThreadTree* thread_tree) {
+  auto symbols = ReadSymbolMapFromFile(GetSymbolMapFile(pid, package));
   if (!symbols.empty()) {
     thread_tree->AddSymbolsForProcess(pid, &symbols);
   }
 }
 
-bool RecordCommand::DumpAdditionalFeatures(const std::vector<std::string>& args) {
-  // Read data section of perf.data to collect hit file information.
-  thread_tree_.ClearThreadAndMap();
-  bool kernel_symbols_available = false;
+// Used when the recording file isn't rewritten in post processing, and hit files can't be
+// collected while recording.
+bool RecordCommand::CollectHitFilesInDataSection() {
+  StartCollectingHitFiles(true, false);
+  bool result =
+      record_file_writer_->ReadDataSection([this](const Record* r) { CollectHitFiles(*r); });
+  collect_hit_files_ = false;
+  FinishCollectingHitFiles();
+  return result;
+}
+
+void RecordCommand::StartCollectingHitFiles(bool update_thread_tree, bool while_recording) {
+  if (update_thread_tree) {
+    thread_tree_.ClearThreadAndMap();
+  }
+  hit_pids_.clear();
+  debug_unwinding_files_.clear();
+  failed_unwinding_sample_ = false;
+  hit_addrs_.clear();
+  hit_addr_index_.clear();
+  collect_hit_files_ = true;
+  collect_hit_files_while_recording_ = while_recording;
+  update_thread_tree_for_hit_files_ = update_thread_tree;
+}
+
+void RecordCommand::CollectHitFiles(const Record& record) {
+  if (update_thread_tree_for_hit_files_) {
+    thread_tree_.Update(record);
+  }
+  if (record.type() == PERF_RECORD_SAMPLE) {
+    uint64_t start_time = GetSystemClock();
+    auto& sample = static_cast<const SampleRecord&>(record);
+    // Symbol map files are available after recording. Load one for the process.
+    if (hit_pids_.insert(sample.tid_data.pid).second && !collect_hit_files_while_recording_) {
+      LoadSymbolMapFile(sample.tid_data.pid, app_package_name_, &thread_tree_);
+    }
+    CollectHitFileInfo(sample, failed_unwinding_sample_);
+    failed_unwinding_sample_ = false;
+    if (time_stat_.stop_recording_time == 0) {
+      time_stat_.collect_hit_files_while_recording_duration += GetSystemClock() - start_time;
+    } else {
+      time_stat_.collect_hit_files_duration += GetSystemClock() - start_time;
+    }
+  } else if (record.type() == SIMPLE_PERF_RECORD_UNWINDING_RESULT) {
+    failed_unwinding_sample_ = true;
+  }
+}
+
+// Symbol map files aren't loaded while recording, because they may not be complete. If a hit
+// process has one, hit files are collected again after recording.
+bool RecordCommand::HitProcessHasSymbolMapFile() {
+  for (int pid : hit_pids_) {
+    if (IsRegularFile(GetSymbolMapFile(pid, app_package_name_))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Symbols of hit addresses are looked up after collecting hit files. So symbols aren't loaded
+// while recording, and each address is only looked up once.
+void RecordCommand::FinishCollectingHitFiles() {
+  uint64_t start_time = GetSystemClock();
   std::string kallsyms;
   if (event_selection_set_.NeedKernelSymbol() && LoadKernelSymbols(&kallsyms)) {
     Dso::SetKallsyms(kallsyms);
-    kernel_symbols_available = true;
-  }
-  std::unordered_set<int> loaded_symbol_maps;
-  std::vector<uint64_t> auxtrace_offset;
-  std::unordered_set<Dso*> debug_unwinding_files;
-  bool failed_unwinding_sample = false;
-
-  auto callback = [&](const Record* r) {
-    thread_tree_.Update(*r);
-    if (r->type() == PERF_RECORD_SAMPLE) {
-      auto sample = reinterpret_cast<const SampleRecord*>(r);
-      // Symbol map files are available after recording. Load one for the process.
-      if (loaded_symbol_maps.insert(sample->tid_data.pid).second) {
-        LoadSymbolMapFile(sample->tid_data.pid, app_package_name_, &thread_tree_);
-      }
-      if (failed_unwinding_sample) {
-        failed_unwinding_sample = false;
-        CollectHitFileInfo(*sample, &debug_unwinding_files);
-      } else {
-        CollectHitFileInfo(*sample, nullptr);
-      }
-    } else if (r->type() == PERF_RECORD_AUXTRACE) {
-      auto auxtrace = static_cast<const AuxTraceRecord*>(r);
-      auxtrace_offset.emplace_back(auxtrace->location.file_offset - auxtrace->size());
-    } else if (r->type() == SIMPLE_PERF_RECORD_UNWINDING_RESULT) {
-      failed_unwinding_sample = true;
+    kernel_symbols_available_ = true;
+  }
+  for (const HitAddr& addr : hit_addrs_) {
+    Dso* dso;
+    const Symbol* symbol = thread_tree_.FindSymbol(addr.map, addr.ip, nullptr, &dso);
+    if (!symbol->HasDumpId()) {
+      dso->CreateSymbolDumpId(symbol);
+    }
+    if (!dso->HasDumpId() && dso->type() != DSO_UNKNOWN_FILE) {
+      dso->CreateDumpId();
+    }
+    if (addr.in_failed_unwinding_sample) {
+      debug_unwinding_files_.insert(dso);
     }
-  };
-
-  if (!record_file_writer_->ReadDataSection(callback)) {
-    return false;
   }
+  hit_addrs_.clear();
+  hit_addr_index_.clear();
+  time_stat_.collect_hit_files_duration += GetSystemClock() - start_time;
+}
 
-  size_t feature_count = 6;
+bool RecordCommand::DumpAdditionalFeatures(const std::vector<std::string>& args) {
+  const std::vector<uint64_t>& auxtrace_offset = record_file_writer_->GetAuxTraceOffsets();
+  // build_id, file, osrelease, arch, cmdline, meta_info and record_index features.
+  size_t feature_count = 7;
   if (branch_sampling_) {
     feature_count++;
   }
@@ -2069,18 +2463,21 @@ bool RecordCommand::DumpAdditionalFeatures(const std::vector<std::string>& args)
   if (branch_sampling_ != 0 && !record_file_writer_->WriteBranchStackFeature()) {
     return false;
   }
-  if (!DumpMetaInfoFeature(kernel_symbols_available)) {
+  if (!DumpMetaInfoFeature(kernel_symbols_available_)) {
     return false;
   }
   if (!auxtrace_offset.empty() && !record_file_writer_->WriteAuxTraceFeature(auxtrace_offset)) {
     return false;
   }
-  if (keep_failed_unwinding_debug_info_ && !DumpDebugUnwindFeature(debug_unwinding_files)) {
+  if (keep_failed_unwinding_debug_info_ && !DumpDebugUnwindFeature(debug_unwinding_files_)) {
     return false;
   }
   if (etm_branch_list_generator_ && !DumpETMBranchListFeature()) {
     return false;
   }
+  if (!record_file_writer_->WriteRecordIndexFeature()) {
+    return false;
+  }
 
   if (!record_file_writer_->EndWriteFeatures()) {
     return false;
@@ -2164,10 +2561,21 @@ bool RecordCommand::DumpMetaInfoFeature(bool kernel_symbols_available) {
   info_map["record_stat"] = android::base::StringPrintf(
       "sample_record_count=%" PRIu64
       ",kernelspace_lost_records=%zu,userspace_lost_samples=%zu,"
-      "userspace_lost_non_samples=%zu,userspace_truncated_stack_samples=%zu",
+      "userspace_lost_non_samples=%zu,userspace_truncated_stack_samples=%zu,"
+      "userspace_truncated_stack_size=%" PRIu64,
       sample_record_count_, record_stat.kernelspace_lost_records,
       record_stat.userspace_lost_samples, record_stat.userspace_lost_non_samples,
-      record_stat.userspace_truncated_stack_samples);
+      record_stat.userspace_truncated_stack_samples, record_stat.userspace_truncated_stack_size);
+  std::string kernel_buffer_stat;
+  for (const auto& [cpu, stat] : record_stat.kernel_buffer_stats) {
+    if (!kernel_buffer_stat.empty()) {
+      kernel_buffer_stat += ";";
+    }
+    kernel_buffer_stat += android::base::StringPrintf(
+        "cpu=%d,buffer_size=%zu,data_size=%" PRIu64 ",max_fill_percent=%u,lost_records=%zu", cpu,
+        stat.buffer_size, stat.data_size, stat.max_fill_percent, stat.lost_records);
+  }
+  info_map["kernel_buffer_stat"] = kernel_buffer_stat;
 
   return record_file_writer_->WriteMetaInfoFeature(info_map);
 }
@@ -2198,7 +2606,7 @@ bool RecordCommand::DumpDebugUnwindFeature(const std::unordered_set<Dso*>& dso_s
   return record_file_writer_->WriteDebugUnwindFeature(debug_unwind_feature);
 }
 
-void RecordCommand::CollectHitFileInfo(const SampleRecord& r, std::unordered_set<Dso*>* dso_set) {
+void RecordCommand::CollectHitFileInfo(const SampleRecord& r, bool in_failed_unwinding_sample) {
   const ThreadEntry* thread = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
   size_t kernel_ip_count;
   std::vector<uint64_t> ips = r.GetCallChain(&kernel_ip_count);
@@ -2211,18 +2619,24 @@ void RecordCommand::CollectHitFileInfo(const SampleRecord& r, std::unordered_set
   }
   for (size_t i = 0; i < ips.size(); i++) {
     const MapEntry* map = thread_tree_.FindMap(thread, ips[i], i < kernel_ip_count);
-    Dso* dso = map->dso;
     if (dump_symbols_) {
-      const Symbol* symbol = thread_tree_.FindSymbol(map, ips[i], nullptr, &dso);
-      if (!symbol->HasDumpId()) {
-        dso->CreateSymbolDumpId(symbol);
+      // The symbol may be in a different dso, so dump ids are created in
+      // FinishCollectingHitFiles().
+      auto [it, inserted] = hit_addr_index_.try_emplace(std::make_pair(map, ips[i]),
+                                                        hit_addrs_.size());
+      if (inserted) {
+        hit_addrs_.push_back(HitAddr{map, ips[i], in_failed_unwinding_sample});
+      } else if (in_failed_unwinding_sample) {
+        hit_addrs_[it->second].in_failed_unwinding_sample = true;
       }
+      continue;
     }
+    Dso* dso = map->dso;
     if (!dso->HasDumpId() && dso->type() != DSO_UNKNOWN_FILE) {
       dso->CreateDumpId();
     }
-    if (dso_set != nullptr) {
-      dso_set->insert(dso);
+    if (in_failed_unwinding_sample) {
+      debug_unwinding_files_.insert(dso);
     }
   }
 }
@@ -294,6 +294,19 @@ TEST(record_cmd, post_unwind_option) {
   ASSERT_TRUE(RunRecordCmd({"-p", pid, "--call-graph", "dwarf", "--post-unwind=no"}));
 }
 
+TEST(record_cmd, unwind_threads_option) {
+  OMIT_TEST_ON_NON_NATIVE_ABIS();
+  ASSERT_TRUE(IsDwarfCallChainSamplingSupported());
+  std::vector<std::unique_ptr<Workload>> workloads;
+  CreateProcesses(2, &workloads);
+  std::string pids =
+      std::to_string(workloads[0]->GetPid()) + "," + std::to_string(workloads[1]->GetPid());
+  ASSERT_TRUE(RunRecordCmd({"-p", pids, "--call-graph", "dwarf", "--unwind-threads", "2"}));
+  ASSERT_TRUE(RunRecordCmd({"-p", pids, "--call-graph", "dwarf", "--unwind-threads", "2",
+                            "--post-unwind=yes"}));
+  ASSERT_FALSE(RunRecordCmd({"-p", pids, "--call-graph", "dwarf", "--unwind-threads", "0"}));
+}
+
 TEST(record_cmd, existing_processes) {
   std::vector<std::unique_ptr<Workload>> workloads;
   CreateProcesses(2, &workloads);
@@ -408,6 +421,52 @@ TEST(record_cmd, no_dump_symbols) {
   ASSERT_TRUE(CheckDumpedSymbols(tmpfile.path, false));
 }
 
+// Check the record index in the recording file matches records in the data section.
+static void CheckRecordIndex(const std::string& path) {
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(path);
+  ASSERT_TRUE(reader != nullptr);
+  std::optional<RecordIndexFeature> index = reader->ReadRecordIndexFeature();
+  ASSERT_TRUE(index.has_value());
+  uint64_t data_size = reader->FileHeader().data.size;
+  uint64_t index_sample_count = 0;
+  uint64_t prev_end = 0;
+  for (const RecordIndexChunk& chunk : index.value()) {
+    ASSERT_GE(chunk.offset, prev_end);
+    prev_end = chunk.offset + chunk.size;
+    ASSERT_LE(prev_end, data_size);
+    index_sample_count += chunk.sample_count;
+  }
+  uint64_t sample_count = 0;
+  for (const auto& r : reader->DataSection()) {
+    if (r->type() == PERF_RECORD_SAMPLE) {
+      sample_count++;
+    }
+  }
+  ASSERT_EQ(index_sample_count, sample_count);
+}
+
+TEST(record_cmd, index_records_while_recording) {
+  // Without dwarf callchains, the recording file isn't rewritten after recording. The record
+  // index is built and hit files are collected while recording.
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({}, tmpfile.path));
+  ASSERT_TRUE(CheckDumpedSymbols(tmpfile.path, true));
+  CheckRecordIndex(tmpfile.path);
+}
+
+TEST(record_cmd, index_records_with_map_record_thread) {
+  // When recording etm data system wide, maps are dumped in a map record thread and merged into
+  // the recording file after recording. So the index is built when rewriting the file.
+  TEST_REQUIRE_ROOT();
+  if (!ETMRecorder::GetInstance().CheckEtmSupport().ok()) {
+    GTEST_LOG_(INFO) << "Omit this test since etm isn't supported on this device";
+    return;
+  }
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"-e", "cs-etm", "-a"}, tmpfile.path));
+  CheckRecordIndex(tmpfile.path);
+}
+
 TEST(record_cmd, dump_kernel_symbols) {
   TEST_REQUIRE_ROOT();
   TemporaryFile tmpfile;
@@ -523,6 +582,7 @@ TEST(record_cmd, record_meta_info_feature) {
   ASSERT_NE(info_map.find("simpleperf_version"), info_map.end());
   ASSERT_NE(info_map.find("timestamp"), info_map.end());
   ASSERT_NE(info_map.find("record_stat"), info_map.end());
+  ASSERT_NE(info_map.find("kernel_buffer_stat"), info_map.end());
 #if defined(__ANDROID__)
   ASSERT_NE(info_map.find("product_props"), info_map.end());
   ASSERT_NE(info_map.find("android_version"), info_map.end());
@@ -646,6 +706,14 @@ TEST(record_cmd, size_limit_option) {
   ASSERT_FALSE(RunRecordCmd({"--size-limit", "0"}));
 }
 
+TEST(record_cmd, z_option) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"-z"}, tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader);
+  ASSERT_FALSE(reader->DataSection().empty());
+}
+
 TEST(record_cmd, support_mmap2) {
   // mmap2 is supported in kernel >= 3.16. If not supported, please cherry pick below kernel
   // patches:
@@ -1328,6 +1396,34 @@ TEST(record_cmd, user_buffer_size_option) {
   ASSERT_TRUE(RunRecordCmd({"--user-buffer-size", "256M"}));
 }
 
+TEST(record_cmd, discard_kernel_data_early_option) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"--discard-kernel-data-early"}, tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader);
+  auto& info_map = reader->GetMetaInfoFeature();
+  ASSERT_NE(info_map.find("kernel_buffer_stat"), info_map.end());
+}
+
+TEST(record_cmd, user_buffer_latency_option) {
+  ASSERT_TRUE(RunRecordCmd({"--user-buffer-latency", "0"}));
+  ASSERT_TRUE(RunRecordCmd({"--user-buffer-latency", "100"}));
+  ASSERT_FALSE(RunRecordCmd({"--user-buffer-latency", "1001"}));
+
+  // Records waiting for a batch are read when recording stops.
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"--user-buffer-latency", "1000"}, tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader != nullptr);
+  size_t sample_count = 0;
+  for (const auto& r : reader->DataSection()) {
+    if (r->type() == PERF_RECORD_SAMPLE) {
+      sample_count++;
+    }
+  }
+  ASSERT_GT(sample_count, 0u);
+}
+
 TEST(record_cmd, record_process_name) {
   TemporaryFile tmpfile;
   ASSERT_TRUE(RecordCmd()->Run({"-e", GetDefaultEvent(), "-o", tmpfile.path, "sleep", SLEEP_SEC}));
@@ -16,10 +16,16 @@
 
 #include <inttypes.h>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -163,6 +169,13 @@ class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, AccInfo
     return sample_tree;
   }
 
+  void MergeSampleTree(ReportCmdSampleTreeBuilder& other) {
+    SampleTreeBuilder::MergeSampleTree(other);
+    total_samples_ += other.total_samples_;
+    total_period_ += other.total_period_;
+    total_error_callchains_ += other.total_error_callchains_;
+  }
+
   virtual void ReportCmdProcessSampleRecord(std::shared_ptr<SampleRecord>& r) {
     return ProcessSampleRecord(*r);
   }
@@ -176,9 +189,10 @@ class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, AccInfo
 
   SampleEntry* CreateSample(const SampleRecord& r, bool in_kernel, AccInfo* acc_info) override {
     const ThreadEntry* thread = thread_tree_->FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
-    const MapEntry* map = thread_tree_->FindMap(thread, r.ip_data.ip, in_kernel);
+    const MapEntry* map;
     uint64_t vaddr_in_file;
-    const Symbol* symbol = thread_tree_->FindSymbol(map, r.ip_data.ip, &vaddr_in_file);
+    const Symbol* symbol =
+        thread_tree_->FindMapAndSymbol(thread, r.ip_data.ip, in_kernel, &map, &vaddr_in_file);
     uint64_t period = GetPeriod(r);
     acc_info->period = period;
     std::vector<uint64_t> counts = GetCountsForSample(r);
@@ -211,14 +225,15 @@ class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, AccInfo
                                      uint64_t ip, bool in_kernel,
                                      const std::vector<SampleEntry*>& callchain,
                                      const AccInfo& acc_info) override {
-    const MapEntry* map = thread_tree_->FindMap(thread, ip, in_kernel);
+    const MapEntry* map;
+    uint64_t vaddr_in_file;
+    const Symbol* symbol =
+        thread_tree_->FindMapAndSymbol(thread, ip, in_kernel, &map, &vaddr_in_file);
     if (thread_tree_->IsUnknownDso(map->dso)) {
       // The unwinders can give wrong ip addresses, which can't map to a valid dso. Skip them.
       total_error_callchains_++;
       return nullptr;
     }
-    uint64_t vaddr_in_file;
-    const Symbol* symbol = thread_tree_->FindSymbol(map, ip, &vaddr_in_file);
     std::unique_ptr<SampleEntry> callchain_sample(
         new SampleEntry(sample->time, 0, acc_info.period, 0, sample->cpu, thread, map, symbol,
                         vaddr_in_file, {}, acc_info.counts));
@@ -271,6 +286,13 @@ class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, AccInfo
     }
   }
 
+  void MergeCallChain(SampleEntry* sample1, SampleEntry* sample2) override {
+    sample1->callchain.MergeCallChain(sample2->callchain,
+                                      [this](const SampleEntry* s1, const SampleEntry* s2) {
+                                        return sample_comparator_.IsSameSample(s1, s2);
+                                      });
+  }
+
  private:
   std::vector<uint64_t> GetCountsForSample(const SampleRecord& r) {
     CHECK_EQ(r.read_data.counts.size(), r.read_data.ids.size());
@@ -356,7 +378,6 @@ class TimestampSampleTreeBuilder : public ReportCmdSampleTreeBuilder {
 
 struct SampleTreeBuilderOptions {
   SampleComparator<SampleEntry> comparator;
-  ThreadTree* thread_tree;
   std::unordered_set<std::string> comm_filter;
   std::unordered_set<std::string> dso_filter;
   std::unordered_set<std::string> symbol_filter;
@@ -368,7 +389,7 @@ struct SampleTreeBuilderOptions {
   bool trace_offcpu;
 
   std::unique_ptr<ReportCmdSampleTreeBuilder> CreateSampleTreeBuilder(
-      const RecordFileReader& reader) {
+      const RecordFileReader& reader, ThreadTree* thread_tree) {
     std::unique_ptr<ReportCmdSampleTreeBuilder> builder;
     if (trace_offcpu) {
       builder.reset(new TimestampSampleTreeBuilder(comparator, thread_tree, reader.EventIdMap()));
@@ -383,6 +404,176 @@ struct SampleTreeBuilderOptions {
   }
 };
 
+// ParallelSampleTreeBuilder builds sample trees in multiple threads. The main thread reads records
+// in batches, and sends each batch to all worker threads. Each worker has its own ThreadTree and
+// sample tree builders. It updates its thread tree with map, comm, fork and exit records in every
+// batch, but only processes samples in batches assigned to it. Batches are assigned to workers in
+// turn. Dsos in different thread trees share symbols, so each file is only parsed once. After
+// reading all records, the partial sample trees are merged.
+class ParallelSampleTreeBuilder {
+ public:
+  // A batch of records read by the main thread.
+  struct RecordBatch {
+    RecordArena arena;
+    std::vector<Record*> records;
+    // The attr index of each record. It is kSkipRecord for records not used to build sample trees.
+    std::vector<size_t> attr_ids;
+  };
+  static constexpr size_t kSkipRecord = SIZE_MAX;
+
+  using SampleTreeBuilders = std::vector<std::unique_ptr<ReportCmdSampleTreeBuilder>>;
+  // Prepare the thread tree and sample tree builders of a worker.
+  using WorkerInitializer = std::function<bool(ThreadTree&, SampleTreeBuilders&)>;
+
+  ~ParallelSampleTreeBuilder() { StopWorkers(); }
+
+  // worker_init is called for each worker in the current thread, before starting worker threads.
+  bool Start(size_t thread_count, const WorkerInitializer& worker_init) {
+    CHECK_GT(thread_count, 0u);
+    Dso::SetShareSymbols(true);
+    for (size_t i = 0; i < thread_count; i++) {
+      auto worker = std::make_unique<Worker>();
+      if (!worker_init(worker->thread_tree, worker->builders)) {
+        return false;
+      }
+      workers_.emplace_back(std::move(worker));
+    }
+    // Keep two batches for each worker, so workers don't wait for the main thread to read records.
+    max_queued_batches_ = thread_count * 2;
+    for (auto& worker : workers_) {
+      Worker* p = worker.get();
+      p->thread = std::thread([this, p]() { RunWorker(p); });
+    }
+    return true;
+  }
+
+  // Send a batch to workers. Wait if workers have too many batches to process.
+  void AddBatch(std::shared_ptr<RecordBatch> batch) {
+    Worker* sample_worker = workers_[next_worker_].get();
+    next_worker_ = (next_worker_ + 1) % workers_.size();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_cond_.wait(lock, [&]() {
+        return std::all_of(workers_.begin(), workers_.end(), [&](const auto& worker) {
+          return worker->queue.size() < max_queued_batches_;
+        });
+      });
+      for (auto& worker : workers_) {
+        worker->queue.emplace_back(WorkItem{batch, worker.get() == sample_worker});
+      }
+    }
+    for (auto& worker : workers_) {
+      worker->cond.notify_one();
+    }
+  }
+
+  // Wait until workers finish all added batches.
+  void WaitForIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cond_.wait(lock, [&]() {
+      return std::all_of(workers_.begin(), workers_.end(), [](const auto& worker) {
+        return worker->queue.empty() && !worker->busy;
+      });
+    });
+  }
+
+  // Stop workers and merge their sample trees. The returned samples refer to thread trees in the
+  // workers, so the ParallelSampleTreeBuilder should live until samples are no longer used.
+  SampleTreeBuilders Finish() {
+    WaitForIdle();
+    StopWorkers();
+    SampleTreeBuilders& result = workers_[0]->builders;
+    for (size_t i = 1; i < workers_.size(); i++) {
+      for (size_t j = 0; j < result.size(); j++) {
+        result[j]->MergeSampleTree(*workers_[i]->builders[j]);
+      }
+    }
+    return std::move(result);
+  }
+
+ private:
+  struct WorkItem {
+    std::shared_ptr<RecordBatch> batch;
+    bool process_samples = false;
+  };
+
+  struct Worker {
+    ThreadTree thread_tree;
+    SampleTreeBuilders builders;
+    // Below fields are protected by mutex_.
+    std::deque<WorkItem> queue;
+    bool busy = false;
+    std::condition_variable cond;
+    std::thread thread;
+  };
+
+  void StopWorkers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    for (auto& worker : workers_) {
+      worker->cond.notify_one();
+    }
+    for (auto& worker : workers_) {
+      if (worker->thread.joinable()) {
+        worker->thread.join();
+      }
+    }
+    Dso::SetShareSymbols(false);
+  }
+
+  void RunWorker(Worker* worker) {
+    while (true) {
+      WorkItem item;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        worker->busy = false;
+        idle_cond_.notify_all();
+        worker->cond.wait(lock, [&]() { return stop_ || !worker->queue.empty(); });
+        if (stop_) {
+          return;
+        }
+        item = std::move(worker->queue.front());
+        worker->queue.pop_front();
+        worker->busy = true;
+      }
+      const RecordBatch& batch = *item.batch;
+      for (size_t i = 0; i < batch.records.size(); i++) {
+        Record* record = batch.records[i];
+        switch (record->type()) {
+          case PERF_RECORD_MMAP:
+          case PERF_RECORD_MMAP2:
+          case PERF_RECORD_COMM:
+          case PERF_RECORD_FORK:
+          case PERF_RECORD_EXIT:
+            worker->thread_tree.Update(*record);
+            break;
+          case PERF_RECORD_SAMPLE:
+            if (item.process_samples && batch.attr_ids[i] != kSkipRecord) {
+              worker->builders[batch.attr_ids[i]]->ReportCmdProcessSampleRecord(
+                  *static_cast<const SampleRecord*>(record));
+            }
+            break;
+          default:
+            // Kernel symbols and tracing data are handled by the main thread.
+            break;
+        }
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  size_t max_queued_batches_ = 0;
+  // Only accessed in the main thread.
+  size_t next_worker_ = 0;
+
+  std::mutex mutex_;
+  // Notified when a worker finishes a batch.
+  std::condition_variable idle_cond_;
+  bool stop_ = false;
+};
+
 using ReportCmdSampleTreeSorter = SampleTreeSorter<SampleEntry>;
 using ReportCmdSampleTreeDisplayer = SampleTreeDisplayer<SampleEntry, SampleTree>;
 
@@ -419,6 +610,9 @@ class ReportCommand : public Command {
 "                      the graph shows how functions call others.\n"
 "                      Default is caller mode.\n"
 "-i <file>  Specify path of record file, default is perf.data.\n"
+"-j <jobs>  Use jobs threads to build sample trees. Default is 1. Samples recorded with\n"
+"           --trace-offcpu or --add-counter are always processed in one thread, with symbols\n"
+"           of hit binaries loaded in jobs threads beforehand.\n"
 "--kallsyms <file>     Set the file to read kernel symbols.\n"
 "--max-stack <frames>  Set max stack frames shown when printing call graph.\n"
 "-n         Print the sample count for each item.\n"
@@ -448,6 +642,8 @@ class ReportCommand : public Command {
 "                        symbol_to       -- name of function branched to\n"
 "                      The default sort keys are:\n"
 "                        comm,pid,tid,dso,symbol\n"
+"--symbol-cache-dir <dir>  Store symbol tables read from binaries in <dir>, keyed by build id.\n"
+"                      Later reports load symbols from the cache instead of parsing binaries.\n"
 "--symfs <dir>         Look for files with symbols relative to this directory.\n"
 "--vmlinux <file>      Parse kernel symbols from <file>.\n"
 "\n"
@@ -483,7 +679,13 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_REPORTING
   bool ReadEventAttrFromRecordFile();
   bool ReadFeaturesFromRecordFile();
   bool ReadSampleTreeFromRecordFile();
+  void CreateSampleTreeBuilders(ThreadTree& thread_tree,
+                                std::vector<std::unique_ptr<ReportCmdSampleTreeBuilder>>& builders);
+  size_t SampleTreeBuildingThreadCount();
+  bool ReadSampleTreeInParallel(size_t thread_count);
+  bool BuildSampleTrees();
   bool ProcessRecord(std::unique_ptr<Record> record);
+  bool ProcessRecord(Record& record);
   void ProcessSampleRecordInTraceOffCpuMode(std::unique_ptr<Record> record, size_t attr_id);
   bool ProcessTracingData(const std::vector<char>& data);
   bool PrintReport();
@@ -498,6 +700,8 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_REPORTING
   // Create a SampleTreeBuilder and SampleTree for each event_attr.
   std::vector<SampleTree> sample_tree_;
   SampleTreeBuilderOptions sample_tree_builder_options_;
+  // Used when building sample trees in multiple threads. Samples refer to thread trees in it.
+  std::unique_ptr<ParallelSampleTreeBuilder> parallel_sample_tree_builder_;
   std::vector<std::unique_ptr<ReportCmdSampleTreeBuilder>> sample_tree_builder_;
 
   std::unique_ptr<ReportCmdSampleTreeSorter> sample_tree_sorter_;
@@ -520,9 +724,12 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_REPORTING
   std::vector<std::string> sort_keys_;
   std::string report_filename_;
   RecordFilter record_filter_;
+  size_t jobs_ = 1;
+  bool show_ip_for_unknown_symbol_ = false;
 };
 
 bool ReportCommand::Run(const std::vector<std::string>& args) {
+  auto start_time = std::chrono::steady_clock::now();
   // 1. Parse options.
   if (!ParseOptions(args)) {
     return false;
@@ -533,6 +740,8 @@ bool ReportCommand::Run(const std::vector<std::string>& args) {
   if (record_file_reader_ == nullptr) {
     return false;
   }
+  // Avoid copying records. If it fails, records are read from the file.
+  record_file_reader_->MmapDataSection();
   if (!ReadMetaInfoFromRecordFile()) {
     return false;
   }
@@ -552,6 +761,8 @@ bool ReportCommand::Run(const std::vector<std::string>& args) {
   }
 
   // 3. Show collected information.
+  std::chrono::duration<double> prepare_time = std::chrono::steady_clock::now() - start_time;
+  LOG(DEBUG) << "Time to first output: " << prepare_time.count() << " s";
   if (!PrintReport()) {
     return false;
   }
@@ -571,6 +782,7 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
       {"--full-callgraph", {OptionValueType::NONE, OptionType::SINGLE}},
       {"-g", {OptionValueType::OPT_STRING, OptionType::SINGLE}},
       {"-i", {OptionValueType::STRING, OptionType::SINGLE}},
+      {"-j", {OptionValueType::UINT, OptionType::SINGLE}},
       {"--kallsyms", {OptionValueType::STRING, OptionType::SINGLE}},
       {"--max-stack", {OptionValueType::UINT, OptionType::SINGLE}},
       {"-n", {OptionValueType::NONE, OptionType::SINGLE}},
@@ -583,6 +795,7 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
       {"--tids", {OptionValueType::STRING, OptionType::MULTIPLE}},
       {"--raw-period", {OptionValueType::NONE, OptionType::SINGLE}},
       {"--sort", {OptionValueType::STRING, OptionType::SINGLE}},
+      {"--symbol-cache-dir", {OptionValueType::STRING, OptionType::SINGLE}},
       {"--symbols", {OptionValueType::STRING, OptionType::MULTIPLE}},
       {"--symfs", {OptionValueType::STRING, OptionType::SINGLE}},
       {"--vmlinux", {OptionValueType::STRING, OptionType::SINGLE}},
@@ -636,6 +849,9 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
     }
   }
   options.PullStringValue("-i", &record_filename_);
+  if (!options.PullUintValue("-j", &jobs_, 1)) {
+    return false;
+  }
   if (auto value = options.PullValue("--kallsyms"); value) {
     std::string kallsyms;
     if (!android::base::ReadFileToString(*value->str_value, &kallsyms)) {
@@ -652,6 +868,7 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
   Dso::SetDemangle(!options.PullBoolValue("--no-demangle"));
 
   if (!options.PullBoolValue("--no-show-ip")) {
+    show_ip_for_unknown_symbol_ = true;
     thread_tree_.ShowIpForUnknownSymbol();
   }
 
@@ -687,6 +904,11 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
     sample_tree_builder_options_.symbol_filter.insert(symbols.begin(), symbols.end());
   }
 
+  if (auto value = options.PullValue("--symbol-cache-dir"); value) {
+    if (!Dso::SetSymbolCacheDir(*value->str_value)) {
+      return false;
+    }
+  }
   if (auto value = options.PullValue("--symfs"); value) {
     if (!Dso::SetSymFsDir(*value->str_value)) {
       return false;
@@ -831,7 +1053,6 @@ bool ReportCommand::BuildSampleComparatorAndDisplayer() {
   }
 
   sample_tree_builder_options_.comparator = comparator;
-  sample_tree_builder_options_.thread_tree = &thread_tree_;
 
   SampleComparator<SampleEntry> sort_comparator;
   sort_comparator.AddCompareFunction(CompareTotalPeriod);
@@ -928,43 +1149,155 @@ bool ReportCommand::ReadSampleTreeFromRecordFile() {
   sample_tree_builder_options_.use_caller_as_callchain_root = !callgraph_show_callee_;
   sample_tree_builder_options_.trace_offcpu = trace_offcpu_;
 
+  size_t thread_count = SampleTreeBuildingThreadCount();
+  if (thread_count > 1) {
+    return ReadSampleTreeInParallel(thread_count) && BuildSampleTrees();
+  }
+  if (jobs_ > 1) {
+    // Samples are processed in one thread. Load symbols of hit dsos in parallel beforehand, so
+    // processing samples doesn't stall on loading symbols of each new dso.
+    Dso::LoadSymbolsInParallel(thread_tree_.GetAllDsos(), jobs_);
+  }
+  CreateSampleTreeBuilders(thread_tree_, sample_tree_builder_);
+  if (trace_offcpu_) {
+    // Samples are kept by sample tree builders in trace offcpu mode, so they need to own memory.
+    if (!record_file_reader_->ReadDataSection(
+            [this](std::unique_ptr<Record> record) { return ProcessRecord(std::move(record)); })) {
+      return false;
+    }
+  } else {
+    RecordArena arena;
+    std::vector<Record*> records;
+    while (true) {
+      if (!record_file_reader_->ReadRecordBatch(arena, RecordFileReader::kRecordBatchSize,
+                                                records)) {
+        return false;
+      }
+      if (records.empty()) {
+        break;
+      }
+      for (Record* record : records) {
+        if (!ProcessRecord(*record)) {
+          return false;
+        }
+      }
+    }
+  }
+  return BuildSampleTrees();
+}
+
+bool ReportCommand::BuildSampleTrees() {
+  for (size_t i = 0; i < sample_tree_builder_.size(); ++i) {
+    sample_tree_.push_back(sample_tree_builder_[i]->GetSampleTree());
+    sample_tree_sorter_->Sort(sample_tree_.back().samples, print_callgraph_);
+  }
+  return true;
+}
+
+void ReportCommand::CreateSampleTreeBuilders(
+    ThreadTree& thread_tree, std::vector<std::unique_ptr<ReportCmdSampleTreeBuilder>>& builders) {
   for (size_t i = 0; i < event_attrs_.size(); ++i) {
-    sample_tree_builder_.push_back(
-        sample_tree_builder_options_.CreateSampleTreeBuilder(*record_file_reader_));
-    sample_tree_builder_.back()->SetEventName(attr_names_[i]);
-    OfflineUnwinder* unwinder = sample_tree_builder_.back()->GetUnwinder();
+    builders.push_back(
+        sample_tree_builder_options_.CreateSampleTreeBuilder(*record_file_reader_, &thread_tree));
+    builders.back()->SetEventName(attr_names_[i]);
+    OfflineUnwinder* unwinder = builders.back()->GetUnwinder();
     if (unwinder != nullptr) {
       unwinder->LoadMetaInfo(record_file_reader_->GetMetaInfoFeature());
     }
   }
+}
+
+size_t ReportCommand::SampleTreeBuildingThreadCount() {
+  if (jobs_ <= 1 || trace_offcpu_) {
+    // In trace offcpu mode, the period of a sample depends on the next sample in the same thread.
+    return 1;
+  }
+  for (const auto& attr : event_attrs_) {
+    if (attr.sample_type & PERF_SAMPLE_READ) {
+      // Event counts of a sample depend on the previous sample having the same event id.
+      LOG(INFO) << "Build sample trees in one thread for samples with event counts.";
+      return 1;
+    }
+  }
+  return jobs_;
+}
 
-  if (!record_file_reader_->ReadDataSection(
-          [this](std::unique_ptr<Record> record) { return ProcessRecord(std::move(record)); })) {
+bool ReportCommand::ReadSampleTreeInParallel(size_t thread_count) {
+  parallel_sample_tree_builder_ = std::make_unique<ParallelSampleTreeBuilder>();
+  auto worker_init = [this](ThreadTree& thread_tree,
+                            ParallelSampleTreeBuilder::SampleTreeBuilders& builders) {
+    if (show_ip_for_unknown_symbol_) {
+      thread_tree.ShowIpForUnknownSymbol();
+    }
+    if (!record_file_reader_->LoadBuildIdAndFileFeatures(thread_tree)) {
+      return false;
+    }
+    CreateSampleTreeBuilders(thread_tree, builders);
+    return true;
+  };
+  if (!parallel_sample_tree_builder_->Start(thread_count, worker_init)) {
     return false;
   }
-  for (size_t i = 0; i < sample_tree_builder_.size(); ++i) {
-    sample_tree_.push_back(sample_tree_builder_[i]->GetSampleTree());
-    sample_tree_sorter_->Sort(sample_tree_.back().samples, print_callgraph_);
+  while (true) {
+    auto batch = std::make_shared<ParallelSampleTreeBuilder::RecordBatch>();
+    if (!record_file_reader_->ReadRecordBatch(batch->arena, RecordFileReader::kRecordBatchSize,
+                                              batch->records)) {
+      return false;
+    }
+    if (batch->records.empty()) {
+      break;
+    }
+    batch->attr_ids.resize(batch->records.size(), ParallelSampleTreeBuilder::kSkipRecord);
+    for (size_t i = 0; i < batch->records.size(); i++) {
+      Record& record = *batch->records[i];
+      if (record.type() == SIMPLE_PERF_RECORD_KERNEL_SYMBOL) {
+        // Kernel symbols are shared by all thread trees. So wait until workers don't use them.
+        parallel_sample_tree_builder_->WaitForIdle();
+      }
+      // The thread tree in the main thread is used by record_filter_.
+      thread_tree_.Update(record);
+      if (record.type() == PERF_RECORD_SAMPLE) {
+        if (record_filter_.Check(static_cast<SampleRecord&>(record))) {
+          batch->attr_ids[i] = record_file_reader_->GetAttrIndexOfRecord(&record);
+        }
+      } else if (record.type() == PERF_RECORD_TRACING_DATA ||
+                 record.type() == SIMPLE_PERF_RECORD_TRACING_DATA) {
+        const auto& r = static_cast<TracingDataRecord&>(record);
+        if (!ProcessTracingData(std::vector<char>(r.data, r.data + r.data_size))) {
+          return false;
+        }
+      }
+    }
+    parallel_sample_tree_builder_->AddBatch(std::move(batch));
   }
+  sample_tree_builder_ = parallel_sample_tree_builder_->Finish();
   return true;
 }
 
 bool ReportCommand::ProcessRecord(std::unique_ptr<Record> record) {
-  thread_tree_.Update(*record);
-  if (record->type() == PERF_RECORD_SAMPLE) {
-    if (!record_filter_.Check(static_cast<SampleRecord&>(*record))) {
-      return true;
-    }
-    size_t attr_id = record_file_reader_->GetAttrIndexOfRecord(record.get());
-    if (!trace_offcpu_) {
-      sample_tree_builder_[attr_id]->ReportCmdProcessSampleRecord(
-          *static_cast<SampleRecord*>(record.get()));
-    } else {
+  if (trace_offcpu_ && record->type() == PERF_RECORD_SAMPLE) {
+    thread_tree_.Update(*record);
+    if (record_filter_.Check(static_cast<SampleRecord&>(*record))) {
+      size_t attr_id = record_file_reader_->GetAttrIndexOfRecord(record.get());
       ProcessSampleRecordInTraceOffCpuMode(std::move(record), attr_id);
     }
-  } else if (record->type() == PERF_RECORD_TRACING_DATA ||
-             record->type() == SIMPLE_PERF_RECORD_TRACING_DATA) {
-    const auto& r = *static_cast<TracingDataRecord*>(record.get());
+    return true;
+  }
+  return ProcessRecord(*record);
+}
+
+bool ReportCommand::ProcessRecord(Record& record) {
+  thread_tree_.Update(record);
+  if (record.type() == PERF_RECORD_SAMPLE) {
+    if (!record_filter_.Check(static_cast<SampleRecord&>(record))) {
+      return true;
+    }
+    size_t attr_id = record_file_reader_->GetAttrIndexOfRecord(&record);
+    sample_tree_builder_[attr_id]->ReportCmdProcessSampleRecord(
+        static_cast<const SampleRecord&>(record));
+  } else if (record.type() == PERF_RECORD_TRACING_DATA ||
+             record.type() == SIMPLE_PERF_RECORD_TRACING_DATA) {
+    const auto& r = static_cast<TracingDataRecord&>(record);
     if (!ProcessTracingData(std::vector<char>(r.data, r.data + r.data_size))) {
       return false;
     }
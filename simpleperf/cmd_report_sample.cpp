@@ -16,8 +16,12 @@
 
 #include <inttypes.h>
 
+#include <condition_variable>
+#include <deque>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include <android-base/strings.h>
 
@@ -153,6 +157,216 @@ struct ThreadData {
   std::queue<SampleEntry> stack_gap_samples;
 };
 
+// File id and symbol id of a callchain entry in protobuf output.
+struct CallChainEntryDumpId {
+  uint32_t file_id;
+  int32_t symbol_id;
+};
+
+// A sample to be written in protobuf output. Dump ids are assigned in the order of reporting
+// samples, so they are assigned before converting the sample to a protobuf record.
+struct ProtobufSample {
+  ThreadId thread_id;
+  SampleEntry sample;
+  std::vector<CallChainEntryDumpId> dump_ids;
+};
+
+static void AddUnwindingResultInProtobuf(const UnwindingResult& unwinding_result,
+                                         proto::Sample_UnwindingResult* proto_unwinding_result);
+
+static void ToProtobufRecord(const ProtobufSample& sample, bool show_execution_type,
+                             proto::Record* proto_record) {
+  proto::Sample* proto_sample = proto_record->mutable_sample();
+  proto_sample->set_time(sample.sample.time);
+  proto_sample->set_event_count(sample.sample.period);
+  proto_sample->set_thread_id(sample.thread_id.tid);
+  proto_sample->set_event_type_id(sample.sample.event_type_id);
+
+  const std::vector<CallChainReportEntry>& callchain = sample.sample.callchain;
+  for (size_t i = 0; i < callchain.size(); i++) {
+    proto::Sample_CallChainEntry* proto_entry = proto_sample->add_callchain();
+    proto_entry->set_vaddr_in_file(callchain[i].vaddr_in_file);
+    proto_entry->set_file_id(sample.dump_ids[i].file_id);
+    proto_entry->set_symbol_id(sample.dump_ids[i].symbol_id);
+    if (show_execution_type) {
+      proto_entry->set_execution_type(ToProtoExecutionType(callchain[i].execution_type));
+    }
+  }
+  if (sample.sample.unwinding_result.has_value()) {
+    AddUnwindingResultInProtobuf(sample.sample.unwinding_result.value(),
+                                 proto_sample->mutable_unwinding_result());
+  }
+}
+
+// Append a record to output in the format of protobuf output: a 32-bit little endian size
+// followed by the serialized record.
+static void AppendProtobufRecord(const proto::Record& proto_record, std::string* output) {
+  uint32_t size = static_cast<uint32_t>(proto_record.ByteSizeLong());
+  uint8_t size_buf[sizeof(uint32_t)];
+  google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(size, size_buf);
+  output->append(reinterpret_cast<const char*>(size_buf), sizeof(size_buf));
+  proto_record.AppendToString(output);
+}
+
+// Convert samples to protobuf records and serialize them in worker threads, while the main thread
+// reads and symbolizes samples. Serialized records are written in the order they are added, so the
+// output is the same as serializing in the main thread.
+class ParallelProtobufWriter {
+ public:
+  ParallelProtobufWriter(google::protobuf::io::CodedOutputStream* coded_os, size_t thread_count,
+                         bool show_execution_type)
+      : coded_os_(coded_os), show_execution_type_(show_execution_type) {
+    for (size_t i = 0; i < thread_count; i++) {
+      threads_.emplace_back(&ParallelProtobufWriter::RunWorker, this);
+    }
+    max_pending_batches_ = thread_count * 2;
+  }
+
+  ~ParallelProtobufWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_cond_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  bool AddSample(ProtobufSample&& sample) {
+    GetCurrentBatch().items.emplace_back(Item{std::move(sample), {}});
+    return MaySubmitCurrentBatch();
+  }
+
+  // Add a record not needing much work to serialize, like a context switch record.
+  bool AddRecord(const proto::Record& proto_record) {
+    Item item;
+    AppendProtobufRecord(proto_record, &item.data);
+    GetCurrentBatch().items.emplace_back(std::move(item));
+    return MaySubmitCurrentBatch();
+  }
+
+  // Write all records added.
+  bool Flush() {
+    if (current_batch_) {
+      SubmitCurrentBatch();
+    }
+    while (!pending_batches_.empty()) {
+      if (!WriteFirstPendingBatch()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  struct Item {
+    std::optional<ProtobufSample> sample;
+    // Serialized record, if the record isn't a sample.
+    std::string data;
+  };
+
+  struct Batch {
+    std::vector<Item> items;
+    std::string output;
+    // Protected by mutex_.
+    bool done = false;
+  };
+
+  static constexpr size_t kSamplesPerBatch = 1024;
+
+  Batch& GetCurrentBatch() {
+    if (!current_batch_) {
+      current_batch_ = std::make_shared<Batch>();
+      current_batch_->items.reserve(kSamplesPerBatch);
+    }
+    return *current_batch_;
+  }
+
+  bool MaySubmitCurrentBatch() {
+    if (current_batch_->items.size() < kSamplesPerBatch) {
+      return true;
+    }
+    SubmitCurrentBatch();
+    // Limit memory used by batches not written.
+    while (pending_batches_.size() > max_pending_batches_) {
+      if (!WriteFirstPendingBatch()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void SubmitCurrentBatch() {
+    pending_batches_.push_back(current_batch_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      work_queue_.push_back(std::move(current_batch_));
+    }
+    work_cond_.notify_one();
+    current_batch_.reset();
+  }
+
+  bool WriteFirstPendingBatch() {
+    std::shared_ptr<Batch> batch = std::move(pending_batches_.front());
+    pending_batches_.pop_front();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_cond_.wait(lock, [&]() { return batch->done; });
+    }
+    coded_os_->WriteRaw(batch->output.data(), static_cast<int>(batch->output.size()));
+    if (coded_os_->HadError()) {
+      LOG(ERROR) << "failed to write record to protobuf";
+      return false;
+    }
+    return true;
+  }
+
+  void RunWorker() {
+    while (true) {
+      std::shared_ptr<Batch> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cond_.wait(lock, [&]() { return stop_ || !work_queue_.empty(); });
+        if (stop_) {
+          return;
+        }
+        batch = std::move(work_queue_.front());
+        work_queue_.pop_front();
+      }
+      for (Item& item : batch->items) {
+        if (item.sample) {
+          proto::Record proto_record;
+          ToProtobufRecord(item.sample.value(), show_execution_type_, &proto_record);
+          AppendProtobufRecord(proto_record, &batch->output);
+        } else {
+          batch->output += item.data;
+        }
+      }
+      batch->items.clear();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch->done = true;
+      }
+      done_cond_.notify_all();
+    }
+  }
+
+  google::protobuf::io::CodedOutputStream* coded_os_;
+  const bool show_execution_type_;
+  size_t max_pending_batches_;
+  // Only accessed in the main thread.
+  std::shared_ptr<Batch> current_batch_;
+  std::deque<std::shared_ptr<Batch>> pending_batches_;
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_cond_;
+  std::condition_variable done_cond_;
+  std::deque<std::shared_ptr<Batch>> work_queue_;
+  bool stop_ = false;
+};
+
 class ReportSampleCommand : public Command {
  public:
   ReportSampleCommand()
@@ -163,6 +377,9 @@ class ReportSampleCommand : public Command {
 "--dump-protobuf-report <file>      Dump report file generated by\n"
 "                                   `simpleperf report-sample --protobuf -o <file>`.\n"
 "-i <file>                          Specify path of record file, default is perf.data.\n"
+"-j <jobs>                          Load symbols of hit binaries in jobs threads before reporting\n"
+"                                   samples. With --protobuf, also convert samples to protobuf\n"
+"                                   records in jobs - 1 threads. Default is 1.\n"
 "-o report_file_name                Set report file name. When --protobuf is used, default is\n"
 "                                   report_sample.trace. Otherwise, default writes to stdout.\n"
 "--proguard-mapping-file <file>     Add proguard mapping file to de-obfuscate symbols.\n"
@@ -178,6 +395,9 @@ class ReportSampleCommand : public Command {
 "--show-art-frames                  Show frames of internal methods in the ART Java interpreter.\n"
 "--show-callchain                   Show callchain with samples.\n"
 "--show-execution-type              Show execution type of a method\n"
+"--symbol-cache-dir <dir>           Store symbol tables read from binaries in <dir>, keyed by\n"
+"                                   build id. Later runs load symbols from the cache instead of\n"
+"                                   parsing binaries.\n"
 "--symdir <dir>                     Look for files with symbols in a directory recursively.\n"
 "\n"
 "Sample filter options:\n"
@@ -208,11 +428,10 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_REPORTING
   void UpdateThreadName(uint32_t pid, uint32_t tid);
   bool ProcessSampleRecord(const SampleRecord& r);
   bool ProcessSample(const ThreadEntry& thread, SampleEntry& sample);
-  bool ReportSample(const ThreadId& thread_id, const SampleEntry& sample, size_t stack_gap_length);
+  bool ReportSample(const ThreadId& thread_id, SampleEntry& sample, size_t stack_gap_length);
   bool FinishReportSamples();
-  bool PrintSampleInProtobuf(const ThreadId& thread_id, const SampleEntry& sample);
-  void AddUnwindingResultInProtobuf(const UnwindingResult& unwinding_result,
-                                    proto::Sample_UnwindingResult* proto_unwinding_result);
+  // The sample is moved to the protobuf writer.
+  bool PrintSampleInProtobuf(const ThreadId& thread_id, SampleEntry& sample);
   bool ProcessSwitchRecord(Record* r);
   bool WriteRecordInProtobuf(proto::Record& proto_record);
   bool PrintLostSituationInProtobuf();
@@ -230,6 +449,7 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_REPORTING
   std::string report_filename_;
   FILE* report_fp_;
   google::protobuf::io::CodedOutputStream* coded_os_;
+  std::unique_ptr<ParallelProtobufWriter> parallel_protobuf_writer_;
   size_t sample_count_;
   size_t lost_count_;
   bool trace_offcpu_;
@@ -242,6 +462,7 @@ RECORD_FILTER_OPTION_HELP_MSG_FOR_REPORTING
   std::unique_ptr<UnwindingResultRecord> last_unwinding_result_;
   RecordFilter record_filter_;
   uint32_t max_remove_gap_length_ = 3;
+  size_t jobs_ = 1;
 };
 
 bool ReportSampleCommand::Run(const std::vector<std::string>& args) {
@@ -271,6 +492,9 @@ bool ReportSampleCommand::Run(const std::vector<std::string>& args) {
   if (!OpenRecordFile()) {
     return false;
   }
+  if (jobs_ > 1) {
+    Dso::LoadSymbolsInParallel(thread_tree_.GetAllDsos(), jobs_);
+  }
   if (use_protobuf_) {
     GOOGLE_PROTOBUF_VERIFY_VERSION;
   } else {
@@ -292,6 +516,10 @@ bool ReportSampleCommand::Run(const std::vector<std::string>& args) {
     protobuf_os.reset(new google::protobuf::io::CopyingOutputStreamAdaptor(protobuf_writer.get()));
     protobuf_coded_os.reset(new google::protobuf::io::CodedOutputStream(protobuf_os.get()));
     coded_os_ = protobuf_coded_os.get();
+    if (jobs_ > 1) {
+      parallel_protobuf_writer_.reset(
+          new ParallelProtobufWriter(coded_os_, jobs_ - 1, show_execution_type_));
+    }
   }
 
   // 6. Read record file, and print samples online.
@@ -308,6 +536,12 @@ bool ReportSampleCommand::Run(const std::vector<std::string>& args) {
   }
 
   if (use_protobuf_) {
+    if (parallel_protobuf_writer_) {
+      if (!parallel_protobuf_writer_->Flush()) {
+        return false;
+      }
+      parallel_protobuf_writer_.reset();
+    }
     if (!PrintLostSituationInProtobuf()) {
       return false;
     }
@@ -338,6 +572,7 @@ bool ReportSampleCommand::ParseOptions(const std::vector<std::string>& args) {
   OptionFormatMap option_formats = {
       {"--dump-protobuf-report", {OptionValueType::STRING, OptionType::SINGLE}},
       {"-i", {OptionValueType::STRING, OptionType::SINGLE}},
+      {"-j", {OptionValueType::UINT, OptionType::SINGLE}},
       {"-o", {OptionValueType::STRING, OptionType::SINGLE}},
       {"--proguard-mapping-file", {OptionValueType::STRING, OptionType::MULTIPLE}},
       {"--protobuf", {OptionValueType::NONE, OptionType::SINGLE}},
@@ -346,6 +581,7 @@ bool ReportSampleCommand::ParseOptions(const std::vector<std::string>& args) {
       {"--remove-unknown-kernel-symbols", {OptionValueType::NONE, OptionType::SINGLE}},
       {"--show-art-frames", {OptionValueType::NONE, OptionType::SINGLE}},
       {"--show-execution-type", {OptionValueType::NONE, OptionType::SINGLE}},
+      {"--symbol-cache-dir", {OptionValueType::STRING, OptionType::SINGLE}},
       {"--symdir", {OptionValueType::STRING, OptionType::MULTIPLE}},
   };
   OptionFormatMap record_filter_options = GetRecordFilterOptionFormats(false);
@@ -357,6 +593,9 @@ bool ReportSampleCommand::ParseOptions(const std::vector<std::string>& args) {
   }
   options.PullStringValue("--dump-protobuf-report", &dump_protobuf_report_file_);
   options.PullStringValue("-i", &record_filename_);
+  if (!options.PullUintValue("-j", &jobs_, 1)) {
+    return false;
+  }
   options.PullStringValue("-o", &report_filename_);
   for (const OptionValue& value : options.PullValues("--proguard-mapping-file")) {
     if (!callchain_report_builder_.AddProguardMappingFile(*value.str_value)) {
@@ -373,6 +612,11 @@ bool ReportSampleCommand::ParseOptions(const std::vector<std::string>& args) {
     callchain_report_builder_.SetRemoveArtFrame(false);
   }
   show_execution_type_ = options.PullBoolValue("--show-execution-type");
+  if (auto value = options.PullValue("--symbol-cache-dir"); value) {
+    if (!Dso::SetSymbolCacheDir(*value->str_value)) {
+      return false;
+    }
+  }
   for (const OptionValue& value : options.PullValues("--symdir")) {
     if (!Dso::AddSymbolDir(*value.str_value)) {
       return false;
@@ -755,7 +999,7 @@ bool ReportSampleCommand::ProcessSample(const ThreadEntry& thread, SampleEntry&
   return ReportSample(thread_id, sample, 0);
 }
 
-bool ReportSampleCommand::ReportSample(const ThreadId& thread_id, const SampleEntry& sample,
+bool ReportSampleCommand::ReportSample(const ThreadId& thread_id, SampleEntry& sample,
                                        size_t stack_gap_length) {
   // Remove samples within a stack gap <= max_remove_gap_length_.
   if (stack_gap_length > 0 && stack_gap_length <= max_remove_gap_length_) {
@@ -783,17 +1027,11 @@ bool ReportSampleCommand::FinishReportSamples() {
   return true;
 }
 
-bool ReportSampleCommand::PrintSampleInProtobuf(const ThreadId& thread_id,
-                                                const SampleEntry& sample) {
-  proto::Record proto_record;
-  proto::Sample* proto_sample = proto_record.mutable_sample();
-  proto_sample->set_time(sample.time);
-  proto_sample->set_event_count(sample.period);
-  proto_sample->set_thread_id(thread_id.tid);
-  proto_sample->set_event_type_id(sample.event_type_id);
-
-  for (const auto& node : sample.callchain) {
-    proto::Sample_CallChainEntry* callchain = proto_sample->add_callchain();
+bool ReportSampleCommand::PrintSampleInProtobuf(const ThreadId& thread_id, SampleEntry& sample) {
+  ProtobufSample protobuf_sample{thread_id, std::move(sample), {}};
+  protobuf_sample.dump_ids.resize(protobuf_sample.sample.callchain.size());
+  for (size_t i = 0; i < protobuf_sample.sample.callchain.size(); i++) {
+    const CallChainReportEntry& node = protobuf_sample.sample.callchain[i];
     uint32_t file_id;
     if (!node.dso->GetDumpId(&file_id)) {
       file_id = node.dso->CreateDumpId();
@@ -804,23 +1042,18 @@ bool ReportSampleCommand::PrintSampleInProtobuf(const ThreadId& thread_id,
         symbol_id = node.dso->CreateSymbolDumpId(node.symbol);
       }
     }
-    callchain->set_vaddr_in_file(node.vaddr_in_file);
-    callchain->set_file_id(file_id);
-    callchain->set_symbol_id(symbol_id);
-    if (show_execution_type_) {
-      callchain->set_execution_type(ToProtoExecutionType(node.execution_type));
-    }
+    protobuf_sample.dump_ids[i] = {file_id, symbol_id};
   }
-  if (sample.unwinding_result.has_value()) {
-    AddUnwindingResultInProtobuf(sample.unwinding_result.value(),
-                                 proto_sample->mutable_unwinding_result());
+  if (parallel_protobuf_writer_) {
+    return parallel_protobuf_writer_->AddSample(std::move(protobuf_sample));
   }
+  proto::Record proto_record;
+  ToProtobufRecord(protobuf_sample, show_execution_type_, &proto_record);
   return WriteRecordInProtobuf(proto_record);
 }
 
-void ReportSampleCommand::AddUnwindingResultInProtobuf(
-    const UnwindingResult& unwinding_result,
-    proto::Sample_UnwindingResult* proto_unwinding_result) {
+static void AddUnwindingResultInProtobuf(const UnwindingResult& unwinding_result,
+                                         proto::Sample_UnwindingResult* proto_unwinding_result) {
   proto_unwinding_result->set_raw_error_code(unwinding_result.error_code);
   proto_unwinding_result->set_error_addr(unwinding_result.error_addr);
   proto::Sample_UnwindingResult_ErrorCode error_code;
@@ -892,6 +1125,9 @@ bool ReportSampleCommand::ProcessSwitchRecord(Record* r) {
 }
 
 bool ReportSampleCommand::WriteRecordInProtobuf(proto::Record& proto_record) {
+  if (parallel_protobuf_writer_) {
+    return parallel_protobuf_writer_->AddRecord(proto_record);
+  }
   coded_os_->WriteLittleEndian32(static_cast<uint32_t>(proto_record.ByteSizeLong()));
   if (!proto_record.SerializeToCodedStream(coded_os_)) {
     LOG(ERROR) << "failed to write record to protobuf";
@@ -299,3 +299,30 @@ TEST(cmd_report_sample, remove_gaps_option) {
   ASSERT_EQ(get_sample_count(data), 525);
   ASSERT_NE(data.find("sample_count: 525"), std::string::npos);
 }
+
+TEST(cmd_report_sample, jobs_option) {
+  std::string data;
+  GetProtobufReport(PERF_DATA_WITH_SYMBOLS, &data, {"--show-callchain"});
+  std::string parallel_data;
+  GetProtobufReport(PERF_DATA_WITH_SYMBOLS, &parallel_data, {"--show-callchain", "-j", "4"});
+  ASSERT_EQ(data, parallel_data);
+  ASSERT_FALSE(ReportSampleCmd()->Run({"-i", GetTestData(PERF_DATA_WITH_SYMBOLS), "-j", "0"}));
+}
+
+TEST(cmd_report_sample, jobs_option_writes_same_protobuf_file) {
+  // Samples are converted to protobuf records in multiple threads, mixed with context switch
+  // records.
+  auto get_protobuf_file = [](const std::string& jobs, std::string* data) {
+    TemporaryFile tmpfile;
+    ASSERT_TRUE(ReportSampleCmd()->Run({"-i", GetTestData("perf_with_trace_offcpu_v2.data"), "-o",
+                                        tmpfile.path, "--protobuf", "--show-callchain",
+                                        "--show-execution-type", "-j", jobs}));
+    ASSERT_TRUE(android::base::ReadFileToString(tmpfile.path, data));
+  };
+  std::string data;
+  get_protobuf_file("1", &data);
+  std::string parallel_data;
+  get_protobuf_file("4", &parallel_data);
+  ASSERT_FALSE(data.empty());
+  ASSERT_EQ(data, parallel_data);
+}
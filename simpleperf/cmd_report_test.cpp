@@ -16,6 +16,7 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <set>
 #include <unordered_map>
 
@@ -638,6 +639,31 @@ TEST_F(ReportCommandTest, filter_file_option) {
   ASSERT_NE(capture.str().find("doesn't match clock used in time filter"), std::string::npos);
 }
 
+TEST_F(ReportCommandTest, jobs_option) {
+  auto get_sorted_lines = [&]() {
+    std::vector<std::string> result = lines;
+    std::sort(result.begin(), result.end());
+    return result;
+  };
+  std::vector<std::vector<std::string>> args_list = {{}, {"--children"}, {"-g"}, {"-g", "callee"}};
+  for (const std::string& perf_data : {PERF_DATA_GENERATED_BY_LINUX_PERF, CALLGRAPH_FP_PERF_DATA}) {
+    for (const auto& args : args_list) {
+      Report(perf_data, args);
+      ASSERT_TRUE(success);
+      // Children of a callgraph node having the same period may be printed in a different order.
+      std::vector<std::string> expected_lines = get_sorted_lines();
+      for (const char* jobs : {"2", "4"}) {
+        std::vector<std::string> new_args = args;
+        new_args.insert(new_args.end(), {"-j", jobs});
+        Report(perf_data, new_args);
+        ASSERT_TRUE(success);
+        ASSERT_EQ(get_sorted_lines(), expected_lines);
+      }
+    }
+  }
+  ASSERT_FALSE(ReportCmd()->Run({"-j", "0"}));
+}
+
 #if defined(__linux__)
 #include "event_selection_set.h"
 
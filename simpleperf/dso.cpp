@@ -16,19 +16,28 @@
 
 #include "dso.h"
 
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/mapped_file.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 
 #include "JITDebugReader.h"
 #include "environment.h"
@@ -208,11 +217,18 @@ std::string DebugElfFileFinder::GetPathInSymFsDir(const std::string& path) {
 }  // namespace simpleperf_dso_impl
 
 static OneTimeFreeAllocator symbol_name_allocator;
+// Symbols can be created in multiple threads.
+static std::mutex symbol_name_allocator_mutex;
+
+static const char* AllocateSymbolName(std::string_view name) {
+  std::lock_guard<std::mutex> lock(symbol_name_allocator_mutex);
+  return symbol_name_allocator.AllocateString(name);
+}
 
 Symbol::Symbol(std::string_view name, uint64_t addr, uint64_t len)
     : addr(addr),
       len(len),
-      name_(symbol_name_allocator.AllocateString(name)),
+      name_(AllocateSymbolName(name)),
       demangled_name_(nullptr),
       dump_id_(UINT_MAX) {}
 
@@ -228,7 +244,7 @@ void Symbol::SetDemangledName(std::string_view name) const {
   if (name == name_) {
     demangled_name_ = name_;
   } else {
-    demangled_name_ = symbol_name_allocator.AllocateString(name);
+    demangled_name_ = AllocateSymbolName(name);
   }
 }
 
@@ -250,17 +266,16 @@ static bool CompareSymbolToAddr(const Symbol& s, uint64_t addr) {
   return s.addr < addr;
 }
 
-static bool CompareAddrToSymbol(uint64_t addr, const Symbol& s) {
-  return addr < s.addr;
-}
-
 bool Dso::demangle_ = true;
 std::string Dso::vmlinux_;
 std::string Dso::kallsyms_;
+std::string Dso::symbol_cache_dir_;
+bool Dso::share_symbols_ = false;
 std::unordered_map<std::string, BuildId> Dso::build_id_map_;
-size_t Dso::dso_count_;
+std::atomic<size_t> Dso::dso_count_;
 uint32_t Dso::g_dump_id_;
 simpleperf_dso_impl::DebugElfFileFinder Dso::debug_elf_file_finder_;
+static thread_local std::optional<std::unordered_map<std::string, BuildId>> thread_build_id_map;
 
 void Dso::SetDemangle(bool demangle) {
   demangle_ = demangle;
@@ -324,13 +339,217 @@ void Dso::SetVmlinux(const std::string& vmlinux) {
   vmlinux_ = vmlinux;
 }
 
+bool Dso::SetSymbolCacheDir(const std::string& cache_dir) {
+  if (!IsDir(cache_dir) && !MkdirWithParents(cache_dir + OS_PATH_SEPARATOR)) {
+    LOG(ERROR) << "failed to create symbol cache dir " << cache_dir;
+    return false;
+  }
+  symbol_cache_dir_ = simpleperf_dso_impl::RemovePathSeparatorSuffix(cache_dir);
+  return true;
+}
+
+// A symbol cache file contains a SymbolCacheHeader, an array of SymbolCacheEntry sorted by addr,
+// and a string table of null terminated names. It is mapped into memory when loaded, and the
+// names are used in place.
+// The cache is keyed only by build id, so it is only filled from ELF files having a .symtab
+// section. Otherwise the partial symbols of a stripped file (read from .dynsym or
+// .gnu_debugdata) would hide the full symbols of an unstripped file with the same build id.
+static constexpr char SYMBOL_CACHE_MAGIC[8] = {'S', 'Y', 'M', 'C', 'A', 'C', 'H', 'E'};
+// Version 1 may contain symbols of stripped files.
+static constexpr uint32_t SYMBOL_CACHE_VERSION = 2;
+static constexpr uint32_t SYMBOL_CACHE_FLAG_DEMANGLED = 1;
+
+struct SymbolCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dso_type;
+  uint32_t flags;
+  uint32_t symbol_count;
+  uint64_t string_table_size;
+};
+
+struct SymbolCacheEntry {
+  uint64_t addr;
+  uint64_t len;
+  uint32_t name_offset;
+  uint32_t demangled_name_offset;
+};
+
+// Mapped symbol cache files are kept until all dsos are destroyed, since symbol names point to
+// them.
+static std::vector<std::unique_ptr<android::base::MappedFile>> symbol_cache_files;
+static std::mutex symbol_cache_files_mutex;
+
+// Symbols read from a file, shared by dsos created for the file when share_symbols_ is set.
+struct SharedSymbols {
+  std::once_flag once;
+  std::vector<Symbol> symbols;
+};
+
+static std::unordered_map<std::string, std::shared_ptr<SharedSymbols>> shared_symbols_map;
+static std::mutex shared_symbols_mutex;
+
+static bool HasSymtabSection(ElfFile* elf) {
+  for (const ElfSection& section : elf->GetSectionHeader()) {
+    if (section.name == ".symtab" && section.size != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::string GetSymbolCacheFilePath(const std::string& cache_dir, const BuildId& build_id) {
+  // Remove "0x" prefix.
+  return cache_dir + OS_PATH_SEPARATOR + build_id.ToString().substr(2) + ".symbols";
+}
+
+bool Dso::LoadSymbolsFromCache(const BuildId& build_id, std::vector<Symbol>* symbols) {
+  if (symbol_cache_dir_.empty() || build_id.IsEmpty()) {
+    return false;
+  }
+  std::string path = GetSymbolCacheFilePath(symbol_cache_dir_, build_id);
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_BINARY)));
+  if (fd == -1) {
+    return false;
+  }
+  uint64_t file_size = GetFileSize(path);
+  if (file_size < sizeof(SymbolCacheHeader)) {
+    LOG(DEBUG) << "invalid symbol cache file " << path;
+    return false;
+  }
+  auto map = android::base::MappedFile::FromFd(fd, 0, file_size, PROT_READ);
+  if (!map) {
+    PLOG(DEBUG) << "failed to map " << path;
+    return false;
+  }
+  const char* data = map->data();
+  const SymbolCacheHeader* header = reinterpret_cast<const SymbolCacheHeader*>(data);
+  if (memcmp(header->magic, SYMBOL_CACHE_MAGIC, sizeof(SYMBOL_CACHE_MAGIC)) != 0 ||
+      header->version != SYMBOL_CACHE_VERSION || header->dso_type != type_) {
+    LOG(DEBUG) << "symbol cache file " << path << " doesn't match " << path_;
+    return false;
+  }
+  uint64_t entries_size = static_cast<uint64_t>(header->symbol_count) * sizeof(SymbolCacheEntry);
+  if (file_size != sizeof(SymbolCacheHeader) + entries_size + header->string_table_size ||
+      (header->string_table_size != 0 && data[file_size - 1] != '\0')) {
+    LOG(DEBUG) << "invalid symbol cache file " << path;
+    return false;
+  }
+  const SymbolCacheEntry* entries =
+      reinterpret_cast<const SymbolCacheEntry*>(data + sizeof(SymbolCacheHeader));
+  const char* strings = data + sizeof(SymbolCacheHeader) + entries_size;
+  bool use_demangled_name = demangle_ && (header->flags & SYMBOL_CACHE_FLAG_DEMANGLED);
+
+  std::vector<Symbol> result;
+  result.reserve(header->symbol_count);
+  for (uint32_t i = 0; i < header->symbol_count; i++) {
+    const SymbolCacheEntry& entry = entries[i];
+    if (entry.name_offset >= header->string_table_size ||
+        entry.demangled_name_offset >= header->string_table_size) {
+      LOG(DEBUG) << "invalid symbol cache file " << path;
+      return false;
+    }
+    const char* name = strings + entry.name_offset;
+    const char* demangled_name =
+        use_demangled_name ? strings + entry.demangled_name_offset : nullptr;
+    result.push_back(Symbol(name, demangled_name, entry.addr, entry.len));
+  }
+  {
+    std::lock_guard<std::mutex> lock(symbol_cache_files_mutex);
+    symbol_cache_files.emplace_back(std::move(map));
+  }
+  LOG(VERBOSE) << "Read symbols of " << path_ << " from symbol cache " << path;
+  *symbols = std::move(result);
+  return true;
+}
+
+void Dso::SaveSymbolsToCache(const BuildId& build_id, const std::vector<Symbol>& symbols) {
+  if (symbol_cache_dir_.empty() || build_id.IsEmpty() || symbols.empty()) {
+    return;
+  }
+  std::string strings;
+  std::unordered_map<std::string_view, uint32_t> string_offsets;
+  auto add_string = [&](const char* s) {
+    auto it = string_offsets.find(s);
+    if (it != string_offsets.end()) {
+      return it->second;
+    }
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings.append(s, strlen(s) + 1);
+    // The key points to the symbol name, which outlives this function.
+    string_offsets.emplace(s, offset);
+    return offset;
+  };
+  std::vector<SymbolCacheEntry> entries;
+  entries.reserve(symbols.size());
+  for (const Symbol& symbol : symbols) {
+    SymbolCacheEntry& entry = entries.emplace_back();
+    entry.addr = symbol.addr;
+    entry.len = symbol.len;
+    entry.name_offset = add_string(symbol.Name());
+    entry.demangled_name_offset =
+        demangle_ ? add_string(symbol.DemangledName()) : entry.name_offset;
+    if (strings.size() > UINT32_MAX) {
+      LOG(DEBUG) << "too many symbols to cache for " << path_;
+      return;
+    }
+  }
+  SymbolCacheHeader header;
+  memcpy(header.magic, SYMBOL_CACHE_MAGIC, sizeof(SYMBOL_CACHE_MAGIC));
+  header.version = SYMBOL_CACHE_VERSION;
+  header.dso_type = type_;
+  header.flags = demangle_ ? SYMBOL_CACHE_FLAG_DEMANGLED : 0;
+  header.symbol_count = static_cast<uint32_t>(entries.size());
+  header.string_table_size = strings.size();
+
+  std::string data;
+  data.reserve(sizeof(header) + entries.size() * sizeof(SymbolCacheEntry) + strings.size());
+  data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  data.append(reinterpret_cast<const char*>(entries.data()),
+              entries.size() * sizeof(SymbolCacheEntry));
+  data.append(strings);
+
+  // Write to a temporary file and rename it, so other processes sharing the cache dir never see
+  // a partially written cache file.
+  std::string path = GetSymbolCacheFilePath(symbol_cache_dir_, build_id);
+  TemporaryFile tmpfile(symbol_cache_dir_);
+  if (tmpfile.fd == -1 || !android::base::WriteFully(tmpfile.fd, data.data(), data.size())) {
+    PLOG(DEBUG) << "failed to write symbol cache file for " << path_;
+    return;
+  }
+#if !defined(_WIN32)
+  // Let other users sharing the cache dir read it.
+  fchmod(tmpfile.fd, 0644);
+#endif
+  tmpfile.DoNotRemove();
+  close(tmpfile.release());
+  if (rename(tmpfile.path, path.c_str()) != 0) {
+    PLOG(DEBUG) << "failed to rename " << tmpfile.path << " to " << path;
+    unlink(tmpfile.path);
+    return;
+  }
+  LOG(VERBOSE) << "Saved symbols of " << path_ << " to symbol cache " << path;
+}
+
 void Dso::SetBuildIds(const std::vector<std::pair<std::string, BuildId>>& build_ids) {
   std::unordered_map<std::string, BuildId> map;
   for (auto& pair : build_ids) {
     LOG(DEBUG) << "build_id_map: " << pair.first << ", " << pair.second.ToString();
     map.insert(pair);
   }
-  build_id_map_ = std::move(map);
+  if (thread_build_id_map) {
+    thread_build_id_map = std::move(map);
+  } else {
+    build_id_map_ = std::move(map);
+  }
+}
+
+void Dso::UseThreadLocalBuildIds(bool enable) {
+  if (enable) {
+    thread_build_id_map.emplace();
+  } else {
+    thread_build_id_map.reset();
+  }
 }
 
 void Dso::SetVdsoFile(const std::string& vdso_file, bool is_64bit) {
@@ -338,8 +557,9 @@ void Dso::SetVdsoFile(const std::string& vdso_file, bool is_64bit) {
 }
 
 BuildId Dso::FindExpectedBuildIdForPath(const std::string& path) {
-  auto it = build_id_map_.find(path);
-  if (it != build_id_map_.end()) {
+  const auto& map = thread_build_id_map ? thread_build_id_map.value() : build_id_map_;
+  auto it = map.find(path);
+  if (it != map.end()) {
     return it->second;
   }
   return BuildId();
@@ -368,10 +588,23 @@ Dso::Dso(DsoType type, const std::string& path)
 Dso::~Dso() {
   if (--dso_count_ == 0) {
     // Clean up global variables when no longer used.
-    symbol_name_allocator.Clear();
+    {
+      std::lock_guard<std::mutex> lock(symbol_name_allocator_mutex);
+      symbol_name_allocator.Clear();
+    }
+    {
+      std::lock_guard<std::mutex> lock(symbol_cache_files_mutex);
+      symbol_cache_files.clear();
+    }
+    {
+      std::lock_guard<std::mutex> lock(shared_symbols_mutex);
+      shared_symbols_map.clear();
+    }
+    share_symbols_ = false;
     demangle_ = true;
     vmlinux_.clear();
     kallsyms_.clear();
+    symbol_cache_dir_.clear();
     build_id_map_.clear();
     g_dump_id_ = 0;
     debug_elf_file_finder_.Reset();
@@ -397,11 +630,33 @@ const Symbol* Dso::FindSymbol(uint64_t vaddr_in_dso) {
   if (!is_loaded_) {
     LoadSymbols();
   }
-  auto it = std::upper_bound(symbols_.begin(), symbols_.end(), vaddr_in_dso, CompareAddrToSymbol);
-  if (it != symbols_.begin()) {
-    --it;
-    if (it->addr <= vaddr_in_dso && (it->addr + it->len > vaddr_in_dso)) {
-      return &*it;
+  if (!symbols_.empty()) {
+    uint32_t pos = last_symbol_pos_.load(std::memory_order_relaxed);
+    const Symbol* symbol = &symbols_[pos];
+    if (symbol->addr <= vaddr_in_dso && symbol->addr + symbol->len > vaddr_in_dso &&
+        (pos + 1 == symbols_.size() || symbols_[pos + 1].addr > vaddr_in_dso)) {
+      return symbol;
+    }
+    // Find the first symbol starting after vaddr_in_dso. Prefetch the descendants three levels
+    // down, which are adjacent in memory. Don't form pointers past the end of symbol_addrs_.
+    const uint64_t* addrs = symbol_addrs_.data();
+    size_t n = symbols_.size();
+    size_t k = 1;
+    while (k <= n) {
+      if (k * 8 <= n) {
+        __builtin_prefetch(addrs + k * 8);
+      }
+      k = 2 * k + (addrs[k] <= vaddr_in_dso);
+    }
+    // Go back to the last node where we went left. It's 0 if there is no such node.
+    k >>= __builtin_ffsll(~k);
+    pos = symbol_index_[k];
+    if (pos != 0) {
+      symbol = &symbols_[--pos];
+      if (symbol->addr + symbol->len > vaddr_in_dso) {
+        last_symbol_pos_.store(pos, std::memory_order_relaxed);
+        return symbol;
+      }
     }
   }
   if (!unknown_symbols_.empty()) {
@@ -416,6 +671,29 @@ const Symbol* Dso::FindSymbol(uint64_t vaddr_in_dso) {
 void Dso::SetSymbols(std::vector<Symbol>* symbols) {
   symbols_ = std::move(*symbols);
   symbols->clear();
+  if (is_loaded_) {
+    BuildSymbolIndex();
+  }
+}
+
+void Dso::BuildSymbolIndex() {
+  size_t n = symbols_.size();
+  CHECK_LT(n, std::numeric_limits<uint32_t>::max());
+  symbol_addrs_.resize(n + 1);
+  symbol_index_.resize(n + 1);
+  symbol_index_[0] = n;
+  // Fill the tree by in-order traversal, which visits nodes in increasing address order.
+  size_t pos = 0;
+  std::function<void(size_t)> fill = [&](size_t k) {
+    if (k <= n) {
+      fill(2 * k);
+      symbol_addrs_[k] = symbols_[pos].addr;
+      symbol_index_[k] = pos++;
+      fill(2 * k + 1);
+    }
+  };
+  fill(1);
+  last_symbol_pos_ = 0;
 }
 
 void Dso::AddUnknownSymbol(uint64_t vaddr_in_dso, const std::string& name) {
@@ -438,10 +716,38 @@ bool Dso::IsForJavaMethod() const {
   return false;
 }
 
+void Dso::SetShareSymbols(bool share) {
+  share_symbols_ = share;
+  if (!share) {
+    std::lock_guard<std::mutex> lock(shared_symbols_mutex);
+    shared_symbols_map.clear();
+  }
+}
+
+std::vector<Symbol> Dso::LoadSharedSymbols() {
+  std::shared_ptr<SharedSymbols> shared;
+  {
+    std::lock_guard<std::mutex> lock(shared_symbols_mutex);
+    std::shared_ptr<SharedSymbols>& p = shared_symbols_map[std::to_string(type_) + ":" + path_];
+    if (!p) {
+      p = std::make_shared<SharedSymbols>();
+    }
+    shared = p;
+  }
+  // The first dso reads symbols from the file, others wait for it and copy the result. Symbol
+  // names are allocated globally, so copies stay valid after the shared symbols are cleared.
+  std::call_once(shared->once, [&]() { shared->symbols = LoadSymbolsImpl(); });
+  return shared->symbols;
+}
+
 void Dso::LoadSymbols() {
   if (!is_loaded_) {
     is_loaded_ = true;
-    std::vector<Symbol> symbols = LoadSymbolsImpl();
+    // Like LoadSymbolsInParallel(), kernel symbols depend on the state of each dso, so they
+    // aren't shared.
+    bool share = share_symbols_ && (type_ == DSO_ELF_FILE || type_ == DSO_KERNEL_MODULE ||
+                                    type_ == DSO_DEX_FILE);
+    std::vector<Symbol> symbols = share ? LoadSharedSymbols() : LoadSymbolsImpl();
     if (symbols_.empty()) {
       symbols_ = std::move(symbols);
     } else {
@@ -450,9 +756,57 @@ void Dso::LoadSymbols() {
                      std::back_inserter(merged_symbols), Symbol::CompareValueByAddr);
       symbols_ = std::move(merged_symbols);
     }
+    BuildSymbolIndex();
   }
 }
 
+void Dso::LoadSymbolsInParallel(const std::vector<Dso*>& dsos, size_t thread_count) {
+  std::vector<Dso*> dsos_to_load;
+  for (Dso* dso : dsos) {
+    // Kernel symbols depend on whether kernel addresses are fixed for kernel address
+    // randomization, which is only known when processing samples. And symbols of symbol map files
+    // aren't read from files.
+    if (!dso->is_loaded_ && (dso->type_ == DSO_ELF_FILE || dso->type_ == DSO_KERNEL_MODULE ||
+                             dso->type_ == DSO_DEX_FILE)) {
+      dsos_to_load.push_back(dso);
+    }
+  }
+  if (dsos_to_load.empty()) {
+    return;
+  }
+  if (thread_build_id_map) {
+    // Build ids set in the current thread aren't visible to other threads.
+    thread_count = 1;
+  }
+  thread_count = std::min(thread_count, dsos_to_load.size());
+  auto start_time = std::chrono::steady_clock::now();
+  std::atomic<size_t> next_index = 0;
+  auto load_symbols = [&]() {
+    while (true) {
+      size_t i = next_index++;
+      if (i >= dsos_to_load.size()) {
+        break;
+      }
+      Dso* dso = dsos_to_load[i];
+      dso->LoadSymbols();
+      for (const Symbol& symbol : dso->symbols_) {
+        symbol.DemangledName();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back(load_symbols);
+  }
+  load_symbols();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - start_time;
+  LOG(DEBUG) << "Loaded symbols of " << dsos_to_load.size() << " dsos in " << thread_count
+             << " threads, taking " << load_time.count() << " s";
+}
+
 static void ReportReadElfSymbolResult(
     ElfStatus result, const std::string& path, const std::string& debug_file_path,
     android::base::LogSeverity warning_loglevel = android::base::WARNING) {
@@ -633,6 +987,9 @@ class ElfDso : public Dso {
     }
     std::vector<Symbol> symbols;
     BuildId build_id = GetExpectedBuildId();
+    if (LoadSymbolsFromCache(build_id, &symbols)) {
+      return symbols;
+    }
     auto symbol_callback = [&](const ElfFileSymbol& symbol) {
       if (symbol.is_func || (symbol.is_label && symbol.is_in_text_section)) {
         symbols.emplace_back(symbol.name, symbol.vaddr, symbol.len);
@@ -655,6 +1012,9 @@ class ElfDso : public Dso {
     }
     ReportReadElfSymbolResult(status, path_, GetDebugFilePath(), log_level);
     SortAndFixSymbols(symbols);
+    if (status == ElfStatus::NO_ERROR && HasSymtabSection(elf.get())) {
+      SaveSymbolsToCache(build_id, symbols);
+    }
     return symbols;
   }
 
@@ -740,6 +1100,10 @@ class KernelDso : public Dso {
     // symbols in debug_file_path.
     symbols_.clear();
 
+    BuildId build_id = GetExpectedBuildId();
+    if (LoadSymbolsFromCache(build_id, symbols)) {
+      return;
+    }
     auto symbol_callback = [&](const ElfFileSymbol& symbol) {
       if (symbol.is_func) {
         symbols->emplace_back(symbol.name, symbol.vaddr, symbol.len);
@@ -747,6 +1111,12 @@ class KernelDso : public Dso {
     };
     status = elf->ParseSymbols(symbol_callback);
     ReportReadElfSymbolResult(status, path_, GetDebugFilePath());
+    if (status == ElfStatus::NO_ERROR) {
+      SortAndFixSymbols(*symbols);
+      if (HasSymtabSection(elf.get())) {
+        SaveSymbolsToCache(build_id, *symbols);
+      }
+    }
   }
 
   void ReadSymbolsFromKallsyms(std::string& kallsyms, std::vector<Symbol>* symbols) {
@@ -864,6 +1234,9 @@ class KernelModuleDso : public Dso {
   std::vector<Symbol> LoadSymbolsImpl() override {
     std::vector<Symbol> symbols;
     BuildId build_id = GetExpectedBuildId();
+    if (LoadSymbolsFromCache(build_id, &symbols)) {
+      return symbols;
+    }
     auto symbol_callback = [&](const ElfFileSymbol& symbol) {
       // We only know how to map ip addrs to symbols in text section.
       if (symbol.is_in_text_section && (symbol.is_label || symbol.is_func)) {
@@ -878,6 +1251,9 @@ class KernelModuleDso : public Dso {
     ReportReadElfSymbolResult(status, path_, GetDebugFilePath(),
                               symbols_.empty() ? android::base::WARNING : android::base::DEBUG);
     SortAndFixSymbols(symbols);
+    if (status == ElfStatus::NO_ERROR && HasSymtabSection(elf.get())) {
+      SaveSymbolsToCache(build_id, symbols);
+    }
     return symbols;
   }
 
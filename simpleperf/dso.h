@@ -17,6 +17,7 @@
 #ifndef SIMPLE_PERF_DSO_H_
 #define SIMPLE_PERF_DSO_H_
 
+#include <atomic>
 #include <memory>
 #include <optional>
 #include <string>
@@ -92,6 +93,10 @@ struct Symbol {
   static bool CompareValueByAddr(const Symbol& s1, const Symbol& s2) { return s1.addr < s2.addr; }
 
  private:
+  // Used for symbols loaded from the symbol cache, whose names are already in memory.
+  Symbol(const char* name, const char* demangled_name, uint64_t addr, uint64_t len)
+      : addr(addr), len(len), name_(name), demangled_name_(demangled_name), dump_id_(UINT_MAX) {}
+
   const char* name_;
   mutable const char* demangled_name_;
   mutable uint32_t dump_id_;
@@ -122,6 +127,10 @@ class Dso {
   // be searched recursively to build a build_id_map.
   static bool AddSymbolDir(const std::string& symbol_dir);
   static void SetVmlinux(const std::string& vmlinux);
+  // SymbolCacheDir is used to store sorted and demangled symbol tables of ELF files having a
+  // .symtab section, keyed by build id. Later sessions map them from the cache instead of parsing
+  // the ELF files again.
+  static bool SetSymbolCacheDir(const std::string& cache_dir);
   static void SetKallsyms(std::string kallsyms) {
     if (!kallsyms.empty()) {
       kallsyms_ = std::move(kallsyms);
@@ -129,6 +138,9 @@ class Dso {
   }
   static void SetBuildIds(const std::vector<std::pair<std::string, BuildId>>& build_ids);
   static BuildId FindExpectedBuildIdForPath(const std::string& path);
+  // When enabled, build ids set and found in the current thread are kept in a map only used by the
+  // current thread. It allows processing recording files with different build ids in parallel.
+  static void UseThreadLocalBuildIds(bool enable);
   static void SetVdsoFile(const std::string& vdso_file, bool is_64bit);
 
   static std::unique_ptr<Dso> CreateDso(DsoType dso_type, const std::string& dso_path,
@@ -138,6 +150,12 @@ class Dso {
   static std::unique_ptr<Dso> CreateKernelModuleDso(const std::string& dso_path,
                                                     uint64_t memory_start, uint64_t memory_end,
                                                     Dso* kernel_dso);
+  // Load and demangle symbols of dsos in multiple threads. It should be called before using the
+  // dsos, so the sample processing loop doesn't stall on loading symbols of each new dso.
+  static void LoadSymbolsInParallel(const std::vector<Dso*>& dsos, size_t thread_count);
+  // Let dsos of the same type and path share symbols read from files. It is used when thread
+  // trees in different threads create dsos for the same files, so each file is only parsed once.
+  static void SetShareSymbols(bool share);
   virtual ~Dso();
 
   DsoType type() const { return type_; }
@@ -196,8 +214,11 @@ class Dso {
   static bool demangle_;
   static std::string vmlinux_;
   static std::string kallsyms_;
+  static std::string symbol_cache_dir_;
+  static bool share_symbols_;
   static std::unordered_map<std::string, BuildId> build_id_map_;
-  static size_t dso_count_;
+  // Dsos can be created in unwinding threads, see ParallelUnwinder.
+  static std::atomic<size_t> dso_count_;
   static uint32_t g_dump_id_;
   static simpleperf_dso_impl::DebugElfFileFinder debug_elf_file_finder_;
 
@@ -206,6 +227,10 @@ class Dso {
 
   virtual std::string FindDebugFilePath() const { return path_; }
   virtual std::vector<Symbol> LoadSymbolsImpl() = 0;
+  void BuildSymbolIndex();
+  bool LoadSymbolsFromCache(const BuildId& build_id, std::vector<Symbol>* symbols);
+  void SaveSymbolsToCache(const BuildId& build_id, const std::vector<Symbol>& symbols);
+  std::vector<Symbol> LoadSharedSymbols();
 
   DsoType type_;
   // path of the shared library used by the profiled program
@@ -216,6 +241,14 @@ class Dso {
   // File name of the shared library, got by removing directories in path_.
   std::string file_name_;
   std::vector<Symbol> symbols_;
+  // Start addresses of symbols_ in Eytzinger layout (a binary tree stored in breadth-first order,
+  // starting at index 1), for cache-friendly binary search. symbol_index_[i] is the position in
+  // symbols_ of the symbol starting at symbol_addrs_[i]. symbol_index_[0] is symbols_.size(),
+  // used when no symbol starts after the searched address.
+  std::vector<uint64_t> symbol_addrs_;
+  std::vector<uint32_t> symbol_index_;
+  // Position in symbols_ of the last found symbol. Nearby ips are likely to hit the same symbol.
+  std::atomic<uint32_t> last_symbol_pos_ = 0;
   // unknown symbols are like [libc.so+0x1234].
   std::unordered_map<uint64_t, Symbol> unknown_symbols_;
   bool is_loaded_;
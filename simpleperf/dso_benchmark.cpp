@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+#include "dso.h"
+
+using namespace simpleperf;
+
+namespace {
+
+// Create a dso with symbol_count symbols, like a big shared library.
+std::unique_ptr<Dso> CreateDsoWithSymbols(size_t symbol_count, std::mt19937_64& rng) {
+  std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_SYMBOL_MAP_FILE, "perf-1.map");
+  std::vector<Symbol> symbols;
+  uint64_t addr = 0x1000;
+  for (size_t i = 0; i < symbol_count; i++) {
+    uint64_t len = 16 + rng() % 512;
+    symbols.emplace_back("func" + std::to_string(i), addr, len);
+    addr += len + rng() % 16;
+  }
+  dso->SetSymbols(&symbols);
+  dso->LoadSymbols();
+  return dso;
+}
+
+void BM_FindSymbol(benchmark::State& state, bool nearby_ips) {
+  std::mt19937_64 rng(0);
+  std::unique_ptr<Dso> dso = CreateDsoWithSymbols(state.range(0), rng);
+  const std::vector<Symbol>& symbols = dso->GetSymbols();
+  uint64_t end_addr = symbols.back().addr + symbols.back().len;
+  std::vector<uint64_t> ips(1 << 16);
+  for (size_t i = 0; i < ips.size(); i++) {
+    if (nearby_ips && i % 8 != 0) {
+      // Samples in a hot function.
+      ips[i] = ips[i - 1] + rng() % 8;
+    } else {
+      ips[i] = rng() % end_addr;
+    }
+  }
+  size_t found = 0;
+  for (auto _ : state) {
+    for (uint64_t ip : ips) {
+      found += dso->FindSymbol(ip) != nullptr;
+    }
+  }
+  benchmark::DoNotOptimize(found);
+  state.SetItemsProcessed(state.iterations() * ips.size());
+}
+BENCHMARK_CAPTURE(BM_FindSymbol, random_ips, false)->Arg(1000)->Arg(100000)->Arg(1000000);
+BENCHMARK_CAPTURE(BM_FindSymbol, nearby_ips, true)->Arg(1000)->Arg(100000)->Arg(1000000);
+
+}  // namespace
@@ -18,6 +18,9 @@
 
 #include <gtest/gtest.h>
 
+#include <random>
+#include <thread>
+
 #include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/test_utils.h>
@@ -378,3 +381,181 @@ TEST(dso, demangle) {
   ASSERT_EQ(Dso::Demangle("_RNvC6_123foo3bar"), "123foo::bar");
 #endif
 }
+
+TEST(dso, symbol_cache) {
+  TemporaryDir tmpdir;
+  ASSERT_TRUE(Dso::SetSymbolCacheDir(tmpdir.path));
+  std::string elf_path = GetTestData(ELF_FILE);
+  Dso::SetBuildIds({std::make_pair(elf_path, BuildId(ELF_FILE_BUILD_ID))});
+  // Read symbols from the elf file, and save them in the cache.
+  auto dso = Dso::CreateDso(DSO_ELF_FILE, elf_path);
+  ASSERT_TRUE(dso);
+  dso->LoadSymbols();
+  const std::vector<Symbol>& symbols = dso->GetSymbols();
+  ASSERT_FALSE(symbols.empty());
+  ASSERT_EQ(GetEntriesInDir(tmpdir.path).size(), 1u);
+
+  // Read symbols from the cache, even if the elf file isn't available.
+  std::string missing_path = "/data/missing_elf";
+  Dso::SetBuildIds({std::make_pair(missing_path, BuildId(ELF_FILE_BUILD_ID))});
+  auto cached_dso = Dso::CreateDso(DSO_ELF_FILE, missing_path);
+  ASSERT_TRUE(cached_dso);
+  cached_dso->LoadSymbols();
+  const std::vector<Symbol>& cached_symbols = cached_dso->GetSymbols();
+  ASSERT_EQ(cached_symbols.size(), symbols.size());
+  for (size_t i = 0; i < symbols.size(); i++) {
+    ASSERT_EQ(cached_symbols[i].addr, symbols[i].addr);
+    ASSERT_EQ(cached_symbols[i].len, symbols[i].len);
+    ASSERT_STREQ(cached_symbols[i].Name(), symbols[i].Name());
+    ASSERT_STREQ(cached_symbols[i].DemangledName(), symbols[i].DemangledName());
+  }
+
+  // Don't use the cache for a different build id.
+  Dso::SetBuildIds(
+      {std::make_pair(missing_path, BuildId("1b12a384a9f4a3f3659b7171ca615dbec3a81f71"))});
+  auto mismatch_dso = Dso::CreateDso(DSO_ELF_FILE, missing_path);
+  ASSERT_TRUE(mismatch_dso);
+  mismatch_dso->LoadSymbols();
+  ASSERT_TRUE(mismatch_dso->GetSymbols().empty());
+}
+
+TEST(dso, symbol_cache_with_stripped_file) {
+  TemporaryDir cache_dir;
+  ASSERT_TRUE(Dso::SetSymbolCacheDir(cache_dir.path));
+  // Create a stripped copy of the elf file by renaming its .symtab section.
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(GetTestData(ELF_FILE), &data));
+  const std::string symtab_name(".symtab\0", 8);
+  size_t pos = data.find(symtab_name);
+  ASSERT_NE(pos, std::string::npos);
+  data[pos + 7] = 'X';
+  TemporaryDir elf_dir;
+  std::string stripped_path = std::string(elf_dir.path) + "/stripped_elf";
+  ASSERT_TRUE(android::base::WriteStringToFile(data, stripped_path));
+  std::string unstripped_path = GetTestData(ELF_FILE);
+  Dso::SetBuildIds({std::make_pair(stripped_path, BuildId(ELF_FILE_BUILD_ID)),
+                    std::make_pair(unstripped_path, BuildId(ELF_FILE_BUILD_ID))});
+
+  // Symbols of the stripped file aren't saved in the cache.
+  auto stripped_dso = Dso::CreateDso(DSO_ELF_FILE, stripped_path);
+  ASSERT_TRUE(stripped_dso);
+  stripped_dso->LoadSymbols();
+  ASSERT_TRUE(GetEntriesInDir(cache_dir.path).empty());
+
+  // So the unstripped file with the same build id is parsed, and its symbols are cached.
+  auto unstripped_dso = Dso::CreateDso(DSO_ELF_FILE, unstripped_path);
+  ASSERT_TRUE(unstripped_dso);
+  unstripped_dso->LoadSymbols();
+  size_t symbol_count = unstripped_dso->GetSymbols().size();
+  ASSERT_GT(symbol_count, stripped_dso->GetSymbols().size());
+  ASSERT_EQ(GetEntriesInDir(cache_dir.path).size(), 1u);
+
+  // Later loads of the stripped file get the full symbols from the cache.
+  auto cached_dso = Dso::CreateDso(DSO_ELF_FILE, stripped_path);
+  ASSERT_TRUE(cached_dso);
+  cached_dso->LoadSymbols();
+  ASSERT_EQ(cached_dso->GetSymbols().size(), symbol_count);
+}
+
+TEST(dso, LoadSymbolsInParallel) {
+  std::vector<std::string> paths = {GetTestData(ELF_FILE), GetTestData("elf_with_mini_debug_info"),
+                                    GetTestData(ELF_FILE), GetTestData("base.vdex")};
+  std::vector<std::unique_ptr<Dso>> dsos;
+  std::vector<Dso*> dso_ptrs;
+  for (const auto& path : paths) {
+    dsos.emplace_back(Dso::CreateDso(DSO_ELF_FILE, path));
+    dso_ptrs.push_back(dsos.back().get());
+  }
+  Dso::LoadSymbolsInParallel(dso_ptrs, 3);
+  for (size_t i = 0; i < paths.size(); i++) {
+    auto dso = Dso::CreateDso(DSO_ELF_FILE, paths[i]);
+    dso->LoadSymbols();
+    const auto& symbols = dso->GetSymbols();
+    const auto& parallel_symbols = dsos[i]->GetSymbols();
+    ASSERT_EQ(symbols.size(), parallel_symbols.size());
+    for (size_t j = 0; j < symbols.size(); j++) {
+      ASSERT_EQ(symbols[j].addr, parallel_symbols[j].addr);
+      ASSERT_STREQ(symbols[j].DemangledName(), parallel_symbols[j].DemangledName());
+    }
+  }
+}
+
+TEST(dso, share_symbols) {
+  TemporaryDir tmpdir;
+  std::string elf_path = std::string(tmpdir.path) + "/elf";
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(GetTestData(ELF_FILE), &data));
+  ASSERT_TRUE(android::base::WriteStringToFile(data, elf_path));
+  Dso::SetShareSymbols(true);
+  // Load symbols of dsos for the same file in multiple threads.
+  std::vector<std::unique_ptr<Dso>> dsos;
+  for (size_t i = 0; i < 4; i++) {
+    dsos.emplace_back(Dso::CreateDso(DSO_ELF_FILE, elf_path));
+  }
+  std::vector<std::thread> threads;
+  for (auto& dso : dsos) {
+    threads.emplace_back([&dso]() { dso->LoadSymbols(); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const std::vector<Symbol>& symbols = dsos[0]->GetSymbols();
+  ASSERT_FALSE(symbols.empty());
+  for (auto& dso : dsos) {
+    ASSERT_EQ(dso->GetSymbols().size(), symbols.size());
+  }
+
+  // Dsos created later get shared symbols without reading the file.
+  ASSERT_EQ(unlink(elf_path.c_str()), 0);
+  auto shared_dso = Dso::CreateDso(DSO_ELF_FILE, elf_path);
+  shared_dso->LoadSymbols();
+  const std::vector<Symbol>& shared_symbols = shared_dso->GetSymbols();
+  ASSERT_EQ(shared_symbols.size(), symbols.size());
+  for (size_t i = 0; i < symbols.size(); i++) {
+    ASSERT_EQ(shared_symbols[i].addr, symbols[i].addr);
+    ASSERT_STREQ(shared_symbols[i].DemangledName(), symbols[i].DemangledName());
+  }
+
+  // Shared symbols are dropped when sharing is disabled.
+  Dso::SetShareSymbols(false);
+  auto dso = Dso::CreateDso(DSO_ELF_FILE, elf_path);
+  dso->LoadSymbols();
+  ASSERT_TRUE(dso->GetSymbols().empty());
+}
+
+TEST(dso, FindSymbol) {
+  // Compare with a linear search, for symbol tables of different sizes, with gaps between symbols
+  // and symbols starting at the same address.
+  std::mt19937 rng(0);
+  for (size_t symbol_count = 0; symbol_count < 70; symbol_count++) {
+    std::vector<Symbol> symbols;
+    uint64_t addr = 0x100;
+    for (size_t i = 0; i < symbol_count; i++) {
+      uint64_t len = 1 + rng() % 8;
+      symbols.emplace_back("func" + std::to_string(i), addr, len);
+      addr += rng() % 3 == 0 ? 0 : len + rng() % 3;
+    }
+    std::vector<Symbol> expected_symbols = symbols;
+    auto dso = Dso::CreateDso(DSO_SYMBOL_MAP_FILE, "perf-123.map");
+    ASSERT_TRUE(dso);
+    dso->SetSymbols(&symbols);
+    for (uint64_t vaddr = 0; vaddr < addr + 16; vaddr++) {
+      const Symbol* expected = nullptr;
+      for (const Symbol& symbol : expected_symbols) {
+        if (symbol.addr <= vaddr) {
+          expected = &symbol;
+        }
+      }
+      if (expected != nullptr && expected->addr + expected->len <= vaddr) {
+        expected = nullptr;
+      }
+      const Symbol* symbol = dso->FindSymbol(vaddr);
+      if (expected == nullptr) {
+        ASSERT_EQ(symbol, nullptr) << "vaddr " << vaddr << ", symbol_count " << symbol_count;
+      } else {
+        ASSERT_NE(symbol, nullptr) << "vaddr " << vaddr << ", symbol_count " << symbol_count;
+        ASSERT_STREQ(symbol->Name(), expected->Name());
+      }
+    }
+  }
+}
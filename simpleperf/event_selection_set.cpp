@@ -837,6 +837,21 @@ bool EventSelectionSet::MmapEventFiles(size_t min_mmap_pages, size_t max_mmap_pa
   return true;
 }
 
+void EventSelectionSet::SetRecordNotificationLimits(size_t size_watermark,
+                                                    uint32_t max_latency_in_ms) {
+  record_read_thread_->SetDataNotificationLimits(size_watermark, max_latency_in_ms);
+}
+
+void EventSelectionSet::SetDiscardKernelDataEarly(bool enable) {
+  record_read_thread_->SetDiscardKernelDataEarly(enable);
+}
+
+void EventSelectionSet::UpdateStackUsage(pid_t tid, uint32_t used_stack_size) {
+  if (record_read_thread_) {
+    record_read_thread_->UpdateStackUsage(tid, used_stack_size);
+  }
+}
+
 bool EventSelectionSet::PrepareToReadMmapEventData(const std::function<bool(Record*)>& callback) {
   // Prepare record callback function.
   record_callback_ = callback;
@@ -866,10 +881,17 @@ bool EventSelectionSet::ReadMmapEventData(bool with_time_limit) {
   if (with_time_limit) {
     start_time_in_ns = GetSystemClock();
   }
-  std::unique_ptr<Record> r;
-  while ((r = record_read_thread_->GetRecord()) != nullptr) {
-    if (!record_callback_(r.get())) {
-      return false;
+  // Records are parsed in place in the RecordBuffer, and are released when reading the next batch.
+  static constexpr size_t kRecordBatchSize = 256;
+  while (true) {
+    record_read_thread_->GetRecords(record_arena_, kRecordBatchSize, record_batch_);
+    if (record_batch_.empty()) {
+      break;
+    }
+    for (Record* r : record_batch_) {
+      if (!record_callback_(r)) {
+        return false;
+      }
     }
     if (with_time_limit && (GetSystemClock() - start_time_in_ns) >= 1e8) {
       break;
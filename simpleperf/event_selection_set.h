@@ -167,6 +167,12 @@ class EventSelectionSet {
   bool ReadCounters(std::vector<CountersInfo>* counters);
   bool MmapEventFiles(size_t min_mmap_pages, size_t max_mmap_pages, size_t aux_buffer_size,
                       size_t record_buffer_size, bool allow_truncating_samples, bool exclude_perf);
+  // Coalesce wakeups for reading records, see RecordReadThread::SetDataNotificationLimits().
+  void SetRecordNotificationLimits(size_t size_watermark, uint32_t max_latency_in_ms);
+  // See RecordReadThread::SetDiscardKernelDataEarly().
+  void SetDiscardKernelDataEarly(bool enable);
+  // See RecordReadThread::UpdateStackUsage().
+  void UpdateStackUsage(pid_t tid, uint32_t used_stack_size);
   bool PrepareToReadMmapEventData(const std::function<bool(Record*)>& callback);
   bool SyncKernelBuffer();
   bool FinishReadMmapEventData();
@@ -226,6 +232,9 @@ class EventSelectionSet {
   std::function<bool(Record*)> record_callback_;
 
   std::unique_ptr<simpleperf::RecordReadThread> record_read_thread_;
+  // Records read from record_read_thread_ in a batch.
+  RecordArena record_arena_;
+  std::vector<Record*> record_batch_;
 
   bool has_aux_trace_ = false;
   std::vector<AddrFilter> addr_filters_;
@@ -25,6 +25,7 @@
 #include <unistd.h>
 
 #include <memory>
+#include <mutex>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -36,8 +37,11 @@
 namespace simpleperf {
 
 std::unordered_map<std::string, ApkInspector::ApkNode> ApkInspector::embedded_elf_cache_;
+// The cache can be accessed in multiple unwinding threads.
+static std::mutex embedded_elf_cache_mutex;
 
 EmbeddedElf* ApkInspector::FindElfInApkByOffset(const std::string& apk_path, uint64_t file_offset) {
+  std::lock_guard<std::mutex> lock(embedded_elf_cache_mutex);
   // Already in cache?
   ApkNode& node = embedded_elf_cache_[apk_path];
   auto it = node.offset_map.find(file_offset);
@@ -55,6 +59,7 @@ EmbeddedElf* ApkInspector::FindElfInApkByOffset(const std::string& apk_path, uin
 
 EmbeddedElf* ApkInspector::FindElfInApkByName(const std::string& apk_path,
                                               const std::string& entry_name) {
+  std::lock_guard<std::mutex> lock(embedded_elf_cache_mutex);
   ApkNode& node = embedded_elf_cache_[apk_path];
   auto it = node.name_map.find(entry_name);
   if (it != node.name_map.end()) {
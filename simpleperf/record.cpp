@@ -73,6 +73,7 @@ static std::string RecordTypeToString(int record_type) {
       {SIMPLE_PERF_RECORD_UNWINDING_RESULT, "unwinding_result"},
       {SIMPLE_PERF_RECORD_TRACING_DATA, "tracing_data"},
       {SIMPLE_PERF_RECORD_DEBUG, "debug"},
+      {SIMPLE_PERF_RECORD_COMPRESSED, "compressed"},
   };
 
   auto it = record_type_names.find(record_type);
@@ -1646,77 +1647,108 @@ bool UnknownRecord::Parse(const perf_event_attr&, char* p, char* end) {
 
 void UnknownRecord::DumpData(size_t) const {}
 
-std::unique_ptr<Record> ReadRecordFromBuffer(const perf_event_attr& attr, uint32_t type, char* p,
-                                             char* end) {
-  std::unique_ptr<Record> r;
+void* RecordArena::Alloc(size_t size, size_t align) {
+  while (true) {
+    if (cur_block_ < blocks_.size()) {
+      Block& block = blocks_[cur_block_];
+      size_t pos = Align(cur_pos_, align);
+      if (pos <= block.size && size <= block.size - pos) {
+        cur_pos_ = pos + size;
+        return block.data.get() + pos;
+      }
+      if (cur_pos_ != 0) {
+        cur_block_++;
+        cur_pos_ = 0;
+        continue;
+      }
+    }
+    // Insert a new block big enough for the allocation.
+    Block block;
+    block.size = std::max(block_size_, size);
+    block.data.reset(new char[block.size]);
+    blocks_.emplace(blocks_.begin() + cur_block_, std::move(block));
+  }
+}
+
+void RecordArena::Reset() {
+  for (auto it = records_.rbegin(); it != records_.rend(); ++it) {
+    (*it)->~Record();
+  }
+  records_.clear();
+  cur_block_ = 0;
+  cur_pos_ = 0;
+}
+
+template <typename T>
+static Record* NewRecord(RecordArena* arena) {
+  if (arena != nullptr) {
+    return arena->New<T>();
+  }
+  return new T;
+}
+
+static Record* NewRecordOfType(uint32_t type, RecordArena* arena) {
   switch (type) {
     case PERF_RECORD_MMAP:
-      r.reset(new MmapRecord);
-      break;
+      return NewRecord<MmapRecord>(arena);
     case PERF_RECORD_MMAP2:
-      r.reset(new Mmap2Record);
-      break;
+      return NewRecord<Mmap2Record>(arena);
     case PERF_RECORD_COMM:
-      r.reset(new CommRecord);
-      break;
+      return NewRecord<CommRecord>(arena);
     case PERF_RECORD_EXIT:
-      r.reset(new ExitRecord);
-      break;
+      return NewRecord<ExitRecord>(arena);
     case PERF_RECORD_FORK:
-      r.reset(new ForkRecord);
-      break;
+      return NewRecord<ForkRecord>(arena);
     case PERF_RECORD_LOST:
-      r.reset(new LostRecord);
-      break;
+      return NewRecord<LostRecord>(arena);
     case PERF_RECORD_SAMPLE:
-      r.reset(new SampleRecord);
-      break;
+      return NewRecord<SampleRecord>(arena);
     case PERF_RECORD_AUX:
-      r.reset(new AuxRecord);
-      break;
+      return NewRecord<AuxRecord>(arena);
     case PERF_RECORD_SWITCH:
-      r.reset(new SwitchRecord);
-      break;
+      return NewRecord<SwitchRecord>(arena);
     case PERF_RECORD_SWITCH_CPU_WIDE:
-      r.reset(new SwitchCpuWideRecord);
-      break;
+      return NewRecord<SwitchCpuWideRecord>(arena);
     case PERF_RECORD_TRACING_DATA:
-      r.reset(new TracingDataRecord);
-      break;
+      return NewRecord<TracingDataRecord>(arena);
     case PERF_RECORD_AUXTRACE_INFO:
-      r.reset(new AuxTraceInfoRecord);
-      break;
+      return NewRecord<AuxTraceInfoRecord>(arena);
     case PERF_RECORD_AUXTRACE:
-      r.reset(new AuxTraceRecord);
-      break;
+      return NewRecord<AuxTraceRecord>(arena);
     case SIMPLE_PERF_RECORD_KERNEL_SYMBOL:
-      r.reset(new KernelSymbolRecord);
-      break;
+      return NewRecord<KernelSymbolRecord>(arena);
     case SIMPLE_PERF_RECORD_DSO:
-      r.reset(new DsoRecord);
-      break;
+      return NewRecord<DsoRecord>(arena);
     case SIMPLE_PERF_RECORD_SYMBOL:
-      r.reset(new SymbolRecord);
-      break;
+      return NewRecord<SymbolRecord>(arena);
     case SIMPLE_PERF_RECORD_EVENT_ID:
-      r.reset(new EventIdRecord);
-      break;
+      return NewRecord<EventIdRecord>(arena);
     case SIMPLE_PERF_RECORD_CALLCHAIN:
-      r.reset(new CallChainRecord);
-      break;
+      return NewRecord<CallChainRecord>(arena);
     case SIMPLE_PERF_RECORD_UNWINDING_RESULT:
-      r.reset(new UnwindingResultRecord);
-      break;
+      return NewRecord<UnwindingResultRecord>(arena);
     case SIMPLE_PERF_RECORD_TRACING_DATA:
-      r.reset(new TracingDataRecord);
-      break;
+      return NewRecord<TracingDataRecord>(arena);
     case SIMPLE_PERF_RECORD_DEBUG:
-      r.reset(new DebugRecord);
-      break;
+      return NewRecord<DebugRecord>(arena);
     default:
-      r.reset(new UnknownRecord);
-      break;
+      return NewRecord<UnknownRecord>(arena);
   }
+}
+
+std::unique_ptr<Record> ReadRecordFromBuffer(const perf_event_attr& attr, uint32_t type, char* p,
+                                             char* end) {
+  std::unique_ptr<Record> r(NewRecordOfType(type, nullptr));
+  if (UNLIKELY(!r->Parse(attr, p, end))) {
+    LOG(ERROR) << "failed to parse record " << RecordTypeToString(type);
+    return nullptr;
+  }
+  return r;
+}
+
+Record* ReadRecordFromBuffer(const perf_event_attr& attr, uint32_t type, char* p, char* end,
+                             RecordArena& arena) {
+  Record* r = NewRecordOfType(type, &arena);
   if (UNLIKELY(!r->Parse(attr, p, end))) {
     LOG(ERROR) << "failed to parse record " << RecordTypeToString(type);
     return nullptr;
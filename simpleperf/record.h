@@ -57,6 +57,9 @@ enum user_record_type {
   SIMPLE_PERF_RECORD_UNWINDING_RESULT,
   SIMPLE_PERF_RECORD_TRACING_DATA,
   SIMPLE_PERF_RECORD_DEBUG,
+  // Contains a block of records compressed by zstd. It is only used in the data section of
+  // record files, and is decompressed transparently by RecordFileReader.
+  SIMPLE_PERF_RECORD_COMPRESSED,
 };
 
 // perf_event_header uses u16 to store record size. However, that is not
@@ -699,11 +702,53 @@ struct UnknownRecord : public Record {
   void DumpData(size_t indent) const override;
 };
 
+// RecordArena allocates Record objects and their binary data in large blocks, and frees them
+// together in Reset(). It avoids two heap allocations per record when reading records in batches.
+// Records allocated in an arena shouldn't be deleted or owned by std::unique_ptr.
+class RecordArena {
+ public:
+  explicit RecordArena(size_t block_size = 1024 * 1024) : block_size_(block_size) {}
+  ~RecordArena() { Reset(); }
+
+  template <typename T>
+  T* New() {
+    T* r = new (Alloc(sizeof(T), alignof(T))) T;
+    records_.push_back(r);
+    return r;
+  }
+
+  char* AllocBinary(size_t size) { return static_cast<char*>(Alloc(size, alignof(uint64_t))); }
+
+  // Destroy all records in the arena, and reuse its memory for later allocations.
+  void Reset();
+
+ private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  void* Alloc(size_t size, size_t align);
+
+  const size_t block_size_;
+  std::vector<Block> blocks_;
+  size_t cur_block_ = 0;
+  size_t cur_pos_ = 0;
+  std::vector<Record*> records_;
+
+  DISALLOW_COPY_AND_ASSIGN(RecordArena);
+};
+
 // Read record from the buffer pointed by [p]. But the record doesn't own
 // the buffer.
 std::unique_ptr<Record> ReadRecordFromBuffer(const perf_event_attr& attr, uint32_t type, char* p,
                                              char* end);
 
+// Like above, but allocate the record in [arena]. The returned record is valid until the arena is
+// reset.
+Record* ReadRecordFromBuffer(const perf_event_attr& attr, uint32_t type, char* p, char* end,
+                             RecordArena& arena);
+
 // Read records from the buffer pointed by [buf]. None of the records own
 // the buffer.
 std::vector<std::unique_ptr<Record>> ReadRecordsFromBuffer(const perf_event_attr& attr, char* buf,
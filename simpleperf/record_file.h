@@ -19,12 +19,19 @@
 
 #include <stdio.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/macros.h>
@@ -70,6 +77,39 @@ struct DebugUnwindFile {
 
 using DebugUnwindFeature = std::vector<DebugUnwindFile>;
 
+// A chunk of the data section in the record index feature.
+struct RecordIndexChunk {
+  // Offset relative to the start of the data section.
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  uint64_t sample_count = 0;
+  uint64_t min_sample_time = UINT64_MAX;
+  uint64_t max_sample_time = 0;
+  // Sorted pids of samples in the chunk.
+  std::vector<uint32_t> pids;
+  bool has_non_sample_records = false;
+};
+
+using RecordIndexFeature = std::vector<RecordIndexChunk>;
+
+// Select samples to read using the record index feature.
+struct RecordIndexFilter {
+  uint64_t start_time = 0;
+  uint64_t end_time = UINT64_MAX;
+  // If not empty, only read samples of these processes.
+  std::set<uint32_t> pids;
+};
+
+// Data of a SIMPLE_PERF_RECORD_COMPRESSED record, following the record header.
+struct CompressedRecordData {
+  uint64_t decompressed_size;
+  uint64_t compressed_size;
+  // Followed by compressed data, padded to 8 bytes.
+};
+
+// Decompress the data of a SIMPLE_PERF_RECORD_COMPRESSED record into [records].
+bool DecompressRecordBlock(const char* data, size_t size, std::vector<char>* records);
+
 // RecordFileWriter writes to a perf record file, like perf.data.
 // User should call RecordFileWriter::Close() to finish writing the file, otherwise the file will
 // be removed in RecordFileWriter::~RecordFileWriter().
@@ -81,12 +121,30 @@ class RecordFileWriter {
   RecordFileWriter(const std::string& filename, FILE* fp, bool own_fp);
   ~RecordFileWriter();
 
+  static constexpr size_t kDefaultCompressionBlockSize = 1024 * 1024;
+  // Approximate size of data covered by a chunk in the record index feature.
+  static constexpr uint64_t kRecordIndexChunkSize = 256 * 1024;
+
+  // Compress records in the data section with zstd at [level], in blocks of [block_size] bytes.
+  // Blocks are compressed in a background thread. AUXTRACE records and data written by
+  // WriteData() aren't compressed. It should be called before writing records.
+  void EnableCompression(int level, size_t block_size = kDefaultCompressionBlockSize);
+  // Build the record index and collect offsets of AUXTRACE records while writing records, so
+  // features can be written without calling ReadDataSection(). It should be called before
+  // writing records.
+  void IndexRecordsWhileWriting();
+
   bool WriteAttrSection(const EventAttrIds& attr_ids);
   bool WriteRecord(const Record& record);
   bool WriteData(const void* buf, size_t len);
 
+  // Return the size of data written to the file, not including records waiting for compression.
   uint64_t GetDataSectionSize() const { return data_section_size_; }
+  // Read records in the data section. It also builds the record index written by
+  // WriteRecordIndexFeature(), and collects offsets of AUXTRACE records.
   bool ReadDataSection(const std::function<void(const Record*)>& callback);
+  // Return file offsets of AUXTRACE records, used by WriteAuxTraceFeature().
+  const std::vector<uint64_t>& GetAuxTraceOffsets() const { return auxtrace_offsets_; }
 
   bool BeginWriteFeatures(size_t feature_count);
   bool WriteBuildIdFeature(const std::vector<BuildIdRecord>& build_id_records);
@@ -98,6 +156,7 @@ class RecordFileWriter {
   bool WriteFileFeature(const FileFeature& file);
   bool WriteMetaInfoFeature(const std::unordered_map<std::string, std::string>& info_map);
   bool WriteDebugUnwindFeature(const DebugUnwindFeature& debug_unwind);
+  bool WriteRecordIndexFeature();
   bool WriteFeature(int feature, const char* data, size_t size);
   bool EndWriteFeatures();
 
@@ -114,6 +173,20 @@ class RecordFileWriter {
   bool WriteStringWithLength(const std::string& s);
   bool WriteFeatureBegin(int feature);
   bool WriteFeatureEnd(int feature);
+  bool WriteRecordData(const void* buf, size_t len);
+  void SubmitCompressionBlock();
+  bool FlushCompressionBlocks();
+  void StopCompressionThread();
+  void CompressionThreadMain();
+  bool WriteCompressedBlock(const std::vector<char>& block, std::vector<char>& compressed_data);
+  void AddRecordToIndex(uint64_t offset, bool can_start_chunk, const Record& r);
+  void AddRecordToBlockIndex(const Record& r);
+  void AddBlockToIndex(uint64_t offset, RecordIndexChunk& block);
+  void StartIndexChunkIfNeeded(uint64_t offset, bool can_start_chunk);
+  void FinishIndexChunk(uint64_t end_offset);
+
+  // Limit memory used by blocks waiting for compression.
+  static constexpr size_t kMaxPendingCompressionBlocks = 4;
 
   const std::string filename_;
   FILE* record_fp_;
@@ -123,9 +196,33 @@ class RecordFileWriter {
   uint64_t attr_section_offset_;
   uint64_t attr_section_size_;
   uint64_t data_section_offset_;
-  uint64_t data_section_size_;
+  std::atomic<uint64_t> data_section_size_;
   uint64_t feature_section_offset_;
 
+  // Used when compression is enabled. The compression thread writes compressed blocks to the
+  // file. Other threads should call FlushCompressionBlocks() before accessing the file.
+  int compression_level_ = 0;
+  size_t compression_block_size_ = 0;
+  std::vector<char> compression_block_;
+  std::unique_ptr<std::thread> compression_thread_;
+  std::mutex compression_mutex_;
+  std::condition_variable compression_cond_;
+  std::condition_variable compression_done_cond_;
+  // Summary of records in compression_block_, used when index_while_writing_ is true.
+  RecordIndexChunk compression_block_index_;
+  // Below are protected by compression_mutex_.
+  std::deque<std::pair<std::vector<char>, RecordIndexChunk>> pending_compression_blocks_;
+  bool compressing_block_ = false;
+  bool stop_compression_ = false;
+  bool compression_error_ = false;
+
+  // Built by ReadDataSection(), or while writing records if index_while_writing_ is true.
+  // With compression, blocks are added to the index by the compression thread.
+  bool index_while_writing_ = false;
+  RecordIndexFeature record_index_;
+  std::set<uint32_t> index_chunk_pids_;
+  std::vector<uint64_t> auxtrace_offsets_;
+
   std::map<int, PerfFileFormat::SectionDesc> features_;
   size_t feature_count_;
 
@@ -135,7 +232,11 @@ class RecordFileWriter {
 // RecordFileReader read contents from a perf record file, like perf.data.
 class RecordFileReader {
  public:
-  static std::unique_ptr<RecordFileReader> CreateInstance(const std::string& filename);
+  // If use_recording_environment is true, the arch and event types of the recording are used
+  // (process wide) until the reader is destroyed. Callers creating readers in multiple threads
+  // should pass false, and set up the environment in the main thread.
+  static std::unique_ptr<RecordFileReader> CreateInstance(const std::string& filename,
+                                                          bool use_recording_environment = true);
 
   ~RecordFileReader();
 
@@ -155,9 +256,16 @@ class RecordFileReader {
   bool ReadFeatureSection(int feature, std::vector<char>* data);
   bool ReadFeatureSection(int feature, std::string* data);
 
-  // There are two ways to read records in data section: one is by calling
-  // ReadDataSection(), and [callback] is called for each Record. the other
-  // is by calling ReadRecord() in a loop.
+  // There are three ways to read records in data section: one is by calling
+  // ReadDataSection(), and [callback] is called for each Record. the second
+  // is by calling ReadRecord() in a loop. the third is by calling ReadRecordBatch()
+  // in a loop, which avoids allocating each record on heap.
+
+  // Map the data section into memory. Then records read later refer to the mapped data instead of
+  // owning a copy, except records merged from SPLIT records. So they can't be used after the
+  // reader is closed. It should be called before reading records. Return false if the data
+  // section can't be mapped, in which case records are still read from the file.
+  bool MmapDataSection();
 
   // If sorted is true, sort records before passing them to callback function.
   bool ReadDataSection(const std::function<bool(std::unique_ptr<Record>)>& callback);
@@ -168,6 +276,21 @@ class RecordFileReader {
   // Otherwise return false.
   bool ReadRecord(std::unique_ptr<Record>& record);
 
+  // A batch size for ReadRecordBatch(), big enough to amortize the cost of resetting the arena.
+  static constexpr size_t kRecordBatchSize = 1024;
+
+  // Only read chunks of the data section possibly having samples selected by [filter], using the
+  // record index feature. Non-sample records are still read before the last selected chunk, to
+  // keep thread and map states. Some samples not selected may still be read, so users should
+  // check samples themselves. It should be called before reading records. Return false if the
+  // file doesn't have a valid record index.
+  bool SetRecordIndexFilter(const RecordIndexFilter& filter);
+
+  // Reset [arena], then read at most [max_records] records allocated in [arena] into [records].
+  // The records are valid until [arena] is reset. If there is no more records, [records] is empty.
+  // Return false on error.
+  bool ReadRecordBatch(RecordArena& arena, size_t max_records, std::vector<Record*>& records);
+
   size_t GetAttrIndexOfRecord(const Record* record);
 
   std::vector<std::string> ReadCmdlineFeature();
@@ -186,6 +309,7 @@ class RecordFileReader {
   const std::unordered_map<std::string, std::string>& GetMetaInfoFeature() { return meta_info_; }
   std::string GetClockId();
   std::optional<DebugUnwindFeature> ReadDebugUnwindFeature();
+  std::optional<RecordIndexFeature> ReadRecordIndexFeature();
 
   bool LoadBuildIdAndFileFeatures(ThreadTree& thread_tree);
 
@@ -195,6 +319,11 @@ class RecordFileReader {
   // When having error, return false and set error to true.
   bool ReadAuxData(uint32_t cpu, uint64_t aux_offset, size_t size, std::vector<uint8_t>& buf,
                    bool& error);
+  // Like ReadAuxData(), but return a pointer to the aux data instead of copying. The data is in
+  // the mapped data section if available, otherwise it is read into buf. Return nullptr if the
+  // data isn't available or having error.
+  const uint8_t* GetAuxData(uint32_t cpu, uint64_t aux_offset, size_t size,
+                            std::vector<uint8_t>& buf, bool& error);
 
   bool Close();
 
@@ -213,7 +342,24 @@ class RecordFileReader {
   bool ReadFileV2Feature(uint64_t& read_pos, uint64_t max_size, FileFeature& file);
   bool ReadMetaInfoFeature();
   void UseRecordingEnvironment();
+  bool PrepareReadRecord();
+  bool HasMoreRecords() const {
+    return read_record_size_ < header_.data.size || InDecompressedBlock();
+  }
+  bool SkipChunksByRecordIndex();
   std::unique_ptr<Record> ReadRecord();
+  Record* ReadRecord(RecordArena& arena);
+  // Read binary data of the next record into [binary]. If [arena] is nullptr and the data needs
+  // a copy, the copy is owned by [owned_binary].
+  bool ReadRecordBinary(RecordHeader& header, char*& binary, std::unique_ptr<char[]>& owned_binary,
+                        RecordArena* arena);
+  const perf_event_attr& GetAttrForRecordBinary(const RecordHeader& header, const char* binary);
+  bool FinishReadRecord(Record& r);
+  // Read or skip data for records in the data section.
+  bool ReadRecordData(void* buf, size_t len);
+  bool SkipRecordData(uint64_t len);
+  bool InDecompressedBlock() const { return decompressed_pos_ < decompressed_block_.size(); }
+  bool ReadCompressedBlock(const RecordHeader& header);
   bool Read(void* buf, size_t len);
   void ProcessEventIdRecord(const EventIdRecord& r);
   bool BuildAuxDataLocation();
@@ -232,6 +378,25 @@ class RecordFileReader {
 
   uint64_t read_record_size_;
 
+  // Used when the data section is mapped.
+  void* data_mmap_addr_ = nullptr;
+  size_t data_mmap_size_ = 0;
+  char* data_section_ = nullptr;
+
+  // Records decompressed from a SIMPLE_PERF_RECORD_COMPRESSED record, which are read before
+  // reading the data section again.
+  std::vector<char> decompressed_block_;
+  size_t decompressed_pos_ = 0;
+
+  // Used when a record index filter is set.
+  bool use_record_index_ = false;
+  RecordIndexFeature index_chunks_;
+  std::vector<bool> index_chunk_selected_;
+  size_t index_chunk_pos_ = 0;
+  // Chunks starting from it have no selected samples.
+  size_t index_chunk_end_ = 0;
+  bool skip_samples_in_chunk_ = false;
+
   std::unordered_map<std::string, std::string> meta_info_;
   std::unique_ptr<ScopedCurrentArch> scoped_arch_;
   std::unique_ptr<ScopedEventTypes> scoped_event_types_;
@@ -85,6 +85,9 @@ file2 feature section (used to replace file feature section):
 
 etm_branch_list feature section:
   ETMBranchList etm_branch_list;  // from etm_branch_list.proto
+
+record_index feature section:
+  RecordIndex record_index;  // from record_file.proto
 */
 
 namespace simpleperf {
@@ -120,6 +123,7 @@ enum {
   FEAT_DEBUG_UNWIND_FILE,
   FEAT_FILE2,
   FEAT_ETM_BRANCH_LIST,
+  FEAT_RECORD_INDEX,
   FEAT_MAX_NUM = 256,
 };
 
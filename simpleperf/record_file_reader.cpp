@@ -18,7 +18,12 @@
 
 #include <fcntl.h>
 #include <string.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
+#include <algorithm>
 #include <set>
 #include <string_view>
 #include <vector>
@@ -61,6 +66,7 @@ static const std::map<int, std::string> feature_name_map = {
     {FEAT_DEBUG_UNWIND_FILE, "debug_unwind_file"},
     {FEAT_FILE2, "file2"},
     {FEAT_ETM_BRANCH_LIST, "etm_branch_list"},
+    {FEAT_RECORD_INDEX, "record_index"},
 };
 
 std::string GetFeatureName(int feature_id) {
@@ -79,7 +85,8 @@ int GetFeatureId(const std::string& feature_name) {
 
 }  // namespace PerfFileFormat
 
-std::unique_ptr<RecordFileReader> RecordFileReader::CreateInstance(const std::string& filename) {
+std::unique_ptr<RecordFileReader> RecordFileReader::CreateInstance(
+    const std::string& filename, bool use_recording_environment) {
   std::string mode = std::string("rb") + CLOSE_ON_EXEC_MODE;
   FILE* fp = fopen(filename.c_str(), mode.c_str());
   if (fp == nullptr) {
@@ -91,7 +98,9 @@ std::unique_ptr<RecordFileReader> RecordFileReader::CreateInstance(const std::st
       !reader->ReadFeatureSectionDescriptors() || !reader->ReadMetaInfoFeature()) {
     return nullptr;
   }
-  reader->UseRecordingEnvironment();
+  if (use_recording_environment) {
+    reader->UseRecordingEnvironment();
+  }
   return reader;
 }
 
@@ -112,6 +121,13 @@ RecordFileReader::~RecordFileReader() {
 
 bool RecordFileReader::Close() {
   bool result = true;
+#if !defined(_WIN32)
+  if (data_mmap_addr_ != nullptr) {
+    munmap(data_mmap_addr_, data_mmap_size_);
+    data_mmap_addr_ = nullptr;
+    data_section_ = nullptr;
+  }
+#endif
   if (fclose(record_fp_) != 0) {
     PLOG(ERROR) << "failed to close record file '" << filename_ << "'";
     result = false;
@@ -264,6 +280,38 @@ void RecordFileReader::UseRecordingEnvironment() {
   }
 }
 
+bool RecordFileReader::MmapDataSection() {
+#if defined(_WIN32)
+  return false;
+#else
+  if (data_section_ != nullptr) {
+    return true;
+  }
+  CHECK_EQ(read_record_size_, 0u) << "MmapDataSection() should be called before reading records";
+  if (header_.data.size == 0) {
+    return false;
+  }
+  uint64_t page_size = sysconf(_SC_PAGE_SIZE);
+  uint64_t map_offset = header_.data.offset & ~(page_size - 1);
+  uint64_t map_size = header_.data.offset + header_.data.size - map_offset;
+  if (map_size > SIZE_MAX) {
+    return false;
+  }
+  // Use a private writable mapping, because some users adjust records in place (like
+  // SampleRecord::AdjustCallChainGeneratedByKernel()). The changes are not written to the file.
+  void* addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(record_fp_),
+                    map_offset);
+  if (addr == MAP_FAILED) {
+    PLOG(DEBUG) << "failed to mmap data section of " << filename_;
+    return false;
+  }
+  data_mmap_addr_ = addr;
+  data_mmap_size_ = map_size;
+  data_section_ = static_cast<char*>(addr) + (header_.data.offset - map_offset);
+  return true;
+#endif
+}
+
 bool RecordFileReader::ReadDataSection(
     const std::function<bool(std::unique_ptr<Record>)>& callback) {
   std::unique_ptr<Record> record;
@@ -279,32 +327,206 @@ bool RecordFileReader::ReadDataSection(
 }
 
 bool RecordFileReader::ReadRecord(std::unique_ptr<Record>& record) {
-  if (read_record_size_ == 0) {
-    if (fseek(record_fp_, header_.data.offset, SEEK_SET) != 0) {
-      PLOG(ERROR) << "fseek() failed";
-      return false;
-    }
+  if (!PrepareReadRecord()) {
+    return false;
   }
   record = nullptr;
-  if (read_record_size_ < header_.data.size) {
+  while (true) {
+    if (!SkipChunksByRecordIndex()) {
+      return false;
+    }
+    if (!HasMoreRecords()) {
+      break;
+    }
     record = ReadRecord();
     if (record == nullptr) {
       return false;
     }
+    if (skip_samples_in_chunk_ && record->type() == PERF_RECORD_SAMPLE) {
+      record = nullptr;
+      continue;
+    }
     if (record->type() == SIMPLE_PERF_RECORD_EVENT_ID) {
       ProcessEventIdRecord(*static_cast<EventIdRecord*>(record.get()));
     }
+    break;
+  }
+  return true;
+}
+
+bool RecordFileReader::ReadRecordBatch(RecordArena& arena, size_t max_records,
+                                       std::vector<Record*>& records) {
+  records.clear();
+  arena.Reset();
+  if (!PrepareReadRecord()) {
+    return false;
+  }
+  while (records.size() < max_records) {
+    if (!SkipChunksByRecordIndex()) {
+      return false;
+    }
+    if (!HasMoreRecords()) {
+      break;
+    }
+    Record* r = ReadRecord(arena);
+    if (r == nullptr) {
+      return false;
+    }
+    if (skip_samples_in_chunk_ && r->type() == PERF_RECORD_SAMPLE) {
+      continue;
+    }
+    if (r->type() == SIMPLE_PERF_RECORD_EVENT_ID) {
+      ProcessEventIdRecord(*static_cast<EventIdRecord*>(r));
+    }
+    records.push_back(r);
+  }
+  return true;
+}
+
+bool RecordFileReader::SetRecordIndexFilter(const RecordIndexFilter& filter) {
+  CHECK_EQ(read_record_size_, 0u) << "SetRecordIndexFilter() should be called before reading";
+  std::optional<RecordIndexFeature> index = ReadRecordIndexFeature();
+  if (!index) {
+    return false;
+  }
+  // Chunks should cover the whole data section in order.
+  uint64_t offset = 0;
+  for (const RecordIndexChunk& chunk : *index) {
+    if (chunk.offset != offset || chunk.size > header_.data.size - offset) {
+      LOG(ERROR) << "invalid record index in " << filename_;
+      return false;
+    }
+    offset += chunk.size;
+  }
+  if (offset != header_.data.size) {
+    LOG(ERROR) << "invalid record index in " << filename_;
+    return false;
+  }
+  index_chunks_ = std::move(index.value());
+  index_chunk_selected_.assign(index_chunks_.size(), false);
+  index_chunk_end_ = 0;
+  for (size_t i = 0; i < index_chunks_.size(); i++) {
+    const RecordIndexChunk& chunk = index_chunks_[i];
+    if (chunk.sample_count == 0 || chunk.max_sample_time < filter.start_time ||
+        chunk.min_sample_time >= filter.end_time) {
+      continue;
+    }
+    if (!filter.pids.empty() &&
+        std::none_of(chunk.pids.begin(), chunk.pids.end(),
+                     [&](uint32_t pid) { return filter.pids.count(pid) != 0; })) {
+      continue;
+    }
+    index_chunk_selected_[i] = true;
+    index_chunk_end_ = i + 1;
+  }
+  index_chunk_pos_ = 0;
+  skip_samples_in_chunk_ = false;
+  use_record_index_ = true;
+  return true;
+}
+
+// Called before reading each record. When reaching the start of a chunk, skip the chunk if it
+// has nothing needed. If only its non-sample records are needed, read it and drop its samples.
+bool RecordFileReader::SkipChunksByRecordIndex() {
+  if (!use_record_index_ || InDecompressedBlock()) {
+    return true;
+  }
+  while (index_chunk_pos_ < index_chunks_.size() &&
+         read_record_size_ == index_chunks_[index_chunk_pos_].offset) {
+    size_t i = index_chunk_pos_;
+    if (i >= index_chunk_end_) {
+      // No selected samples in the rest of the data section.
+      index_chunk_pos_ = index_chunks_.size();
+      return SkipRecordData(header_.data.size - read_record_size_);
+    }
+    index_chunk_pos_++;
+    if (index_chunk_selected_[i] || index_chunks_[i].has_non_sample_records) {
+      skip_samples_in_chunk_ = !index_chunk_selected_[i];
+      break;
+    }
+    if (!SkipRecordData(index_chunks_[i].size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecordFileReader::PrepareReadRecord() {
+  if (read_record_size_ == 0 && data_section_ == nullptr) {
+    if (fseek(record_fp_, header_.data.offset, SEEK_SET) != 0) {
+      PLOG(ERROR) << "fseek() failed";
+      return false;
+    }
   }
   return true;
 }
 
 std::unique_ptr<Record> RecordFileReader::ReadRecord() {
-  char header_buf[Record::header_size()];
   RecordHeader header;
-  if (!Read(header_buf, Record::header_size()) || !header.Parse(header_buf)) {
+  char* binary;
+  std::unique_ptr<char[]> p;
+  if (!ReadRecordBinary(header, binary, p, nullptr)) {
+    return nullptr;
+  }
+  auto r = ReadRecordFromBuffer(GetAttrForRecordBinary(header, binary), header.type, binary,
+                                binary + header.size);
+  if (!r) {
     return nullptr;
   }
+  if (p) {
+    p.release();
+    r->OwnBinary();
+  }
+  if (!FinishReadRecord(*r)) {
+    return nullptr;
+  }
+  return r;
+}
+
+Record* RecordFileReader::ReadRecord(RecordArena& arena) {
+  RecordHeader header;
+  char* binary;
   std::unique_ptr<char[]> p;
+  if (!ReadRecordBinary(header, binary, p, &arena)) {
+    return nullptr;
+  }
+  Record* r = ReadRecordFromBuffer(GetAttrForRecordBinary(header, binary), header.type, binary,
+                                   binary + header.size, arena);
+  if (r == nullptr || !FinishReadRecord(*r)) {
+    return nullptr;
+  }
+  return r;
+}
+
+bool RecordFileReader::ReadRecordBinary(RecordHeader& header, char*& binary,
+                                        std::unique_ptr<char[]>& owned_binary,
+                                        RecordArena* arena) {
+  auto alloc_binary = [&](size_t size) {
+    if (arena != nullptr) {
+      return arena->AllocBinary(size);
+    }
+    owned_binary.reset(new char[size]);
+    return owned_binary.get();
+  };
+
+  char header_buf[Record::header_size()];
+  bool in_decompressed_block;
+  while (true) {
+    in_decompressed_block = InDecompressedBlock();
+    if (!ReadRecordData(header_buf, Record::header_size()) || !header.Parse(header_buf)) {
+      return false;
+    }
+    if (header.type != SIMPLE_PERF_RECORD_COMPRESSED) {
+      break;
+    }
+    if (in_decompressed_block) {
+      LOG(ERROR) << "nested compressed records in " << filename_;
+      return false;
+    }
+    if (!ReadCompressedBlock(header)) {
+      return false;
+    }
+  }
   if (header.type == SIMPLE_PERF_RECORD_SPLIT) {
     // Read until meeting a RECORD_SPLIT_END record.
     std::vector<char> buf;
@@ -312,76 +534,164 @@ std::unique_ptr<Record> RecordFileReader::ReadRecord() {
       size_t add_size = header.size - Record::header_size();
       size_t old_size = buf.size();
       buf.resize(old_size + add_size);
-      if (!Read(&buf[old_size], add_size)) {
-        return nullptr;
+      if (!ReadRecordData(&buf[old_size], add_size)) {
+        return false;
       }
-      read_record_size_ += header.size;
-      if (!Read(header_buf, Record::header_size()) || !header.Parse(header_buf)) {
-        return nullptr;
+      if (!ReadRecordData(header_buf, Record::header_size()) || !header.Parse(header_buf)) {
+        return false;
       }
     }
     if (header.type != SIMPLE_PERF_RECORD_SPLIT_END) {
       LOG(ERROR) << "SPLIT records are not followed by a SPLIT_END record.";
-      return nullptr;
+      return false;
     }
-    read_record_size_ += header.size;
     if (buf.size() < Record::header_size() || !header.Parse(buf.data()) ||
         header.size != buf.size()) {
       LOG(ERROR) << "invalid record merged from SPLIT records";
-      return nullptr;
+      return false;
+    }
+    binary = alloc_binary(buf.size());
+    memcpy(binary, buf.data(), buf.size());
+  } else if (data_section_ != nullptr && !in_decompressed_block) {
+    // Use the record in the mapped data section without copying it.
+    binary = data_section_ + read_record_size_ - Record::header_size();
+    if (!SkipRecordData(header.size - Record::header_size())) {
+      return false;
     }
-    p.reset(new char[buf.size()]);
-    memcpy(p.get(), buf.data(), buf.size());
   } else {
-    p.reset(new char[header.size]);
-    memcpy(p.get(), header_buf, Record::header_size());
-    if (header.size > Record::header_size()) {
-      if (!Read(p.get() + Record::header_size(), header.size - Record::header_size())) {
-        return nullptr;
-      }
+    // Records in a decompressed block are copied, because the block is reused for the next
+    // compressed record.
+    binary = alloc_binary(header.size);
+    memcpy(binary, header_buf, Record::header_size());
+    if (!ReadRecordData(binary + Record::header_size(), header.size - Record::header_size())) {
+      return false;
     }
-    read_record_size_ += header.size;
   }
+  return true;
+}
 
-  const perf_event_attr* attr = &event_attrs_[0].attr;
+const perf_event_attr& RecordFileReader::GetAttrForRecordBinary(const RecordHeader& header,
+                                                                const char* binary) {
   if (event_attrs_.size() > 1 && header.type < PERF_RECORD_USER_DEFINED_TYPE_START) {
     bool has_event_id = false;
     uint64_t event_id;
     if (header.type == PERF_RECORD_SAMPLE) {
       if (header.size > event_id_pos_in_sample_records_ + sizeof(uint64_t)) {
         has_event_id = true;
-        event_id = *reinterpret_cast<uint64_t*>(p.get() + event_id_pos_in_sample_records_);
+        event_id = *reinterpret_cast<const uint64_t*>(binary + event_id_pos_in_sample_records_);
       }
     } else {
       if (header.size > event_id_reverse_pos_in_non_sample_records_) {
         has_event_id = true;
-        event_id = *reinterpret_cast<uint64_t*>(p.get() + header.size -
-                                                event_id_reverse_pos_in_non_sample_records_);
+        event_id = *reinterpret_cast<const uint64_t*>(binary + header.size -
+                                                      event_id_reverse_pos_in_non_sample_records_);
       }
     }
     if (has_event_id) {
       auto it = event_id_to_attr_map_.find(event_id);
       if (it != event_id_to_attr_map_.end()) {
-        attr = &event_attrs_[it->second].attr;
+        return event_attrs_[it->second].attr;
       }
     }
   }
-  auto r = ReadRecordFromBuffer(*attr, header.type, p.get(), p.get() + header.size);
-  if (!r) {
-    return nullptr;
+  return event_attrs_[0].attr;
+}
+
+bool RecordFileReader::FinishReadRecord(Record& r) {
+  if (r.type() == PERF_RECORD_AUXTRACE) {
+    if (InDecompressedBlock()) {
+      // Aux data is located by file offsets, so AUXTRACE records are never compressed.
+      LOG(ERROR) << "compressed AUXTRACE record in " << filename_;
+      return false;
+    }
+    auto& auxtrace = static_cast<AuxTraceRecord&>(r);
+    auxtrace.location.file_offset = header_.data.offset + read_record_size_;
+    if (data_section_ != nullptr) {
+      auxtrace.location.addr = data_section_ + read_record_size_;
+    }
+    if (!SkipRecordData(auxtrace.data->aux_size)) {
+      return false;
+    }
   }
-  p.release();
-  r->OwnBinary();
-  if (r->type() == PERF_RECORD_AUXTRACE) {
-    auto auxtrace = static_cast<AuxTraceRecord*>(r.get());
-    auxtrace->location.file_offset = header_.data.offset + read_record_size_;
-    read_record_size_ += auxtrace->data->aux_size;
-    if (fseek(record_fp_, auxtrace->data->aux_size, SEEK_CUR) != 0) {
-      PLOG(ERROR) << "fseek() failed";
-      return nullptr;
+  return true;
+}
+
+// Read data of records from the decompressed block if available, otherwise from the data section.
+// read_record_size_ counts the data read from the data section.
+bool RecordFileReader::ReadRecordData(void* buf, size_t len) {
+  if (InDecompressedBlock()) {
+    if (len > decompressed_block_.size() - decompressed_pos_) {
+      LOG(ERROR) << "record exceeds the compressed block in " << filename_;
+      return false;
     }
+    memcpy(buf, decompressed_block_.data() + decompressed_pos_, len);
+    decompressed_pos_ += len;
+    return true;
   }
-  return r;
+  if (len > header_.data.size - read_record_size_) {
+    LOG(ERROR) << "record exceeds the data section in " << filename_;
+    return false;
+  }
+  if (data_section_ == nullptr) {
+    if (!Read(buf, len)) {
+      return false;
+    }
+  } else {
+    memcpy(buf, data_section_ + read_record_size_, len);
+  }
+  read_record_size_ += len;
+  return true;
+}
+
+bool RecordFileReader::SkipRecordData(uint64_t len) {
+  if (InDecompressedBlock()) {
+    if (len > decompressed_block_.size() - decompressed_pos_) {
+      LOG(ERROR) << "record exceeds the compressed block in " << filename_;
+      return false;
+    }
+    decompressed_pos_ += len;
+    return true;
+  }
+  if (len > header_.data.size - read_record_size_) {
+    LOG(ERROR) << "record exceeds the data section in " << filename_;
+    return false;
+  }
+  if (data_section_ == nullptr && fseek(record_fp_, len, SEEK_CUR) != 0) {
+    PLOG(ERROR) << "fseek() failed";
+    return false;
+  }
+  read_record_size_ += len;
+  return true;
+}
+
+bool RecordFileReader::ReadCompressedBlock(const RecordHeader& header) {
+  std::vector<char> data(header.size - Record::header_size());
+  if (!ReadRecordData(data.data(), data.size())) {
+    return false;
+  }
+  if (!DecompressRecordBlock(data.data(), data.size(), &decompressed_block_)) {
+    LOG(ERROR) << "failed to decompress records in " << filename_;
+    return false;
+  }
+  decompressed_pos_ = 0;
+  return true;
+}
+
+bool DecompressRecordBlock(const char* data, size_t size, std::vector<char>* records) {
+  CompressedRecordData header;
+  if (size < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  // Blocks are cut by RecordFileWriter at the first record boundary after reaching the block
+  // size, so they are far below this limit.
+  constexpr uint64_t kMaxDecompressedSize = 1ULL << 30;
+  if (header.compressed_size > size - sizeof(header) ||
+      header.decompressed_size > kMaxDecompressedSize) {
+    return false;
+  }
+  return ZstdDecompress(data + sizeof(header), header.compressed_size, header.decompressed_size,
+                        records);
 }
 
 bool RecordFileReader::Read(void* buf, size_t len) {
@@ -735,6 +1045,34 @@ std::optional<DebugUnwindFeature> RecordFileReader::ReadDebugUnwindFeature() {
   return std::nullopt;
 }
 
+std::optional<RecordIndexFeature> RecordFileReader::ReadRecordIndexFeature() {
+  if (feature_section_descriptors_.count(FEAT_RECORD_INDEX)) {
+    std::string s;
+    if (!ReadFeatureSection(FEAT_RECORD_INDEX, &s)) {
+      return std::nullopt;
+    }
+    proto::RecordIndex proto_index;
+    if (!proto_index.ParseFromString(s)) {
+      LOG(ERROR) << "failed to parse record index in " << filename_;
+      return std::nullopt;
+    }
+    RecordIndexFeature index(proto_index.chunk_size());
+    for (size_t i = 0; i < proto_index.chunk_size(); i++) {
+      const auto& proto_chunk = proto_index.chunk(i);
+      RecordIndexChunk& chunk = index[i];
+      chunk.offset = proto_chunk.offset();
+      chunk.size = proto_chunk.size();
+      chunk.sample_count = proto_chunk.sample_count();
+      chunk.min_sample_time = proto_chunk.min_sample_time();
+      chunk.max_sample_time = proto_chunk.max_sample_time();
+      chunk.pids.assign(proto_chunk.pid().begin(), proto_chunk.pid().end());
+      chunk.has_non_sample_records = proto_chunk.has_non_sample_records();
+    }
+    return index;
+  }
+  return std::nullopt;
+}
+
 bool RecordFileReader::LoadBuildIdAndFileFeatures(ThreadTree& thread_tree) {
   std::vector<BuildIdRecord> records = ReadBuildIdFeature();
   std::vector<std::pair<std::string, BuildId>> build_ids;
@@ -756,22 +1094,44 @@ bool RecordFileReader::LoadBuildIdAndFileFeatures(ThreadTree& thread_tree) {
 
 bool RecordFileReader::ReadAuxData(uint32_t cpu, uint64_t aux_offset, size_t size,
                                    std::vector<uint8_t>& buf, bool& error) {
+  const uint8_t* data = GetAuxData(cpu, aux_offset, size, buf, error);
+  if (data == nullptr) {
+    return false;
+  }
+  if (data != buf.data()) {
+    if (buf.size() < size) {
+      buf.resize(size);
+    }
+    memcpy(buf.data(), data, size);
+  }
+  return true;
+}
+
+const uint8_t* RecordFileReader::GetAuxData(uint32_t cpu, uint64_t aux_offset, size_t size,
+                                            std::vector<uint8_t>& buf, bool& error) {
   error = false;
   long saved_pos = ftell(record_fp_);
   if (saved_pos == -1) {
     PLOG(ERROR) << "ftell() failed";
     error = true;
-    return false;
+    return nullptr;
   }
   OverflowResult aux_end = SafeAdd(aux_offset, size);
   if (aux_end.overflow) {
     LOG(ERROR) << "aux_end overflow";
     error = true;
-    return false;
+    return nullptr;
   }
-  if (aux_data_location_.empty() && !BuildAuxDataLocation()) {
-    error = true;
-    return false;
+  if (aux_data_location_.empty()) {
+    bool result = BuildAuxDataLocation();
+    if (fseek(record_fp_, saved_pos, SEEK_SET) != 0) {
+      PLOG(ERROR) << "fseek() failed";
+      result = false;
+    }
+    if (!result) {
+      error = true;
+      return nullptr;
+    }
   }
   AuxDataLocation* location = nullptr;
   auto it = aux_data_location_.find(cpu);
@@ -791,21 +1151,26 @@ bool RecordFileReader::ReadAuxData(uint32_t cpu, uint64_t aux_offset, size_t siz
     // ETM data can be dropped when recording if the userspace buffer is full. This isn't an error.
     LOG(INFO) << "aux data is missing: cpu " << cpu << ", aux_offset " << aux_offset << ", size "
               << size << ". Probably the data is lost when recording.";
-    return false;
+    return nullptr;
+  }
+  uint64_t file_offset = aux_offset - location->aux_offset + location->file_offset;
+  if (data_section_ != nullptr && file_offset >= header_.data.offset &&
+      file_offset + size <= header_.data.offset + header_.data.size) {
+    return reinterpret_cast<const uint8_t*>(data_section_ + (file_offset - header_.data.offset));
   }
   if (buf.size() < size) {
     buf.resize(size);
   }
-  if (!ReadAtOffset(aux_offset - location->aux_offset + location->file_offset, buf.data(), size)) {
+  if (!ReadAtOffset(file_offset, buf.data(), size)) {
     error = true;
-    return false;
+    return nullptr;
   }
   if (fseek(record_fp_, saved_pos, SEEK_SET) != 0) {
     PLOG(ERROR) << "fseek() failed";
     error = true;
-    return false;
+    return nullptr;
   }
-  return true;
+  return buf.data();
 }
 
 bool RecordFileReader::BuildAuxDataLocation() {
@@ -19,6 +19,8 @@
 #include <string.h>
 
 #include <memory>
+#include <optional>
+#include <set>
 #include <vector>
 
 #include <android-base/file.h>
@@ -254,4 +256,271 @@ TEST_F(RecordFileTest, write_file2_feature_section) {
   }
   ASSERT_FALSE(error);
   ASSERT_EQ(file_id, files.size());
-}
\ No newline at end of file
+}
+
+TEST_F(RecordFileTest, mmap_data_section) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  std::vector<std::unique_ptr<Record>> records;
+  for (uint32_t i = 0; i < 10; i++) {
+    records.emplace_back(new MmapRecord(attr_ids_[0].attr, false, i, i, 0x1000 * i, 0x1000, 0,
+                                        "mmap_record_" + std::to_string(i), attr_ids_[0].ids[0]));
+    ASSERT_TRUE(writer->WriteRecord(*records.back()));
+  }
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  ASSERT_TRUE(reader->MmapDataSection());
+  std::vector<std::unique_ptr<Record>> read_records = reader->DataSection();
+  ASSERT_EQ(read_records.size(), records.size());
+  for (size_t i = 0; i < records.size(); i++) {
+    CheckRecordEqual(*records[i], *read_records[i]);
+  }
+  // Records refer to the mapped data, so release them before closing the reader.
+  read_records.clear();
+  ASSERT_TRUE(reader->Close());
+}
+
+TEST_F(RecordFileTest, read_record_batch) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  std::vector<std::unique_ptr<Record>> records;
+  for (uint32_t i = 0; i < 10; i++) {
+    records.emplace_back(new MmapRecord(attr_ids_[0].attr, false, i, i, 0x1000 * i, 0x1000, 0,
+                                        "mmap_record_" + std::to_string(i), attr_ids_[0].ids[0]));
+    ASSERT_TRUE(writer->WriteRecord(*records.back()));
+  }
+  ASSERT_TRUE(writer->Close());
+
+  for (bool use_mmap : {false, true}) {
+    std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+    ASSERT_TRUE(reader != nullptr);
+    if (use_mmap) {
+      ASSERT_TRUE(reader->MmapDataSection());
+    }
+    // Use a small block size to test allocating records across blocks.
+    RecordArena arena(64);
+    std::vector<Record*> batch;
+    size_t read_count = 0;
+    while (true) {
+      ASSERT_TRUE(reader->ReadRecordBatch(arena, 3, batch));
+      if (batch.empty()) {
+        break;
+      }
+      ASSERT_LE(batch.size(), 3u);
+      for (Record* r : batch) {
+        ASSERT_LT(read_count, records.size());
+        CheckRecordEqual(*records[read_count++], *r);
+      }
+    }
+    ASSERT_EQ(read_count, records.size());
+  }
+}
+
+TEST_F(RecordFileTest, compression) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  // Use a small block size to generate multiple compressed records.
+  writer->EnableCompression(3, 256);
+  std::vector<std::unique_ptr<Record>> records;
+  for (uint32_t i = 0; i < 20; i++) {
+    records.emplace_back(new MmapRecord(attr_ids_[0].attr, false, i, i, 0x1000 * i, 0x1000, 0,
+                                        "mmap_record_" + std::to_string(i), attr_ids_[0].ids[0]));
+    if (i == 10) {
+      // A record written as SPLIT records.
+      records.emplace_back(new KernelSymbolRecord(std::string(100 * 1024, 'a')));
+    }
+  }
+  for (auto& r : records) {
+    ASSERT_TRUE(writer->WriteRecord(*r));
+  }
+  size_t read_count = 0;
+  ASSERT_TRUE(writer->ReadDataSection([&](const Record* r) {
+    // The writer doesn't merge SPLIT records.
+    if (r->type() == PERF_RECORD_MMAP) {
+      read_count++;
+    }
+  }));
+  ASSERT_EQ(read_count, 20u);
+  ASSERT_TRUE(writer->Close());
+
+  for (bool use_mmap : {false, true}) {
+    std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+    ASSERT_TRUE(reader != nullptr);
+    ASSERT_LT(reader->FileHeader().data.size, 100 * 1024u);
+    if (use_mmap) {
+      ASSERT_TRUE(reader->MmapDataSection());
+    }
+    std::vector<std::unique_ptr<Record>> read_records = reader->DataSection();
+    ASSERT_EQ(read_records.size(), records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+      CheckRecordEqual(*records[i], *read_records[i]);
+    }
+  }
+}
+
+TEST_F(RecordFileTest, record_index) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-clock");
+  perf_event_attr& attr = attr_ids_[0].attr;
+  attr.sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  // Write 128 samples from 4 processes. Each sample has 16K stack data, so the data section is
+  // split into multiple index chunks.
+  const size_t kSampleCount = 128;
+  MmapRecord mmap_record(attr, false, 1, 1, 0x1000, 0x1000, 0, "mmap_record", attr_ids_[0].ids[0],
+                         0);
+  ASSERT_TRUE(writer->WriteRecord(mmap_record));
+  for (uint64_t i = 0; i < kSampleCount; i++) {
+    uint32_t pid = i / 32 + 1;
+    SampleRecord sample(attr, attr_ids_[0].ids[0], 0x1000, pid, pid, i, 0, 1, PerfSampleReadType(),
+                        {}, std::vector<char>(16 * 1024), 16 * 1024);
+    ASSERT_TRUE(writer->WriteRecord(sample));
+  }
+  ASSERT_TRUE(writer->ReadDataSection([](const Record*) {}));
+  ASSERT_TRUE(writer->BeginWriteFeatures(1));
+  ASSERT_TRUE(writer->WriteRecordIndexFeature());
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  std::optional<RecordIndexFeature> index = reader->ReadRecordIndexFeature();
+  ASSERT_TRUE(index.has_value());
+  ASSERT_GT(index->size(), 4u);
+  ASSERT_TRUE(index->front().has_non_sample_records);
+  uint64_t sample_count = 0;
+  for (const RecordIndexChunk& chunk : index.value()) {
+    sample_count += chunk.sample_count;
+  }
+  ASSERT_EQ(sample_count, kSampleCount);
+
+  auto read_samples = [&](const RecordIndexFilter& filter, bool use_batch, bool& has_mmap) {
+    std::unique_ptr<RecordFileReader> index_reader =
+        RecordFileReader::CreateInstance(tmpfile_.path);
+    EXPECT_TRUE(index_reader != nullptr);
+    EXPECT_TRUE(index_reader->MmapDataSection());
+    EXPECT_TRUE(index_reader->SetRecordIndexFilter(filter));
+    std::set<uint64_t> times;
+    auto process_record = [&](const Record& r) {
+      if (r.type() == PERF_RECORD_SAMPLE) {
+        times.insert(r.Timestamp());
+      } else if (r.type() == PERF_RECORD_MMAP) {
+        has_mmap = true;
+      }
+    };
+    has_mmap = false;
+    if (use_batch) {
+      RecordArena arena;
+      std::vector<Record*> batch;
+      while (index_reader->ReadRecordBatch(arena, 16, batch) && !batch.empty()) {
+        for (Record* r : batch) {
+          process_record(*r);
+        }
+      }
+    } else {
+      for (auto& r : index_reader->DataSection()) {
+        process_record(*r);
+      }
+    }
+    return times;
+  };
+
+  for (bool use_batch : {false, true}) {
+    // Filter by time.
+    RecordIndexFilter filter;
+    filter.start_time = 40;
+    filter.end_time = 60;
+    bool has_mmap;
+    std::set<uint64_t> times = read_samples(filter, use_batch, has_mmap);
+    ASSERT_TRUE(has_mmap);
+    ASSERT_LT(times.size(), kSampleCount);
+    for (uint64_t time = 40; time < 60; time++) {
+      ASSERT_EQ(times.count(time), 1u);
+    }
+
+    // Filter by pid.
+    filter = RecordIndexFilter();
+    filter.pids.insert(3);
+    times = read_samples(filter, use_batch, has_mmap);
+    ASSERT_TRUE(has_mmap);
+    ASSERT_LT(times.size(), kSampleCount);
+    for (uint64_t time = 64; time < 96; time++) {
+      ASSERT_EQ(times.count(time), 1u);
+    }
+
+    // No samples selected.
+    filter = RecordIndexFilter();
+    filter.start_time = kSampleCount;
+    times = read_samples(filter, use_batch, has_mmap);
+    ASSERT_TRUE(times.empty());
+  }
+}
+
+TEST_F(RecordFileTest, index_records_while_writing) {
+  AddEventType("cpu-clock");
+  perf_event_attr& attr = attr_ids_[0].attr;
+  attr.sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+  auto write_file = [&](const std::string& path, bool compression, bool index_while_writing) {
+    std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(path);
+    ASSERT_TRUE(writer != nullptr);
+    ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+    if (compression) {
+      // Use a small block size to generate multiple compressed records.
+      writer->EnableCompression(3, 64 * 1024);
+    }
+    if (index_while_writing) {
+      writer->IndexRecordsWhileWriting();
+    }
+    for (uint64_t i = 0; i < 128; i++) {
+      if (i % 40 == 0) {
+        MmapRecord mmap_record(attr, false, 1, 1, 0x1000 * i, 0x1000, 0, "mmap_record",
+                               attr_ids_[0].ids[0], i);
+        ASSERT_TRUE(writer->WriteRecord(mmap_record));
+      }
+      uint32_t pid = i / 32 + 1;
+      SampleRecord sample(attr, attr_ids_[0].ids[0], 0x1000, pid, pid, i, 0, 1,
+                          PerfSampleReadType(), {}, std::vector<char>(16 * 1024), 16 * 1024);
+      ASSERT_TRUE(writer->WriteRecord(sample));
+    }
+    if (!index_while_writing) {
+      ASSERT_TRUE(writer->ReadDataSection([](const Record*) {}));
+    }
+    ASSERT_TRUE(writer->BeginWriteFeatures(1));
+    ASSERT_TRUE(writer->WriteRecordIndexFeature());
+    ASSERT_TRUE(writer->Close());
+  };
+  auto read_index = [](const std::string& path) {
+    std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(path);
+    EXPECT_TRUE(reader != nullptr);
+    std::optional<RecordIndexFeature> index = reader->ReadRecordIndexFeature();
+    EXPECT_TRUE(index.has_value());
+    return index.value_or(RecordIndexFeature());
+  };
+
+  for (bool compression : {false, true}) {
+    TemporaryFile expected_file;
+    write_file(expected_file.path, compression, false);
+    write_file(tmpfile_.path, compression, true);
+    RecordIndexFeature expected = read_index(expected_file.path);
+    RecordIndexFeature index = read_index(tmpfile_.path);
+    ASSERT_GT(expected.size(), 1u);
+    ASSERT_EQ(index.size(), expected.size());
+    for (size_t i = 0; i < index.size(); i++) {
+      ASSERT_EQ(index[i].offset, expected[i].offset);
+      ASSERT_EQ(index[i].size, expected[i].size);
+      ASSERT_EQ(index[i].sample_count, expected[i].sample_count);
+      ASSERT_EQ(index[i].min_sample_time, expected[i].min_sample_time);
+      ASSERT_EQ(index[i].max_sample_time, expected[i].max_sample_time);
+      ASSERT_EQ(index[i].pids, expected[i].pids);
+      ASSERT_EQ(index[i].has_non_sample_records, expected[i].has_non_sample_records);
+    }
+  }
+}
@@ -68,12 +68,29 @@ RecordFileWriter::RecordFileWriter(const std::string& filename, FILE* fp, bool o
       feature_count_(0) {}
 
 RecordFileWriter::~RecordFileWriter() {
+  StopCompressionThread();
   if (record_fp_ != nullptr && own_fp_) {
     fclose(record_fp_);
     unlink(filename_.c_str());
   }
 }
 
+void RecordFileWriter::EnableCompression(int level, size_t block_size) {
+  CHECK_EQ(data_section_size_.load(), 0u)
+      << "EnableCompression() should be called before writing records";
+  CHECK(!compression_thread_);
+  compression_level_ = level;
+  compression_block_size_ = block_size;
+  compression_block_.reserve(block_size);
+  compression_thread_.reset(new std::thread([this]() { CompressionThreadMain(); }));
+}
+
+void RecordFileWriter::IndexRecordsWhileWriting() {
+  CHECK_EQ(data_section_size_.load(), 0u)
+      << "IndexRecordsWhileWriting() should be called before writing records";
+  index_while_writing_ = true;
+}
+
 bool RecordFileWriter::WriteAttrSection(const EventAttrIds& attr_ids) {
   if (attr_ids.empty()) {
     return false;
@@ -131,13 +148,34 @@ bool RecordFileWriter::WriteRecord(const Record& record) {
   // Split simpleperf custom records which are > 65535 into a bunch of
   // RECORD_SPLIT records, followed by a RECORD_SPLIT_END record.
   constexpr uint32_t RECORD_SIZE_LIMIT = 65535;
-  if (record.size() <= RECORD_SIZE_LIMIT) {
-    bool result = WriteData(record.Binary(), record.size());
-    if (result && record.type() == PERF_RECORD_AUXTRACE) {
-      auto auxtrace = static_cast<const AuxTraceRecord*>(&record);
-      result = WriteData(auxtrace->location.addr, auxtrace->data->aux_size);
+  if (compression_block_.size() >= compression_block_size_ && compression_thread_) {
+    // Only cut blocks at record boundaries, so records (including SPLIT records) are never split
+    // between blocks.
+    SubmitCompressionBlock();
+  }
+  if (record.type() == PERF_RECORD_AUXTRACE) {
+    // Aux data is located by file offsets in the AuxTrace feature, so AUXTRACE records and aux
+    // data are written without compression.
+    if (index_while_writing_) {
+      if (!FlushCompressionBlocks()) {
+        return false;
+      }
+      AddRecordToIndex(data_section_size_, true, record);
+      auxtrace_offsets_.push_back(data_section_offset_ + data_section_size_);
     }
-    return result;
+    auto auxtrace = static_cast<const AuxTraceRecord*>(&record);
+    return WriteData(record.Binary(), record.size()) &&
+           WriteData(auxtrace->location.addr, auxtrace->data->aux_size);
+  }
+  if (index_while_writing_) {
+    if (compression_thread_) {
+      AddRecordToBlockIndex(record);
+    } else {
+      AddRecordToIndex(data_section_size_, true, record);
+    }
+  }
+  if (record.size() <= RECORD_SIZE_LIMIT) {
+    return WriteRecordData(record.Binary(), record.size());
   }
   CHECK_GT(record.type(), SIMPLE_PERF_RECORD_TYPE_START);
   const char* p = record.Binary();
@@ -151,10 +189,10 @@ bool RecordFileWriter::WriteRecord(const Record& record) {
     header.size = bytes_to_write + Record::header_size();
     header_p = header_buf;
     header.MoveToBinaryFormat(header_p);
-    if (!WriteData(header_buf, Record::header_size())) {
+    if (!WriteRecordData(header_buf, Record::header_size())) {
       return false;
     }
-    if (!WriteData(p, bytes_to_write)) {
+    if (!WriteRecordData(p, bytes_to_write)) {
       return false;
     }
     p += bytes_to_write;
@@ -164,10 +202,22 @@ bool RecordFileWriter::WriteRecord(const Record& record) {
   header.size = Record::header_size();
   header_p = header_buf;
   header.MoveToBinaryFormat(header_p);
-  return WriteData(header_buf, Record::header_size());
+  return WriteRecordData(header_buf, Record::header_size());
+}
+
+bool RecordFileWriter::WriteRecordData(const void* buf, size_t len) {
+  if (!compression_thread_) {
+    return WriteData(buf, len);
+  }
+  const char* p = static_cast<const char*>(buf);
+  compression_block_.insert(compression_block_.end(), p, p + len);
+  return true;
 }
 
 bool RecordFileWriter::WriteData(const void* buf, size_t len) {
+  if (!FlushCompressionBlocks()) {
+    return false;
+  }
   if (!Write(buf, len)) {
     return false;
   }
@@ -175,6 +225,108 @@ bool RecordFileWriter::WriteData(const void* buf, size_t len) {
   return true;
 }
 
+void RecordFileWriter::SubmitCompressionBlock() {
+  std::unique_lock<std::mutex> lock(compression_mutex_);
+  compression_done_cond_.wait(lock, [this]() {
+    return pending_compression_blocks_.size() < kMaxPendingCompressionBlocks;
+  });
+  pending_compression_blocks_.emplace_back(std::move(compression_block_),
+                                           std::move(compression_block_index_));
+  lock.unlock();
+  compression_cond_.notify_one();
+  compression_block_.clear();
+  compression_block_index_ = RecordIndexChunk();
+  compression_block_.reserve(compression_block_size_);
+}
+
+// Wait until all records are compressed and written to the file.
+bool RecordFileWriter::FlushCompressionBlocks() {
+  if (!compression_thread_) {
+    return true;
+  }
+  if (!compression_block_.empty()) {
+    SubmitCompressionBlock();
+  }
+  std::unique_lock<std::mutex> lock(compression_mutex_);
+  compression_done_cond_.wait(lock, [this]() {
+    return pending_compression_blocks_.empty() && !compressing_block_;
+  });
+  return !compression_error_;
+}
+
+void RecordFileWriter::StopCompressionThread() {
+  if (compression_thread_) {
+    {
+      std::lock_guard<std::mutex> lock(compression_mutex_);
+      stop_compression_ = true;
+    }
+    compression_cond_.notify_one();
+    compression_thread_->join();
+    compression_thread_.reset();
+  }
+}
+
+void RecordFileWriter::CompressionThreadMain() {
+  std::vector<char> compressed_data;
+  while (true) {
+    std::vector<char> block;
+    RecordIndexChunk block_index;
+    {
+      std::unique_lock<std::mutex> lock(compression_mutex_);
+      compression_cond_.wait(lock, [this]() {
+        return stop_compression_ || !pending_compression_blocks_.empty();
+      });
+      if (stop_compression_) {
+        return;
+      }
+      block = std::move(pending_compression_blocks_.front().first);
+      block_index = std::move(pending_compression_blocks_.front().second);
+      pending_compression_blocks_.pop_front();
+      compressing_block_ = true;
+    }
+    // Blocks are written in order, and other threads don't access the index until all blocks
+    // are written.
+    uint64_t block_offset = data_section_size_;
+    bool result = WriteCompressedBlock(block, compressed_data);
+    if (result && index_while_writing_) {
+      AddBlockToIndex(block_offset, block_index);
+    }
+    {
+      std::lock_guard<std::mutex> lock(compression_mutex_);
+      compressing_block_ = false;
+      if (!result) {
+        compression_error_ = true;
+      }
+    }
+    compression_done_cond_.notify_all();
+  }
+}
+
+bool RecordFileWriter::WriteCompressedBlock(const std::vector<char>& block,
+                                            std::vector<char>& compressed_data) {
+  if (!ZstdCompress(block.data(), block.size(), compression_level_, &compressed_data)) {
+    return false;
+  }
+  CompressedRecordData data;
+  data.decompressed_size = block.size();
+  data.compressed_size = compressed_data.size();
+  size_t padded_size = Align(compressed_data.size(), 8);
+  compressed_data.resize(padded_size, 0);
+
+  RecordHeader header;
+  header.type = SIMPLE_PERF_RECORD_COMPRESSED;
+  header.size = Record::header_size() + sizeof(data) + padded_size;
+  char header_buf[Record::header_size()];
+  char* header_p = header_buf;
+  header.MoveToBinaryFormat(header_p);
+  if (!Write(header_buf, sizeof(header_buf)) || !Write(&data, sizeof(data)) ||
+      !Write(compressed_data.data(), compressed_data.size())) {
+    return false;
+  }
+  data_section_size_ += header.size;
+  return true;
+}
+
 bool RecordFileWriter::Write(const void* buf, size_t len) {
   if (len != 0u && fwrite(buf, len, 1, record_fp_) != 1) {
     PLOG(ERROR) << "failed to write to record file '" << filename_ << "'";
@@ -192,13 +344,23 @@ bool RecordFileWriter::Read(void* buf, size_t len) {
 }
 
 bool RecordFileWriter::ReadDataSection(const std::function<void(const Record*)>& callback) {
+  if (!FlushCompressionBlocks()) {
+    return false;
+  }
   if (fseek(record_fp_, data_section_offset_, SEEK_SET) == -1) {
     PLOG(ERROR) << "fseek() failed";
     return false;
   }
   std::vector<char> record_buf(512);
   uint64_t read_pos = 0;
+  bool prev_is_split = false;
+  // The index and AUXTRACE offsets are rebuilt from the data section.
+  index_while_writing_ = false;
+  record_index_.clear();
+  index_chunk_pids_.clear();
+  auxtrace_offsets_.clear();
   while (read_pos < data_section_size_) {
+    uint64_t record_pos = read_pos;
     if (!Read(record_buf.data(), Record::header_size())) {
       return false;
     }
@@ -213,23 +375,107 @@ bool RecordFileWriter::ReadDataSection(const std::function<void(const Record*)>&
       return false;
     }
     read_pos += header.size;
+    // Don't start a chunk in the middle of SPLIT records.
+    bool can_start_chunk = !prev_is_split;
+    prev_is_split = header.type == SIMPLE_PERF_RECORD_SPLIT;
+    if (header.type == SIMPLE_PERF_RECORD_COMPRESSED) {
+      std::vector<char> records;
+      if (!DecompressRecordBlock(record_buf.data() + Record::header_size(),
+                                 header.size - Record::header_size(), &records)) {
+        LOG(ERROR) << "failed to decompress records in " << filename_;
+        return false;
+      }
+      // Records in a compressed block can only be skipped as a whole.
+      for (auto& r : ReadRecordsFromBuffer(event_attr_, records.data(), records.size())) {
+        AddRecordToIndex(record_pos, can_start_chunk, *r);
+        can_start_chunk = false;
+        callback(r.get());
+      }
+      continue;
+    }
     std::unique_ptr<Record> r = ReadRecordFromBuffer(event_attr_, header.type, record_buf.data(),
                                                      record_buf.data() + header.size);
     CHECK(r);
     if (r->type() == PERF_RECORD_AUXTRACE) {
       auto auxtrace = static_cast<AuxTraceRecord*>(r.get());
       auxtrace->location.file_offset = data_section_offset_ + read_pos;
+      auxtrace_offsets_.push_back(data_section_offset_ + record_pos);
       if (fseek(record_fp_, auxtrace->data->aux_size, SEEK_CUR) != 0) {
         PLOG(ERROR) << "fseek() failed";
         return false;
       }
       read_pos += auxtrace->data->aux_size;
     }
+    AddRecordToIndex(record_pos, can_start_chunk, *r);
     callback(r.get());
   }
+  if (!record_index_.empty()) {
+    FinishIndexChunk(data_section_size_);
+  }
   return true;
 }
 
+void RecordFileWriter::AddRecordToIndex(uint64_t offset, bool can_start_chunk, const Record& r) {
+  StartIndexChunkIfNeeded(offset, can_start_chunk);
+  RecordIndexChunk& chunk = record_index_.back();
+  if (r.type() == PERF_RECORD_SAMPLE) {
+    auto& sample = static_cast<const SampleRecord&>(r);
+    chunk.sample_count++;
+    chunk.min_sample_time = std::min(chunk.min_sample_time, sample.Timestamp());
+    chunk.max_sample_time = std::max(chunk.max_sample_time, sample.Timestamp());
+    index_chunk_pids_.insert(sample.tid_data.pid);
+  } else {
+    chunk.has_non_sample_records = true;
+  }
+}
+
+// Records in a compression block are summarized in compression_block_index_, and added to the
+// index when the block is written. Adjacent samples are usually from the same process, so only
+// adjacent duplicate pids are skipped here.
+void RecordFileWriter::AddRecordToBlockIndex(const Record& r) {
+  RecordIndexChunk& block = compression_block_index_;
+  if (r.type() == PERF_RECORD_SAMPLE) {
+    auto& sample = static_cast<const SampleRecord&>(r);
+    block.sample_count++;
+    block.min_sample_time = std::min(block.min_sample_time, sample.Timestamp());
+    block.max_sample_time = std::max(block.max_sample_time, sample.Timestamp());
+    if (block.pids.empty() || block.pids.back() != sample.tid_data.pid) {
+      block.pids.push_back(sample.tid_data.pid);
+    }
+  } else {
+    block.has_non_sample_records = true;
+  }
+}
+
+void RecordFileWriter::AddBlockToIndex(uint64_t offset, RecordIndexChunk& block) {
+  // Like ReadDataSection(), only the start of a compressed block can start a chunk.
+  StartIndexChunkIfNeeded(offset, true);
+  RecordIndexChunk& chunk = record_index_.back();
+  chunk.sample_count += block.sample_count;
+  chunk.min_sample_time = std::min(chunk.min_sample_time, block.min_sample_time);
+  chunk.max_sample_time = std::max(chunk.max_sample_time, block.max_sample_time);
+  index_chunk_pids_.insert(block.pids.begin(), block.pids.end());
+  chunk.has_non_sample_records |= block.has_non_sample_records;
+}
+
+void RecordFileWriter::StartIndexChunkIfNeeded(uint64_t offset, bool can_start_chunk) {
+  if (record_index_.empty() ||
+      (can_start_chunk && offset - record_index_.back().offset >= kRecordIndexChunkSize)) {
+    if (!record_index_.empty()) {
+      FinishIndexChunk(offset);
+    }
+    record_index_.emplace_back();
+    record_index_.back().offset = offset;
+  }
+}
+
+void RecordFileWriter::FinishIndexChunk(uint64_t end_offset) {
+  RecordIndexChunk& chunk = record_index_.back();
+  chunk.size = end_offset - chunk.offset;
+  chunk.pids.assign(index_chunk_pids_.begin(), index_chunk_pids_.end());
+  index_chunk_pids_.clear();
+}
+
 bool RecordFileWriter::GetFilePos(uint64_t* file_pos) {
   off_t offset = ftello(record_fp_);
   if (offset == -1) {
@@ -241,6 +487,15 @@ bool RecordFileWriter::GetFilePos(uint64_t* file_pos) {
 }
 
 bool RecordFileWriter::BeginWriteFeatures(size_t feature_count) {
+  if (!FlushCompressionBlocks()) {
+    return false;
+  }
+  if (index_while_writing_) {
+    index_while_writing_ = false;
+    if (!record_index_.empty()) {
+      FinishIndexChunk(data_section_size_);
+    }
+  }
   feature_section_offset_ = data_section_offset_ + data_section_size_;
   feature_count_ = feature_count;
   uint64_t feature_header_size = feature_count * sizeof(SectionDesc);
@@ -435,6 +690,29 @@ bool RecordFileWriter::WriteDebugUnwindFeature(const DebugUnwindFeature& debug_u
   return WriteFeature(FEAT_DEBUG_UNWIND, s.data(), s.size());
 }
 
+bool RecordFileWriter::WriteRecordIndexFeature() {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  proto::RecordIndex proto_index;
+  for (const RecordIndexChunk& chunk : record_index_) {
+    auto proto_chunk = proto_index.add_chunk();
+    proto_chunk->set_offset(chunk.offset);
+    proto_chunk->set_size(chunk.size);
+    proto_chunk->set_sample_count(chunk.sample_count);
+    proto_chunk->set_min_sample_time(chunk.min_sample_time);
+    proto_chunk->set_max_sample_time(chunk.max_sample_time);
+    for (uint32_t pid : chunk.pids) {
+      proto_chunk->add_pid(pid);
+    }
+    proto_chunk->set_has_non_sample_records(chunk.has_non_sample_records);
+  }
+  std::string s;
+  if (!proto_index.SerializeToString(&s)) {
+    LOG(ERROR) << "SerializeToString() failed";
+    return false;
+  }
+  return WriteFeature(FEAT_RECORD_INDEX, s.data(), s.size());
+}
+
 bool RecordFileWriter::WriteFeature(int feature, const char* data, size_t size) {
   return WriteFeatureBegin(feature) && Write(data, size) && WriteFeatureEnd(feature);
 }
@@ -507,7 +785,8 @@ bool RecordFileWriter::WriteFileHeader() {
 
 bool RecordFileWriter::Close() {
   CHECK(record_fp_ != nullptr);
-  bool result = true;
+  bool result = FlushCompressionBlocks();
+  StopCompressionThread();
 
   // Write file header. We gather enough information to write file header only after
   // writing data section and feature section.
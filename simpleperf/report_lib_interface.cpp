@@ -14,9 +14,13 @@
  * limitations under the License.
  */
 
+#include <deque>
 #include <memory>
 #include <optional>
 #include <queue>
+#include <set>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 
 #include <android-base/file.h>
@@ -80,6 +84,12 @@ struct SymbolEntry {
   uint64_t symbol_addr;
   uint64_t symbol_len;
   Mapping* mapping;
+  // Ids stay the same for a symbol, dso or mapping while reading a recording file. So callers can
+  // use them to cache info converted from the above fields. symbol_id and dso_id are UINT32_MAX
+  // unless enabled by FillSymbolIds().
+  uint32_t symbol_id;   // id in the symbol table
+  uint32_t dso_id;      // id of dso_name in the string table
+  uint32_t mapping_id;  // see GetMappingById()
 };
 
 struct CallChainEntry {
@@ -97,6 +107,41 @@ struct FeatureSection {
   uint32_t data_size;
 };
 
+// Samples read in a batch, stored in columns. Callchain entries of all samples are stored in the
+// callchain columns (ip, vaddr_in_file, symbol_id, dso_id and mapping_id). The callchain of
+// sample i, starting from the sampled ip, is in [callchain_offsets[i], callchain_offsets[i + 1]).
+struct SampleBatch {
+  uint32_t sample_count;
+  uint64_t* time;
+  uint32_t* pid;
+  uint32_t* tid;
+  uint32_t* thread_comm_id;  // id in the string table
+  uint32_t* cpu;
+  uint32_t* in_kernel;
+  uint32_t* event_id;  // see GetEventById()
+  uint64_t* period;
+  uint32_t* callchain_offsets;  // sample_count + 1 elements
+  uint64_t* ip;
+  uint64_t* vaddr_in_file;
+  uint32_t* symbol_id;   // id in the symbol table
+  uint32_t* dso_id;      // id of the dso name in the string table
+  uint32_t* mapping_id;  // see GetMappingById()
+};
+
+// Strings referred by sample batches. Strings are only appended to the table, so ids are stable.
+struct StringTable {
+  uint32_t count;
+  const char** strings;
+};
+
+// Symbols referred by sample batches. Symbols are only appended to the table, so ids are stable.
+struct SymbolTable {
+  uint32_t count;
+  uint32_t* name_id;  // id in the string table
+  uint64_t* addr;
+  uint64_t* len;
+};
+
 }  // extern "C"
 
 namespace simpleperf {
@@ -162,6 +207,92 @@ struct TraceOffCpuData {
   std::unordered_map<pid_t, std::unique_ptr<SampleRecord>> thread_map;
 };
 
+// Interns strings referred by sample batches.
+class StringTableBuilder {
+ public:
+  // Strings passed in are names of dsos, threads and symbols, which live as long as ReportLib.
+  // So look up by address first.
+  uint32_t GetId(const char* s) {
+    if (auto it = id_by_addr_.find(s); it != id_by_addr_.end()) {
+      return it->second;
+    }
+    uint32_t id;
+    if (auto it = id_by_content_.find(s); it != id_by_content_.end()) {
+      id = it->second;
+    } else {
+      id = static_cast<uint32_t>(strings_.size());
+      const std::string& str = storage_.emplace_back(s);
+      strings_.push_back(str.c_str());
+      id_by_content_[str] = id;
+    }
+    id_by_addr_[s] = id;
+    return id;
+  }
+
+  StringTable* GetTable() {
+    table_.count = static_cast<uint32_t>(strings_.size());
+    table_.strings = strings_.data();
+    return &table_;
+  }
+
+ private:
+  std::unordered_map<const char*, uint32_t> id_by_addr_;
+  std::unordered_map<std::string_view, uint32_t> id_by_content_;
+  std::deque<std::string> storage_;
+  std::vector<const char*> strings_;
+  StringTable table_;
+};
+
+struct SampleBatchColumns {
+  std::vector<uint64_t> time;
+  std::vector<uint32_t> pid;
+  std::vector<uint32_t> tid;
+  std::vector<uint32_t> thread_comm_id;
+  std::vector<uint32_t> cpu;
+  std::vector<uint32_t> in_kernel;
+  std::vector<uint32_t> event_id;
+  std::vector<uint64_t> period;
+  std::vector<uint32_t> callchain_offsets;
+  std::vector<uint64_t> ip;
+  std::vector<uint64_t> vaddr_in_file;
+  std::vector<uint32_t> symbol_id;
+  std::vector<uint32_t> dso_id;
+  std::vector<uint32_t> mapping_id;
+
+  void Clear() {
+    time.clear();
+    pid.clear();
+    tid.clear();
+    thread_comm_id.clear();
+    cpu.clear();
+    in_kernel.clear();
+    event_id.clear();
+    period.clear();
+    callchain_offsets.assign(1, 0);
+    ip.clear();
+    vaddr_in_file.clear();
+    symbol_id.clear();
+    dso_id.clear();
+    mapping_id.clear();
+  }
+};
+
+struct SymbolTableColumns {
+  std::vector<uint32_t> name_id;
+  std::vector<uint64_t> addr;
+  std::vector<uint64_t> len;
+  // Demangled names of symbols, used to check if an id in id_map is stale without hashing names.
+  std::vector<const char*> name;
+  std::unordered_map<const Symbol*, uint32_t> id_map;
+  SymbolTable table;
+};
+
+struct MappingTable {
+  // Stored in a deque, so pointers to mappings stay valid.
+  std::deque<Mapping> mappings;
+  std::unordered_map<const MapEntry*, uint32_t> id_map;
+};
+
 }  // namespace
 
 class ReportLib {
@@ -176,6 +307,7 @@ class ReportLib {
   bool SetLogSeverity(const char* log_level);
 
   bool SetSymfs(const char* symfs_dir) { return Dso::SetSymFsDir(symfs_dir); }
+  bool SetSymbolCacheDir(const char* cache_dir) { return Dso::SetSymbolCacheDir(cache_dir); }
 
   bool SetRecordFile(const char* record_file) {
     if (record_file_reader_) {
@@ -197,6 +329,7 @@ class ReportLib {
     return callchain_report_builder_.RemoveMethod(method_name_regex);
   }
   void MergeJavaMethods(bool merge) { callchain_report_builder_.SetConvertJITFrame(merge); }
+  void FillSymbolIds(bool fill) { fill_symbol_ids_ = fill; }
   bool AddProguardMappingFile(const char* mapping_file) {
     return callchain_report_builder_.AddProguardMappingFile(mapping_file);
   }
@@ -204,8 +337,18 @@ class ReportLib {
   bool SetTraceOffCpuMode(const char* mode);
   bool SetSampleFilter(const char** filters, int filters_len);
   bool AggregateThreads(const char** thread_name_regex, int thread_name_regex_len);
+  // Only report samples in [start_time_in_ns, end_time_in_ns), or of given processes. If the
+  // recording file has a record index, data without selected samples isn't read.
+  // They should be called before GetNextSample().
+  bool SeekByTime(uint64_t start_time_in_ns, uint64_t end_time_in_ns);
+  bool SeekByPids(const int* pids, int pids_len);
 
   Sample* GetNextSample();
+  SampleBatch* GetNextSampleBatch(uint32_t max_samples);
+  StringTable* GetStringTable() { return string_table_.GetTable(); }
+  SymbolTable* GetSymbolTable();
+  Event* GetEventById(uint32_t event_id);
+  Mapping* GetMappingById(uint32_t mapping_id);
   Event* GetEventOfCurrentSample() { return &current_event_; }
   SymbolEntry* GetSymbolOfCurrentSample() { return current_symbol_; }
   CallChain* GetCallChainOfCurrentSample() { return &current_callchain_; }
@@ -215,29 +358,42 @@ class ReportLib {
   FeatureSection* GetFeatureSection(const char* feature_name);
 
  private:
+  const SampleRecord* ReadNextSampleRecord();
   std::unique_ptr<SampleRecord> GetNextSampleRecord();
+  SampleRecord* GetNextSampleRecordInBatch();
   void ProcessSampleRecord(std::unique_ptr<Record> r);
   void ProcessSwitchRecord(std::unique_ptr<Record> r);
+  bool ProcessTracingDataRecord(const Record& r);
   void AddSampleRecordToQueue(SampleRecord* r);
-  bool SetCurrentSample(std::unique_ptr<SampleRecord> sample_record);
-  const EventInfo& FindEvent(const SampleRecord& r);
+  bool SetCurrentSample(const SampleRecord& r);
+  void AddSampleToBatch(const SampleRecord& r);
+  uint32_t GetSymbolId(const Symbol* symbol);
+  uint32_t GetDsoId(const CallChainReportEntry& entry);
+  uint32_t GetMappingId(const MapEntry& map);
+  bool CheckSample(const SampleRecord& r);
+  size_t FindEventId(const SampleRecord& r);
+  const EventInfo& FindEvent(const SampleRecord& r) { return events_[FindEventId(r)]; }
   void CreateEvents();
 
   bool OpenRecordFileIfNecessary();
-  Mapping* AddMapping(const MapEntry& map);
 
   std::unique_ptr<android::base::ScopedLogSeverity> log_severity_;
   std::string record_filename_;
   std::unique_ptr<RecordFileReader> record_file_reader_;
   ThreadTree thread_tree_;
   std::queue<std::unique_ptr<SampleRecord>> sample_record_queue_;
+  // Used to read records in batches when samples don't need to be kept across batches.
+  RecordArena record_arena_;
+  std::vector<Record*> record_batch_;
+  size_t record_batch_pos_ = 0;
+  // Keep the current sample record alive, since current_tracing_data_ refers to it.
+  std::unique_ptr<SampleRecord> current_sample_record_;
   const ThreadEntry* current_thread_;
   Sample current_sample_;
   Event current_event_;
   SymbolEntry* current_symbol_;
   CallChain current_callchain_;
   const char* current_tracing_data_;
-  std::vector<std::unique_ptr<Mapping>> current_mappings_;
   std::vector<CallChainEntry> callchain_entries_;
   std::string build_id_string_;
   std::vector<EventInfo> events_;
@@ -248,6 +404,20 @@ class ReportLib {
   ThreadReportBuilder thread_report_builder_;
   std::unique_ptr<Tracing> tracing_;
   RecordFilter record_filter_;
+  RecordIndexFilter record_index_filter_;
+  bool use_record_index_filter_ = false;
+  bool reading_started_ = false;
+  // Used by GetNextSampleBatch().
+  SampleBatchColumns batch_columns_;
+  SampleBatch sample_batch_;
+  Event event_by_id_;
+  // Strings, symbols and mappings referred by ids in samples.
+  StringTableBuilder string_table_;
+  SymbolTableColumns symbol_table_;
+  MappingTable mapping_table_;
+  // Dsos are kept until the ReportLib is destroyed. So ids of their names can be cached.
+  std::unordered_map<const Dso*, uint32_t> dso_id_map_;
+  bool fill_symbol_ids_ = false;
 };
 
 bool ReportLib::SetLogSeverity(const char* log_level) {
@@ -324,6 +494,29 @@ bool ReportLib::AggregateThreads(const char** thread_name_regex, int thread_name
   return thread_report_builder_.AggregateThreads(regs);
 }
 
+bool ReportLib::SeekByTime(uint64_t start_time_in_ns, uint64_t end_time_in_ns) {
+  if (reading_started_) {
+    LOG(ERROR) << "SeekByTime() should be called before GetNextSample()";
+    return false;
+  }
+  record_index_filter_.start_time = start_time_in_ns;
+  record_index_filter_.end_time = end_time_in_ns;
+  use_record_index_filter_ = true;
+  return true;
+}
+
+bool ReportLib::SeekByPids(const int* pids, int pids_len) {
+  if (reading_started_) {
+    LOG(ERROR) << "SeekByPids() should be called before GetNextSample()";
+    return false;
+  }
+  std::set<pid_t> pid_set(pids, pids + pids_len);
+  record_filter_.AddPids(pid_set, false);
+  record_index_filter_.pids.insert(pid_set.begin(), pid_set.end());
+  use_record_index_filter_ = true;
+  return true;
+}
+
 bool ReportLib::OpenRecordFileIfNecessary() {
   if (record_file_reader_ == nullptr) {
     record_file_reader_ = RecordFileReader::CreateInstance(record_filename_);
@@ -361,17 +554,88 @@ Sample* ReportLib::GetNextSample() {
   if (!OpenRecordFileIfNecessary()) {
     return nullptr;
   }
+  while (const SampleRecord* r = ReadNextSampleRecord()) {
+    if (SetCurrentSample(*r)) {
+      return &current_sample_;
+    }
+  }
+  return nullptr;
+}
 
-  while (true) {
-    std::unique_ptr<SampleRecord> r = GetNextSampleRecord();
-    if (!r) {
+SampleBatch* ReportLib::GetNextSampleBatch(uint32_t max_samples) {
+  if (!OpenRecordFileIfNecessary()) {
+    return nullptr;
+  }
+  SampleBatchColumns& c = batch_columns_;
+  c.Clear();
+  while (c.time.size() < max_samples) {
+    const SampleRecord* r = ReadNextSampleRecord();
+    if (r == nullptr) {
       break;
     }
-    if (SetCurrentSample(std::move(r))) {
-      return &current_sample_;
+    AddSampleToBatch(*r);
+  }
+  if (c.time.empty()) {
+    return nullptr;
+  }
+  sample_batch_.sample_count = static_cast<uint32_t>(c.time.size());
+  sample_batch_.time = c.time.data();
+  sample_batch_.pid = c.pid.data();
+  sample_batch_.tid = c.tid.data();
+  sample_batch_.thread_comm_id = c.thread_comm_id.data();
+  sample_batch_.cpu = c.cpu.data();
+  sample_batch_.in_kernel = c.in_kernel.data();
+  sample_batch_.event_id = c.event_id.data();
+  sample_batch_.period = c.period.data();
+  sample_batch_.callchain_offsets = c.callchain_offsets.data();
+  sample_batch_.ip = c.ip.data();
+  sample_batch_.vaddr_in_file = c.vaddr_in_file.data();
+  sample_batch_.symbol_id = c.symbol_id.data();
+  sample_batch_.dso_id = c.dso_id.data();
+  sample_batch_.mapping_id = c.mapping_id.data();
+  return &sample_batch_;
+}
+
+SymbolTable* ReportLib::GetSymbolTable() {
+  SymbolTable& table = symbol_table_.table;
+  table.count = static_cast<uint32_t>(symbol_table_.name_id.size());
+  table.name_id = symbol_table_.name_id.data();
+  table.addr = symbol_table_.addr.data();
+  table.len = symbol_table_.len.data();
+  return &table;
+}
+
+Event* ReportLib::GetEventById(uint32_t event_id) {
+  if (!OpenRecordFileIfNecessary()) {
+    return nullptr;
+  }
+  if (events_.empty()) {
+    CreateEvents();
+  }
+  if (event_id >= events_.size()) {
+    LOG(ERROR) << "invalid event id " << event_id;
+    return nullptr;
+  }
+  event_by_id_.name = events_[event_id].name.c_str();
+  event_by_id_.tracing_data_format = events_[event_id].tracing_info.data_format;
+  return &event_by_id_;
+}
+
+// Return the next sample to report, or nullptr if there are no more samples.
+const SampleRecord* ReportLib::ReadNextSampleRecord() {
+  if (!reading_started_) {
+    reading_started_ = true;
+    // Off-cpu samples are generated from adjacent samples, so can't skip samples in the reader.
+    // Without a record index, samples are still filtered by CheckSample().
+    if (use_record_index_filter_ && !trace_offcpu_.mode) {
+      record_file_reader_->SetRecordIndexFilter(record_index_filter_);
     }
   }
-  return nullptr;
+  if (!trace_offcpu_.mode) {
+    return GetNextSampleRecordInBatch();
+  }
+  current_sample_record_ = GetNextSampleRecord();
+  return current_sample_record_.get();
 }
 
 std::unique_ptr<SampleRecord> ReportLib::GetNextSampleRecord() {
@@ -386,13 +650,8 @@ std::unique_ptr<SampleRecord> ReportLib::GetNextSampleRecord() {
     } else if (record->type() == PERF_RECORD_SWITCH ||
                record->type() == PERF_RECORD_SWITCH_CPU_WIDE) {
       ProcessSwitchRecord(std::move(record));
-    } else if (record->type() == PERF_RECORD_TRACING_DATA ||
-               record->type() == SIMPLE_PERF_RECORD_TRACING_DATA) {
-      const auto& r = *static_cast<TracingDataRecord*>(record.get());
-      tracing_ = Tracing::Create(std::vector<char>(r.data, r.data + r.data_size));
-      if (!tracing_) {
-        return nullptr;
-      }
+    } else if (!ProcessTracingDataRecord(*record)) {
+      return nullptr;
     }
   }
   std::unique_ptr<SampleRecord> result = std::move(sample_record_queue_.front());
@@ -400,6 +659,41 @@ std::unique_ptr<SampleRecord> ReportLib::GetNextSampleRecord() {
   return result;
 }
 
+SampleRecord* ReportLib::GetNextSampleRecordInBatch() {
+  while (true) {
+    if (record_batch_pos_ == record_batch_.size()) {
+      if (!record_file_reader_->ReadRecordBatch(record_arena_, RecordFileReader::kRecordBatchSize,
+                                                record_batch_) ||
+          record_batch_.empty()) {
+        return nullptr;
+      }
+      record_batch_pos_ = 0;
+    }
+    Record* record = record_batch_[record_batch_pos_++];
+    thread_tree_.Update(*record);
+    if (record->type() == PERF_RECORD_SAMPLE) {
+      auto sr = static_cast<SampleRecord*>(record);
+      if (CheckSample(*sr)) {
+        return sr;
+      }
+    } else if (!ProcessTracingDataRecord(*record)) {
+      return nullptr;
+    }
+  }
+}
+
+bool ReportLib::ProcessTracingDataRecord(const Record& record) {
+  if (record.type() == PERF_RECORD_TRACING_DATA ||
+      record.type() == SIMPLE_PERF_RECORD_TRACING_DATA) {
+    const auto& r = static_cast<const TracingDataRecord&>(record);
+    tracing_ = Tracing::Create(std::vector<char>(r.data, r.data + r.data_size));
+    if (!tracing_) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void ReportLib::ProcessSampleRecord(std::unique_ptr<Record> r) {
   auto sr = static_cast<SampleRecord*>(r.get());
   if (!trace_offcpu_.mode) {
@@ -464,14 +758,12 @@ void ReportLib::ProcessSwitchRecord(std::unique_ptr<Record> r) {
 }
 
 void ReportLib::AddSampleRecordToQueue(SampleRecord* r) {
-  if (record_filter_.Check(*r)) {
+  if (CheckSample(*r)) {
     sample_record_queue_.emplace(r);
   }
 }
 
-bool ReportLib::SetCurrentSample(std::unique_ptr<SampleRecord> sample_record) {
-  const SampleRecord& r = *sample_record;
-  current_mappings_.clear();
+bool ReportLib::SetCurrentSample(const SampleRecord& r) {
   callchain_entries_.clear();
   current_sample_.ip = r.ip_data.ip;
   current_thread_ = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
@@ -506,7 +798,15 @@ bool ReportLib::SetCurrentSample(std::unique_ptr<SampleRecord> sample_record) {
     entry.symbol.symbol_name = report_entry.symbol->DemangledName();
     entry.symbol.symbol_addr = report_entry.symbol->addr;
     entry.symbol.symbol_len = report_entry.symbol->len;
-    entry.symbol.mapping = AddMapping(*report_entry.map);
+    if (fill_symbol_ids_) {
+      entry.symbol.symbol_id = GetSymbolId(report_entry.symbol);
+      entry.symbol.dso_id = GetDsoId(report_entry);
+    } else {
+      entry.symbol.symbol_id = UINT32_MAX;
+      entry.symbol.dso_id = UINT32_MAX;
+    }
+    entry.symbol.mapping_id = GetMappingId(*report_entry.map);
+    entry.symbol.mapping = &mapping_table_.mappings[entry.symbol.mapping_id];
   }
   current_sample_.ip = callchain_entries_[0].ip;
   current_symbol_ = &(callchain_entries_[0].symbol);
@@ -524,17 +824,86 @@ bool ReportLib::SetCurrentSample(std::unique_ptr<SampleRecord> sample_record) {
   return true;
 }
 
-const EventInfo& ReportLib::FindEvent(const SampleRecord& r) {
+void ReportLib::AddSampleToBatch(const SampleRecord& r) {
+  const ThreadEntry* thread = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+  size_t kernel_ip_count;
+  std::vector<uint64_t> ips = r.GetCallChain(&kernel_ip_count);
+  std::vector<CallChainReportEntry> report_entries =
+      callchain_report_builder_.Build(thread, ips, kernel_ip_count);
+  if (report_entries.empty()) {
+    // Skip samples with callchain fully removed by RemoveMethod().
+    return;
+  }
+  SampleBatchColumns& c = batch_columns_;
+  ThreadReport thread_report = thread_report_builder_.Build(*thread);
+  c.time.push_back(r.time_data.time);
+  c.pid.push_back(thread_report.pid);
+  c.tid.push_back(thread_report.tid);
+  c.thread_comm_id.push_back(string_table_.GetId(thread_report.thread_name));
+  c.cpu.push_back(r.cpu_data.cpu);
+  c.in_kernel.push_back(r.InKernel());
+  c.event_id.push_back(static_cast<uint32_t>(FindEventId(r)));
+  c.period.push_back(r.period_data.period);
+  for (const auto& entry : report_entries) {
+    c.ip.push_back(entry.ip);
+    c.vaddr_in_file.push_back(entry.vaddr_in_file);
+    c.symbol_id.push_back(GetSymbolId(entry.symbol));
+    c.dso_id.push_back(GetDsoId(entry));
+    c.mapping_id.push_back(GetMappingId(*entry.map));
+  }
+  c.callchain_offsets.push_back(static_cast<uint32_t>(c.ip.size()));
+}
+
+uint32_t ReportLib::GetSymbolId(const Symbol* symbol) {
+  SymbolTableColumns& t = symbol_table_;
+  const char* name = symbol->DemangledName();
+  // A symbol address can be reused after symbols of a dso are replaced. So check if the symbol
+  // is still the same.
+  if (auto it = t.id_map.find(symbol); it != t.id_map.end()) {
+    uint32_t id = it->second;
+    if (t.name[id] == name && t.addr[id] == symbol->addr && t.len[id] == symbol->len) {
+      return id;
+    }
+  }
+  uint32_t id = static_cast<uint32_t>(t.name_id.size());
+  t.name_id.push_back(string_table_.GetId(name));
+  t.name.push_back(name);
+  t.addr.push_back(symbol->addr);
+  t.len.push_back(symbol->len);
+  t.id_map[symbol] = id;
+  return id;
+}
+
+uint32_t ReportLib::GetDsoId(const CallChainReportEntry& entry) {
+  if (entry.dso_name != nullptr) {
+    return string_table_.GetId(entry.dso_name);
+  }
+  auto it = dso_id_map_.find(entry.dso);
+  if (it == dso_id_map_.end()) {
+    it = dso_id_map_.emplace(entry.dso, string_table_.GetId(entry.dso->GetReportPath().data()))
+             .first;
+  }
+  return it->second;
+}
+
+bool ReportLib::CheckSample(const SampleRecord& r) {
+  if (use_record_index_filter_ && (r.Timestamp() < record_index_filter_.start_time ||
+                                   r.Timestamp() >= record_index_filter_.end_time)) {
+    return false;
+  }
+  return record_filter_.Check(r);
+}
+
+size_t ReportLib::FindEventId(const SampleRecord& r) {
   if (events_.empty()) {
     CreateEvents();
   }
   if (trace_offcpu_.mode == TraceOffCpuMode::MIXED_ON_OFF_CPU) {
     // To mix on-cpu and off-cpu samples, pretend they are from the same event type.
     // Otherwise, some report scripts may split them.
-    return events_[0];
+    return 0;
   }
-  size_t attr_index = record_file_reader_->GetAttrIndexOfRecord(&r);
-  return events_[attr_index];
+  return record_file_reader_->GetAttrIndexOfRecord(&r);
 }
 
 void ReportLib::CreateEvents() {
@@ -575,13 +944,26 @@ void ReportLib::CreateEvents() {
   }
 }
 
-Mapping* ReportLib::AddMapping(const MapEntry& map) {
-  current_mappings_.emplace_back(std::unique_ptr<Mapping>(new Mapping));
-  Mapping* mapping = current_mappings_.back().get();
-  mapping->start = map.start_addr;
-  mapping->end = map.start_addr + map.len;
-  mapping->pgoff = map.pgoff;
-  return mapping;
+uint32_t ReportLib::GetMappingId(const MapEntry& map) {
+  MappingTable& t = mapping_table_;
+  if (auto it = t.id_map.find(&map); it != t.id_map.end()) {
+    return it->second;
+  }
+  uint32_t id = static_cast<uint32_t>(t.mappings.size());
+  Mapping& mapping = t.mappings.emplace_back();
+  mapping.start = map.start_addr;
+  mapping.end = map.start_addr + map.len;
+  mapping.pgoff = map.pgoff;
+  t.id_map[&map] = id;
+  return id;
+}
+
+Mapping* ReportLib::GetMappingById(uint32_t mapping_id) {
+  if (mapping_id >= mapping_table_.mappings.size()) {
+    LOG(ERROR) << "invalid mapping id " << mapping_id;
+    return nullptr;
+  }
+  return &mapping_table_.mappings[mapping_id];
 }
 
 const char* ReportLib::GetBuildIdForPath(const char* path) {
@@ -628,20 +1010,33 @@ void DestroyReportLib(ReportLib* report_lib) EXPORT;
 // verbose, debug, info, warning, error, fatal.
 bool SetLogSeverity(ReportLib* report_lib, const char* log_level) EXPORT;
 bool SetSymfs(ReportLib* report_lib, const char* symfs_dir) EXPORT;
+bool SetSymbolCacheDir(ReportLib* report_lib, const char* cache_dir) EXPORT;
 bool SetRecordFile(ReportLib* report_lib, const char* record_file) EXPORT;
 bool SetKallsymsFile(ReportLib* report_lib, const char* kallsyms_file) EXPORT;
 void ShowIpForUnknownSymbol(ReportLib* report_lib) EXPORT;
 void ShowArtFrames(ReportLib* report_lib, bool show) EXPORT;
 bool RemoveMethod(ReportLib* report_lib, const char* method_name_regex) EXPORT;
 void MergeJavaMethods(ReportLib* report_lib, bool merge) EXPORT;
+void FillSymbolIds(ReportLib* report_lib, bool fill) EXPORT;
 bool AddProguardMappingFile(ReportLib* report_lib, const char* mapping_file) EXPORT;
 const char* GetSupportedTraceOffCpuModes(ReportLib* report_lib) EXPORT;
 bool SetTraceOffCpuMode(ReportLib* report_lib, const char* mode) EXPORT;
 bool SetSampleFilter(ReportLib* report_lib, const char** filters, int filters_len) EXPORT;
 bool AggregateThreads(ReportLib* report_lib, const char** thread_name_regex,
                       int thread_name_regex_len) EXPORT;
+bool SeekByTime(ReportLib* report_lib, uint64_t start_time_in_ns, uint64_t end_time_in_ns) EXPORT;
+bool SeekByPids(ReportLib* report_lib, const int* pids, int pids_len) EXPORT;
 
 Sample* GetNextSample(ReportLib* report_lib) EXPORT;
+// Read up to max_samples samples in columns. Return nullptr if there are no more samples. The
+// returned batch is valid until the next call. Strings, symbols, mappings and events in the batch
+// are referred by ids, which can be looked up by GetStringTable(), GetSymbolTable(),
+// GetMappingById() and GetEventById(). Tracing data isn't returned in batches.
+SampleBatch* GetNextSampleBatch(ReportLib* report_lib, uint32_t max_samples) EXPORT;
+StringTable* GetStringTable(ReportLib* report_lib) EXPORT;
+SymbolTable* GetSymbolTable(ReportLib* report_lib) EXPORT;
+Event* GetEventById(ReportLib* report_lib, uint32_t event_id) EXPORT;
+Mapping* GetMappingById(ReportLib* report_lib, uint32_t mapping_id) EXPORT;
 Event* GetEventOfCurrentSample(ReportLib* report_lib) EXPORT;
 SymbolEntry* GetSymbolOfCurrentSample(ReportLib* report_lib) EXPORT;
 CallChain* GetCallChainOfCurrentSample(ReportLib* report_lib) EXPORT;
@@ -668,6 +1063,10 @@ bool SetSymfs(ReportLib* report_lib, const char* symfs_dir) {
   return report_lib->SetSymfs(symfs_dir);
 }
 
+bool SetSymbolCacheDir(ReportLib* report_lib, const char* cache_dir) {
+  return report_lib->SetSymbolCacheDir(cache_dir);
+}
+
 bool SetRecordFile(ReportLib* report_lib, const char* record_file) {
   return report_lib->SetRecordFile(record_file);
 }
@@ -688,6 +1087,10 @@ void MergeJavaMethods(ReportLib* report_lib, bool merge) {
   return report_lib->MergeJavaMethods(merge);
 }
 
+void FillSymbolIds(ReportLib* report_lib, bool fill) {
+  return report_lib->FillSymbolIds(fill);
+}
+
 bool SetKallsymsFile(ReportLib* report_lib, const char* kallsyms_file) {
   return report_lib->SetKallsymsFile(kallsyms_file);
 }
@@ -713,10 +1116,38 @@ bool AggregateThreads(ReportLib* report_lib, const char** thread_name_regex,
   return report_lib->AggregateThreads(thread_name_regex, thread_name_regex_len);
 }
 
+bool SeekByTime(ReportLib* report_lib, uint64_t start_time_in_ns, uint64_t end_time_in_ns) {
+  return report_lib->SeekByTime(start_time_in_ns, end_time_in_ns);
+}
+
+bool SeekByPids(ReportLib* report_lib, const int* pids, int pids_len) {
+  return report_lib->SeekByPids(pids, pids_len);
+}
+
 Sample* GetNextSample(ReportLib* report_lib) {
   return report_lib->GetNextSample();
 }
 
+SampleBatch* GetNextSampleBatch(ReportLib* report_lib, uint32_t max_samples) {
+  return report_lib->GetNextSampleBatch(max_samples);
+}
+
+StringTable* GetStringTable(ReportLib* report_lib) {
+  return report_lib->GetStringTable();
+}
+
+SymbolTable* GetSymbolTable(ReportLib* report_lib) {
+  return report_lib->GetSymbolTable();
+}
+
+Event* GetEventById(ReportLib* report_lib, uint32_t event_id) {
+  return report_lib->GetEventById(event_id);
+}
+
+Mapping* GetMappingById(ReportLib* report_lib, uint32_t mapping_id) {
+  return report_lib->GetMappingById(mapping_id);
+}
+
 Event* GetEventOfCurrentSample(ReportLib* report_lib) {
   return report_lib->GetEventOfCurrentSample();
 }
@@ -398,10 +398,11 @@ std::vector<CallChainReportEntry> CallChainReportBuilder::Build(const ThreadEntr
   std::vector<CallChainReportEntry> result;
   result.reserve(ips.size());
   for (size_t i = 0; i < ips.size(); i++) {
-    const MapEntry* map = thread_tree_.FindMap(thread, ips[i], i < kernel_ip_count);
-    Dso* dso = map->dso;
+    const MapEntry* map;
+    Dso* dso;
     uint64_t vaddr_in_file;
-    const Symbol* symbol = thread_tree_.FindSymbol(map, ips[i], &vaddr_in_file, &dso);
+    const Symbol* symbol = thread_tree_.FindMapAndSymbol(thread, ips[i], i < kernel_ip_count,
+                                                         &map, &vaddr_in_file, &dso);
     CallChainExecutionType execution_type = CallChainExecutionType::NATIVE_METHOD;
     if (dso->IsForJavaMethod()) {
       if (dso->type() == DSO_DEX_FILE) {
@@ -97,7 +97,9 @@ class SampleTreeBuilder {
       return;
     }
     if (accumulate_callchain_) {
-      std::vector<uint64_t> ips;
+      // Reuse buffers across samples, to avoid allocations for each sample.
+      std::vector<uint64_t>& ips = ips_buffer_;
+      ips.clear();
       if (r.sample_type & PERF_SAMPLE_CALLCHAIN) {
         ips.insert(ips.end(), r.callchain_data.ips, r.callchain_data.ips + r.callchain_data.ip_nr);
       }
@@ -108,8 +110,8 @@ class SampleTreeBuilder {
           (r.regs_user_data.reg_mask != 0) && (r.sample_type & PERF_SAMPLE_STACK_USER) &&
           (r.GetValidStackSize() > 0)) {
         RegSet regs(r.regs_user_data.abi, r.regs_user_data.reg_mask, r.regs_user_data.regs);
-        std::vector<uint64_t> user_ips;
-        std::vector<uint64_t> sps;
+        std::vector<uint64_t>& user_ips = user_ips_buffer_;
+        std::vector<uint64_t>& sps = sps_buffer_;
         if (offline_unwinder_->UnwindCallChain(*thread, regs, r.stack_user_data.data,
                                                r.GetValidStackSize(), &user_ips, &sps)) {
           ips.push_back(PERF_CONTEXT_USER);
@@ -117,7 +119,8 @@ class SampleTreeBuilder {
         }
       }
 
-      std::vector<EntryT*> callchain;
+      std::vector<EntryT*>& callchain = callchain_buffer_;
+      callchain.clear();
       callchain.push_back(sample);
 
       bool first_ip = true;
@@ -151,20 +154,20 @@ class SampleTreeBuilder {
       }
 
       if (build_callchain_) {
-        std::set<EntryT*> added_set;
         if (use_caller_as_callchain_root_) {
           std::reverse(callchain.begin(), callchain.end());
         }
+        ResetVisitedSamples(callchain.size());
         EntryT* parent = nullptr;
-        while (callchain.size() >= 2) {
-          EntryT* sample = callchain[0];
-          callchain.erase(callchain.begin());
+        // Each sample in the callchain records the part of the callchain after it.
+        for (size_t i = 0; i + 1 < callchain.size(); i++) {
+          EntryT* sample = callchain[i];
           // Add only once for recursive calls on callchain.
-          if (added_set.find(sample) != added_set.end()) {
+          if (!AddVisitedSample(sample)) {
             continue;
           }
-          added_set.insert(sample);
-          InsertCallChainForSample(sample, callchain, acc_info);
+          InsertCallChainForSample(sample, callchain.data() + i + 1, callchain.size() - i - 1,
+                                   acc_info);
           UpdateCallChainParentInfo(sample, parent);
           parent = sample;
         }
@@ -172,6 +175,51 @@ class SampleTreeBuilder {
     }
   }
 
+  // Merge samples built by another builder using the same options, like a builder running in
+  // another thread. Samples of the other builder are moved into this builder.
+  void MergeSampleTree(SampleTreeBuilder& other) {
+    // Map samples in the other builder to the matching samples in this builder.
+    std::unordered_map<EntryT*, EntryT*> sample_map;
+    auto find_sample = [&](EntryT* sample) {
+      auto it = sample_map.find(sample);
+      return it == sample_map.end() ? sample : it->second;
+    };
+    for (EntryT* sample : other.filtered_sample_set_) {
+      if (auto it = filtered_sample_set_.find(sample); it != filtered_sample_set_.end()) {
+        sample_map[sample] = *it;
+      } else {
+        filtered_sample_set_.insert(sample);
+      }
+    }
+    for (EntryT* sample : other.sample_set_) {
+      if (auto it = sample_set_.find(sample); it != sample_set_.end()) {
+        MergeSample(*it, sample);
+        MergeCallChain(*it, sample);
+        sample_map[sample] = *it;
+      } else {
+        sample_set_.insert(sample);
+      }
+    }
+    for (auto& [sample, info] : other.callchain_parent_map_) {
+      EntryT* key = find_sample(sample);
+      EntryT* parent = find_sample(info.parent);
+      auto it = callchain_parent_map_.find(key);
+      if (it == callchain_parent_map_.end()) {
+        callchain_parent_map_[key] = CallChainParentInfo{parent, info.has_multiple_parents};
+      } else if (info.has_multiple_parents || it->second.parent != parent) {
+        it->second.has_multiple_parents = true;
+      }
+    }
+    // Merged samples may still be referenced in callchains, so keep them alive.
+    for (auto& sample : other.sample_storage_) {
+      sample_storage_.emplace_back(std::move(sample));
+    }
+    other.sample_set_.clear();
+    other.filtered_sample_set_.clear();
+    other.sample_storage_.clear();
+    other.callchain_parent_map_.clear();
+  }
+
   std::vector<EntryT*> GetSamples() const {
     std::vector<EntryT*> result;
     for (auto& entry : sample_set_) {
@@ -195,6 +243,8 @@ class SampleTreeBuilder {
   virtual void UpdateSummary(const EntryT*) {}
 
   virtual void MergeSample(EntryT* sample1, EntryT* sample2) = 0;
+  // Merge the callchain of sample2 into sample1. Used by MergeSampleTree().
+  virtual void MergeCallChain(EntryT* sample1, EntryT* sample2) = 0;
 
   EntryT* InsertSample(std::unique_ptr<EntryT> sample) {
     if (sample == nullptr) {
@@ -241,12 +291,13 @@ class SampleTreeBuilder {
     return InsertSample(std::move(sample));
   }
 
-  void InsertCallChainForSample(EntryT* sample, const std::vector<EntryT*>& callchain,
+  void InsertCallChainForSample(EntryT* sample, EntryT* const* callchain, size_t size,
                                 const AccumulateInfoT& acc_info) {
     uint64_t period = GetPeriodForCallChain(acc_info);
-    sample->callchain.AddCallChain(callchain, period, [&](const EntryT* s1, const EntryT* s2) {
-      return sample_comparator_.IsSameSample(s1, s2);
-    });
+    sample->callchain.AddCallChain(callchain, size, period,
+                                   [&](const EntryT* s1, const EntryT* s2) {
+                                     return sample_comparator_.IsSameSample(s1, s2);
+                                   });
   }
 
   void AddCallChainDuplicateInfo() {
@@ -262,8 +313,34 @@ class SampleTreeBuilder {
 
   std::set<EntryT*, SampleComparator<EntryT>> sample_set_;
   bool accumulate_callchain_;
+  const SampleComparator<EntryT> sample_comparator_;
 
  private:
+  // visited_samples_ is a flat hash set used to find recursive calls in a callchain. Its size is
+  // kept at least twice the callchain length, so lookups don't need to probe far.
+  void ResetVisitedSamples(size_t callchain_size) {
+    size_t capacity = 16;
+    while (capacity < callchain_size * 2) {
+      capacity *= 2;
+    }
+    visited_samples_.assign(capacity, nullptr);
+  }
+
+  // Return false if the sample is already visited.
+  bool AddVisitedSample(EntryT* sample) {
+    size_t mask = visited_samples_.size() - 1;
+    uint64_t hash = reinterpret_cast<uintptr_t>(sample) * 0x9E3779B97F4A7C15ULL;
+    for (size_t i = (hash >> 32) & mask;; i = (i + 1) & mask) {
+      if (visited_samples_[i] == sample) {
+        return false;
+      }
+      if (visited_samples_[i] == nullptr) {
+        visited_samples_[i] = sample;
+        return true;
+      }
+    }
+  }
+
   void UpdateCallChainParentInfo(EntryT* sample, EntryT* parent) {
     if (parent == nullptr) {
       return;
@@ -279,7 +356,6 @@ class SampleTreeBuilder {
     }
   }
 
-  const SampleComparator<EntryT> sample_comparator_;
   // If a Sample/CallChainSample is filtered out, it is stored in filtered_sample_set_,
   // and only used in other EntryT's callchain.
   std::set<EntryT*, SampleComparator<EntryT>> filtered_sample_set_;
@@ -295,6 +371,13 @@ class SampleTreeBuilder {
   bool build_callchain_;
   bool use_caller_as_callchain_root_;
   std::unique_ptr<OfflineUnwinder> offline_unwinder_;
+
+  // Buffers reused when processing samples.
+  std::vector<uint64_t> ips_buffer_;
+  std::vector<uint64_t> user_ips_buffer_;
+  std::vector<uint64_t> sps_buffer_;
+  std::vector<EntryT*> callchain_buffer_;
+  std::vector<EntryT*> visited_samples_;
 };
 
 template <typename EntryT>
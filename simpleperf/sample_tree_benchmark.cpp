@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+#include "event_attr.h"
+#include "event_type.h"
+#include "sample_tree.h"
+
+using namespace simpleperf;
+
+namespace {
+
+struct BenchSample {
+  uint64_t ip;
+  uint64_t period;
+  uint64_t accumulated_period;
+  CallChainRoot<BenchSample> callchain;
+
+  BenchSample(uint64_t ip, uint64_t period, uint64_t accumulated_period)
+      : ip(ip), period(period), accumulated_period(accumulated_period) {}
+};
+
+BUILD_COMPARE_VALUE_FUNCTION(CompareIp, ip);
+
+// Build a call graph like `report -g`, with each ip as a function.
+class BenchSampleTreeBuilder : public SampleTreeBuilder<BenchSample, uint64_t> {
+ public:
+  explicit BenchSampleTreeBuilder(const SampleComparator<BenchSample>& comparator)
+      : SampleTreeBuilder(comparator) {
+    SetCallChainSampleOptions(true, true, true);
+  }
+
+ protected:
+  BenchSample* CreateSample(const SampleRecord& r, bool, uint64_t* acc_info) override {
+    *acc_info = r.period_data.period;
+    return InsertSample(std::make_unique<BenchSample>(r.ip_data.ip, r.period_data.period, 0));
+  }
+  BenchSample* CreateBranchSample(const SampleRecord&, const BranchStackItemType&) override {
+    return nullptr;
+  }
+  BenchSample* CreateCallChainSample(const ThreadEntry*, const BenchSample*, uint64_t ip, bool,
+                                     const std::vector<BenchSample*>& callchain,
+                                     const uint64_t& acc_info) override {
+    return InsertCallChainSample(std::make_unique<BenchSample>(ip, 0, acc_info), callchain);
+  }
+  const ThreadEntry* GetThreadOfSample(BenchSample*) override { return nullptr; }
+  uint64_t GetPeriodForCallChain(const uint64_t& acc_info) override { return acc_info; }
+  void MergeSample(BenchSample* sample1, BenchSample* sample2) override {
+    sample1->period += sample2->period;
+    sample1->accumulated_period += sample2->accumulated_period;
+  }
+  void MergeCallChain(BenchSample* sample1, BenchSample* sample2) override {
+    sample1->callchain.MergeCallChain(sample2->callchain,
+                                      [this](const BenchSample* s1, const BenchSample* s2) {
+                                        return sample_comparator_.IsSameSample(s1, s2);
+                                      });
+  }
+};
+
+// Generate samples with deep stacks, like those of Java code. Stacks share a common root part,
+// and some have recursive calls.
+std::vector<std::unique_ptr<SampleRecord>> GenerateDeepStackSamples(size_t count,
+                                                                    size_t max_depth) {
+  const EventType* type = FindEventTypeByName("cpu-clock");
+  perf_event_attr attr = CreateDefaultPerfEventAttr(*type);
+  attr.sample_type |= PERF_SAMPLE_CALLCHAIN;
+  std::mt19937_64 rng(0);
+  std::vector<std::unique_ptr<SampleRecord>> samples;
+  for (size_t i = 0; i < count; i++) {
+    size_t depth = max_depth / 2 + rng() % (max_depth / 2 + 1);
+    uint64_t path = rng() % 32;
+    std::vector<uint64_t> ips(depth);
+    for (size_t d = 0; d < depth; d++) {
+      uint64_t ip;
+      if (d < 16) {
+        ip = 0x100000 + d * 4;
+      } else if (path % 4 == 0 && d < 48) {
+        // Recursive calls of three functions.
+        ip = 0x200000 + (d % 3) * 4;
+      } else {
+        ip = 0x300000 + path * 0x10000 + d * 4;
+      }
+      // ips[0] is the leaf function.
+      ips[depth - 1 - d] = ip;
+    }
+    samples.emplace_back(std::make_unique<SampleRecord>(attr, 0, ips[0], 1, 1, i, 0, 1,
+                                                        PerfSampleReadType(), ips,
+                                                        std::vector<char>(), 0));
+  }
+  return samples;
+}
+
+void BM_BuildCallGraph(benchmark::State& state) {
+  auto samples = GenerateDeepStackSamples(10000, state.range(0));
+  SampleComparator<BenchSample> comparator;
+  comparator.AddCompareFunction(CompareIp);
+  for (auto _ : state) {
+    BenchSampleTreeBuilder builder(comparator);
+    for (const auto& r : samples) {
+      builder.ProcessSampleRecord(*r);
+    }
+    benchmark::DoNotOptimize(builder.GetSamples());
+  }
+  state.SetItemsProcessed(state.iterations() * samples.size());
+}
+BENCHMARK(BM_BuildCallGraph)->Arg(16)->Arg(64)->Arg(128)->Unit(benchmark::kMillisecond);
+
+}  // namespace
@@ -16,6 +16,11 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <map>
+
+#include "event_attr.h"
+#include "event_type.h"
 #include "sample_tree.h"
 #include "thread_tree.h"
 
@@ -83,6 +88,7 @@ class TestSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, int> {
   void MergeSample(SampleEntry* sample1, SampleEntry* sample2) override {
     sample1->sample_count += sample2->sample_count;
   }
+  void MergeCallChain(SampleEntry*, SampleEntry*) override {}
 
  private:
   ThreadTree* thread_tree_;
@@ -109,6 +115,113 @@ static void CheckSamples(const std::vector<SampleEntry*>& samples,
     ASSERT_FALSE(has_error) << "Error matching sample at pos " << i;
   }
 }
+
+struct CallChainSample {
+  uint64_t ip;
+  uint64_t period;
+  uint64_t accumulated_period;
+  CallChainRoot<CallChainSample> callchain;
+
+  CallChainSample(uint64_t ip, uint64_t period, uint64_t accumulated_period)
+      : ip(ip), period(period), accumulated_period(accumulated_period) {}
+};
+
+BUILD_COMPARE_VALUE_FUNCTION(TestCompareIp, ip);
+
+// Build a call graph like `report -g --children`, with each ip as a function.
+class CallChainSampleTreeBuilder : public SampleTreeBuilder<CallChainSample, uint64_t> {
+ public:
+  CallChainSampleTreeBuilder() : SampleTreeBuilder(CreateComparator()) {
+    SetCallChainSampleOptions(true, true, false);
+  }
+
+  void MarkDuplicatedCallChains() { AddCallChainDuplicateInfo(); }
+
+ protected:
+  static SampleComparator<CallChainSample> CreateComparator() {
+    SampleComparator<CallChainSample> comparator;
+    comparator.AddCompareFunction(TestCompareIp);
+    return comparator;
+  }
+
+  CallChainSample* CreateSample(const SampleRecord& r, bool, uint64_t* acc_info) override {
+    *acc_info = r.period_data.period;
+    return InsertSample(std::make_unique<CallChainSample>(r.ip_data.ip, r.period_data.period,
+                                                          r.period_data.period));
+  }
+  CallChainSample* CreateBranchSample(const SampleRecord&, const BranchStackItemType&) override {
+    return nullptr;
+  }
+  CallChainSample* CreateCallChainSample(const ThreadEntry*, const CallChainSample*, uint64_t ip,
+                                         bool, const std::vector<CallChainSample*>& callchain,
+                                         const uint64_t& acc_info) override {
+    return InsertCallChainSample(std::make_unique<CallChainSample>(ip, 0, acc_info), callchain);
+  }
+  const ThreadEntry* GetThreadOfSample(CallChainSample*) override { return nullptr; }
+  uint64_t GetPeriodForCallChain(const uint64_t& acc_info) override { return acc_info; }
+  void MergeSample(CallChainSample* sample1, CallChainSample* sample2) override {
+    sample1->period += sample2->period;
+    sample1->accumulated_period += sample2->accumulated_period;
+  }
+  void MergeCallChain(CallChainSample* sample1, CallChainSample* sample2) override {
+    sample1->callchain.MergeCallChain(
+        sample2->callchain, [this](const CallChainSample* s1, const CallChainSample* s2) {
+          return sample_comparator_.IsSameSample(s1, s2);
+        });
+  }
+};
+
+// Samples with callchains, ips[0] is the leaf function. Some have recursive calls.
+static const std::vector<std::pair<std::vector<uint64_t>, uint64_t>> kCallChainSamples = {
+    {{1, 2, 3}, 1},       {{1, 2, 3}, 2},           {{4, 2, 3}, 4},
+    {{2, 3, 2, 3, 5}, 8}, {{4, 3, 2, 3, 2, 5}, 16}, {{5}, 32},
+};
+
+static std::unique_ptr<SampleRecord> CreateCallChainSampleRecord(const std::vector<uint64_t>& ips,
+                                                                 uint64_t period) {
+  const EventType* type = FindEventTypeByName("cpu-clock");
+  perf_event_attr attr = CreateDefaultPerfEventAttr(*type);
+  attr.sample_type |= PERF_SAMPLE_CALLCHAIN;
+  return std::make_unique<SampleRecord>(attr, 0, ips[0], 1, 1, 0, 0, period, PerfSampleReadType(),
+                                        ips, std::vector<char>(), 0);
+}
+
+// Print a callchain tree in a form not depending on the order of children.
+template <typename EntryT, typename GetNameFn>
+static std::string CallChainToString(const CallChainRoot<EntryT>& root, GetNameFn get_name) {
+  std::function<std::string(const std::vector<std::unique_ptr<CallChainNode<EntryT>>>&)>
+      children_to_string = [&](const auto& children) {
+        std::vector<std::string> strs;
+        for (const auto& node : children) {
+          std::string s = "[";
+          for (const EntryT* entry : node->chain) {
+            s += std::to_string(get_name(entry)) + " ";
+          }
+          s += "] " + std::to_string(node->period) + "/" + std::to_string(node->children_period) +
+               " " + children_to_string(node->children);
+          strs.emplace_back(std::move(s));
+        }
+        std::sort(strs.begin(), strs.end());
+        std::string result = "{";
+        for (const auto& s : strs) {
+          result += s + ",";
+        }
+        return result + "}";
+      };
+  return std::to_string(root.children_period) + " " + children_to_string(root.children);
+}
+
+static std::map<uint64_t, std::string> DumpCallChainSamples(CallChainSampleTreeBuilder& builder) {
+  builder.MarkDuplicatedCallChains();
+  std::map<uint64_t, std::string> result;
+  for (const CallChainSample* sample : builder.GetSamples()) {
+    result[sample->ip] =
+        std::to_string(sample->period) + " " + std::to_string(sample->accumulated_period) + " " +
+        (sample->callchain.duplicated ? "duplicated " : "") +
+        CallChainToString(sample->callchain, [](const CallChainSample* s) { return s->ip; });
+  }
+  return result;
+}
 }  // namespace
 
 class SampleTreeTest : public testing::Test {
@@ -204,6 +317,106 @@ TEST_F(SampleTreeTest, map_kernel) {
   CheckSamples(expected_samples);
 }
 
+TEST_F(SampleTreeTest, merge_sample_tree) {
+  TestSampleTreeBuilder other_builder(&thread_tree);
+  sample_tree_builder->AddSample(1, 1, 1, false);
+  sample_tree_builder->AddSample(2, 2, 1, false);
+  other_builder.AddSample(1, 1, 2, false);
+  other_builder.AddSample(1, 11, 1, false);
+  sample_tree_builder->MergeSampleTree(other_builder);
+  std::vector<SampleEntry> expected_samples = {
+      SampleEntry(1, 1, "p1t1", "process1_thread1", 1, 2),
+      SampleEntry(1, 11, "p1t11", "process1_thread1", 1, 1),
+      SampleEntry(2, 2, "p2t2", "process2_thread2", 1, 1),
+  };
+  CheckSamples(expected_samples);
+  ASSERT_TRUE(other_builder.GetSamples().empty());
+}
+
+TEST_F(SampleTreeTest, merge_sample_tree_with_callchains) {
+  // Build a sample tree in one builder, and in two builders each processing half of the samples.
+  CallChainSampleTreeBuilder expected_builder;
+  CallChainSampleTreeBuilder builder1;
+  CallChainSampleTreeBuilder builder2;
+  for (size_t i = 0; i < kCallChainSamples.size(); i++) {
+    auto r = CreateCallChainSampleRecord(kCallChainSamples[i].first, kCallChainSamples[i].second);
+    expected_builder.ProcessSampleRecord(*r);
+    (i % 2 == 0 ? builder1 : builder2).ProcessSampleRecord(*r);
+  }
+  builder1.MergeSampleTree(builder2);
+  ASSERT_TRUE(builder2.GetSamples().empty());
+
+  std::map<uint64_t, std::string> expected = DumpCallChainSamples(expected_builder);
+  ASSERT_EQ(DumpCallChainSamples(builder1), expected);
+  // Check a function called recursively. Its accumulated period counts each sample once.
+  ASSERT_EQ(expected[3], "0 31 24 {[2 3 ] 0/24 {[2 5 ] 16/0 {},[5 ] 8/0 {},},}");
+
+  uint64_t total_period = 0;
+  for (const CallChainSample* sample : builder1.GetSamples()) {
+    total_period += sample->period;
+  }
+  ASSERT_EQ(total_period, 63u);
+}
+
+TEST_F(SampleTreeTest, merge_sample_tree_into_empty_tree) {
+  CallChainSampleTreeBuilder expected_builder;
+  CallChainSampleTreeBuilder builder;
+  for (const auto& [ips, period] : kCallChainSamples) {
+    auto r = CreateCallChainSampleRecord(ips, period);
+    expected_builder.ProcessSampleRecord(*r);
+    builder.ProcessSampleRecord(*r);
+  }
+  CallChainSampleTreeBuilder empty_builder;
+  empty_builder.MergeSampleTree(builder);
+  ASSERT_EQ(DumpCallChainSamples(empty_builder), DumpCallChainSamples(expected_builder));
+
+  // Merging an empty tree doesn't change anything.
+  CallChainSampleTreeBuilder another_empty_builder;
+  empty_builder.MergeSampleTree(another_empty_builder);
+  ASSERT_EQ(DumpCallChainSamples(empty_builder), DumpCallChainSamples(expected_builder));
+}
+
+TEST(callchain, merge_callchain) {
+  int a = 1, b = 2, c = 3;
+  auto is_same = [](const int* x, const int* y) { return *x == *y; };
+  CallChainRoot<int> root1;
+  root1.AddCallChain({&a, &b}, 1, is_same);
+  CallChainRoot<int> root2;
+  root2.AddCallChain({&a, &b}, 2, is_same);
+  root2.AddCallChain({&a, &c}, 4, is_same);
+  root2.AddCallChain({&a}, 8, is_same);
+  root1.MergeCallChain(root2, is_same);
+
+  ASSERT_EQ(root1.children_period, 15u);
+  ASSERT_EQ(root1.children.size(), 1u);
+  auto& node_a = root1.children[0];
+  ASSERT_EQ(node_a->chain.size(), 1u);
+  ASSERT_EQ(node_a->period, 8u);
+  ASSERT_EQ(node_a->children_period, 7u);
+  ASSERT_EQ(node_a->children.size(), 2u);
+  ASSERT_EQ(*node_a->children[0]->chain[0], b);
+  ASSERT_EQ(node_a->children[0]->period, 3u);
+  ASSERT_EQ(*node_a->children[1]->chain[0], c);
+  ASSERT_EQ(node_a->children[1]->period, 4u);
+}
+
+TEST(callchain, merge_callchain_with_empty_tree) {
+  int a = 1, b = 2, c = 3;
+  auto is_same = [](const int* x, const int* y) { return *x == *y; };
+  auto get_name = [](const int* x) { return *x; };
+  CallChainRoot<int> root;
+  root.AddCallChain({&a, &b, &c}, 1, is_same);
+  root.AddCallChain({&a, &b}, 2, is_same);
+  root.AddCallChain({&a, &c, &a}, 4, is_same);
+  std::string expected = CallChainToString(root, get_name);
+
+  CallChainRoot<int> empty_root;
+  root.MergeCallChain(empty_root, is_same);
+  ASSERT_EQ(CallChainToString(root, get_name), expected);
+  empty_root.MergeCallChain(root, is_same);
+  ASSERT_EQ(CallChainToString(empty_root, get_name), expected);
+}
+
 TEST(sample_tree, overlapped_map) {
   ThreadTree thread_tree;
   TestSampleTreeBuilder sample_tree_builder(&thread_tree);
@@ -25,7 +25,7 @@ from collections import namedtuple
 import ctypes as ct
 from pathlib import Path
 import struct
-from typing import Any, Dict, List, Optional, Union
+from typing import Any, Dict, List, Optional, Set, Tuple, Union
 
 from simpleperf_utils import (bytes_to_str, get_host_binary_path, is_windows, log_exit,
                               str_to_bytes, ReportLibOptions)
@@ -186,13 +186,20 @@ class SymbolStruct(ct.Structure):
         symbol_addr: start addr of the function containing the instruction.
         symbol_len: length of the function in the shared library.
         mapping: the mapping area hit by the instruction.
+        symbol_id, dso_id, mapping_id: ids that stay the same for a symbol, dso_name or mapping
+          in a recording file. They can be used to cache info converted from the above fields.
+          dso_id is a string id, see ReportLib.GetString(). symbol_id and dso_id are only
+          filled after calling ReportLib.FillSymbolIds(). Otherwise they are 0xffffffff.
     """
     _fields_ = [('_dso_name', ct.c_char_p),
                 ('vaddr_in_file', ct.c_uint64),
                 ('_symbol_name', ct.c_char_p),
                 ('symbol_addr', ct.c_uint64),
                 ('symbol_len', ct.c_uint64),
-                ('mapping', ct.POINTER(MappingStruct))]
+                ('mapping', ct.POINTER(MappingStruct)),
+                ('symbol_id', ct.c_uint32),
+                ('dso_id', ct.c_uint32),
+                ('mapping_id', ct.c_uint32)]
 
     @property
     def dso_name(self) -> str:
@@ -234,10 +241,56 @@ class FeatureSectionStructure(ct.Structure):
                 ('data_size', ct.c_uint32)]
 
 
+class SampleBatchStruct(ct.Structure):
+    _fields_ = [('sample_count', ct.c_uint32),
+                ('time', ct.POINTER(ct.c_uint64)),
+                ('pid', ct.POINTER(ct.c_uint32)),
+                ('tid', ct.POINTER(ct.c_uint32)),
+                ('thread_comm_id', ct.POINTER(ct.c_uint32)),
+                ('cpu', ct.POINTER(ct.c_uint32)),
+                ('in_kernel', ct.POINTER(ct.c_uint32)),
+                ('event_id', ct.POINTER(ct.c_uint32)),
+                ('period', ct.POINTER(ct.c_uint64)),
+                ('callchain_offsets', ct.POINTER(ct.c_uint32)),
+                ('ip', ct.POINTER(ct.c_uint64)),
+                ('vaddr_in_file', ct.POINTER(ct.c_uint64)),
+                ('symbol_id', ct.POINTER(ct.c_uint32)),
+                ('dso_id', ct.POINTER(ct.c_uint32)),
+                ('mapping_id', ct.POINTER(ct.c_uint32))]
+
+
+class StringTableStruct(ct.Structure):
+    _fields_ = [('count', ct.c_uint32),
+                ('strings', ct.POINTER(ct.c_char_p))]
+
+
+class SymbolTableStruct(ct.Structure):
+    _fields_ = [('count', ct.c_uint32),
+                ('name_id', ct.POINTER(ct.c_uint32)),
+                ('addr', ct.POINTER(ct.c_uint64)),
+                ('len', ct.POINTER(ct.c_uint64))]
+
+
 class ReportLibStructure(ct.Structure):
     _fields_ = []
 
 
+# Samples returned by ReportLib.GetNextSampleBatch(), stored in columns. Each field is a list.
+#   time, pid, tid, thread_comm_id, cpu, in_kernel, event_id, period: one element per sample.
+#   callchain_offsets: one element per sample, plus one at the end.
+#   ip, vaddr_in_file, symbol_id, dso_id, mapping_id: one element per callchain entry. The
+#     callchain of sample i, starting from the sampled ip, is in
+#     [callchain_offsets[i], callchain_offsets[i + 1]).
+#   thread_comm_id and dso_id are ids of strings. Use ReportLib.GetString() to get the strings.
+#   symbol_id is id of a symbol. Use ReportLib.GetSymbolById() to get the symbol.
+#   event_id is id of an event. Use ReportLib.GetEventById() to get the event.
+#   mapping_id is id of a mapping. Use ReportLib.GetMappingById() to get the mapping.
+SampleBatch = namedtuple('SampleBatch', [
+    'time', 'pid', 'tid', 'thread_comm_id', 'cpu', 'in_kernel', 'event_id', 'period',
+    'callchain_offsets', 'ip', 'vaddr_in_file', 'symbol_id', 'dso_id', 'mapping_id'])
+BatchSymbol = namedtuple('BatchSymbol', ['symbol_name', 'symbol_addr', 'symbol_len'])
+
+
 # pylint: disable=invalid-name
 class ReportLib(object):
     """ Read contents from perf.data. """
@@ -253,11 +306,13 @@ class ReportLib(object):
         self._DestroyReportLibFunc = self._lib.DestroyReportLib
         self._SetLogSeverityFunc = self._lib.SetLogSeverity
         self._SetSymfsFunc = self._lib.SetSymfs
+        self._SetSymbolCacheDirFunc = self._lib.SetSymbolCacheDir
         self._SetRecordFileFunc = self._lib.SetRecordFile
         self._SetKallsymsFileFunc = self._lib.SetKallsymsFile
         self._ShowIpForUnknownSymbolFunc = self._lib.ShowIpForUnknownSymbol
         self._ShowArtFramesFunc = self._lib.ShowArtFrames
         self._MergeJavaMethodsFunc = self._lib.MergeJavaMethods
+        self._FillSymbolIdsFunc = self._lib.FillSymbolIds
         self._AddProguardMappingFileFunc = self._lib.AddProguardMappingFile
         self._AddProguardMappingFileFunc.restype = ct.c_bool
         self._GetSupportedTraceOffCpuModesFunc = self._lib.GetSupportedTraceOffCpuModes
@@ -268,8 +323,22 @@ class ReportLib(object):
         self._SetSampleFilterFunc.restype = ct.c_bool
         self._AggregateThreadsFunc = self._lib.AggregateThreads
         self._AggregateThreadsFunc.restype = ct.c_bool
+        self._SeekByTimeFunc = self._lib.SeekByTime
+        self._SeekByTimeFunc.restype = ct.c_bool
+        self._SeekByPidsFunc = self._lib.SeekByPids
+        self._SeekByPidsFunc.restype = ct.c_bool
         self._GetNextSampleFunc = self._lib.GetNextSample
         self._GetNextSampleFunc.restype = ct.POINTER(SampleStruct)
+        self._GetNextSampleBatchFunc = self._lib.GetNextSampleBatch
+        self._GetNextSampleBatchFunc.restype = ct.POINTER(SampleBatchStruct)
+        self._GetStringTableFunc = self._lib.GetStringTable
+        self._GetStringTableFunc.restype = ct.POINTER(StringTableStruct)
+        self._GetSymbolTableFunc = self._lib.GetSymbolTable
+        self._GetSymbolTableFunc.restype = ct.POINTER(SymbolTableStruct)
+        self._GetEventByIdFunc = self._lib.GetEventById
+        self._GetEventByIdFunc.restype = ct.POINTER(EventStruct)
+        self._GetMappingByIdFunc = self._lib.GetMappingById
+        self._GetMappingByIdFunc.restype = ct.POINTER(MappingStruct)
         self._GetEventOfCurrentSampleFunc = self._lib.GetEventOfCurrentSample
         self._GetEventOfCurrentSampleFunc.restype = ct.POINTER(EventStruct)
         self._GetSymbolOfCurrentSampleFunc = self._lib.GetSymbolOfCurrentSample
@@ -288,6 +357,8 @@ class ReportLib(object):
         self.meta_info: Optional[Dict[str, str]] = None
         self.current_sample: Optional[SampleStruct] = None
         self.record_cmd: Optional[str] = None
+        self._strings: List[str] = []
+        self._symbols: List[BatchSymbol] = []
 
     def _get_native_lib(self) -> str:
         return get_host_binary_path('libsimpleperf_report.so')
@@ -326,6 +397,11 @@ class ReportLib(object):
         cond: bool = self._SetSymfsFunc(self.getInstance(), _char_pt(symfs_dir))
         _check(cond, 'Failed to set symbols directory')
 
+    def SetSymbolCacheDir(self, cache_dir: str):
+        """ Set directory used to cache symbol tables read from binaries, keyed by build id."""
+        cond: bool = self._SetSymbolCacheDirFunc(self.getInstance(), _char_pt(cache_dir))
+        _check(cond, 'Failed to set symbol cache directory')
+
     def SetRecordFile(self, record_file: str):
         """ Set the path of record file, like perf.data."""
         cond: bool = self._SetRecordFileFunc(self.getInstance(), _char_pt(record_file))
@@ -349,6 +425,13 @@ class ReportLib(object):
         """
         self._MergeJavaMethodsFunc(self.getInstance(), merge)
 
+    def FillSymbolIds(self, fill: bool = True):
+        """ Fill symbol_id and dso_id in symbols returned by GetSymbolOfCurrentSample() and
+            GetCallChainOfCurrentSample(). It costs extra time per sample, so it is off by
+            default. Samples returned by GetNextSampleBatch() always have ids.
+        """
+        self._FillSymbolIdsFunc(self.getInstance(), fill)
+
     def AddProguardMappingFile(self, mapping_file: Union[str, Path]):
         """ Add proguard mapping.txt to de-obfuscate method names. """
         if not self._AddProguardMappingFileFunc(self.getInstance(), _char_pt(str(mapping_file))):
@@ -417,6 +500,23 @@ class ReportLib(object):
             regex_array, len(thread_name_regex_list))
         _check(res, f'Failed to call AggregateThreads({thread_name_regex_list})')
 
+    def SeekByTime(self, start_time_in_ns: int, end_time_in_ns: int):
+        """ Only report samples with start_time_in_ns <= time < end_time_in_ns. If the recording
+            file has a record index, data without such samples isn't read. It should be called
+            before GetNextSample().
+        """
+        res: bool = self._SeekByTimeFunc(self.getInstance(), ct.c_uint64(start_time_in_ns),
+                                         ct.c_uint64(end_time_in_ns))
+        _check(res, f'Failed to call SeekByTime({start_time_in_ns}, {end_time_in_ns})')
+
+    def SeekByPids(self, pids: List[int]):
+        """ Only report samples of the given processes. If the recording file has a record index,
+            data without such samples isn't read. It should be called before GetNextSample().
+        """
+        pid_array = (ct.c_int * len(pids))(*pids)
+        res: bool = self._SeekByPidsFunc(self.getInstance(), pid_array, len(pids))
+        _check(res, f'Failed to call SeekByPids({pids})')
+
     def GetNextSample(self) -> Optional[SampleStruct]:
         """ Return the next sample. If no more samples, return None. """
         psample = self._GetNextSampleFunc(self.getInstance())
@@ -429,6 +529,54 @@ class ReportLib(object):
     def GetCurrentSample(self) -> Optional[SampleStruct]:
         return self.current_sample
 
+    def GetNextSampleBatch(self, max_samples: int = 4096) -> Optional[SampleBatch]:
+        """ Return up to max_samples samples in a SampleBatch. If no more samples, return None.
+            It is much faster than calling GetNextSample() and GetCallChainOfCurrentSample()
+            for each sample. But it doesn't return tracing data.
+        """
+        pbatch = self._GetNextSampleBatchFunc(self.getInstance(), max_samples)
+        if _is_null(pbatch):
+            return None
+        batch = pbatch[0]
+        n = batch.sample_count
+        entries = batch.callchain_offsets[n]
+        return SampleBatch(
+            time=batch.time[:n], pid=batch.pid[:n], tid=batch.tid[:n],
+            thread_comm_id=batch.thread_comm_id[:n], cpu=batch.cpu[:n],
+            in_kernel=batch.in_kernel[:n], event_id=batch.event_id[:n], period=batch.period[:n],
+            callchain_offsets=batch.callchain_offsets[:n + 1], ip=batch.ip[:entries],
+            vaddr_in_file=batch.vaddr_in_file[:entries], symbol_id=batch.symbol_id[:entries],
+            dso_id=batch.dso_id[:entries], mapping_id=batch.mapping_id[:entries])
+
+    def GetString(self, string_id: int) -> str:
+        """ Return a string referred by a SampleBatch or SymbolStruct. """
+        if string_id >= len(self._strings):
+            table = self._GetStringTableFunc(self.getInstance())[0]
+            for i in range(len(self._strings), table.count):
+                self._strings.append(_char_pt_to_str(table.strings[i]))
+        return self._strings[string_id]
+
+    def GetSymbolById(self, symbol_id: int) -> BatchSymbol:
+        """ Return a symbol referred by a SampleBatch or SymbolStruct. """
+        if symbol_id >= len(self._symbols):
+            table = self._GetSymbolTableFunc(self.getInstance())[0]
+            for i in range(len(self._symbols), table.count):
+                self._symbols.append(BatchSymbol(
+                    self.GetString(table.name_id[i]), table.addr[i], table.len[i]))
+        return self._symbols[symbol_id]
+
+    def GetMappingById(self, mapping_id: int) -> MappingStruct:
+        """ Return a mapping referred by a SampleBatch or SymbolStruct. """
+        mapping = self._GetMappingByIdFunc(self.getInstance(), mapping_id)
+        _check(not _is_null(mapping), f'Failed to call GetMappingById({mapping_id})')
+        return mapping[0]
+
+    def GetEventById(self, event_id: int) -> EventStruct:
+        """ Return an event referred by a SampleBatch. """
+        event = self._GetEventByIdFunc(self.getInstance(), event_id)
+        _check(not _is_null(event), f'Failed to call GetEventById({event_id})')
+        return event[0]
+
     def GetEventOfCurrentSample(self) -> EventStruct:
         event = self._GetEventOfCurrentSampleFunc(self.getInstance())
         assert not _is_null(event)
@@ -577,6 +725,9 @@ class ProtoFileReportLib:
         self.trace_offcpu_mode = None
         # mapping from thread id to the last off-cpu sample in the thread
         self.offcpu_samples = {}
+        # Set by SeekByTime() and SeekByPids().
+        self.time_range: Optional[Tuple[int, int]] = None
+        self.pids: Optional[Set[int]] = None
 
     def Close(self):
         pass
@@ -601,6 +752,9 @@ class ProtoFileReportLib:
     def SetSymfs(self, symfs_dir: str):
         pass
 
+    def SetSymbolCacheDir(self, cache_dir: str):
+        pass
+
     def SetRecordFile(self, record_file: str):
         self.record_file = record_file
         with open(record_file, 'rb') as fh:
@@ -681,6 +835,25 @@ class ProtoFileReportLib:
         raise NotImplementedError(
             'Aggregating threads are not implemented for report_sample profiles')
 
+    def SeekByTime(self, start_time_in_ns: int, end_time_in_ns: int):
+        """ Only report samples with start_time_in_ns <= time < end_time_in_ns. It should be called
+            before GetNextSample().
+        """
+        _check(self.record_index == -1, 'SeekByTime() should be called before GetNextSample()')
+        self.time_range = (start_time_in_ns, end_time_in_ns)
+
+    def SeekByPids(self, pids: List[int]):
+        """ Only report samples of the given processes. It should be called before
+            GetNextSample().
+        """
+        _check(self.record_index == -1, 'SeekByPids() should be called before GetNextSample()')
+        self.pids = set(pids)
+
+    def GetNextSampleBatch(self, max_samples: int = 4096) -> Optional[SampleBatch]:
+        raise NotImplementedError(
+            'Reading samples in batches is not implemented for report_sample profiles. ' +
+            'Please use GetNextSample()')
+
     def GetNextSample(self) -> Optional[ProtoSample]:
         if self.sample_queue:
             self.sample_queue.popleft()
@@ -728,6 +901,10 @@ class ProtoFileReportLib:
             self._add_to_sample_queue(prev_offcpu_sample)
 
     def _add_to_sample_queue(self, sample) -> None:
+        if self.time_range and not self.time_range[0] <= sample.time < self.time_range[1]:
+            return
+        if self.pids is not None and self.thread_map[sample.thread_id].process_id not in self.pids:
+            return
         self.sample_queue.append(sample)
 
     def GetCurrentSample(self) -> Optional[ProtoSample]:
@@ -19,7 +19,7 @@ from pathlib import Path
 import shutil
 import subprocess
 import tempfile
-from typing import Dict, List, Optional, Set
+from typing import Dict, List, Optional, Set, Tuple
 
 from simpleperf_report_lib import ReportLib, ProtoFileReportLib
 from simpleperf_utils import get_host_binary_path, ReadElf
@@ -69,6 +69,76 @@ class TestReportLib(TestBase):
                 self.assertEqual(callchain.nr, 0)
         self.assertTrue(found_sample)
 
+    def test_sample_batch(self):
+        def get_samples_one_by_one():
+            report_lib = ReportLib()
+            report_lib.SetRecordFile(TestHelper.testdata_path('perf_display_bitmaps.data'))
+            report_lib.MergeJavaMethods(True)
+            samples = []
+            while report_lib.GetNextSample():
+                sample = report_lib.GetCurrentSample()
+                event = report_lib.GetEventOfCurrentSample()
+                symbols = [report_lib.GetSymbolOfCurrentSample()]
+                callchain = report_lib.GetCallChainOfCurrentSample()
+                symbols += [callchain.entries[i].symbol for i in range(callchain.nr)]
+                samples.append((sample.time, sample.pid, sample.tid, sample.thread_comm,
+                                sample.cpu, sample.period, event.name,
+                                [(s.dso_name, s.vaddr_in_file, s.symbol_name, s.symbol_addr,
+                                  s.symbol_len) for s in symbols]))
+            report_lib.Close()
+            return samples
+
+        def get_samples_in_batches():
+            report_lib = ReportLib()
+            report_lib.SetRecordFile(TestHelper.testdata_path('perf_display_bitmaps.data'))
+            report_lib.MergeJavaMethods(True)
+            samples = []
+            while True:
+                batch = report_lib.GetNextSampleBatch(100)
+                if batch is None:
+                    break
+                for i in range(len(batch.time)):
+                    entries = []
+                    for j in range(batch.callchain_offsets[i], batch.callchain_offsets[i + 1]):
+                        symbol = report_lib.GetSymbolById(batch.symbol_id[j])
+                        entries.append((report_lib.GetString(batch.dso_id[j]),
+                                        batch.vaddr_in_file[j], symbol.symbol_name,
+                                        symbol.symbol_addr, symbol.symbol_len))
+                    samples.append((batch.time[i], batch.pid[i], batch.tid[i],
+                                    report_lib.GetString(batch.thread_comm_id[i]), batch.cpu[i],
+                                    batch.period[i],
+                                    report_lib.GetEventById(batch.event_id[i]).name, entries))
+            report_lib.Close()
+            return samples
+
+        samples = get_samples_one_by_one()
+        self.assertGreater(len(samples), 0)
+        self.assertEqual(samples, get_samples_in_batches())
+
+    def test_symbol_ids(self):
+        self.report_lib.SetRecordFile(TestHelper.testdata_path('perf_with_symbols.data'))
+        # symbol_id and dso_id aren't filled by default.
+        self.assertTrue(self.report_lib.GetNextSample())
+        symbol = self.report_lib.GetSymbolOfCurrentSample()
+        self.assertEqual(symbol.symbol_id, 0xffffffff)
+        self.assertEqual(symbol.dso_id, 0xffffffff)
+        self.report_lib.FillSymbolIds()
+        symbols_by_id = {}
+        mappings_by_id = {}
+        while self.report_lib.GetNextSample():
+            symbol = self.report_lib.GetSymbolOfCurrentSample()
+            key = (symbol.dso_name, symbol.symbol_name, symbol.symbol_addr, symbol.symbol_len)
+            self.assertEqual(symbols_by_id.setdefault(symbol.symbol_id, key), key)
+            self.assertEqual(self.report_lib.GetString(symbol.dso_id), symbol.dso_name)
+            batch_symbol = self.report_lib.GetSymbolById(symbol.symbol_id)
+            self.assertEqual(batch_symbol.symbol_name, symbol.symbol_name)
+            mapping = symbol.mapping[0]
+            key = (mapping.start, mapping.end, mapping.pgoff)
+            self.assertEqual(mappings_by_id.setdefault(symbol.mapping_id, key), key)
+            mapping_by_id = self.report_lib.GetMappingById(symbol.mapping_id)
+            self.assertEqual((mapping_by_id.start, mapping_by_id.end, mapping_by_id.pgoff), key)
+        self.assertGreater(len(symbols_by_id), 1)
+
     def test_meta_info(self):
         self.report_lib.SetRecordFile(TestHelper.testdata_path('perf_with_trace_offcpu_v2.data'))
         meta_info = self.report_lib.MetaInfo()
@@ -397,6 +467,49 @@ class TestProtoFileReportLib(TestBase):
             report_lib.GetCallChainOfCurrentSample()
         self.assertEqual(sample_count, 525)
 
+    def test_seek(self):
+        def read_samples(seek_fn=None) -> List[Tuple[int, int]]:
+            report_lib = ProtoFileReportLib()
+            report_lib.SetRecordFile(TestHelper.testdata_path('display_bitmaps.proto_data'))
+            if seek_fn:
+                seek_fn(report_lib)
+            samples = []
+            while sample := report_lib.GetNextSample():
+                samples.append((sample.time, sample.pid))
+            report_lib.Close()
+            return samples
+
+        all_samples = read_samples()
+        times = sorted(time for time, _ in all_samples)
+        start_time, end_time = times[len(times) // 4], times[len(times) // 2]
+        samples = read_samples(lambda lib: lib.SeekByTime(start_time, end_time))
+        self.assertEqual(
+            samples, [s for s in all_samples if start_time <= s[0] < end_time])
+        self.assertGreater(len(samples), 0)
+
+        pid = all_samples[0][1]
+        samples = read_samples(lambda lib: lib.SeekByPids([pid]))
+        self.assertEqual(samples, [s for s in all_samples if s[1] == pid])
+        self.assertEqual(read_samples(lambda lib: lib.SeekByPids([])), [])
+
+        # Seeking after reading samples triggers RuntimeError.
+        report_lib = ProtoFileReportLib()
+        report_lib.SetRecordFile(TestHelper.testdata_path('display_bitmaps.proto_data'))
+        report_lib.GetNextSample()
+        with self.assertRaises(RuntimeError):
+            report_lib.SeekByTime(start_time, end_time)
+        with self.assertRaises(RuntimeError):
+            report_lib.SeekByPids([pid])
+        report_lib.Close()
+
+    def test_get_next_sample_batch(self):
+        # Reading samples in batches isn't supported for proto files.
+        report_lib = ProtoFileReportLib()
+        report_lib.SetRecordFile(TestHelper.testdata_path('display_bitmaps.proto_data'))
+        with self.assertRaises(NotImplementedError):
+            report_lib.GetNextSampleBatch()
+        report_lib.Close()
+
     def convert_perf_data_to_proto_file(self, perf_data_path: str) -> str:
         simpleperf_path = get_host_binary_path('simpleperf')
         proto_file_path = 'perf.trace'
@@ -18,6 +18,7 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <limits>
 
 #include <android-base/logging.h>
@@ -63,12 +64,12 @@ bool ThreadTree::ForkThread(int pid, int tid, int ppid, int ptid) {
   child->comm = parent->comm;
   if (pid != ppid) {
     // Copy maps from parent process.
-    if (child->maps->maps.empty()) {
-      *child->maps = *parent->maps;
+    if (child->maps->GetMaps().empty()) {
+      child->maps->CopyMapsFrom(*parent->maps);
     } else {
       CHECK_NE(child->maps, parent->maps);
-      for (auto& pair : parent->maps->maps) {
-        InsertMap(*child->maps, *pair.second);
+      for (const MapEntry* map : parent->maps->GetMaps()) {
+        InsertMap(*child->maps, *map);
       }
     }
   }
@@ -222,14 +223,16 @@ void ThreadTree::AddSymbolsForProcess(int pid, std::vector<Symbol>* symbols) {
 
   auto dso = FindUserDsoOrNew(name, 0, DSO_SYMBOL_MAP_FILE);
   dso->SetSymbols(symbols);
+  // Symbols found before may be freed.
+  InvalidateIpCaches();
 
   auto thread = FindThreadOrNew(pid, pid);
   AddThreadMapsForDsoSymbols(thread, dso);
 }
 
 const MapEntry* ThreadTree::AllocateMap(const MapEntry& entry) {
-  map_storage_.emplace_back(new MapEntry(entry));
-  return map_storage_.back().get();
+  map_storage_.push_back(entry);
+  return &map_storage_.back();
 }
 
 static MapEntry RemoveFirstPartOfMapEntry(const MapEntry* entry, uint64_t new_start_addr) {
@@ -249,41 +252,67 @@ static MapEntry RemoveSecondPartOfMapEntry(const MapEntry* entry, uint64_t new_l
 // Insert a new map entry in a MapSet. If some existing map entries overlap the new map entry,
 // then remove the overlapped parts.
 void ThreadTree::InsertMap(MapSet& maps, const MapEntry& entry) {
-  std::map<uint64_t, const MapEntry*>& map = maps.maps;
-  auto it = map.lower_bound(entry.start_addr);
-  // Remove overlapped entry with start_addr < entry.start_addr.
-  if (it != map.begin()) {
-    auto it2 = it;
-    --it2;
-    if (it2->second->get_end_addr() > entry.get_end_addr()) {
-      map.emplace(entry.get_end_addr(),
-                  AllocateMap(RemoveFirstPartOfMapEntry(it2->second, entry.get_end_addr())));
-    }
-    if (it2->second->get_end_addr() > entry.start_addr) {
-      it2->second =
-          AllocateMap(RemoveSecondPartOfMapEntry(it2->second, entry.start_addr - it2->first));
-    }
-  }
-  // Remove overlapped entries with start_addr >= entry.start_addr.
-  while (it != map.end() && it->second->get_end_addr() <= entry.get_end_addr()) {
-    it = map.erase(it);
-  }
-  if (it != map.end() && it->second->start_addr < entry.get_end_addr()) {
-    map.emplace(entry.get_end_addr(),
-                AllocateMap(RemoveFirstPartOfMapEntry(it->second, entry.get_end_addr())));
-    map.erase(it);
+  std::vector<const MapEntry*>& map = maps.MutableMaps();
+  uint64_t start_addr = entry.start_addr;
+  uint64_t end_addr = entry.get_end_addr();
+  // Find overlapped entries in [first, last). Most maps are added in address order, so check the
+  // end first.
+  auto first = map.end();
+  if (!map.empty() && map.back()->get_end_addr() > start_addr) {
+    first = std::partition_point(map.begin(), map.end(), [&](const MapEntry* e) {
+      return e->get_end_addr() <= start_addr;
+    });
+  }
+  auto last = std::partition_point(first, map.end(),
+                                   [&](const MapEntry* e) { return e->start_addr < end_addr; });
+  // Replace overlapped entries with the new entry and parts of them not overlapped.
+  const MapEntry* new_entries[3];
+  size_t new_count = 0;
+  if (first != last && (*first)->start_addr < start_addr) {
+    new_entries[new_count++] =
+        AllocateMap(RemoveSecondPartOfMapEntry(*first, start_addr - (*first)->start_addr));
+  }
+  new_entries[new_count++] = AllocateMap(entry);
+  if (first != last && last[-1]->get_end_addr() > end_addr) {
+    new_entries[new_count++] = AllocateMap(RemoveFirstPartOfMapEntry(last[-1], end_addr));
+  }
+  size_t old_count = last - first;
+  if (new_count > old_count) {
+    first = map.insert(first, new_count - old_count, nullptr);
+  } else {
+    first = map.erase(first + new_count, last) - new_count;
   }
-  // Insert the new entry.
-  map.emplace(entry.start_addr, AllocateMap(entry));
+  std::copy(new_entries, new_entries + new_count, first);
   maps.version++;
 }
 
+std::vector<const MapEntry*>& MapSet::MutableMaps() {
+  if (!maps_) {
+    maps_ = std::make_shared<std::vector<const MapEntry*>>();
+  } else if (maps_.use_count() > 1) {
+    maps_ = std::make_shared<std::vector<const MapEntry*>>(*maps_);
+  }
+  return *maps_;
+}
+
+void MapSet::CopyMapsFrom(const MapSet& other) {
+  maps_ = other.maps_;
+  version++;
+}
+
+void MapSet::Clear() {
+  maps_.reset();
+  version++;
+}
+
 const MapEntry* MapSet::FindMapByAddr(uint64_t addr) const {
-  auto it = maps.upper_bound(addr);
+  const std::vector<const MapEntry*>& maps = GetMaps();
+  auto it = std::upper_bound(maps.begin(), maps.end(), addr,
+                             [](uint64_t addr, const MapEntry* e) { return addr < e->start_addr; });
   if (it != maps.begin()) {
     --it;
-    if (it->second->get_end_addr() > addr) {
-      return it->second;
+    if ((*it)->get_end_addr() > addr) {
+      return *it;
     }
   }
   return nullptr;
@@ -348,6 +377,39 @@ const Symbol* ThreadTree::FindSymbol(const MapEntry* map, uint64_t ip, uint64_t*
   return symbol;
 }
 
+const Symbol* ThreadTree::FindMapAndSymbol(const ThreadEntry* thread, uint64_t ip,
+                                           bool in_kernel, const MapEntry** pmap,
+                                           uint64_t* pvaddr_in_file, Dso** pdso) {
+  MapSet& maps = in_kernel ? kernel_maps_ : *thread->maps;
+  if (maps.ip_cache.empty()) {
+    maps.ip_cache.resize(MapSet::kIpCacheSize);
+  }
+  size_t index = (ip * 0x9E3779B97F4A7C15ULL) >> 54;
+  static_assert(MapSet::kIpCacheSize == 1 << (64 - 54));
+  MapSet::IpCacheEntry& entry = maps.ip_cache[index];
+  if (entry.map == nullptr || entry.ip != ip || entry.version != maps.version) {
+    entry.ip = ip;
+    entry.version = maps.version;
+    entry.map = FindMap(thread, ip, in_kernel);
+    entry.symbol = FindSymbol(entry.map, ip, &entry.vaddr_in_file, &entry.dso);
+  }
+  *pmap = entry.map;
+  if (pvaddr_in_file != nullptr) {
+    *pvaddr_in_file = entry.vaddr_in_file;
+  }
+  if (pdso != nullptr) {
+    *pdso = entry.dso;
+  }
+  return entry.symbol;
+}
+
+void ThreadTree::InvalidateIpCaches() {
+  kernel_maps_.version++;
+  for (auto& pair : thread_tree_) {
+    pair.second->maps->version++;
+  }
+}
+
 const Symbol* ThreadTree::FindKernelSymbol(uint64_t ip) {
   const MapEntry* map = FindMap(nullptr, ip, true);
   return FindSymbol(map, ip, nullptr);
@@ -356,7 +418,7 @@ const Symbol* ThreadTree::FindKernelSymbol(uint64_t ip) {
 void ThreadTree::ClearThreadAndMap() {
   thread_tree_.clear();
   thread_comm_storage_.clear();
-  kernel_maps_.maps.clear();
+  kernel_maps_.Clear();
   map_storage_.clear();
 }
 
@@ -378,12 +440,14 @@ bool ThreadTree::AddDsoInfo(FileFeature& file) {
   for (uint64_t offset : file.dex_file_offsets) {
     dso->AddDexFileOffset(offset);
   }
+  InvalidateIpCaches();
   return true;
 }
 
 void ThreadTree::AddDexFileOffset(const std::string& file_path, uint64_t dex_file_offset) {
   Dso* dso = FindUserDsoOrNew(file_path, 0, DSO_DEX_FILE);
   dso->AddDexFileOffset(dex_file_offset);
+  InvalidateIpCaches();
 }
 
 void ThreadTree::Update(const Record& record) {
@@ -19,10 +19,12 @@
 
 #include <stdint.h>
 
+#include <deque>
 #include <limits>
 #include <map>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include "dso.h"
 
@@ -67,11 +69,39 @@ struct MapEntry {
   }
 };
 
+// MapSet keeps maps sorted by start_addr in an array, which is faster to search and cheaper to
+// free than a tree. The maps don't overlap with each other. The array can be shared by MapSets
+// copied from each other (like maps of a process and its forked child), and is copied when one of
+// them is modified.
 struct MapSet {
-  std::map<uint64_t, const MapEntry*> maps;  // Map from start_addr to a MapEntry.
-  uint64_t version = 0u;                     // incremented each time changing maps
+  uint64_t version = 0u;  // incremented each time changing maps
 
+  const std::vector<const MapEntry*>& GetMaps() const {
+    static const std::vector<const MapEntry*> empty_maps;
+    return maps_ ? *maps_ : empty_maps;
+  }
+  // Return maps that can be modified. Callers should keep them sorted and not overlapped.
+  std::vector<const MapEntry*>& MutableMaps();
+  // Share maps of another MapSet until one of them is modified.
+  void CopyMapsFrom(const MapSet& other);
+  void Clear();
   const MapEntry* FindMapByAddr(uint64_t addr) const;
+
+  // A direct-mapped cache of results of ThreadTree::FindMapAndSymbol(). An entry is valid only
+  // when its version matches the version of the MapSet. It is allocated on first use.
+  struct IpCacheEntry {
+    uint64_t ip;
+    uint64_t version;
+    const MapEntry* map;  // nullptr for an empty entry
+    const Symbol* symbol;
+    Dso* dso;
+    uint64_t vaddr_in_file;
+  };
+  static constexpr size_t kIpCacheSize = 1024;
+  std::vector<IpCacheEntry> ip_cache;
+
+ private:
+  std::shared_ptr<std::vector<const MapEntry*>> maps_;
 };
 
 struct ThreadEntry {
@@ -120,6 +150,11 @@ class ThreadTree {
   const MapEntry* FindMap(const ThreadEntry* thread, uint64_t ip);
   const Symbol* FindSymbol(const MapEntry* map, uint64_t ip, uint64_t* pvaddr_in_file,
                            Dso** pdso = nullptr);
+  // Same as calling FindMap(thread, ip, in_kernel) and then FindSymbol(). Results are memoized in
+  // the MapSet searched, since the same ips are looked up again and again in most profiles.
+  const Symbol* FindMapAndSymbol(const ThreadEntry* thread, uint64_t ip, bool in_kernel,
+                                 const MapEntry** pmap, uint64_t* pvaddr_in_file,
+                                 Dso** pdso = nullptr);
   const Symbol* FindKernelSymbol(uint64_t ip);
   bool IsUnknownDso(const Dso* dso) const { return dso == unknown_dso_.get(); }
   const Symbol* UnknownSymbol() const { return &unknown_symbol_; }
@@ -153,12 +188,15 @@ class ThreadTree {
 
   // Add thread maps to cover symbols in dso.
   void AddThreadMapsForDsoSymbols(ThreadEntry* thread, Dso* dso);
+  // Invalidate results memoized by FindMapAndSymbol() in all MapSets.
+  void InvalidateIpCaches();
 
   std::unordered_map<int, std::unique_ptr<ThreadEntry>> thread_tree_;
   std::vector<std::unique_ptr<std::string>> thread_comm_storage_;
 
   MapSet kernel_maps_;
-  std::vector<std::unique_ptr<MapEntry>> map_storage_;
+  // An arena for MapEntry, to avoid allocating each of them separately.
+  std::deque<MapEntry> map_storage_;
   MapEntry unknown_map_;
 
   std::unique_ptr<Dso> kernel_dso_;
@@ -40,17 +40,16 @@ class ThreadTreeTest : public ::testing::Test {
     ASSERT_TRUE(thread != nullptr);
     ASSERT_TRUE(thread->maps != nullptr);
     uint64_t prev_end = 0;
-    for (auto& pair : thread->maps->maps) {
-      ASSERT_GE(pair.first, prev_end);
-      prev_end = pair.second->get_end_addr();
-      ASSERT_EQ(pair.second->start_addr, pair.first);
-      ASSERT_GT(pair.second->len, 0u);
-      ASSERT_EQ(pair.second->pgoff, pair.first);
-      if (names.size() < pair.second->get_end_addr()) {
-        names.resize(pair.second->get_end_addr());
+    for (const MapEntry* map : thread->maps->GetMaps()) {
+      ASSERT_GE(map->start_addr, prev_end);
+      prev_end = map->get_end_addr();
+      ASSERT_GT(map->len, 0u);
+      ASSERT_EQ(map->pgoff, map->start_addr);
+      if (names.size() < map->get_end_addr()) {
+        names.resize(map->get_end_addr());
       }
-      for (uint64_t i = pair.first; i < pair.second->get_end_addr(); ++i) {
-        names[i] = pair.second->dso->Path();
+      for (uint64_t i = map->start_addr; i < map->get_end_addr(); ++i) {
+        names[i] = map->dso->Path();
       }
     }
     ASSERT_EQ(names, expected_names_);
@@ -114,6 +113,22 @@ TEST_F(ThreadTreeTest, jit_maps_before_fork) {
   ASSERT_EQ(map->flags, map_flags::PROT_JIT_SYMFILE_MAP);
 }
 
+TEST_F(ThreadTreeTest, forked_process_shares_maps_until_modified) {
+  thread_tree_.AddThreadMap(1, 1, 0x1000, 0x1000, 0, "libfoo.so");
+  thread_tree_.ForkThread(2, 2, 1, 1);
+  ThreadEntry* parent = thread_tree_.FindThreadOrNew(1, 1);
+  ThreadEntry* child = thread_tree_.FindThreadOrNew(2, 2);
+  ASSERT_EQ(&parent->maps->GetMaps(), &child->maps->GetMaps());
+
+  thread_tree_.AddThreadMap(2, 2, 0x3000, 0x1000, 0, "libbar.so");
+  thread_tree_.AddThreadMap(1, 1, 0x1000, 0x1000, 0, "libbaz.so");
+  ASSERT_EQ(parent->maps->GetMaps().size(), 1u);
+  ASSERT_EQ(parent->maps->FindMapByAddr(0x1000)->dso->Path(), "libbaz.so");
+  ASSERT_EQ(child->maps->GetMaps().size(), 2u);
+  ASSERT_EQ(child->maps->FindMapByAddr(0x1000)->dso->Path(), "libfoo.so");
+  ASSERT_EQ(child->maps->FindMapByAddr(0x3000)->dso->Path(), "libbar.so");
+}
+
 TEST_F(ThreadTreeTest, reused_tid) {
   // Process 1 has thread 1 and 2.
   thread_tree_.ForkThread(1, 2, 1, 1);
@@ -144,6 +159,39 @@ TEST_F(ThreadTreeTest, add_symbols_for_process) {
   ASSERT_STREQ("three", FindSymbol(1, 1, 0x302f)->Name());
 }
 
+TEST_F(ThreadTreeTest, find_map_and_symbol) {
+  auto symbols = ReadSymbolMapFromString("0x1000 0x10 one\n0x2000 0x20 two\n");
+  thread_tree_.AddSymbolsForProcess(1, &symbols);
+  ThreadEntry* thread = thread_tree_.FindThreadOrNew(1, 1);
+  for (int i = 0; i < 2; i++) {
+    for (uint64_t ip : {0x1000, 0x1008, 0x2010, 0x3000}) {
+      const MapEntry* map;
+      uint64_t vaddr_in_file;
+      Dso* dso;
+      const Symbol* symbol =
+          thread_tree_.FindMapAndSymbol(thread, ip, false, &map, &vaddr_in_file, &dso);
+      const MapEntry* expected_map = thread_tree_.FindMap(thread, ip, false);
+      uint64_t expected_vaddr_in_file;
+      Dso* expected_dso;
+      ASSERT_EQ(symbol, thread_tree_.FindSymbol(expected_map, ip, &expected_vaddr_in_file,
+                                                &expected_dso));
+      ASSERT_EQ(map, expected_map);
+      ASSERT_EQ(vaddr_in_file, expected_vaddr_in_file);
+      ASSERT_EQ(dso, expected_dso);
+    }
+  }
+
+  // Cached results are dropped when symbols or maps change.
+  symbols = ReadSymbolMapFromString("0x1000 0x10 new_one\n");
+  thread_tree_.AddSymbolsForProcess(1, &symbols);
+  const MapEntry* map;
+  const Symbol* symbol = thread_tree_.FindMapAndSymbol(thread, 0x1000, false, &map, nullptr);
+  ASSERT_STREQ(symbol->Name(), "new_one");
+  thread_tree_.AddThreadMap(1, 1, 0x1000, 0x1000, 0, "libfoo.so");
+  thread_tree_.FindMapAndSymbol(thread, 0x1000, false, &map, nullptr);
+  ASSERT_EQ(map->dso->Path(), "libfoo.so");
+}
+
 TEST_F(ThreadTreeTest, invalid_fork) {
   // tid == ptid
   ASSERT_FALSE(thread_tree_.ForkThread(1, 2, 1, 2));
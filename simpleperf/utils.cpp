@@ -39,6 +39,7 @@
 #include <7zCrc.h>
 #include <Xz.h>
 #include <XzCrc64.h>
+#include <zstd.h>
 
 #include "RegEx.h"
 #include "environment.h"
@@ -306,6 +307,34 @@ bool XzDecompress(const std::string& compressed_data, std::string* decompressed_
   return true;
 }
 
+bool ZstdCompress(const char* data, size_t size, int level, std::vector<char>* compressed_data) {
+  compressed_data->resize(ZSTD_compressBound(size));
+  size_t result =
+      ZSTD_compress(compressed_data->data(), compressed_data->size(), data, size, level);
+  if (ZSTD_isError(result)) {
+    LOG(ERROR) << "zstd compression failed: " << ZSTD_getErrorName(result);
+    return false;
+  }
+  compressed_data->resize(result);
+  return true;
+}
+
+bool ZstdDecompress(const char* data, size_t size, size_t decompressed_size,
+                    std::vector<char>* decompressed_data) {
+  decompressed_data->resize(decompressed_size);
+  size_t result = ZSTD_decompress(decompressed_data->data(), decompressed_size, data, size);
+  if (ZSTD_isError(result)) {
+    LOG(ERROR) << "zstd decompression failed: " << ZSTD_getErrorName(result);
+    return false;
+  }
+  if (result != decompressed_size) {
+    LOG(ERROR) << "zstd decompression failed: expected size " << decompressed_size << ", got "
+               << result;
+    return false;
+  }
+  return true;
+}
+
 static std::map<std::string, android::base::LogSeverity> log_severity_map = {
     {"verbose", android::base::VERBOSE}, {"debug", android::base::DEBUG},
     {"info", android::base::INFO},       {"warning", android::base::WARNING},
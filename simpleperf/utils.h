@@ -240,6 +240,9 @@ uint64_t GetFileSize(const std::string& filename);
 bool MkdirWithParents(const std::string& path);
 
 bool XzDecompress(const std::string& compressed_data, std::string* decompressed_data);
+bool ZstdCompress(const char* data, size_t size, int level, std::vector<char>* compressed_data);
+bool ZstdDecompress(const char* data, size_t size, size_t decompressed_size,
+                    std::vector<char>* decompressed_data);
 
 bool GetLogSeverity(const std::string& name, android::base::LogSeverity* severity);
 std::string GetLogSeverityName();